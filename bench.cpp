@@ -0,0 +1,487 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "gflags.h"
+#include "flagstore.h"
+#include "server.h"
+#include "inventory.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*
+ * Throughput / latency benchmark for the parsing, masking and store code paths.
+ * Everything runs against a MemoryFlagStore, so the numbers measure gflags
+ * itself and not the registry.
+ */
+
+#define BENCH_DEFAULT_MAX_IMAGES    1000000
+#define BENCH_DEFAULT_THREADS       4
+#define BENCH_MIN_OPS               100000
+#define BENCH_STRESS_OPS            200000
+#define BENCH_SERVE_OPS             2000
+#define BENCH_SERVE_IMAGES          16
+#define BENCH_INVENTORY_TARGETS     1000        /* records per host */
+#define BENCH_INVENTORY_QUERIES     50
+
+typedef std::chrono::steady_clock BenchClock;
+
+static FILE* g_NullOutput = NULL;
+static std::atomic<ULONG> g_Sink(0);
+
+
+struct BenchResult
+{
+    std::vector<ULONG> Samples;     /* nanoseconds per operation */
+    double Seconds;
+};
+
+static void PrintHeader()
+{
+    wprintf(L"%-28ls %10ls %12ls %8ls %8ls %8ls %8ls %10ls\n",
+        L"benchmark", L"ops", L"ops/s", L"p50", L"p90", L"p99", L"p99.9", L"max (ns)");
+}
+
+static void Report( _In_z_ PCWSTR Name, _Inout_ BenchResult* Result )
+{
+    std::vector<ULONG>& Samples = Result->Samples;
+    if(Samples.empty())
+    {
+        return;
+    }
+    std::sort(Samples.begin(), Samples.end());
+    size_t Count = Samples.size();
+    wprintf(L"%-28ls %10zu %12.0f %8u %8u %8u %8u %10u\n", Name, Count,
+        Result->Seconds > 0 ? Count / Result->Seconds : 0.0,
+        Samples[Count * 50 / 100], Samples[Count * 90 / 100], Samples[Count * 99 / 100],
+        Samples[Count * 999 / 1000], Samples[Count - 1]);
+}
+
+/* Runs Op(n) for n in [0, Ops), timing every call on its own. */
+template<typename OP_>
+static void Measure( _In_z_ PCWSTR Name, _In_ size_t Ops, OP_ Op )
+{
+    BenchResult Result;
+    Result.Samples.resize(Ops);
+    BenchClock::time_point Start = BenchClock::now();
+    for(size_t n = 0; n < Ops; ++n)
+    {
+        BenchClock::time_point Before = BenchClock::now();
+        Op(n);
+        Result.Samples[n] = (ULONG)std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - Before).count();
+    }
+    Result.Seconds = std::chrono::duration<double>(BenchClock::now() - Start).count();
+    Report(Name, &Result);
+}
+
+static void ImageName( _Out_ PWSTR Buffer, _In_ size_t Size, _In_ size_t Index )
+{
+    swprintf(Buffer, Size, L"image%zu.exe", Index);
+}
+
+
+static PCWSTR g_Expressions[] =
+{
+    L"+hpa",
+    L"-ust",
+    L"2000000",
+    L"+hpa+htc-ust",
+    L"=(soe|sls)",
+    L"^0x10",
+    L"+(hpa|ust|htc|hfc|hpc)-(soe|sls)^0x100",
+};
+
+static void BenchParsing()
+{
+    const size_t ExpressionCount = sizeof(g_Expressions) / sizeof(g_Expressions[0]);
+    Measure(L"compile expression", BENCH_MIN_OPS, [&](size_t n)
+    {
+        FlagEdit Edit;
+        InitFlagEdit(&Edit);
+        CompileFlagEdit(g_Expressions[n % ExpressionCount], &Edit);
+        g_Sink += Edit.Or;
+    });
+    Measure(L"find abbreviation", BENCH_MIN_OPS, [&](size_t n)
+    {
+        const FlagInfo* Flag = FindFlag(g_Flags[n % g_FlagCount].szAbbr);
+        g_Sink += Flag ? Flag->dwFlag : 0;
+    });
+
+    FlagEdit Edit;
+    InitFlagEdit(&Edit);
+    CompileFlagEdit(L"+hpa+htc-ust", &Edit);
+    Measure(L"apply edit", BENCH_MIN_OPS, [&](size_t n)
+    {
+        g_Sink += ApplyFlagEdit(&Edit, (ULONG)n);
+    });
+    Measure(L"mask flags", BENCH_MIN_OPS, [&](size_t n)
+    {
+        static const DWORD Dests[] = { DEST_REGISTRY, DEST_KERNEL, DEST_IMAGE };
+        DWORD Apply, Ignored;
+        MaskFlags(Dests[n % 3], (DWORD)(n * 2654435761u), &Apply, &Ignored);
+        g_Sink += Apply;
+    });
+    Measure(L"print flags", BENCH_MIN_OPS / 10, [&](size_t n)
+    {
+        PrintFlags(g_NullOutput, (ULONG)(n * 2654435761u), DEST_IMAGE, 0);
+    });
+}
+
+static BOOL CountImage( _In_z_ PCWSTR /* ImageName */, _In_ ULONG /* Value */, _In_opt_ PVOID Context )
+{
+    ++*(size_t*)Context;
+    return TRUE;
+}
+
+static void BenchStore( _In_ size_t Images )
+{
+    MemoryFlagStore Store;
+    SetFlagStore(&Store);
+
+    WCHAR Name[64], Label[64];
+    size_t Ops = std::max(Images, (size_t)BENCH_MIN_OPS);
+    std::mt19937 Random((ULONG)Images);
+    std::uniform_int_distribution<size_t> Pick(0, Images - 1);
+
+    swprintf(Label, 64, L"write   %zu images", Images);
+    Measure(Label, Images, [&](size_t n)
+    {
+        ImageName(Name, 64, n);
+        WriteImageGlobalFlagsToRegistry(Name, FLG_HEAP_PAGE_ALLOCS);
+    });
+
+    swprintf(Label, 64, L"read    %zu images", Images);
+    Measure(Label, Ops, [&](size_t)
+    {
+        ULONG Flags;
+        ImageName(Name, 64, Pick(Random));
+        ReadImageGlobalFlagsFromRegistry(Name, &Flags);
+        g_Sink += Flags;
+    });
+
+    FlagEdit Edit;
+    InitFlagEdit(&Edit);
+    CompileFlagEdit(L"^ust", &Edit);
+    swprintf(Label, 64, L"update  %zu images", Images);
+    Measure(Label, Ops, [&](size_t)
+    {
+        FlagUpdate Update;
+        ImageName(Name, 64, Pick(Random));
+        UpdateFlags(&Store, DEST_IMAGE, Name, &Edit, &Update);
+    });
+
+    swprintf(Label, 64, L"enum    %zu images", Images);
+    Measure(Label, 1, [&](size_t)
+    {
+        size_t Count = 0;
+        EnumImageGlobalFlagsFromRegistry(CountImage, &Count);
+        g_Sink += (ULONG)Count;
+    });
+
+    SetFlagStore(NULL);
+}
+
+/*
+ * Counting queries over Records inventory records, without a callback. The
+ * flags are random with a few densities, from rare (hpa) to half (htc).
+ */
+static void BenchInventory( _In_ size_t Records )
+{
+    static const PCWSTR Queries[] = { L"hpa & !ust", L"htc | hfc", L"(htc & hfc) | (hpa & !ust)", L"0x2000010" };
+    const size_t QueryCount = sizeof(Queries) / sizeof(Queries[0]);
+    FlagInventory Inventory;
+    std::vector<std::wstring> Targets(BENCH_INVENTORY_TARGETS);
+    WCHAR Host[64], Label[64];
+    for(size_t n = 0; n < Targets.size(); ++n)
+    {
+        ImageName(Host, 64, n);
+        Targets[n] = Host;
+    }
+    std::mt19937 Random((ULONG)Records);
+    std::uniform_int_distribution<ULONG> Percent(0, 99);
+    for(size_t n = 0; n < Records; ++n)
+    {
+        if(n % BENCH_INVENTORY_TARGETS == 0)
+        {
+            swprintf(Host, 64, L"host%zu", n / BENCH_INVENTORY_TARGETS);
+        }
+        ULONG Flags = (Percent(Random) < 1 ? FLG_HEAP_PAGE_ALLOCS : 0) | (Percent(Random) < 20 ? FLG_USER_STACK_TRACE_DB : 0) |
+                      (Percent(Random) < 50 ? FLG_HEAP_ENABLE_TAIL_CHECK : 0) | (Percent(Random) < 10 ? FLG_HEAP_ENABLE_FREE_CHECK : 0);
+        Inventory.Add(Host, Targets[n % BENCH_INVENTORY_TARGETS].c_str(), Flags);
+    }
+
+    swprintf(Label, 64, L"inventory %zu records", Records);
+    Measure(Label, BENCH_INVENTORY_QUERIES * QueryCount, [&](size_t n)
+    {
+        ULONGLONG Matches = 0;
+        Inventory.Query(Queries[n % QueryCount], NULL, NULL, &Matches);
+        g_Sink += (ULONG)Matches;
+    });
+}
+
+/*
+ * Every thread toggles its own flag bit on random images and remembers how
+ * often it did so per image. Lost updates show up as a bit whose state does
+ * not match the parity of its toggles.
+ */
+static BOOL BenchStress( _In_ unsigned Threads, _In_ size_t Images )
+{
+    static const ULONG Bits[] = { FLG_HEAP_ENABLE_TAIL_CHECK, FLG_HEAP_ENABLE_FREE_CHECK, FLG_HEAP_VALIDATE_PARAMETERS,
+        FLG_HEAP_VALIDATE_ALL, FLG_APPLICATION_VERIFIER, FLG_HEAP_ENABLE_TAGGING, FLG_USER_STACK_TRACE_DB, FLG_HEAP_PAGE_ALLOCS };
+    const unsigned BitCount = sizeof(Bits) / sizeof(Bits[0]);
+    Threads = std::min(Threads, BitCount);
+
+    MemoryFlagStore Store;
+    SetFlagStore(&Store);
+
+    std::vector<std::vector<BYTE> > Toggles(Threads, std::vector<BYTE>(Images));
+    std::vector<BenchResult> Results(Threads);
+    std::atomic<ULONG> Retries(0), Failures(0);
+    std::vector<std::thread> Workers;
+    BenchClock::time_point Start = BenchClock::now();
+    for(unsigned t = 0; t < Threads; ++t)
+    {
+        Workers.push_back(std::thread([&, t]()
+        {
+            WCHAR Name[64], Expression[16];
+            FlagEdit Edit;
+            InitFlagEdit(&Edit);
+            swprintf(Expression, 16, L"^0x%x", Bits[t]);
+            CompileFlagEdit(Expression, &Edit);
+            std::mt19937 Random(t);
+            std::uniform_int_distribution<size_t> Pick(0, Images - 1);
+            Results[t].Samples.resize(BENCH_STRESS_OPS);
+            for(size_t n = 0; n < BENCH_STRESS_OPS; ++n)
+            {
+                size_t Image = Pick(Random);
+                FlagUpdate Update;
+                ImageName(Name, 64, Image);
+                BenchClock::time_point Before = BenchClock::now();
+                if(!UpdateFlags(&Store, DEST_IMAGE, Name, &Edit, &Update))
+                {
+                    ++Failures;
+                }
+                Results[t].Samples[n] = (ULONG)std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - Before).count();
+                Retries += Update.Retries;
+                Toggles[t][Image] ^= 1;
+            }
+        }));
+    }
+    for(size_t t = 0; t < Workers.size(); ++t)
+    {
+        Workers[t].join();
+    }
+
+    BenchResult Total;
+    Total.Seconds = std::chrono::duration<double>(BenchClock::now() - Start).count();
+    for(unsigned t = 0; t < Threads; ++t)
+    {
+        Total.Samples.insert(Total.Samples.end(), Results[t].Samples.begin(), Results[t].Samples.end());
+    }
+    WCHAR Label[64];
+    swprintf(Label, 64, L"stress  %u threads", Threads);
+    Report(Label, &Total);
+
+    size_t Lost = 0;
+    for(size_t Image = 0; Image < Images; ++Image)
+    {
+        WCHAR Name[64];
+        ULONG Flags = 0;
+        ImageName(Name, 64, Image);
+        ReadImageGlobalFlagsFromRegistry(Name, &Flags);
+        for(unsigned t = 0; t < Threads; ++t)
+        {
+            Lost += ((Flags & Bits[t]) ? 1 : 0) != Toggles[t][Image];
+        }
+    }
+    SetFlagStore(NULL);
+
+    wprintf(L"    %u retries, %u failed updates, %zu lost updates\n", (ULONG)Retries, (ULONG)Failures, Lost);
+    return !Lost && !Failures;
+}
+
+/*
+ * Clients toggle their own bit on a handful of images through a FlagServer,
+ * so most requests share a batch with changes to the same image. Checked the
+ * same way as the stress test, the writes column shows the coalescing.
+ */
+static BOOL BenchServe( _In_ unsigned Clients )
+{
+    static const ULONG Bits[] = { FLG_HEAP_ENABLE_TAIL_CHECK, FLG_HEAP_ENABLE_FREE_CHECK, FLG_HEAP_VALIDATE_PARAMETERS,
+        FLG_HEAP_VALIDATE_ALL, FLG_APPLICATION_VERIFIER, FLG_HEAP_ENABLE_TAGGING, FLG_USER_STACK_TRACE_DB, FLG_HEAP_PAGE_ALLOCS };
+    const unsigned BitCount = sizeof(Bits) / sizeof(Bits[0]);
+    Clients = std::min(Clients, BitCount);
+
+    WCHAR Endpoint[64];
+#ifdef _WIN32
+    swprintf(Endpoint, 64, L"\\\\.\\pipe\\gflags-bench-%u", (ULONG)GetCurrentProcessId());
+#else
+    swprintf(Endpoint, 64, L"/tmp/gflags-bench-%u.sock", (ULONG)getpid());
+#endif
+    MemoryFlagStore Store;
+    FlagServer Server(&Store, SERVER_BATCH_WINDOW_MS);
+    std::thread Serving([&]() { Server.Serve(Endpoint); });
+
+    std::vector<std::vector<BYTE> > Toggles(Clients, std::vector<BYTE>(BENCH_SERVE_IMAGES));
+    std::vector<BenchResult> Results(Clients);
+    std::atomic<ULONG> Failures(0);
+    std::vector<std::thread> Workers;
+    BenchClock::time_point Start = BenchClock::now();
+    for(unsigned t = 0; t < Clients; ++t)
+    {
+        Workers.push_back(std::thread([&, t]()
+        {
+            FlagClient Client;
+            for(int Attempt = 0; !Client.Connect(Endpoint); ++Attempt)
+            {
+                if(Attempt == 100)
+                {
+                    ++Failures;
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            WCHAR Request[64];
+            std::wstring Response;
+            std::mt19937 Random(t);
+            std::uniform_int_distribution<size_t> Pick(0, BENCH_SERVE_IMAGES - 1);
+            for(size_t n = 0; n < BENCH_SERVE_OPS; ++n)
+            {
+                size_t Image = Pick(Random);
+                swprintf(Request, 64, L"set image%zu.exe ^0x%x", Image, Bits[t]);
+                BenchClock::time_point Before = BenchClock::now();
+                if(!Client.Request(Request, &Response) || Response.compare(0, 3, L"ok ") != 0)
+                {
+                    ++Failures;
+                    continue;
+                }
+                Results[t].Samples.push_back((ULONG)std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - Before).count());
+                Toggles[t][Image] ^= 1;
+            }
+        }));
+    }
+    for(size_t n = 0; n < Workers.size(); ++n)
+    {
+        Workers[n].join();
+    }
+    Server.Stop();
+    Serving.join();
+
+    BenchResult Total;
+    Total.Seconds = std::chrono::duration<double>(BenchClock::now() - Start).count();
+    for(unsigned t = 0; t < Clients; ++t)
+    {
+        Total.Samples.insert(Total.Samples.end(), Results[t].Samples.begin(), Results[t].Samples.end());
+    }
+    WCHAR Label[64];
+    swprintf(Label, 64, L"serve   %u clients", Clients);
+    Report(Label, &Total);
+
+    size_t Lost = 0;
+    for(size_t Image = 0; Image < BENCH_SERVE_IMAGES; ++Image)
+    {
+        WCHAR Name[64];
+        ULONG Flags = 0;
+        ImageName(Name, 64, Image);
+        ReadFlags(&Store, DEST_IMAGE, Name, &Flags);
+        for(unsigned t = 0; t < Clients; ++t)
+        {
+            Lost += ((Flags & Bits[t]) ? 1 : 0) != Toggles[t][Image];
+        }
+    }
+    ULONG Changes, Writes;
+    Server.GetCounters(&Changes, &Writes);
+    wprintf(L"    %u changes in %u writes, %u failed requests, %zu lost updates\n", Changes, Writes, (ULONG)Failures, Lost);
+    return !Lost && !Failures;
+}
+
+
+/* A decimal number of at least Minimum, nothing else may follow it. */
+static BOOL ParseCount( _In_z_ const char* Text, _In_ unsigned long Minimum, _Out_ unsigned long* Count )
+{
+    char* End = NULL;
+    errno = 0;
+    *Count = strtoul(Text, &End, 10);
+    return isdigit((unsigned char)Text[0]) && !*End && errno != ERANGE && *Count >= Minimum;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t MaxImages = BENCH_DEFAULT_MAX_IMAGES;
+    unsigned Threads = BENCH_DEFAULT_THREADS;
+    for(int n = 1; n < argc; ++n)
+    {
+        unsigned long Count = 0;
+        /* BenchStress needs at least one image to pick from, -t 0 skips the threaded runs. */
+        if(!strcmp(argv[n], "-n") && n + 1 < argc && ParseCount(argv[n + 1], 1, &Count))
+        {
+            MaxImages = Count;
+            ++n;
+        }
+        else if(!strcmp(argv[n], "-t") && n + 1 < argc && ParseCount(argv[n + 1], 0, &Count) && Count <= UINT_MAX)
+        {
+            Threads = (unsigned)Count;
+            ++n;
+        }
+        else
+        {
+            fprintf(stderr, "usage: gflags_bench [-n <MaxImages, at least 1>] [-t <StressThreads>]\n");
+            return 1;
+        }
+    }
+
+#ifdef _WIN32
+    g_NullOutput = fopen("NUL", "w");
+#else
+    g_NullOutput = fopen("/dev/null", "w");
+#endif
+    if(!g_NullOutput)
+    {
+        return 1;
+    }
+
+    PrintHeader();
+    BenchParsing();
+    for(size_t Images = 1; Images <= MaxImages; Images *= 10)
+    {
+        BenchStore(Images);
+    }
+    BenchInventory(MaxImages * 10);
+    BOOL Success = !Threads || BenchStress(Threads, std::min(MaxImages, (size_t)1000));
+    Success = (!Threads || BenchServe(Threads)) && Success;
+    fclose(g_NullOutput);
+    return Success ? 0 : 1;
+}
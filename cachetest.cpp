@@ -0,0 +1,152 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "platform.h"
+#include "gflags.h"
+#include "flagstore.h"
+#include <chrono>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*
+ * CachedFlagStore over a FileFlagStore, with a second FileFlagStore on the
+ * same journal standing in for another gflags process: its changes have to
+ * reach the cache through the change stamp, the writes through the cache
+ * have to reach the journal.
+ */
+
+#define TEST_NOTIFY_WAIT_MS     2000
+
+static int g_Failures = 0;
+
+#define CHECK(Condition)    Check(!!(Condition), #Condition, __LINE__)
+
+static void Check( _In_ BOOL Passed, _In_z_ const char* Condition, _In_ int Line )
+{
+    if(!Passed)
+    {
+        fprintf(stderr, "cachetest.cpp(%d): failed: %s\n", Line, Condition);
+        ++g_Failures;
+    }
+}
+
+static ULONG ReadFlags( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName )
+{
+    ULONG Flags = 0xffffffff;
+    return Store->ReadImageValue(ImageName, GLOBALFLAG_VALUENAME, &Flags) ? Flags : 0xffffffff;
+}
+
+/*
+ * A journal catches up with other writers in GetChangeStamp, once the change
+ * notification arrived. It is not always there by the time the write returns.
+ */
+static ULONG WaitForFlags( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ ULONG Expected )
+{
+    ULONG Stamp, Flags = ReadFlags(Store, ImageName);
+    for(int Waited = 0; Flags != Expected && Waited < TEST_NOTIFY_WAIT_MS; Waited += 10)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        Store->GetChangeStamp(&Stamp);
+        Flags = ReadFlags(Store, ImageName);
+    }
+    return Flags;
+}
+
+static void RemoveJournal( _In_ const std::wstring& FileName )
+{
+    _wremove(FileName.c_str());
+    _wremove((FileName + L".lock").c_str());
+}
+
+int main()
+{
+    WCHAR FileName[64];
+#ifdef _WIN32
+    swprintf(FileName, 64, L"gflags-cachetest-%u.journal", (ULONG)GetCurrentProcessId());
+#else
+    swprintf(FileName, 64, L"gflags-cachetest-%u.journal", (ULONG)getpid());
+#endif
+    RemoveJournal(FileName);
+    {
+        FileFlagStore Journal, Other;
+        CHECK(Journal.Open(FileName));
+        CHECK(Other.Open(FileName));
+        CachedFlagStore Cache(&Journal);
+        ULONG Stamp, Hits = 0, Misses = 0, Current = 0;
+        CHECK(Cache.GetChangeStamp(&Stamp));
+
+        /* Repeated reads are answered from the cache. */
+        CHECK(Other.WriteImageValue(L"a.exe", GLOBALFLAG_VALUENAME, FLG_HEAP_ENABLE_TAIL_CHECK));
+        CHECK(WaitForFlags(&Cache, L"a.exe", FLG_HEAP_ENABLE_TAIL_CHECK) == FLG_HEAP_ENABLE_TAIL_CHECK);
+        Cache.GetCounters(&Hits, &Misses);
+        CHECK(ReadFlags(&Cache, L"A.EXE") == FLG_HEAP_ENABLE_TAIL_CHECK);
+        CHECK(ReadFlags(&Cache, L"a.exe") == FLG_HEAP_ENABLE_TAIL_CHECK);
+        ULONG Before = Hits;
+        Cache.GetCounters(&Hits, &Misses);
+        CHECK(Hits == Before + 2);
+
+        /* A change behind the cache moves the stamp, which drops the cached value. */
+        CHECK(Other.WriteImageValue(L"a.exe", GLOBALFLAG_VALUENAME, FLG_HEAP_ENABLE_FREE_CHECK));
+        CHECK(WaitForFlags(&Cache, L"a.exe", FLG_HEAP_ENABLE_FREE_CHECK) == FLG_HEAP_ENABLE_FREE_CHECK);
+        ULONG NewStamp;
+        CHECK(Cache.GetChangeStamp(&NewStamp) && NewStamp != Stamp);
+
+        /* Writes go through to the journal, and are not answered from a stale copy. */
+        CHECK(Cache.WriteImageValue(L"a.exe", GLOBALFLAG_VALUENAME, FLG_HEAP_VALIDATE_PARAMETERS));
+        CHECK(ReadFlags(&Cache, L"a.exe") == FLG_HEAP_VALIDATE_PARAMETERS);
+        CHECK(WaitForFlags(&Other, L"a.exe", FLG_HEAP_VALIDATE_PARAMETERS) == FLG_HEAP_VALIDATE_PARAMETERS);
+
+        /* The swap sees the other writer even before the notification is read. */
+        CHECK(Other.WriteImageValue(L"a.exe", GLOBALFLAG_VALUENAME, FLG_HEAP_VALIDATE_ALL));
+        CHECK(Cache.CompareExchange(DEST_IMAGE, L"a.exe", GLOBALFLAG_VALUENAME, FLG_HEAP_VALIDATE_PARAMETERS, 0, &Current));
+        CHECK(Current == FLG_HEAP_VALIDATE_ALL);
+        CHECK(ReadFlags(&Cache, L"a.exe") == FLG_HEAP_VALIDATE_ALL);
+        CHECK(Cache.CompareExchange(DEST_IMAGE, L"a.exe", GLOBALFLAG_VALUENAME, FLG_HEAP_VALIDATE_ALL, FLG_HEAP_PAGE_ALLOCS, &Current));
+        CHECK(Current == FLG_HEAP_VALIDATE_ALL);
+        CHECK(ReadFlags(&Cache, L"a.exe") == FLG_HEAP_PAGE_ALLOCS);
+
+        /* Removed values are gone from the cache too. */
+        CHECK(Cache.DeleteImageValue(L"a.exe", GLOBALFLAG_VALUENAME));
+        CHECK(ReadFlags(&Cache, L"a.exe") == 0);
+    }
+    {
+        FileFlagStore Reopened;
+        CHECK(Reopened.Open(FileName));
+        CHECK(ReadFlags(&Reopened, L"a.exe") == 0);
+        BOOL Exists = FALSE;
+        CHECK(Reopened.HasImage(L"a.exe", &Exists) && Exists);
+    }
+    RemoveJournal(FileName);
+
+    if(g_Failures)
+    {
+        fprintf(stderr, "cachetest: %d checks failed\n", g_Failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include "platform.h"
+#include "callstats.h"
+#include <atomic>
+#include <chrono>
+
+struct CallCounter
+{
+    std::atomic<ULONGLONG> Count;
+    std::atomic<ULONGLONG> TotalNs;
+    std::atomic<ULONGLONG> MaxNs;
+    std::atomic<ULONGLONG> Buckets[CALLSTAT_BUCKETS];
+};
+
+/* Zero initialized as a static, before any constructor runs. */
+static CallCounter g_CallCounters[CALLSTAT_COUNT];
+
+static const PCWSTR g_CallNames[CALLSTAT_COUNT] =
+{
+    L"UpdateValidFlags",
+    L"EnableDebug",
+    L"ReadGlobalFlags",
+    L"WriteGlobalFlags",
+    L"ReadImageValue",
+    L"WriteImageValue",
+    L"DeleteImageValue",
+    L"ReadImageString",
+    L"WriteImageString",
+    L"EnumImageValues",
+    L"ReadKernelFlags",
+    L"WriteKernelFlags",
+    L"RegOpenKeyExW",
+    L"RegCreateKeyExW",
+    L"RegQueryValueExW",
+    L"RegSetValueExW",
+    L"RegEnumKeyExW",
+    L"NtQuerySystemInformation",
+    L"NtSetSystemInformation",
+};
+
+
+ULONGLONG CallStatClock()
+{
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RecordCall( _In_ int Id, _In_ ULONGLONG StartNs )
+{
+    ULONGLONG Elapsed = CallStatClock() - StartNs;
+    CallCounter& Counter = g_CallCounters[Id];
+    size_t Bucket = 0;
+    for(ULONGLONG Us = Elapsed / 1000; Us && Bucket < CALLSTAT_BUCKETS - 1; Us >>= 1)
+    {
+        ++Bucket;
+    }
+    Counter.Count.fetch_add(1, std::memory_order_relaxed);
+    Counter.TotalNs.fetch_add(Elapsed, std::memory_order_relaxed);
+    Counter.Buckets[Bucket].fetch_add(1, std::memory_order_relaxed);
+    ULONGLONG Max = Counter.MaxNs.load(std::memory_order_relaxed);
+    while(Elapsed > Max && !Counter.MaxNs.compare_exchange_weak(Max, Elapsed, std::memory_order_relaxed))
+    {
+    }
+}
+
+void GetCallStat( _In_ int Id, _Out_ CallStat* Stat )
+{
+    const CallCounter& Counter = g_CallCounters[Id];
+    Stat->Name = g_CallNames[Id];
+    Stat->Count = Counter.Count.load(std::memory_order_relaxed);
+    Stat->TotalNs = Counter.TotalNs.load(std::memory_order_relaxed);
+    Stat->MaxNs = Counter.MaxNs.load(std::memory_order_relaxed);
+    for(size_t n = 0; n < CALLSTAT_BUCKETS; ++n)
+    {
+        Stat->Buckets[n] = Counter.Buckets[n].load(std::memory_order_relaxed);
+    }
+}
+
+void ResetCallStats()
+{
+    for(size_t Id = 0; Id < CALLSTAT_COUNT; ++Id)
+    {
+        CallCounter& Counter = g_CallCounters[Id];
+        Counter.Count.store(0, std::memory_order_relaxed);
+        Counter.TotalNs.store(0, std::memory_order_relaxed);
+        Counter.MaxNs.store(0, std::memory_order_relaxed);
+        for(size_t n = 0; n < CALLSTAT_BUCKETS; ++n)
+        {
+            Counter.Buckets[n].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+ULONGLONG CallStatPercentile( _In_ const CallStat* Stat, _In_ ULONG Percent )
+{
+    ULONGLONG Rank = (Stat->Count * Percent + 99) / 100, Seen = 0;
+    ULONGLONG MaxUs = (Stat->MaxNs + 999) / 1000;
+    for(size_t n = 0; n < CALLSTAT_BUCKETS; ++n)
+    {
+        Seen += Stat->Buckets[n];
+        if(Rank && Seen >= Rank)
+        {
+            ULONGLONG Upper = (ULONGLONG)1 << n;
+            return Upper < MaxUs ? Upper : MaxUs;
+        }
+    }
+    return MaxUs;
+}
+
+void PrintCallStats( _In_ FILE* dst )
+{
+    fwprintf(dst, L"%-26ls %10ls %12ls %10ls %10ls %10ls %10ls\r\n", L"Call", L"Count", L"Total ms", L"Mean us", L"p50 us", L"p99 us", L"Max us");
+    for(int Id = 0; Id < CALLSTAT_COUNT; ++Id)
+    {
+        CallStat Stat;
+        GetCallStat(Id, &Stat);
+        if(!Stat.Count)
+        {
+            continue;
+        }
+        fwprintf(dst, L"%-26ls %10llu %12.3f %10.1f %10llu %10llu %10.1f\r\n", Stat.Name, Stat.Count,
+                 Stat.TotalNs / 1e6, Stat.TotalNs / 1e3 / Stat.Count,
+                 CallStatPercentile(&Stat, 50), CallStatPercentile(&Stat, 99), Stat.MaxNs / 1e3);
+    }
+}
+
+/* The names are identifiers from g_CallNames, nothing in them needs escaping. */
+static void AppendJsonNumber( _Inout_ std::wstring* Json, _In_z_ PCWSTR Name, _In_ ULONGLONG Value )
+{
+    *Json += L",\"";
+    *Json += Name;
+    *Json += L"\":";
+    *Json += std::to_wstring(Value);
+}
+
+std::wstring FormatCallStatsJson()
+{
+    std::wstring Json = L"{\"calls\":[";
+    BOOL First = TRUE;
+    for(int Id = 0; Id < CALLSTAT_COUNT; ++Id)
+    {
+        CallStat Stat;
+        GetCallStat(Id, &Stat);
+        if(!Stat.Count)
+        {
+            continue;
+        }
+        Json += First ? L"{\"name\":\"" : L",{\"name\":\"";
+        Json += Stat.Name;
+        Json += L"\"";
+        AppendJsonNumber(&Json, L"count", Stat.Count);
+        AppendJsonNumber(&Json, L"total_ns", Stat.TotalNs);
+        AppendJsonNumber(&Json, L"max_ns", Stat.MaxNs);
+        AppendJsonNumber(&Json, L"p50_us", CallStatPercentile(&Stat, 50));
+        AppendJsonNumber(&Json, L"p99_us", CallStatPercentile(&Stat, 99));
+        Json += L",\"buckets\":[";
+        First = FALSE;
+
+        /* Up to the last bucket in use, the rest are empty. */
+        size_t Used = CALLSTAT_BUCKETS;
+        while(Used > 1 && !Stat.Buckets[Used - 1])
+        {
+            --Used;
+        }
+        for(size_t n = 0; n < Used; ++n)
+        {
+            if(n)
+            {
+                Json += L',';
+            }
+            Json += std::to_wstring(Stat.Buckets[n]);
+        }
+        Json += L"]}";
+    }
+    return Json + L"]}";
+}
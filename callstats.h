@@ -0,0 +1,104 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#pragma once
+
+#include "platform.h"
+#include <stdio.h>
+#include <string>
+
+/*
+ * Call counts and latency histograms of the calls gflags makes into the
+ * registry and the kernel, printed by -stats and returned by the 'stats'
+ * server request. Collection is always on: a timed call reads the clock
+ * twice and does a few relaxed atomic adds, next to registry calls that take
+ * microseconds. The counters are process wide and shared by all threads.
+ */
+
+#define CALLSTAT_UPDATE_VALID_FLAGS         0
+#define CALLSTAT_ENABLE_DEBUG               1
+#define CALLSTAT_READ_GLOBAL_FLAGS          2
+#define CALLSTAT_WRITE_GLOBAL_FLAGS         3
+#define CALLSTAT_READ_IMAGE_VALUE           4
+#define CALLSTAT_WRITE_IMAGE_VALUE          5
+#define CALLSTAT_DELETE_IMAGE_VALUE         6
+#define CALLSTAT_READ_IMAGE_STRING          7
+#define CALLSTAT_WRITE_IMAGE_STRING         8
+#define CALLSTAT_ENUM_IMAGE_VALUES          9
+#define CALLSTAT_READ_KERNEL_FLAGS          10
+#define CALLSTAT_WRITE_KERNEL_FLAGS         11
+#define CALLSTAT_REG_OPEN_KEY               12
+#define CALLSTAT_REG_CREATE_KEY             13
+#define CALLSTAT_REG_QUERY_VALUE            14
+#define CALLSTAT_REG_SET_VALUE              15
+#define CALLSTAT_REG_ENUM_KEY               16
+#define CALLSTAT_NT_QUERY_SYSTEM_INFO       17
+#define CALLSTAT_NT_SET_SYSTEM_INFO         18
+#define CALLSTAT_COUNT                      19
+
+/* Bucket 0 counts the calls below 1us, bucket n the ones from 2^(n-1) up to 2^n us. */
+#define CALLSTAT_BUCKETS                    32
+
+struct CallStat
+{
+    PCWSTR Name;
+    ULONGLONG Count;
+    ULONGLONG TotalNs;
+    ULONGLONG MaxNs;
+    ULONGLONG Buckets[CALLSTAT_BUCKETS];
+};
+
+/* Nanoseconds from a monotonic clock. */
+GFLAGS_API ULONGLONG CallStatClock();
+GFLAGS_API void RecordCall( _In_ int Id, _In_ ULONGLONG StartNs );
+
+/* A copy of the counters, each one is read atomically but not all of them at once. */
+GFLAGS_API void GetCallStat( _In_ int Id, _Out_ CallStat* Stat );
+GFLAGS_API void ResetCallStats();
+
+/* The upper bound in us of the bucket that holds the Percent'th call, at most MaxNs. */
+GFLAGS_API ULONGLONG CallStatPercentile( _In_ const CallStat* Stat, _In_ ULONG Percent );
+
+/* A table of the calls that were made. */
+GFLAGS_API void PrintCallStats( _In_ FILE* dst );
+
+/* The same as a single line of JSON: {"calls":[{"name":..., "count":..., ...}]} */
+GFLAGS_API std::wstring FormatCallStatsJson();
+
+/* Times the rest of the scope it is declared in. */
+class CallTimer
+{
+public:
+    explicit CallTimer( _In_ int Id ) : m_Id(Id), m_Start(CallStatClock()) {;}
+    ~CallTimer() { RecordCall(m_Id, m_Start); }
+
+private:
+    CallTimer( const CallTimer& );
+    CallTimer& operator=( const CallTimer& );
+
+    int m_Id;
+    ULONGLONG m_Start;
+};
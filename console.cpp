@@ -1,7 +1,22 @@
-#include <Windows.h>
-#include <strsafe.h>
+#include "platform.h"
+#include <errno.h>
 #include <stdio.h>
+#include <set>
+#include <vector>
 #include "gflags.h"
+#include "flagstore.h"
+#include "flagttl.h"
+#include "hive.h"
+#include "hivescan.h"
+#include "imageindex.h"
+#include "pageheap.h"
+#include "inventory.h"
+#include "regfile.h"
+#include "winereg.h"
+#include "server.h"
+#include "snapshot.h"
+#include "callstats.h"
+#include "tracedb.h"
 
 
 PCWSTR g_License =
@@ -28,14 +43,99 @@ L"OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE\
 L"SOFTWARE.\r\n";
 
 PCWSTR g_CommandlineUsage = L"\r\n"
-L"usage: gflags [-i <ImageName> [<Flags>]]\r\n"
+L"usage: gflags [-i <ImageName> [<Flags>] [-force]]\r\n"
+L"       gflags -i *\r\n"
+L"       gflags -i <ImageName> <Flags> -ttl <Duration>\r\n"
+L"       gflags -i <ImageName> [<Flags>] -largepages on|off\r\n"
+L"       gflags -i <ImageName> [<Flags>] -pageheap off|light|full\r\n"
+L"              [-dlls <Dll>[,<Dll>...]] [-size <Start> <End>] [-random <Percent>]\r\n"
+L"       gflags -i <ImageName> [<Flags>] -tracedb <SizeInMb>\r\n"
+L"       gflags -i|-k|-r ... -budget <Cpu>[,<Memory>] [-force]\r\n"
 L"       gflags [-k [<Flags>]]\r\n"
 L"       gflags [-r [<Flags>]]\r\n"
+L"       gflags -store <File> [-i|-k|-r ...]\r\n"
+L"       gflags -hive|-hivelog <File> [-hive|-hivelog <File>] [-i|-r ...]\r\n"
+L"       gflags -wine <Prefix> [-i|-r ...]\r\n"
+L"       gflags [-store <File>|-hive <File>] -batch <File>\r\n"
+L"       gflags [-store <File>|-hive <File>] -serve [<Endpoint>]\r\n"
+L"       gflags [-store <File>|-hive <File>] -complete <Prefix>\r\n"
+L"       gflags [-store <File>|-hive <File>] -export|-import <File>\r\n"
+L"       gflags [-store <File>|-hive <File>] -snapshot <File>\r\n"
+L"       gflags -diff <OldSnapshot> <NewSnapshot>\r\n"
+L"       gflags -scan-hives <Directory>\r\n"
+L"       gflags -inventory <Directory>\r\n"
+L"       gflags [-store <File>|-hive <File>] -list-ttl|-revert-expired\r\n"
+L"       gflags [-store <File>|-hive <File>] -list-largepages|-list-ust\r\n"
+L"       gflags -tracedb-size <AllocationsPerSecond> <Duration>\r\n"
+L"       gflags ... -stats [text|json]\r\n"
 L"\r\n"
 L"where: -i operates on flags for a specific image.\r\n"
 L"          this mode also requires an image name to operate on.\r\n"
+L"          Settings for an image that has none yet are only created\r\n"
+L"          with -force, otherwise similar image names are listed.\r\n"
+L"          With * as image name, every image with a GlobalFlag value is listed\r\n"
+L"          as 'image, flags, abbreviations', one per line.\r\n"
+L"       -ttl reverts the changed image flags after <Duration>, such as\r\n"
+L"          30m, 2h or 1d. Expired changes are reverted by -serve, by\r\n"
+L"          -revert-expired and whenever gflags is started.\r\n"
+L"       -largepages sets the UseLargePages option of the image, which\r\n"
+L"          loads it using large pages if possible.\r\n"
+L"       -pageheap sets up page heap for the image. Light page heap costs\r\n"
+L"          little memory, full page heap catches overruns as they happen.\r\n"
+L"          -dlls, -size and -random limit full page heap to allocations\r\n"
+L"          from those DLLs, of <Start> to <End> bytes, or to <Percent> of\r\n"
+L"          all allocations; the others get light page heap.\r\n"
+L"       -tracedb sets the size of the stack trace database that ust\r\n"
+L"          creates for the image, 0 for the default size.\r\n"
+L"       -budget refuses flags whose estimated overhead is above <Cpu>\r\n"
+L"          times the run time or <Memory> times the memory, such as 1.5\r\n"
+L"          or 3. <Memory> is <Cpu> when not given. -force applies\r\n"
+L"          them anyway. The estimate is shown with the flags.\r\n"
 L"       -k operates on flags of the running system.\r\n"
 L"       -r operates on flags in the system registry.\r\n"
+L"       -store uses the flag journal <File> instead of the registry\r\n"
+L"          and the running system, it must precede -i, -k or -r.\r\n"
+L"       -hive operates on an offline SOFTWARE or SYSTEM hive file\r\n"
+L"          instead of the registry, it must precede -i or -r.\r\n"
+L"          Changes are written to the hive in place, with -hivelog\r\n"
+L"          they are appended to <File>.LOG1 instead.\r\n"
+L"       -wine operates on the system.reg of the Wine prefix <Prefix>\r\n"
+L"          instead of the registry, it must precede -i or -r. Changes\r\n"
+L"          are refused while a wineserver runs for the prefix.\r\n"
+L"       -batch applies all changes listed in <File> in one go.\r\n"
+L"          Each line holds 'registry', 'kernel' or a comma separated\r\n"
+L"          list of image names, followed by the flags to apply to them.\r\n"
+L"          Text after a # is ignored.\r\n"
+L"       -serve answers 'get <Target>' and 'set <Target> <Flags>' requests\r\n"
+L"          from local clients on <Endpoint>, one per line, until stopped.\r\n"
+L"          Targets are named like in batch files. Changes to the same\r\n"
+L"          target that arrive together are written once.\r\n"
+L"       -complete lists the image names starting with <Prefix>,\r\n"
+L"          ignoring case, one per line.\r\n"
+L"       -export writes the global flags and the flags of every image\r\n"
+L"          to <File>, in the .reg format of regedit.\r\n"
+L"       -import applies the GlobalFlag values from the .reg <File>.\r\n"
+L"       -snapshot saves all flags, the OS build and the valid flags\r\n"
+L"          to <File>, in a compact binary format.\r\n"
+L"       -diff lists the flags that differ between two snapshots,\r\n"
+L"          as the bits set (+) and cleared (-) since <OldSnapshot>.\r\n"
+L"       -scan-hives lists the flags of all SOFTWARE and SYSTEM hives\r\n"
+L"          below <Directory>, as 'hive, target, flags, abbreviations'.\r\n"
+L"          The hives are read in parallel.\r\n"
+L"       -inventory loads all snapshots below <Directory>, each named\r\n"
+L"          after its host, and answers 'count <Query>' and 'list <Query>'\r\n"
+L"          lines from the standard input. A query combines abbreviations\r\n"
+L"          and hex masks with &, |, ! and parentheses: hpa & !ust\r\n"
+L"       -list-ttl lists the image flags that are still to be reverted.\r\n"
+L"       -revert-expired reverts the expired ones, to run as a scheduled task.\r\n"
+L"       -list-largepages lists the images loaded using large pages.\r\n"
+L"       -list-ust lists the images with ust and their trace database size,\r\n"
+L"          and the ones where USTEnabled does not match the flag.\r\n"
+L"       -tracedb-size suggests a -tracedb size for a process that keeps\r\n"
+L"          <AllocationsPerSecond> allocations for <Duration>, such as 10m.\r\n"
+L"       -stats prints the number and the latency of the registry and\r\n"
+L"          kernel calls to the standard error when the command ends.\r\n"
+L"          A running -serve returns them for a 'stats' request.\r\n"
 L"\r\n"
 L"       If only -r, -k or -i are specified, then the current\r\n"
 L"       flags are displayed.\r\n"
@@ -43,7 +143,10 @@ L"       If no arguments are specified, gflags will show the UI.\r\n"
 L"\r\n"
 L"       Flags can either be a hex number, or a combination of the\r\n"
 L"       abbreviations listed below. Prefix a number or an abbrev\r\n"
-L"       with a + to set the bits, or with a - to remove the bits.\r\n"
+L"       with a + to set the bits, with a - to remove the bits,\r\n"
+L"       with a ^ to toggle them or with a = to replace all flags.\r\n"
+L"       Operations can be chained and grouped: +hpa+htc-ust =(soe|sls)\r\n"
+L"       A number with a 0x prefix is never taken for an abbrev.\r\n"
 L"       Valid abbreviations are:\r\n"
 L"\r\n";
 
@@ -52,22 +155,112 @@ void PrintUsage(FILE* dst)
     fwprintf(dst, g_CommandlineUsage);
     for(size_t n = 0; n < g_FlagCount; ++n)
     {
-        fwprintf(dst, L"       %s - %s\r\n", g_Flags[n].szAbbr, g_Flags[n].szDesc);
+        fwprintf(dst, L"       %ls - %ls\r\n", g_Flags[n].szAbbr, g_Flags[n].szDesc);
     }
 }
 
-void PrintFlags(FILE* dst, ULONG Flags, DWORD Dest)
+/* 250 as 2.5x */
+static void PrintCostFactor(FILE* dst, ULONG Percent)
 {
-    PWSTR Name = (Dest & DEST_KERNEL) ? L"Running Kernel" : L"";
+    fwprintf(dst, L"%u.%ux", Percent / 100, Percent % 100 / 10);
+}
+
+static void PrintCost(FILE* dst, const FlagCost* Cost)
+{
+    PrintCostFactor(dst, Cost->CpuPercent);
+    fwprintf(dst, L" CPU, ");
+    PrintCostFactor(dst, Cost->MemoryPercent);
+    fwprintf(dst, L" memory");
+}
+
+void PrintFlags(FILE* dst, ULONG Flags, DWORD Dest, ULONG PageHeapFlags)
+{
+    PCWSTR Name = (Dest & DEST_KERNEL) ? L"Running Kernel" : L"";
     Name = (Dest & DEST_REGISTRY) ? L"Boot Registry" : Name;
-    fwprintf(dst, L"Current %s Settings are: %08x\r\n", Name, Flags);
+    fwprintf(dst, L"Current %ls Settings are: %08x\r\n", Name, Flags);
     for(size_t n = 0; n < g_FlagCount; ++n)
     {
         if(Flags & g_Flags[n].dwFlag)
         {
-            fwprintf(dst, L"    %s - %s\r\n", g_Flags[n].szAbbr, g_Flags[n].szDesc);
+            fwprintf(dst, L"    %ls - %ls\r\n", g_Flags[n].szAbbr, g_Flags[n].szDesc);
+        }
+    }
+    FlagCost Cost;
+    EstimateFlagCost(Flags, PageHeapFlags, &Cost);
+    if(Cost.CpuPercent > 100 || Cost.MemoryPercent > 100)
+    {
+        fwprintf(dst, L"Estimated overhead: ");
+        PrintCost(dst, &Cost);
+        fwprintf(dst, L"\r\n");
+    }
+}
+
+/* The whole of Text as an unsigned number, wcstoul alone skips trailing text and accepts a sign. */
+static BOOL ParseNumber(PCWSTR Text, int Base, ULONG* Value)
+{
+    PWSTR End = NULL;
+    errno = 0;
+    *Value = wcstoul(Text, &End, Base);
+    return iswdigit(Text[0]) && End && !*End && errno != ERANGE;
+}
+
+/* '2', '1.5' or '150%' as a percentage, at least 100. */
+static BOOL ParseCostFactor(PCWSTR Text, ULONG* Percent)
+{
+    PWSTR End = NULL;
+    ULONG Whole = wcstoul(Text, &End, 10);
+    if(!End || End == Text)
+    {
+        return FALSE;
+    }
+    if(*End == L'%' && !End[1])
+    {
+        *Percent = Whole;
+    }
+    else
+    {
+        ULONG Tenths = 0;
+        if(*End == L'.' && End[1] >= L'0' && End[1] <= L'9')
+        {
+            Tenths = End[1] - L'0';
+            End += 2;
         }
+        if(*End == L'x')
+        {
+            ++End;
+        }
+        if(*End || Whole > 10000)
+        {
+            return FALSE;
+        }
+        *Percent = Whole * 100 + Tenths * 10;
     }
+    return *Percent >= 100;
+}
+
+/* The budget only stops changes that make the estimate worse, so expensive flags can always be removed. */
+static BOOL IsOverBudget(ULONG OldFlags, ULONG OldPageHeap, ULONG NewFlags, ULONG NewPageHeap, const FlagCost* Budget, FlagCost* Cost)
+{
+    FlagCost Old;
+    EstimateFlagCost(OldFlags, OldPageHeap, &Old);
+    EstimateFlagCost(NewFlags, NewPageHeap, Cost);
+    return (Cost->CpuPercent > Budget->CpuPercent && Cost->CpuPercent > Old.CpuPercent) ||
+           (Cost->MemoryPercent > Budget->MemoryPercent && Cost->MemoryPercent > Old.MemoryPercent);
+}
+
+static BOOL PrintImageRecord(PCWSTR ImageName, ULONG Flags, PVOID Context)
+{
+    FILE* dst = (FILE*)Context;
+    fwprintf(dst, L"%ls, %08x,", ImageName, Flags);
+    for(size_t n = 0; n < g_FlagCount; ++n)
+    {
+        if(Flags & g_Flags[n].dwFlag)
+        {
+            fwprintf(dst, L" %ls", g_Flags[n].szAbbr);
+        }
+    }
+    fwprintf(dst, L"\r\n");
+    return TRUE;
 }
 
 void ShowLicense(FILE* dst)
@@ -77,65 +270,591 @@ void ShowLicense(FILE* dst)
 
 BOOL IsCommandlineOption(PCWSTR lpArgString, PCWSTR Option)
 {
+    if(lpArgString[0] == '-' && lpArgString[1] == '-')
+    {
+        ++lpArgString;
+    }
     return (lpArgString[0] == '/' || lpArgString[0] == '-') && !wcscmp(lpArgString + 1, Option);
 }
 
-void MaskFlags( DWORD ActiveDest, DWORD ActiveFlags, PDWORD ApplyFlags, PDWORD IgnoredFlags)
+#define BATCH_LINE_MAX      1024
+
+/*
+ * Each line is '<Target>[,<Target>...] <Flags>', the flags expression is compiled once per line.
+ * Everything runs in this process, so the privilege adjustment and key handles are shared by all lines.
+ */
+static BOOL RunBatch(FlagStore* Store, PCWSTR FileName)
+{
+    FILE* File = _wfopen(FileName, L"r");
+    if(!File)
+    {
+        fwprintf(stderr, L"gflags: Could not open batch file '%ls'\r\n", FileName);
+        return FALSE;
+    }
+
+    WCHAR Line[BATCH_LINE_MAX];
+    ULONG LineNumber = 0, Applied = 0, Total = 0, Unchanged = 0;
+    DWORD IgnoredFlags = 0;
+    std::vector<ULONG> Failed;
+    while(fgetws(Line, BATCH_LINE_MAX, File))
+    {
+        ++LineNumber;
+        PWSTR Comment = wcschr(Line, L'#');
+        if(Comment)
+        {
+            *Comment = L'\0';
+        }
+        PWSTR Targets = Line;
+        while(iswspace(*Targets))
+        {
+            ++Targets;
+        }
+        if(!*Targets)
+        {
+            continue;
+        }
+        PWSTR Expression = Targets;
+        while(*Expression && !iswspace(*Expression))
+        {
+            ++Expression;
+        }
+        if(*Expression)
+        {
+            *Expression++ = L'\0';
+        }
+
+        FlagEdit Edit;
+        InitFlagEdit(&Edit);
+        if(!CompileFlagEdit(Expression, &Edit))
+        {
+            ++Total;
+            Failed.push_back(LineNumber);
+            continue;
+        }
+        BOOL LineApplied = TRUE;
+        PWSTR Context = NULL;
+        for(PWSTR Target = wcstok_s(Targets, L",", &Context); Target; Target = wcstok_s(NULL, L",", &Context))
+        {
+            DWORD Dest = ParseFlagTarget(Target);
+
+            FlagUpdate Update;
+            ++Total;
+            if(UpdateFlags(Store, Dest, Target, &Edit, &Update))
+            {
+                ++Applied;
+                Unchanged += Update.Written ? 0 : 1;
+                IgnoredFlags |= Update.IgnoredFlags;
+            }
+            else
+            {
+                LineApplied = FALSE;
+            }
+        }
+        if(!LineApplied)
+        {
+            Failed.push_back(LineNumber);
+        }
+    }
+    BOOL ReadError = ferror(File);
+    fclose(File);
+    BOOL Flushed = Store->Flush();
+
+    fwprintf(stdout, L"gflags: %u of %u changes applied, %u writes skipped as the value was already set\r\n", Applied, Total, Unchanged);
+    if(!Failed.empty())
+    {
+        fwprintf(stdout, L"    failed lines:");
+        for(size_t n = 0; n < Failed.size(); ++n)
+        {
+            fwprintf(stdout, L" %u", Failed[n]);
+        }
+        fwprintf(stdout, L"\r\n");
+    }
+    if(IgnoredFlags)
+    {
+        fwprintf(stdout, L"    ignored flags not valid for their destination: %08x\r\n", IgnoredFlags);
+    }
+    if(ReadError || !Flushed)
+    {
+        fwprintf(stderr, L"gflags: Could not %ls\r\n", ReadError ? L"read the batch file" : L"save the changes");
+    }
+    return Failed.empty() && !ReadError && Flushed;
+}
+
+/*
+ * Serves requests until the process is stopped. Key handles and privileges are
+ * acquired by the store on first use, and kept for all clients.
+ */
+static BOOL RunServer(FlagStore* Store, PCWSTR Endpoint)
 {
-    DWORD Mask = 0;
-    if(ActiveDest & DEST_IMAGE)
-        Mask = g_ValidImageFlags;
-    else if(ActiveDest & DEST_KERNEL)
-        Mask = g_ValidKernelFlags;
+    FlagServer Server(Store, SERVER_BATCH_WINDOW_MS);
+    fwprintf(stdout, L"gflags: Serving flag requests on %ls\r\n", Endpoint);
+    fflush(stdout);
+    if(!Server.Serve(Endpoint))
+    {
+        fwprintf(stderr, L"gflags: Could not listen on '%ls'\r\n", Endpoint);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL CompleteImageName(FlagStore* Store, PCWSTR Prefix)
+{
+    ImageNameIndex Index;
+    std::vector<std::wstring> Names;
+    if(!Index.Build(Store))
+    {
+        fwprintf(stderr, L"gflags: Could not enumerate the image names\r\n");
+        return FALSE;
+    }
+    Index.Complete(Prefix, Index.Count(), &Names);
+    for(size_t n = 0; n < Names.size(); ++n)
+    {
+        fwprintf(stdout, L"%ls\r\n", Names[n].c_str());
+    }
+    return TRUE;
+}
+
+#define IMAGE_SUGGEST_MAX   5
+
+/*
+ * An image without settings is most likely a typo, the names sharing the longest prefix with it are suggested.
+ * The images are only enumerated for the suggestions, once the image is known to be missing.
+ */
+static BOOL IsNewImage(FlagStore* Store, PCWSTR ImageName, std::vector<std::wstring>* Similar)
+{
+    ImageNameIndex Index;
+    BOOL Exists = FALSE;
+    if(!Store->HasImage(ImageName, &Exists) || Exists || !Index.Build(Store))
+    {
+        return FALSE;
+    }
+    std::wstring Prefix(ImageName);
+    while(Similar->empty() && !Prefix.empty())
+    {
+        Index.Complete(Prefix.c_str(), IMAGE_SUGGEST_MAX, Similar);
+        Prefix.erase(Prefix.size() - 1);
+    }
+    return TRUE;
+}
+
+static BOOL ExportFlags(FlagStore* Store, PCWSTR FileName)
+{
+    if(!ExportRegFile(Store, FileName))
+    {
+        fwprintf(stderr, L"gflags: Could not export the flags to '%ls'\r\n", FileName);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL ImportFlags(FlagStore* Store, PCWSTR FileName)
+{
+    RegImportResult Result;
+    BOOL Success = ImportRegFile(Store, FileName, &Result);
+    if(Result.Values)
+    {
+        fwprintf(stdout, L"gflags: Imported %u of %u values, %u already set\r\n", Result.Applied, Result.Values, Result.Unchanged);
+    }
+    if(Result.IgnoredFlags)
+    {
+        fwprintf(stderr, L"gflags: Ignored flags not valid for their destination: %08x\r\n", Result.IgnoredFlags);
+    }
+    if(!Success)
+    {
+        fwprintf(stderr, L"gflags: Could not import '%ls', %u values failed, first at line %u\r\n", FileName, Result.Failed, Result.FailedLine);
+    }
+    return Success;
+}
+
+static BOOL SaveSnapshot(FlagStore* Store, PCWSTR FileName)
+{
+    ULONG Images;
+    if(!WriteSnapshot(Store, FileName, &Images))
+    {
+        fwprintf(stderr, L"gflags: Could not write the snapshot '%ls'\r\n", FileName);
+        return FALSE;
+    }
+    fwprintf(stdout, L"gflags: Saved the flags of %u images\r\n", Images);
+    return TRUE;
+}
+
+/* '+abbr' for each bit set in Flags, '-abbr' for each bit in Cleared. Bits without a name are printed as hex. */
+static void PrintFlagChanges(FILE* dst, ULONG Set, ULONG Cleared)
+{
+    for(size_t n = 0; n < g_FlagCount; ++n)
+    {
+        if(Set & g_Flags[n].dwFlag)
+        {
+            fwprintf(dst, L" +%ls", g_Flags[n].szAbbr);
+        }
+        if(Cleared & g_Flags[n].dwFlag)
+        {
+            fwprintf(dst, L" -%ls", g_Flags[n].szAbbr);
+        }
+        Set &= ~g_Flags[n].dwFlag;
+        Cleared &= ~g_Flags[n].dwFlag;
+    }
+    if(Set)
+    {
+        fwprintf(dst, L" +0x%x", Set);
+    }
+    if(Cleared)
+    {
+        fwprintf(dst, L" -0x%x", Cleared);
+    }
+}
+
+static BOOL PrintSnapshotChange(DWORD Dest, PCWSTR ImageName, DWORD Change, ULONG OldFlags, ULONG NewFlags, PVOID Context)
+{
+    static const PCWSTR Changes[] = { L"changed", L"added", L"removed" };
+    ++*(ULONG*)Context;
+    if(ImageName)
+    {
+        fwprintf(stdout, L"image %ls: %ls %08x -> %08x,", ImageName, Changes[Change], OldFlags, NewFlags);
+    }
     else
-        Mask = g_ValidRegistryFlags;
+    {
+        fwprintf(stdout, L"%ls: %ls %08x -> %08x,", Dest == DEST_KERNEL ? L"kernel" : L"registry", Changes[Change], OldFlags, NewFlags);
+    }
+    PrintFlagChanges(stdout, NewFlags & ~OldFlags, OldFlags & ~NewFlags);
+    fwprintf(stdout, L"\r\n");
+    return TRUE;
+}
 
-    *ApplyFlags = ActiveFlags & Mask;
-    *IgnoredFlags = ActiveFlags & ~Mask;
+static BOOL PrintSnapshotDiff(PCWSTR OldFile, PCWSTR NewFile)
+{
+    SnapshotReader Old, New;
+    PCWSTR Files[] = { OldFile, NewFile };
+    SnapshotReader* Readers[] = { &Old, &New };
+    for(int n = 0; n < 2; ++n)
+    {
+        if(!Readers[n]->Open(Files[n]))
+        {
+            fwprintf(stderr, L"gflags: Could not read the snapshot '%ls'\r\n", Files[n]);
+            return FALSE;
+        }
+    }
+    const SnapshotHeader& OldHeader = Old.Header();
+    const SnapshotHeader& NewHeader = New.Header();
+    if(OldHeader.OsMajor != NewHeader.OsMajor || OldHeader.OsMinor != NewHeader.OsMinor || OldHeader.OsBuild != NewHeader.OsBuild)
+    {
+        fwprintf(stdout, L"os: %u.%u.%u -> %u.%u.%u\r\n", OldHeader.OsMajor, OldHeader.OsMinor, OldHeader.OsBuild,
+                 NewHeader.OsMajor, NewHeader.OsMinor, NewHeader.OsBuild);
+    }
+    if(OldHeader.ValidRegistryFlags != NewHeader.ValidRegistryFlags || OldHeader.ValidKernelFlags != NewHeader.ValidKernelFlags ||
+       OldHeader.ValidImageFlags != NewHeader.ValidImageFlags)
+    {
+        fwprintf(stdout, L"valid flags: %08x %08x %08x -> %08x %08x %08x (registry kernel image)\r\n",
+                 OldHeader.ValidRegistryFlags, OldHeader.ValidKernelFlags, OldHeader.ValidImageFlags,
+                 NewHeader.ValidRegistryFlags, NewHeader.ValidKernelFlags, NewHeader.ValidImageFlags);
+    }
+    ULONG Differences = 0;
+    if(!DiffSnapshots(&Old, &New, PrintSnapshotChange, &Differences))
+    {
+        fwprintf(stderr, L"gflags: The snapshots are damaged\r\n");
+        return FALSE;
+    }
+    fwprintf(stdout, L"gflags: %u differences\r\n", Differences);
+    return TRUE;
 }
 
-static DWORD g_ActiveDest = 0;
-static DWORD g_ActiveFlags = 0;
-static WCHAR g_ImageName[128] = {NULL};
+static BOOL PrintHiveScan(PCWSTR Directory)
+{
+    std::vector<HiveScanResult> Results;
+    if(!ScanHives(Directory, 0, &Results))
+    {
+        fwprintf(stderr, L"gflags: Could not list the files in '%ls'\r\n", Directory);
+        return FALSE;
+    }
+    BOOL Success = TRUE;
+    for(size_t n = 0; n < Results.size(); ++n)
+    {
+        const HiveScanResult& Result = Results[n];
+        if(Result.Type == HIVE_SCAN_DAMAGED)
+        {
+            fwprintf(stderr, L"gflags: Could not read the hive '%ls'\r\n", Result.FileName.c_str());
+            Success = FALSE;
+            continue;
+        }
+        if(Result.HasGlobalFlags)
+        {
+            fwprintf(stdout, L"%ls, ", Result.FileName.c_str());
+            PrintImageRecord(L"registry", Result.GlobalFlags, stdout);
+        }
+        for(size_t i = 0; i < Result.Images.size(); ++i)
+        {
+            fwprintf(stdout, L"%ls, ", Result.FileName.c_str());
+            PrintImageRecord(Result.Images[i].Name.c_str(), Result.Images[i].Flags, stdout);
+        }
+    }
+    return Success;
+}
 
-static void ParseFlags(PCWSTR Arg)
+static BOOL PrintInventoryRecord(PCWSTR Host, PCWSTR Target, ULONG Flags, PVOID Context)
 {
-    if(Arg[0] == L'+' || Arg[0] == L'-')
+    fwprintf((FILE*)Context, L"%ls, ", Host);
+    return PrintImageRecord(Target, Flags, Context);
+}
+
+/* Answers one query per line until the end of the input, the inventory is loaded once. */
+static BOOL RunInventory(PCWSTR Directory)
+{
+    FlagInventory Inventory;
+    ULONG Hosts;
+    BOOL Success = Inventory.AddSnapshots(Directory, &Hosts);
+    if(!Success)
     {
-        for(size_t n = 0; n < g_FlagCount; ++n)
+        fwprintf(stderr, L"gflags: Some snapshots in '%ls' are damaged\r\n", Directory);
+    }
+    fwprintf(stdout, L"gflags: Loaded %zu records from %u hosts\r\n", Inventory.Count(), Hosts);
+
+    WCHAR Line[BATCH_LINE_MAX];
+    while(fgetws(Line, BATCH_LINE_MAX, stdin))
+    {
+        PWSTR Command = Line;
+        while(iswspace(*Command))
+        {
+            ++Command;
+        }
+        if(!*Command)
+        {
+            continue;
+        }
+        PWSTR Query = Command;
+        while(*Query && !iswspace(*Query))
         {
-            if( !_wcsicmp(Arg+1, g_Flags[n].szAbbr) )
+            ++Query;
+        }
+        if(*Query)
+        {
+            *Query++ = L'\0';
+        }
+
+        BOOL List = !wcscmp(Command, L"list");
+        ULONGLONG Matches;
+        if(!List && wcscmp(Command, L"count"))
+        {
+            fwprintf(stderr, L"gflags: Unknown command - '%ls'\r\n", Command);
+            Success = FALSE;
+        }
+        else if(!Inventory.Query(Query, List ? PrintInventoryRecord : NULL, stdout, &Matches))
+        {
+            fwprintf(stderr, L"gflags: Invalid query - '%ls'\r\n", Query);
+            Success = FALSE;
+        }
+        else
+        {
+            fwprintf(stdout, L"%llu\r\n", Matches);
+        }
+        fflush(stdout);
+    }
+    return Success;
+}
+
+static void FormatRevertTime(ULONG Time, PWSTR Buffer, size_t Size)
+{
+    time_t Value = (time_t)Time;
+    struct tm Local;
+    if(localtime_s(&Local, &Value) || !wcsftime(Buffer, Size, L"%Y-%m-%d %H:%M", &Local))
+    {
+        swprintf(Buffer, Size, L"%u", Time);
+    }
+}
+
+/* 'image, revert time, flags now -> after the revert, bits restored' */
+static BOOL ListTtl(FlagStore* Store)
+{
+    std::vector<PendingRevert> Reverts;
+    if(!ListPendingReverts(Store, &Reverts))
+    {
+        fwprintf(stderr, L"gflags: Could not read the pending reverts\r\n");
+        return FALSE;
+    }
+    ULONG Now = GetTtlTime();
+    for(size_t n = 0; n < Reverts.size(); ++n)
+    {
+        const PendingRevert& Revert = Reverts[n];
+        WCHAR Time[64];
+        ULONG Flags = 0;
+        ReadFlags(Store, DEST_IMAGE, Revert.ImageName.c_str(), &Flags);
+        ULONG Restored = (Flags & ~Revert.Mask) | (Revert.Flags & Revert.Mask);
+        FormatRevertTime(Revert.Time, Time, 64);
+        fwprintf(stdout, L"%ls, %ls%ls, %08x -> %08x,", Revert.ImageName.c_str(), Time, Revert.Time <= Now ? L" (expired)" : L"", Flags, Restored);
+        PrintFlagChanges(stdout, Restored & ~Flags, Flags & ~Restored);
+        fwprintf(stdout, L"\r\n");
+    }
+    return TRUE;
+}
+
+static void PrintPageHeap(FILE* dst, const PageHeapConfig* Config)
+{
+    static const PCWSTR Modes[] = { L"off", L"light", L"full" };
+    fwprintf(dst, L"Page Heap: %ls", Modes[Config->Mode]);
+    if(!Config->TargetDlls.empty())
+    {
+        fwprintf(dst, L", dlls %ls", Config->TargetDlls.c_str());
+    }
+    if(Config->SizeEnd)
+    {
+        fwprintf(dst, L", sizes %u-%u", Config->SizeStart, Config->SizeEnd);
+    }
+    if(Config->RandomPercent)
+    {
+        fwprintf(dst, L", random %u%%", Config->RandomPercent);
+    }
+    fwprintf(dst, L"\r\n");
+}
+
+static void PrintTraceDatabaseSize(FILE* dst, PCWSTR Prefix, ULONG SizeInMb)
+{
+    if(SizeInMb)
+    {
+        fwprintf(dst, L"%ls%u MB", Prefix, SizeInMb);
+    }
+    else
+    {
+        fwprintf(dst, L"%lsdefault size", Prefix);
+    }
+}
+
+static BOOL CollectImageRecord(PCWSTR ImageName, ULONG Flags, PVOID Context)
+{
+    std::vector<std::pair<std::wstring, ULONG> >* Images = (std::vector<std::pair<std::wstring, ULONG> >*)Context;
+    Images->push_back(std::make_pair(std::wstring(ImageName), Flags));
+    return TRUE;
+}
+
+/* 'image, size' per image with ust; USTEnabled is checked when the store has it. */
+static BOOL ListUst(FlagStore* Store)
+{
+    std::vector<std::pair<std::wstring, ULONG> > Images;
+    std::vector<std::wstring> Listed;
+    if(!Store->EnumImageValues(GLOBALFLAG_VALUENAME, CollectImageRecord, &Images))
+    {
+        fwprintf(stderr, L"gflags: Could not enumerate image flags\r\n");
+        return FALSE;
+    }
+    BOOL HasList = ReadUstEnabled(Store, &Listed);
+    /* Both sides can hold thousands of images, they are matched by their normalized names. */
+    std::set<std::wstring> ListedNames, ImageNames;
+    for(size_t n = 0; n < Listed.size(); ++n)
+    {
+        ListedNames.insert(NormalizeName(Listed[n].c_str()));
+    }
+    for(size_t n = 0; n < Images.size(); ++n)
+    {
+        PCWSTR ImageName = Images[n].first.c_str();
+        std::wstring Normalized = NormalizeName(ImageName);
+        ImageNames.insert(Normalized);
+        BOOL Enabled = !!(Images[n].second & FLG_USER_STACK_TRACE_DB);
+        ULONG SizeInMb = 0;
+        if(Enabled && !Store->ReadImageValue(ImageName, TRACEDB_SIZE_VALUENAME, &SizeInMb))
+        {
+            fwprintf(stderr, L"gflags: Could not read the trace database size of %ls\r\n", ImageName);
+            return FALSE;
+        }
+        BOOL Mismatch = HasList && Enabled != !!ListedNames.count(Normalized);
+        if(Enabled || Mismatch)
+        {
+            fwprintf(stdout, L"%ls", ImageName);
+            if(Enabled)
             {
-                if(Arg[0] == '+')
-                {
-                    g_ActiveFlags |= g_Flags[n].dwFlag;
-                }
-                else
-                {
-                    g_ActiveFlags &= ~g_Flags[n].dwFlag;
-                }
-                return;
+                PrintTraceDatabaseSize(stdout, L", ", SizeInMb);
             }
+            fwprintf(stdout, L"%ls\r\n", !Mismatch ? L"" : Enabled ? L", not in USTEnabled" : L", in USTEnabled without ust");
+        }
+    }
+    /* Listed images that have no GlobalFlag at all. */
+    for(size_t n = 0; n < Listed.size(); ++n)
+    {
+        if(!ImageNames.count(NormalizeName(Listed[n].c_str())))
+        {
+            fwprintf(stdout, L"%ls, in USTEnabled without ust\r\n", Listed[n].c_str());
         }
     }
-    if(Arg[0] != '+' && Arg[0] != '-')
+    return TRUE;
+}
+
+static BOOL PrintTraceDatabaseSuggestion(PCWSTR AllocationsPerSecond, PCWSTR Duration)
+{
+    PWSTR End = NULL;
+    ULONG Rate = wcstoul(AllocationsPerSecond, &End, 10);
+    ULONG Seconds;
+    if(!End || *End || End == AllocationsPerSecond || !ParseDuration(Duration, &Seconds))
     {
-        g_ActiveFlags = wcstoul(Arg, NULL, 16);
+        fwprintf(stderr, L"gflags: Expected a number of allocations per second and a duration such as 10m\r\n");
+        return FALSE;
     }
-    else if(Arg[0] == '+')
+    ULONG SizeInMb = SuggestTraceDatabaseSize(Rate, Seconds);
+    fwprintf(stdout, L"%u\r\n", SizeInMb);
+    if(SizeInMb == TRACEDB_MAX_MB)
     {
-        g_ActiveFlags |= wcstoul(Arg+1, NULL, 16);
+        fwprintf(stderr, L"gflags: Capped at %u MB, traces beyond that are not recorded\r\n", TRACEDB_MAX_MB);
     }
-    else
+    return TRUE;
+}
+
+static BOOL PrintLargePagesImage(PCWSTR ImageName, ULONG Value, PVOID Context)
+{
+    if(Value)
+    {
+        fwprintf((FILE*)Context, L"%ls\r\n", ImageName);
+    }
+    return TRUE;
+}
+
+/*
+ * Runs before the commands that write to the store, so a change does not outlive
+ * its TTL when nothing else reverts it. Reading commands leave the store alone.
+ */
+static BOOL RevertExpiredOnStart(FlagStore* Store, BOOL Report, ULONG* Reverted)
+{
+    BOOL Success = RevertExpiredFlags(Store, GetTtlTime(), Reverted);
+    if(*Reverted || Report)
+    {
+        fwprintf(Report ? stdout : stderr, L"gflags: Reverted the flags of %u images whose TTL expired\r\n", *Reverted);
+    }
+    if(!Success)
     {
-        g_ActiveFlags &= ~wcstoul(Arg+1, NULL, 16);
+        fwprintf(stderr, L"gflags: Could not revert all expired flags\r\n");
     }
+    return Success;
 }
 
-void ParseCommandline(int argc, PCWSTR argv[])
+/*
+ * Runs a command line and returns the process exit code, or COMMANDLINE_SHOW_UI
+ * when it only selected a store for the UI. All state is local to the call.
+ * A store opened by -store / -hive / -wine is handed to the caller in *OpenedStore,
+ * the caller deletes it.
+ */
+static int RunCommandline(int argc, PCWSTR argv[], FlagStore** OpenedStore)
 {
     BOOL DisplayUsage = FALSE;
     BOOL DisplayFlags = TRUE;
+    DWORD ActiveDest = 0;
+    ULONG ActiveFlags = 0;
+    FlagEdit ActiveEdit;
+    PCWSTR ImageName = NULL;
+    BOOL EnumImages = FALSE;
+    PCWSTR Mode = NULL;             /* -batch, -serve, -complete, -export, -import, -snapshot, -diff, -scan-hives, -inventory,
+                                       -list-ttl, -revert-expired, -list-largepages, -list-ust or -tracedb-size */
+    PCWSTR ModeArgument = NULL;
+    PCWSTR SecondArgument = NULL;   /* -diff and -tracedb-size */
+    ULONG Ttl = 0;
+    int LargePages = -1;            /* -largepages, -1 when not given */
+    LONG TraceDbSize = -1;          /* -tracedb, -1 when not given */
+    BOOL HasBudget = FALSE;
+    BOOL Force = FALSE;
+    FlagCost Budget;
+    BOOL SetPageHeap = FALSE;
+    PageHeapConfig PageHeap;
+    FileFlagStore* File = NULL;
+    HiveFlagStore* Hive = NULL;
+    WineFlagStore* Wine = NULL;
+    FlagStore* Store = GetFlagStore();
+
+    InitFlagEdit(&ActiveEdit);
+    *OpenedStore = NULL;
     for(int n = 1; n < argc; ++n)
     {
         PCWSTR Arg = argv[n];
@@ -143,7 +862,7 @@ void ParseCommandline(int argc, PCWSTR argv[])
         BOOL IsRegistry = !IsImage && IsCommandlineOption(Arg,L"r");
         if(IsImage || IsRegistry || IsCommandlineOption(Arg,L"k"))
         {
-            if(g_ActiveDest)
+            if(ActiveDest || Mode)
             {
                 fwprintf(stderr, L"gflags: Only one of the options -r -k can be specified\r\n", Arg);
                 DisplayUsage = TRUE;
@@ -151,72 +870,529 @@ void ParseCommandline(int argc, PCWSTR argv[])
             }
             if (IsImage)
             {
-                g_ActiveDest = DEST_IMAGE;
+                ActiveDest = DEST_IMAGE;
                 if (n+1 < argc)
                 {
-                    StringCchCopy(g_ImageName, sizeof(g_ImageName) / sizeof(g_ImageName[0]), argv[n+1]);
-                    ++n;
+                    ImageName = argv[++n];
                 }
                 else
                 {
                     DisplayUsage = TRUE;
                     break;
                 }
-                if(!ReadImageGlobalFlagsFromRegistry(g_ImageName, &g_ActiveFlags))
+                if(!wcscmp(ImageName, L"*"))
+                {
+                    EnumImages = TRUE;
+                }
+                else if(!ReadFlags(Store, DEST_IMAGE, ImageName, &ActiveFlags))
                 {
                     fwprintf(stderr, L"gflags: Could not read image flags from registry\r\n");
-                    exit(1);
+                    return 1;
                 }
             }
             else if(IsRegistry)
             {
-                g_ActiveDest = DEST_REGISTRY;
-                if(!ReadGlobalFlagsFromRegistry(&g_ActiveFlags))
+                ActiveDest = DEST_REGISTRY;
+                if(!ReadFlags(Store, DEST_REGISTRY, NULL, &ActiveFlags))
                 {
                     fwprintf(stderr, L"gflags: Could not read global flags from registry\r\n");
-                    exit(1);
+                    return 1;
                 }
             }
             else
             {
-                g_ActiveDest = DEST_KERNEL;
-                if(!ReadGlobalFlagsFromKernel(&g_ActiveFlags))
+                ActiveDest = DEST_KERNEL;
+                if(!ReadFlags(Store, DEST_KERNEL, NULL, &ActiveFlags))
                 {
                     fwprintf(stderr, L"gflags: Could not read global flags from kernel\r\n");
-                    exit(1);
+                    return 1;
                 }
             }
         }
+        else if(IsCommandlineOption(Arg,L"store"))
+        {
+            if(ActiveDest || *OpenedStore || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            File = new FileFlagStore();
+            *OpenedStore = Store = File;
+            if(!File->Open(argv[++n]))
+            {
+                fwprintf(stderr, L"gflags: Could not open flag store '%ls'\r\n", argv[n]);
+                return 1;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"hive") || IsCommandlineOption(Arg,L"hivelog"))
+        {
+            BOOL UseLog = IsCommandlineOption(Arg,L"hivelog");
+            if(ActiveDest || (*OpenedStore && !Hive) || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            if(!Hive)
+            {
+                Hive = new HiveFlagStore();
+                *OpenedStore = Store = Hive;
+            }
+            if(!Hive->OpenHive(argv[++n], UseLog))
+            {
+                fwprintf(stderr, L"gflags: Could not open registry hive '%ls'\r\n", argv[n]);
+                return 1;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"wine"))
+        {
+            if(ActiveDest || *OpenedStore || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            Wine = new WineFlagStore();
+            *OpenedStore = Store = Wine;
+            if(!Wine->Open(argv[++n]))
+            {
+                fwprintf(stderr, L"gflags: Could not open the registry of Wine prefix '%ls'\r\n", argv[n]);
+                return 1;
+            }
+        }
         else if(IsCommandlineOption(Arg,L"lic") || IsCommandlineOption(Arg,L"license"))
         {
             ShowLicense(stdout);
         }
-        else if( g_ActiveDest )
+        else if(IsCommandlineOption(Arg,L"serve"))
+        {
+            if(ActiveDest || Mode)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            Mode = L"serve";
+            ModeArgument = (n+1 < argc && argv[n+1][0] != '-') ? argv[++n] : SERVER_DEFAULT_ENDPOINT;
+        }
+        else if(IsCommandlineOption(Arg,L"batch") || IsCommandlineOption(Arg,L"complete") ||
+                IsCommandlineOption(Arg,L"export") || IsCommandlineOption(Arg,L"import") ||
+                IsCommandlineOption(Arg,L"snapshot") || IsCommandlineOption(Arg,L"scan-hives") ||
+                IsCommandlineOption(Arg,L"inventory"))
+        {
+            if(ActiveDest || Mode || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            Mode = Arg + (Arg[1] == '-' ? 2 : 1);
+            ModeArgument = argv[++n];
+        }
+        else if(IsCommandlineOption(Arg,L"list-ttl") || IsCommandlineOption(Arg,L"revert-expired") ||
+                IsCommandlineOption(Arg,L"list-largepages") || IsCommandlineOption(Arg,L"list-ust"))
+        {
+            if(ActiveDest || Mode)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            Mode = Arg + (Arg[1] == '-' ? 2 : 1);
+        }
+        else if(IsCommandlineOption(Arg,L"ttl"))
+        {
+            if(ActiveDest != DEST_IMAGE || EnumImages || Ttl || n+1 >= argc || !ParseDuration(argv[++n], &Ttl))
+            {
+                fwprintf(stderr, L"gflags: -ttl needs -i <ImageName> and a duration such as 30m, 2h or 1d\r\n");
+                DisplayUsage = TRUE;
+                break;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"largepages"))
+        {
+            if(ActiveDest != DEST_IMAGE || EnumImages || LargePages >= 0 || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            ++n;
+            LargePages = !_wcsicmp(argv[n], L"on") ? 1 : !_wcsicmp(argv[n], L"off") ? 0 : -1;
+            if(LargePages < 0)
+            {
+                fwprintf(stderr, L"gflags: Expected on or off - '%ls'\r\n", argv[n]);
+                DisplayUsage = TRUE;
+                break;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"budget"))
+        {
+            if(!ActiveDest || EnumImages || HasBudget || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            std::wstring Limits = argv[++n];
+            size_t Comma = Limits.find(L',');
+            HasBudget = ParseCostFactor(Limits.substr(0, Comma).c_str(), &Budget.CpuPercent);
+            Budget.MemoryPercent = Budget.CpuPercent;
+            if(!HasBudget || (Comma != std::wstring::npos && !ParseCostFactor(Limits.c_str() + Comma + 1, &Budget.MemoryPercent)))
+            {
+                fwprintf(stderr, L"gflags: Expected factors of at least 1, such as 1.5 or 150%% - '%ls'\r\n", argv[n]);
+                DisplayUsage = TRUE;
+                break;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"force") && ActiveDest)
         {
-            ParseFlags(Arg);
+            Force = TRUE;
+        }
+        else if(IsCommandlineOption(Arg,L"tracedb"))
+        {
+            if(ActiveDest != DEST_IMAGE || EnumImages || TraceDbSize >= 0 || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            PWSTR End = NULL;
+            ULONG Size = wcstoul(argv[++n], &End, 10);
+            if(!End || *End || End == argv[n] || Size > TRACEDB_MAX_MB)
+            {
+                fwprintf(stderr, L"gflags: Expected a size of 0 to %u MB - '%ls'\r\n", TRACEDB_MAX_MB, argv[n]);
+                DisplayUsage = TRUE;
+                break;
+            }
+            TraceDbSize = (LONG)Size;
+        }
+        else if(IsCommandlineOption(Arg,L"pageheap"))
+        {
+            if(ActiveDest != DEST_IMAGE || EnumImages || SetPageHeap || n+1 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            InitPageHeapConfig(&PageHeap);
+            SetPageHeap = TRUE;
+            ++n;
+            if(!_wcsicmp(argv[n], L"light"))
+            {
+                PageHeap.Mode = PAGEHEAP_LIGHT;
+            }
+            else if(!_wcsicmp(argv[n], L"full"))
+            {
+                PageHeap.Mode = PAGEHEAP_FULL;
+            }
+            else if(_wcsicmp(argv[n], L"off"))
+            {
+                fwprintf(stderr, L"gflags: Expected off, light or full - '%ls'\r\n", argv[n]);
+                DisplayUsage = TRUE;
+                break;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"dlls") && SetPageHeap && n+1 < argc)
+        {
+            PageHeap.TargetDlls = argv[++n];
+            for(size_t i = 0; i < PageHeap.TargetDlls.size(); ++i)
+            {
+                PageHeap.TargetDlls[i] = PageHeap.TargetDlls[i] == L',' ? L' ' : PageHeap.TargetDlls[i];
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"size") && SetPageHeap && n+2 < argc)
+        {
+            n += 2;
+            if(!ParseNumber(argv[n-1], 0, &PageHeap.SizeStart) || !ParseNumber(argv[n], 0, &PageHeap.SizeEnd) ||
+               PageHeap.SizeStart >= PageHeap.SizeEnd)
+            {
+                fwprintf(stderr, L"gflags: Expected a size range of two numbers, the start below the end - '%ls %ls'\r\n", argv[n-1], argv[n]);
+                DisplayUsage = TRUE;
+                break;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"random") && SetPageHeap && n+1 < argc)
+        {
+            if(!ParseNumber(argv[++n], 10, &PageHeap.RandomPercent) || PageHeap.RandomPercent > 100)
+            {
+                fwprintf(stderr, L"gflags: Expected a percentage of 0 to 100 - '%ls'\r\n", argv[n]);
+                DisplayUsage = TRUE;
+                break;
+            }
+        }
+        else if(IsCommandlineOption(Arg,L"diff") || IsCommandlineOption(Arg,L"tracedb-size"))
+        {
+            if(ActiveDest || Mode || n+2 >= argc)
+            {
+                DisplayUsage = TRUE;
+                break;
+            }
+            Mode = Arg + (Arg[1] == '-' ? 2 : 1);
+            ModeArgument = argv[++n];
+            SecondArgument = argv[++n];
+        }
+        else if( ActiveDest && !EnumImages )
+        {
+            if(!CompileFlagEdit(Arg, &ActiveEdit))
+            {
+                fwprintf(stderr, L"gflags: Invalid flags - '%ls'\r\n", Arg);
+                DisplayUsage = TRUE;
+                break;
+            }
+            DisplayFlags = FALSE;
         }
         else
         {
-            fwprintf(stderr, L"gflags: Unexpected argument - '%s'\r\n", Arg);
+            fwprintf(stderr, L"gflags: Unexpected argument - '%ls'\r\n", Arg);
             DisplayUsage = TRUE;
             break;
         }
     }
 
+    if(!DisplayUsage && Ttl && (DisplayFlags || SetPageHeap))
+    {
+        fwprintf(stderr, L"gflags: -ttl needs flags to change, and does not revert -pageheap\r\n");
+        DisplayUsage = TRUE;
+    }
+    if(!DisplayUsage && SetPageHeap && PageHeap.Mode != PAGEHEAP_FULL && (PageHeap.SizeEnd || PageHeap.RandomPercent || !PageHeap.TargetDlls.empty()))
+    {
+        fwprintf(stderr, L"gflags: -dlls, -size and -random need -pageheap full\r\n");
+        DisplayUsage = TRUE;
+    }
+    /*
+     * Offline hives and Wine prefixes are only reverted on request, the server
+     * reverts its store itself while idle.
+     */
+    BOOL Writes = (ActiveDest && !EnumImages && (!DisplayFlags || SetPageHeap || LargePages >= 0 || TraceDbSize >= 0)) ||
+                  (Mode && (!wcscmp(Mode, L"batch") || !wcscmp(Mode, L"import")));
+    BOOL RevertedAll = TRUE;
+    if(!DisplayUsage && ((Mode && !wcscmp(Mode, L"revert-expired")) || (Writes && !Hive && !Wine)))
+    {
+        ULONG Reverted = 0;
+        RevertedAll = RevertExpiredOnStart(Store, Mode && !wcscmp(Mode, L"revert-expired"), &Reverted);
+        if(Reverted && ActiveDest && !EnumImages && !ReadFlags(Store, ActiveDest, ImageName, &ActiveFlags))
+        {
+            fwprintf(stderr, L"gflags: Could not read the flags\r\n");
+            return 1;
+        }
+    }
+
     if(DisplayUsage)
     {
         PrintUsage(stderr);
-        exit(1);
+        return 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"revert-expired"))
+    {
+        return RevertedAll ? 0 : 1;
     }
-    else if(g_ActiveDest)
+    else if(Mode && !wcscmp(Mode, L"list-ttl"))
     {
-        DWORD ApplyFlags = 0, IgnoredFlags = 0;
-        MaskFlags(g_ActiveDest, g_ActiveFlags, &ApplyFlags, &IgnoredFlags);
+        return ListTtl(Store) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"list-largepages"))
+    {
+        if(!Store->EnumImageValues(USELARGEPAGES_VALUENAME, PrintLargePagesImage, stdout))
+        {
+            fwprintf(stderr, L"gflags: Could not enumerate the image options\r\n");
+            return 1;
+        }
+        return 0;
+    }
+    else if(Mode && !wcscmp(Mode, L"list-ust"))
+    {
+        return ListUst(Store) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"batch"))
+    {
+        return RunBatch(Store, ModeArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"serve"))
+    {
+        return RunServer(Store, ModeArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"complete"))
+    {
+        return CompleteImageName(Store, ModeArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"export"))
+    {
+        return ExportFlags(Store, ModeArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"import"))
+    {
+        return ImportFlags(Store, ModeArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"snapshot"))
+    {
+        return SaveSnapshot(Store, ModeArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"diff"))
+    {
+        return PrintSnapshotDiff(ModeArgument, SecondArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"tracedb-size"))
+    {
+        return PrintTraceDatabaseSuggestion(ModeArgument, SecondArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"scan-hives"))
+    {
+        return PrintHiveScan(ModeArgument) ? 0 : 1;
+    }
+    else if(Mode && !wcscmp(Mode, L"inventory"))
+    {
+        return RunInventory(ModeArgument) ? 0 : 1;
+    }
+    else if(EnumImages)
+    {
+        if(!Store->EnumImageValues(GLOBALFLAG_VALUENAME, PrintImageRecord, stdout))
+        {
+            fwprintf(stderr, L"gflags: Could not enumerate image flags from registry\r\n");
+            return 1;
+        }
+        return 0;
+    }
+    else if(ActiveDest)
+    {
+        std::vector<std::wstring> Similar;
+        if(ActiveDest == DEST_IMAGE && Writes && !Force && IsNewImage(Store, ImageName, &Similar))
+        {
+            fwprintf(stderr, L"gflags: There are no settings for %ls yet, use -force to create them\r\n", ImageName);
+            for(size_t n = 0; n < Similar.size(); ++n)
+            {
+                fwprintf(stderr, L"%ls%ls", n ? L", " : L"gflags: Similar image names: ", Similar[n].c_str());
+            }
+            fwprintf(stderr, Similar.empty() ? L"" : L"\r\n");
+            return 1;
+        }
+
+        FlagCost Cost;
+        DWORD Planned = ActiveFlags, Unused;
+        /* System wide hpa is full page heap for every process. */
+        PageHeapConfig Stored;
+        BOOL HasStored = ActiveDest == DEST_IMAGE && ReadPageHeapConfig(Store, ImageName, &Stored);
+        ULONG StoredPageHeap = HasStored ? Stored.Flags : PAGE_HEAP_ENABLE_PAGE_HEAP, PlannedPageHeap = StoredPageHeap;
+        if(!DisplayFlags)
+        {
+            MaskFlags(ActiveDest, ApplyFlagEdit(&ActiveEdit, ActiveFlags), &Planned, &Unused);
+        }
+        if(SetPageHeap)
+        {
+            Planned = PageHeap.Mode == PAGEHEAP_OFF ? (Planned & ~FLG_HEAP_PAGE_ALLOCS) : (Planned | FLG_HEAP_PAGE_ALLOCS);
+            PageHeap.Flags = HasStored ? Stored.Flags : 0;
+            PlannedPageHeap = GetPageHeapFlags(&PageHeap);
+        }
+        if(HasBudget && IsOverBudget(ActiveFlags, StoredPageHeap, Planned, PlannedPageHeap, &Budget, &Cost))
+        {
+            FILE* dst = Force ? stdout : stderr;
+            fwprintf(dst, L"gflags: Estimated overhead ");
+            PrintCost(dst, &Cost);
+            fwprintf(dst, L" is over the budget of ");
+            PrintCost(dst, &Budget);
+            fwprintf(dst, Force ? L", applied with -force\r\n" : L", use -force to apply the flags anyway\r\n");
+            if(!Force)
+            {
+                return 1;
+            }
+        }
         if (!DisplayFlags)
         {
-            /* do set it. */
+            FlagUpdate Update;
+            ULONG RevertTime = 0;
+            BOOL Success = Ttl ? UpdateFlagsWithTtl(Store, ImageName, &ActiveEdit, Ttl, &Update, &RevertTime)
+                               : UpdateFlags(Store, ActiveDest, ImageName, &ActiveEdit, &Update);
+            if(!Success || !Store->Flush())
+            {
+                fwprintf(stderr, L"gflags: Could not write the new flags\r\n");
+                return 1;
+            }
+            if(Ttl && RevertTime)
+            {
+                WCHAR Time[64];
+                FormatRevertTime(RevertTime, Time, 64);
+                fwprintf(stdout, L"gflags: The changes are reverted at %ls\r\n", Time);
+            }
+            else if(Ttl)
+            {
+                fwprintf(stdout, L"gflags: The flags did not change, there is nothing to revert\r\n");
+            }
+            if(Update.IgnoredFlags)
+            {
+                fwprintf(stderr, L"gflags: Ignored flags not valid for this destination: %08x\r\n", Update.IgnoredFlags);
+            }
+            ActiveFlags = Update.NewFlags;
+        }
+        /* Written only when they change, so 'off' or 0 does not add the value to an image that never had it. */
+        ULONG StoredLargePages = 0;
+        if(LargePages >= 0 && (!Store->ReadImageValue(ImageName, USELARGEPAGES_VALUENAME, &StoredLargePages) ||
+           (StoredLargePages != (ULONG)LargePages && (!Store->WriteImageValue(ImageName, USELARGEPAGES_VALUENAME, LargePages) || !Store->Flush()))))
+        {
+            fwprintf(stderr, L"gflags: Could not write the UseLargePages option\r\n");
+            return 1;
+        }
+        ULONG StoredTraceDbSize = 0;
+        if(TraceDbSize >= 0 && (!Store->ReadImageValue(ImageName, TRACEDB_SIZE_VALUENAME, &StoredTraceDbSize) ||
+           (StoredTraceDbSize != (ULONG)TraceDbSize && (!Store->WriteImageValue(ImageName, TRACEDB_SIZE_VALUENAME, TraceDbSize) || !Store->Flush()))))
+        {
+            fwprintf(stderr, L"gflags: Could not write the trace database size\r\n");
+            return 1;
+        }
+        if(SetPageHeap)
+        {
+            if(!WritePageHeapConfig(Store, ImageName, &PageHeap) || !Store->Flush() || !ReadFlags(Store, DEST_IMAGE, ImageName, &ActiveFlags))
+            {
+                fwprintf(stderr, L"gflags: Could not write the page heap settings\r\n");
+                return 1;
+            }
+        }
+        PageHeapConfig Current;
+        BOOL HasPageHeap = ActiveDest == DEST_IMAGE && ReadPageHeapConfig(Store, ImageName, &Current);
+        PrintFlags(stdout, ActiveFlags, ActiveDest, HasPageHeap ? Current.Flags : PAGE_HEAP_ENABLE_PAGE_HEAP);
+        if(HasPageHeap && (Current.Mode != PAGEHEAP_OFF || SetPageHeap))
+        {
+            PrintPageHeap(stdout, &Current);
+        }
+        ULONG UseLargePages = 0;
+        if(ActiveDest == DEST_IMAGE && Store->ReadImageValue(ImageName, USELARGEPAGES_VALUENAME, &UseLargePages) && (UseLargePages || LargePages >= 0))
+        {
+            fwprintf(stdout, L"Use Large Pages: %ls\r\n", UseLargePages ? L"on" : L"off");
+        }
+        ULONG TraceDbStored = 0;
+        if(ActiveDest == DEST_IMAGE && ((ActiveFlags & FLG_USER_STACK_TRACE_DB) || TraceDbSize >= 0) &&
+           Store->ReadImageValue(ImageName, TRACEDB_SIZE_VALUENAME, &TraceDbStored))
+        {
+            PrintTraceDatabaseSize(stdout, L"Stack Trace Database: ", TraceDbStored);
+            fwprintf(stdout, L"%ls\r\n", (ActiveFlags & FLG_USER_STACK_TRACE_DB) ? L"" : L", used once ust is set");
+        }
+        return 0;
+    }
+    /* The UI writes too. */
+    if(!Hive && !Wine)
+    {
+        ULONG Reverted = 0;
+        RevertExpiredOnStart(Store, FALSE, &Reverted);
+    }
+    return COMMANDLINE_SHOW_UI;
+}
+
+/* -stats applies to every command, so it is taken out here and printed after any of them returns. */
+int ParseCommandline(int argc, PCWSTR argv[], FlagStore** OpenedStore)
+{
+    std::vector<PCWSTR> Args;
+    PCWSTR StatsFormat = NULL;
+    for(int n = 0; n < argc; ++n)
+    {
+        if(n && IsCommandlineOption(argv[n], L"stats"))
+        {
+            BOOL HasFormat = n+1 < argc && (!wcscmp(argv[n+1], L"text") || !wcscmp(argv[n+1], L"json"));
+            StatsFormat = HasFormat ? argv[++n] : L"text";
+            continue;
+        }
+        Args.push_back(argv[n]);
+    }
+    int Result = RunCommandline((int)Args.size(), &Args[0], OpenedStore);
+    if(StatsFormat && Result != COMMANDLINE_SHOW_UI)
+    {
+        if(!wcscmp(StatsFormat, L"json"))
+        {
+            fwprintf(stderr, L"%ls\r\n", FormatCallStatsJson().c_str());
+        }
+        else
+        {
+            PrintCallStats(stderr);
         }
-        PrintFlags(stdout, g_ActiveFlags, g_ActiveDest);
-        exit(0);
     }
+    return Result;
 }
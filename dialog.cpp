@@ -25,16 +25,124 @@
 #include <Windows.h>
 #include <Prsht.h>
 #include <Strsafe.h>
+#include <Shldisp.h>
+#include <Shlguid.h>
+#include <Shobjidl.h>
 #include <stdio.h>
 #include <assert.h>
 #include "gflags.h"
+#include "flagstore.h"
+#include "imageindex.h"
+#include "tracedb.h"
 #include "resource.h"
 
 #pragma comment(lib, "comctl32.lib")
+#pragma comment(lib, "ole32.lib")
+#pragma comment(lib, "uuid.lib")
+
+#define IMAGE_COMPLETE_MAX      256
 
 static ULONG g_KernelSettings = 0;
 static ULONG g_RegistrySettings = 0;
 static ULONG g_ImageSettings = 0;
+static ULONG g_ImageLargePages = 0;
+static ImageNameIndex g_ImageIndex;
+static IAutoCompleteDropDown* g_ImageDropDown = NULL;
+
+
+/*
+ * Completions for the image name box. The autocomplete object calls Reset
+ * (from its own thread) whenever the list has to be filled again, the list is
+ * then taken from the index for what is typed so far.
+ */
+class ImageNameEnum : public IEnumString
+{
+public:
+    ImageNameEnum(HWND Edit)
+        : m_Refs(1)
+        , m_Edit(Edit)
+        , m_Next(0)
+    {
+    }
+
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppv)
+    {
+        if(riid == IID_IUnknown || riid == IID_IEnumString)
+        {
+            *ppv = static_cast<IEnumString*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    STDMETHODIMP_(ULONG) AddRef()
+    {
+        return InterlockedIncrement(&m_Refs);
+    }
+
+    STDMETHODIMP_(ULONG) Release()
+    {
+        LONG Refs = InterlockedDecrement(&m_Refs);
+        if(!Refs)
+        {
+            delete this;
+        }
+        return Refs;
+    }
+
+    STDMETHODIMP Next(ULONG celt, LPOLESTR* rgelt, ULONG* pceltFetched)
+    {
+        ULONG Fetched = 0;
+        for(; Fetched < celt && m_Next < m_Names.size(); ++Fetched, ++m_Next)
+        {
+            size_t cbName = (m_Names[m_Next].size() + 1) * sizeof(WCHAR);
+            rgelt[Fetched] = (LPOLESTR)CoTaskMemAlloc(cbName);
+            if(!rgelt[Fetched])
+            {
+                break;
+            }
+            memcpy(rgelt[Fetched], m_Names[m_Next].c_str(), cbName);
+        }
+        if(pceltFetched)
+        {
+            *pceltFetched = Fetched;
+        }
+        return Fetched == celt ? S_OK : S_FALSE;
+    }
+
+    STDMETHODIMP Skip(ULONG celt)
+    {
+        m_Next = min(m_Next + celt, m_Names.size());
+        return m_Next < m_Names.size() ? S_OK : S_FALSE;
+    }
+
+    STDMETHODIMP Reset()
+    {
+        WCHAR Prefix[128] = {0};
+        GetWindowTextW(m_Edit, Prefix, 128);
+        m_Names.clear();
+        m_Next = 0;
+        if(Prefix[0])
+        {
+            g_ImageIndex.Complete(Prefix, IMAGE_COMPLETE_MAX, &m_Names);
+        }
+        return S_OK;
+    }
+
+    STDMETHODIMP Clone(IEnumString** ppenum)
+    {
+        *ppenum = NULL;
+        return E_NOTIMPL;
+    }
+
+private:
+    LONG m_Refs;
+    HWND m_Edit;
+    std::vector<std::wstring> m_Names;
+    size_t m_Next;
+};
 
 static
 void UpdateDialogFromFlags(HWND hDlg, ULONG Flags, DWORD Dest, BOOL Enable)
@@ -65,7 +173,7 @@ DWORD FlagsFromDialog(HWND hDlg)
 static
 void HandleWMCommand(HWND hDlg, WPARAM wParam)
 {
-    if( LOWORD(wParam) >= IDC_CHECK1 && LOWORD(wParam) <= IDC_CHECK31 )
+    if( (LOWORD(wParam) >= IDC_CHECK1 && LOWORD(wParam) <= IDC_CHECK31) || LOWORD(wParam) == IDC_LARGEPAGES )
     {
         HWND hParent = GetParent(hDlg);
         SendMessage( hParent, PSM_CHANGED, (WPARAM)hDlg, 0 );   //TODO: PSM_UNCHANGED with correct flags!
@@ -90,7 +198,7 @@ INT_PTR CALLBACK SystemRegistryProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM
         {
         case PSN_APPLY:
             g_RegistrySettings = FlagsFromDialog(hDlg) & g_ValidRegistryFlags;
-            if(!WriteGlobalFlagsToRegistry(g_RegistrySettings))
+            if(!WriteGlobalFlagsToRegistry(g_RegistrySettings) || !GetFlagStore()->Flush())
             {
                 MessageBoxW(hDlg, L"Unable to write flags to registry", L"gflags Error", MB_OK | MB_ICONERROR);
             }
@@ -123,7 +231,7 @@ INT_PTR CALLBACK KernelRegistryProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM
         {
         case PSN_APPLY:
             g_KernelSettings = FlagsFromDialog(hDlg) & g_ValidKernelFlags;
-            if(!WriteGlobalFlagsToKernel(g_KernelSettings))
+            if(!WriteGlobalFlagsToKernel(g_KernelSettings) || !GetFlagStore()->Flush())
             {
                 MessageBoxW(hDlg, L"Unable to write flags to kernel", L"gflags Error", MB_OK | MB_ICONERROR);
             }
@@ -145,20 +253,70 @@ void UpdateImagePage(HWND hDlg)
     SendDlgItemMessageW(hDlg, IDC_EDIT_IMAGENAME, WM_GETTEXT, 128, (LPARAM)Buffer);
     ReadImageGlobalFlagsFromRegistry(Buffer, &g_ImageSettings);
     UpdateDialogFromFlags( hDlg, g_ImageSettings, DEST_IMAGE, Buffer[0] ? 1 : 0);
+    if(!Buffer[0] || !GetFlagStore()->ReadImageValue(Buffer, USELARGEPAGES_VALUENAME, &g_ImageLargePages))
+    {
+        g_ImageLargePages = 0;
+    }
+    SendDlgItemMessage(hDlg, IDC_LARGEPAGES, BM_SETCHECK, g_ImageLargePages ? 1 : 0, 0);
+    EnableWindow(GetDlgItem(hDlg, IDC_LARGEPAGES), Buffer[0] ? 1 : 0);
 }
 
+/* Returns FALSE when the user did not want to create settings for a new image name. */
 static
-void StoreImageFlags(HWND hDlg)
+BOOL StoreImageFlags(HWND hDlg)
 {
     WCHAR Buffer[128] = {0};
     SendDlgItemMessageW(hDlg, IDC_EDIT_IMAGENAME, WM_GETTEXT, 128, (LPARAM)Buffer);
-    g_ImageSettings = FlagsFromDialog(hDlg) & g_ValidImageFlags;
-    if(!WriteImageGlobalFlagsToRegistry(Buffer, g_ImageSettings))
+    if(!Buffer[0])
+    {
+        return TRUE;
+    }
+    if(!g_ImageIndex.Contains(Buffer))
+    {
+        WCHAR Question[256];
+        StringCchPrintfW(Question, 256, L"There are no settings for %s yet, create them?", Buffer);
+        if(MessageBoxW(hDlg, Question, L"gflags", MB_YESNO | MB_ICONQUESTION) != IDYES)
+        {
+            return FALSE;
+        }
+    }
+    /* UpdateFlags keeps USTEnabled and the image index in step with the flags. */
+    FlagEdit Edit = { 0, FlagsFromDialog(hDlg) & g_ValidImageFlags, 0 };
+    FlagUpdate Update;
+    g_ImageSettings = Edit.Or;
+    /* Only written when toggled, so applying flags does not add the value to every image. */
+    ULONG LargePages = SendDlgItemMessage(hDlg, IDC_LARGEPAGES, BM_GETCHECK, 0, 0) == BST_CHECKED ? 1 : 0;
+    BOOL LargePagesWritten = LargePages == (g_ImageLargePages ? 1 : 0) ||
+                             GetFlagStore()->WriteImageValue(Buffer, USELARGEPAGES_VALUENAME, LargePages);
+    if(!UpdateFlags(GetFlagStore(), DEST_IMAGE, Buffer, &Edit, &Update) || !LargePagesWritten || !GetFlagStore()->Flush())
     {
         WCHAR ErrorBuffer[256];
         StringCchPrintfW(ErrorBuffer, 256, L"Unable to write image flags for %s", Buffer);
         MessageBoxW(hDlg, ErrorBuffer, L"gflags Error", MB_OK | MB_ICONERROR);
     }
+    return TRUE;
+}
+
+/* Autocompletion is optional, the page works without it. */
+static
+void InitImageAutoComplete(HWND hDlg)
+{
+    HWND Edit = GetDlgItem(hDlg, IDC_EDIT_IMAGENAME);
+    IAutoComplete2* AutoComplete = NULL;
+    g_ImageIndex.Build(GetFlagStore());
+    GetFlagStore()->SetImageIndex(&g_ImageIndex);
+    if(FAILED(CoCreateInstance(CLSID_AutoComplete, NULL, CLSCTX_INPROC_SERVER, IID_IAutoComplete2, (void**)&AutoComplete)))
+    {
+        return;
+    }
+    ImageNameEnum* Names = new ImageNameEnum(Edit);
+    if(SUCCEEDED(AutoComplete->Init(Edit, Names, NULL, NULL)))
+    {
+        AutoComplete->SetOptions(ACO_AUTOSUGGEST | ACO_UPDOWNKEYDROPSLIST);
+        AutoComplete->QueryInterface(IID_IAutoCompleteDropDown, (void**)&g_ImageDropDown);
+    }
+    Names->Release();
+    AutoComplete->Release();
 }
 
 INT_PTR CALLBACK ImageFileProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
@@ -167,6 +325,14 @@ INT_PTR CALLBACK ImageFileProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lPara
     {
     case WM_INITDIALOG:
         g_ImageSettings = 0;
+        InitImageAutoComplete(hDlg);
+        break;
+    case WM_DESTROY:
+        if(g_ImageDropDown)
+        {
+            g_ImageDropDown->Release();
+            g_ImageDropDown = NULL;
+        }
         break;
     case WM_COMMAND:
         HandleWMCommand(hDlg, wParam);
@@ -174,12 +340,21 @@ INT_PTR CALLBACK ImageFileProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lPara
         {
             UpdateImagePage(hDlg);
         }
+        else if(LOWORD(wParam) == IDC_EDIT_IMAGENAME && HIWORD(wParam) == EN_CHANGE && g_ImageDropDown)
+        {
+            /* The suggestions only hold names for the earlier prefix. */
+            g_ImageDropDown->ResetEnumerator();
+        }
         break;
     case WM_NOTIFY:
         switch(((LPNMHDR)lParam)->code)
         {
         case PSN_APPLY:
-            StoreImageFlags(hDlg);
+            if(!StoreImageFlags(hDlg))
+            {
+                SetWindowLongPtr(hDlg, DWLP_MSGRESULT, PSNRET_INVALID_NOCHANGEPAGE);
+                return TRUE;
+            }
             UpdateImagePage(hDlg);
             break;
         case PSN_SETACTIVE:
@@ -317,11 +492,22 @@ int ShowDialog()
     psh.nPages = numPages;
     psh.ppsp = (LPCPROPSHEETPAGE) &psp;
     psh.pfnCallback = NULL;
-    
+
+    /* Switching tabs or leaving the image name re-reads the image flags, those are served from the cache. */
+    FlagStore* Store = GetFlagStore();
+    CachedFlagStore Cache(Store);
+    SetFlagStore(&Cache);
+    HRESULT hrInit = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+    int Result = 0;
     if( PropertySheet(&psh) == -1 )
     {
-        return GetLastError();
+        Result = GetLastError();
     }
-    return 0;
+    if( SUCCEEDED(hrInit) )
+    {
+        CoUninitialize();
+    }
+    SetFlagStore(Store);
+    return Result;
 }
 
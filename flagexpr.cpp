@@ -0,0 +1,200 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "gflags.h"
+
+#define EXPR_TOKEN_MAX      32
+#define EXPR_MAX_DEPTH      8
+
+/*
+ * Grammar:
+ *   edit    := [set] { op set }        a leading set without op means '='
+ *   op      := '+' | '-' | '^' | '='   set, clear, toggle, replace
+ *   set     := atom { '|' atom }
+ *   atom    := abbreviation | hex number | '(' set ')'
+ * Abbreviations take precedence over hex numbers, use a 0x prefix to force a number.
+ */
+
+static void SkipSpace( _Inout_ PCWSTR* Pos )
+{
+    while(iswspace(**Pos))
+    {
+        ++*Pos;
+    }
+}
+
+static BOOL ParseSet( _Inout_ PCWSTR* Pos, _In_ int Depth, _Out_ ULONG* Mask );
+
+static BOOL ParseAtom( _Inout_ PCWSTR* Pos, _In_ int Depth, _Out_ ULONG* Mask )
+{
+    *Mask = 0;
+    SkipSpace(Pos);
+    if(**Pos == L'(')
+    {
+        ++*Pos;
+        if(Depth >= EXPR_MAX_DEPTH || !ParseSet(Pos, Depth + 1, Mask))
+        {
+            return FALSE;
+        }
+        SkipSpace(Pos);
+        if(**Pos != L')')
+        {
+            return FALSE;
+        }
+        ++*Pos;
+        return TRUE;
+    }
+
+    WCHAR Token[EXPR_TOKEN_MAX];
+    size_t Length = 0;
+    while(iswalnum(**Pos))
+    {
+        if(Length + 1 >= EXPR_TOKEN_MAX)
+        {
+            return FALSE;
+        }
+        Token[Length++] = *(*Pos)++;
+    }
+    Token[Length] = L'\0';
+    if(!Length)
+    {
+        return FALSE;
+    }
+
+    const FlagInfo* Flag = FindFlag(Token);
+    if(Flag)
+    {
+        *Mask = Flag->dwFlag;
+        return TRUE;
+    }
+    PWSTR End = NULL;
+    *Mask = wcstoul(Token, &End, 16);
+    return End && !*End;
+}
+
+static BOOL ParseSet( _Inout_ PCWSTR* Pos, _In_ int Depth, _Out_ ULONG* Mask )
+{
+    if(!ParseAtom(Pos, Depth, Mask))
+    {
+        return FALSE;
+    }
+    for(;;)
+    {
+        SkipSpace(Pos);
+        if(**Pos != L'|')
+        {
+            return TRUE;
+        }
+        ++*Pos;
+        ULONG Next;
+        if(!ParseAtom(Pos, Depth, &Next))
+        {
+            return FALSE;
+        }
+        *Mask |= Next;
+    }
+}
+
+void InitFlagEdit( _Out_ FlagEdit* Edit )
+{
+    Edit->And = 0xffffffff;
+    Edit->Or = 0;
+    Edit->Xor = 0;
+}
+
+/* Folds one operation into the masks, so that applying the result equals applying both in order. */
+static void AddOperation( _Inout_ FlagEdit* Edit, _In_ WCHAR Op, _In_ ULONG Mask )
+{
+    switch(Op)
+    {
+    case L'+':
+        Edit->And &= ~Mask;
+        Edit->Or |= Mask;
+        Edit->Xor &= ~Mask;
+        break;
+    case L'-':
+        Edit->And &= ~Mask;
+        Edit->Or &= ~Mask;
+        Edit->Xor &= ~Mask;
+        break;
+    case L'^':
+        Edit->Xor ^= Mask;
+        break;
+    default:
+        Edit->And = 0;
+        Edit->Or = Mask;
+        Edit->Xor = 0;
+        break;
+    }
+}
+
+BOOL CompileFlagEdit( _In_z_ PCWSTR Expression, _Inout_ FlagEdit* Edit )
+{
+    FlagEdit Result = *Edit;
+    PCWSTR Pos = Expression;
+    BOOL First = TRUE;
+    SkipSpace(&Pos);
+    if(!*Pos)
+    {
+        return FALSE;
+    }
+    while(*Pos)
+    {
+        WCHAR Op = L'=';
+        if(*Pos == L'+' || *Pos == L'-' || *Pos == L'^' || *Pos == L'=')
+        {
+            Op = *Pos++;
+        }
+        else if(!First)
+        {
+            return FALSE;
+        }
+        ULONG Mask;
+        if(!ParseSet(&Pos, 0, &Mask))
+        {
+            return FALSE;
+        }
+        AddOperation(&Result, Op, Mask);
+        First = FALSE;
+        SkipSpace(&Pos);
+    }
+    *Edit = Result;
+    return TRUE;
+}
+
+/* Edit becomes 'Edit, then Then'. Bits Then passes through keep Edit's operation, the others get Then's constant. */
+void CombineFlagEdit( _Inout_ FlagEdit* Edit, _In_ const FlagEdit* Then )
+{
+    ULONG Pass = Then->And & ~Then->Or;
+    Edit->And &= Pass;
+    Edit->Or = (Edit->Or & Pass) | ((Then->Or ^ Then->Xor) & ~Pass);
+    Edit->Xor = (Edit->Xor ^ Then->Xor) & Pass;
+}
+
+ULONG ApplyFlagEdit( _In_ const FlagEdit* Edit, _In_ ULONG Flags )
+{
+    return ((Flags & Edit->And) | Edit->Or) ^ Edit->Xor;
+}
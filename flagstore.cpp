@@ -0,0 +1,1041 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "flagstore.h"
+#include "gflags.h"
+#include "imageindex.h"
+#include "tracedb.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/file.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
+
+#define JOURNAL_LINE_MAX    1024        /* read in pieces of this size, records can be longer */
+#define JOURNAL_LOCK_SUFFIX L".lock"
+#define JOURNAL_GENERATION  L"# generation "
+#define UPDATE_MAX_RETRIES  16
+
+static FlagStore* g_FlagStore = NULL;
+
+
+std::wstring NormalizeName( _In_z_ PCWSTR Name )
+{
+    std::wstring Result(Name);
+    for(size_t n = 0; n < Result.size(); ++n)
+    {
+        Result[n] = towlower(Result[n]);
+    }
+    return Result;
+}
+
+
+BOOL FlagStore::CompareExchange( _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _In_opt_z_ PCWSTR ValueName,
+                                 _In_ ULONG Expected, _In_ ULONG Value, _Out_ ULONG* Current )
+{
+    *Current = 0;
+    if(!Lock())
+    {
+        return FALSE;
+    }
+    BOOL Success;
+    if(Dest & DEST_IMAGE)
+        Success = ReadImageValue(ImageName, ValueName, Current);
+    else if(Dest & DEST_KERNEL)
+        Success = ReadKernelFlags(Current);
+    else
+        Success = ReadGlobalFlags(Current);
+
+    if(Success && *Current == Expected)
+    {
+        if(Dest & DEST_IMAGE)
+            Success = WriteImageValue(ImageName, ValueName, Value);
+        else if(Dest & DEST_KERNEL)
+            Success = WriteKernelFlags(Value);
+        else
+            Success = WriteGlobalFlags(Value);
+    }
+    Unlock();
+    return Success;
+}
+
+struct HasImageContext
+{
+    std::wstring Name;
+    BOOL Exists;
+};
+
+static BOOL FindImage( _In_z_ PCWSTR ImageName, _In_ ULONG /* Value */, _In_opt_ PVOID Context )
+{
+    HasImageContext* Find = (HasImageContext*)Context;
+    Find->Exists = NormalizeName(ImageName) == Find->Name;
+    return !Find->Exists;
+}
+
+BOOL FlagStore::HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists )
+{
+    HasImageContext Find;
+    Find.Name = NormalizeName(ImageName);
+    Find.Exists = FALSE;
+    BOOL Success = EnumImageValues(NULL, FindImage, &Find);
+    *Exists = Find.Exists;
+    return Success;
+}
+
+BOOL FlagStore::DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName )
+{
+    ULONG Value;
+    return ReadImageValue(ImageName, ValueName, &Value) && (!Value || WriteImageValue(ImageName, ValueName, 0));
+}
+
+
+MemoryFlagStore::MemoryFlagStore()
+    : m_GlobalFlags(0)
+    , m_KernelFlags(0)
+    , m_Version(0)
+{
+}
+
+BOOL MemoryFlagStore::Lock()
+{
+    m_Lock.lock();
+    return TRUE;
+}
+
+void MemoryFlagStore::Unlock()
+{
+    m_Lock.unlock();
+}
+
+BOOL MemoryFlagStore::ReadGlobalFlags( _Out_ ULONG* Flag )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    *Flag = m_GlobalFlags;
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::WriteGlobalFlags( _In_ ULONG Flag )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    m_GlobalFlags = Flag;
+    ++m_Version;
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    *Value = 0;
+    ImageMap::const_iterator Image = m_Images.find(NormalizeName(ImageName));
+    if(Image != m_Images.end())
+    {
+        ValueMap::const_iterator Entry = Image->second.find(NormalizeName(ValueName));
+        if(Entry != Image->second.end())
+        {
+            *Value = Entry->second;
+        }
+    }
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    if(!ImageName || !ImageName[0])
+    {
+        return FALSE;
+    }
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    m_Images[NormalizeName(ImageName)][NormalizeName(ValueName)] = Value;
+    ++m_Version;
+    return TRUE;
+}
+
+/* The image key stays, like it does in the registry. */
+BOOL MemoryFlagStore::DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    ImageMap::iterator Image = m_Images.find(NormalizeName(ImageName));
+    if(Image != m_Images.end() && Image->second.erase(NormalizeName(ValueName)))
+    {
+        ++m_Version;
+    }
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::ReadImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ std::wstring* Value )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    StringMap::const_iterator Entry = m_Strings.find(NormalizeName(ImageName) + L'\\' + NormalizeName(ValueName));
+    if(Entry != m_Strings.end())
+    {
+        *Value = Entry->second;
+    }
+    else
+    {
+        Value->clear();
+    }
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value )
+{
+    if(!ImageName)
+    {
+        return FALSE;
+    }
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    std::wstring Image = NormalizeName(ImageName);
+    if(!Image.empty())
+    {
+        m_Images[Image];
+    }
+    m_Strings[Image + L'\\' + NormalizeName(ValueName)] = Value;
+    ++m_Version;
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    std::wstring Name = ValueName ? NormalizeName(ValueName) : L"";
+    for(ImageMap::const_iterator Image = m_Images.begin(); Image != m_Images.end(); ++Image)
+    {
+        if(!ValueName)
+        {
+            if(!Callback(Image->first.c_str(), 0, Context))
+            {
+                break;
+            }
+            continue;
+        }
+        ValueMap::const_iterator Entry = Image->second.find(Name);
+        if(Entry != Image->second.end() && !Callback(Image->first.c_str(), Entry->second, Context))
+        {
+            break;
+        }
+    }
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    *Exists = m_Images.find(NormalizeName(ImageName)) != m_Images.end();
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::ReadKernelFlags( _Out_ ULONG* Flag )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    *Flag = m_KernelFlags;
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::WriteKernelFlags( _In_ ULONG Flag )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    m_KernelFlags = Flag;
+    ++m_Version;
+    return TRUE;
+}
+
+BOOL MemoryFlagStore::GetChangeStamp( _Out_ ULONG* Stamp )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    *Stamp = m_Version;
+    return TRUE;
+}
+
+
+static BOOL LockJournal( _In_ FILE* File, _In_ BOOL Acquire )
+{
+#ifdef _WIN32
+    HANDLE Handle = (HANDLE)_get_osfhandle(_fileno(File));
+    OVERLAPPED Overlapped = {0};
+    if(Acquire)
+    {
+        return LockFileEx(Handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &Overlapped);
+    }
+    return UnlockFileEx(Handle, 0, 1, 0, &Overlapped);
+#else
+    return !flock(fileno(File), Acquire ? LOCK_EX : LOCK_UN);
+#endif
+}
+
+FileFlagStore::FileFlagStore()
+    : m_File(NULL)
+    , m_LockFile(NULL)
+    , m_Offset(0)
+    , m_Generation(0)
+    , m_Records(0)
+    , m_LockDepth(0)
+#ifdef _WIN32
+    , m_Notify(INVALID_HANDLE_VALUE)
+#else
+    , m_Notify(-1)
+#endif
+{
+}
+
+FileFlagStore::~FileFlagStore()
+{
+    Close();
+}
+
+BOOL FileFlagStore::Open( _In_z_ PCWSTR FileName )
+{
+    Close();
+    m_FileName = FileName;
+    m_LockFile = _wfopen((m_FileName + JOURNAL_LOCK_SUFFIX).c_str(), L"a");
+    if(!m_LockFile || !Lock())
+    {
+        Close();
+        return FALSE;
+    }
+
+    size_t Live = 2 + m_Strings.size();
+    for(ImageMap::const_iterator it = m_Images.begin(); it != m_Images.end(); ++it)
+    {
+        Live += it->second.size();
+    }
+    /* Compaction is best effort, it fails on Windows while another process has the journal open. */
+    BOOL Success = TRUE;
+    if(m_Records > 2 * Live + 64)
+    {
+        Compact();
+        Success = Sync();
+    }
+    Unlock();
+    if(!Success)
+    {
+        Close();
+        return FALSE;
+    }
+
+    /* The journal is replaced on compaction, so its directory is watched. */
+    size_t Separator = m_FileName.find_last_of(L"\\/");
+    std::wstring Directory = Separator == std::wstring::npos ? L"." : m_FileName.substr(0, Separator + 1);
+#ifdef _WIN32
+    m_Notify = FindFirstChangeNotificationW(Directory.c_str(), FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+#elif defined(__linux__)
+    char NarrowDirectory[1024];
+    m_Notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_Notify >= 0 && (wcstombs(NarrowDirectory, Directory.c_str(), sizeof(NarrowDirectory)) == (size_t)-1 ||
+       inotify_add_watch(m_Notify, NarrowDirectory, IN_MODIFY | IN_MOVED_TO | IN_CREATE) < 0))
+    {
+        close(m_Notify);
+        m_Notify = -1;
+    }
+#endif
+    return TRUE;
+}
+
+void FileFlagStore::Close()
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    if(m_File)
+    {
+        fclose(m_File);
+        m_File = NULL;
+    }
+    if(m_LockFile)
+    {
+        fclose(m_LockFile);
+        m_LockFile = NULL;
+    }
+    m_Offset = 0;
+    m_Generation = 0;
+    m_Records = 0;
+    m_LockDepth = 0;
+#ifdef _WIN32
+    if(m_Notify != INVALID_HANDLE_VALUE)
+    {
+        FindCloseChangeNotification(m_Notify);
+        m_Notify = INVALID_HANDLE_VALUE;
+    }
+#else
+    if(m_Notify >= 0)
+    {
+        close(m_Notify);
+        m_Notify = -1;
+    }
+#endif
+}
+
+BOOL FileFlagStore::Lock()
+{
+    MemoryFlagStore::Lock();
+    /* The journal lock is not recursive, a write inside CompareExchange already holds it. */
+    if(m_LockDepth)
+    {
+        ++m_LockDepth;
+        return TRUE;
+    }
+    if(m_LockFile && LockJournal(m_LockFile, TRUE))
+    {
+        if(Sync())
+        {
+            m_LockDepth = 1;
+            return TRUE;
+        }
+        LockJournal(m_LockFile, FALSE);
+    }
+    MemoryFlagStore::Unlock();
+    return FALSE;
+}
+
+void FileFlagStore::Unlock()
+{
+    if(!--m_LockDepth)
+    {
+        LockJournal(m_LockFile, FALSE);
+    }
+    MemoryFlagStore::Unlock();
+}
+
+/* Replays the records appended since the last call, or the whole journal when it was compacted in the meantime. */
+BOOL FileFlagStore::Sync()
+{
+    WCHAR Line[JOURNAL_LINE_MAX];
+    ULONG Generation = 0;
+    FILE* File = _wfopen(m_FileName.c_str(), L"r");
+    if(File && fgetws(Line, JOURNAL_LINE_MAX, File) && !wcsncmp(Line, JOURNAL_GENERATION, wcslen(JOURNAL_GENERATION)))
+    {
+        Generation = wcstoul(Line + wcslen(JOURNAL_GENERATION), NULL, 10);
+    }
+
+    if(!m_File || Generation != m_Generation)
+    {
+        if(m_File)
+        {
+            fclose(m_File);
+        }
+        m_GlobalFlags = 0;
+        m_KernelFlags = 0;
+        m_Images.clear();
+        m_Strings.clear();
+        m_Offset = 0;
+        m_Records = 0;
+        m_Generation = Generation;
+        ++m_Version;
+        m_File = _wfopen(m_FileName.c_str(), L"a");
+    }
+
+    BOOL Success = m_File != NULL;
+    if(File)
+    {
+        size_t Records = 0;
+        Success = Success && !fseek(File, m_Offset, SEEK_SET) && Load(File, &Records);
+        m_Offset = ftell(File);
+        m_Records += Records;
+        m_Version += Records ? 1 : 0;
+        fclose(File);
+    }
+    return Success;
+}
+
+/* One line without its line break, however long it is. FALSE at the end of the file. */
+static BOOL ReadJournalLine( _In_ FILE* File, _Out_ std::wstring* Line )
+{
+    WCHAR Piece[JOURNAL_LINE_MAX];
+    Line->clear();
+    while(fgetws(Piece, JOURNAL_LINE_MAX, File))
+    {
+        *Line += Piece;
+        if(Line->back() == L'\n')
+        {
+            break;
+        }
+    }
+    while(!Line->empty() && (Line->back() == L'\n' || Line->back() == L'\r'))
+    {
+        Line->erase(Line->size() - 1);
+    }
+    return !Line->empty() || (!feof(File) && !ferror(File));
+}
+
+BOOL FileFlagStore::Load( _In_ FILE* File, _Out_ size_t* Records )
+{
+    std::wstring Text;
+    *Records = 0;
+    while(ReadJournalLine(File, &Text))
+    {
+        if(Text.empty() || Text[0] == L'#')
+        {
+            continue;
+        }
+
+        PWSTR Line = &Text[0];
+
+        PWSTR Next = NULL;
+        if(!wcsncmp(Line, L"registry ", 9))
+        {
+            m_GlobalFlags = wcstoul(Line + 9, NULL, 16);
+        }
+        else if(!wcsncmp(Line, L"kernel ", 7))
+        {
+            m_KernelFlags = wcstoul(Line + 7, NULL, 16);
+        }
+        else if(!wcsncmp(Line, L"image ", 6))
+        {
+            /* image <ValueName> <Value> <ImageName> */
+            PWSTR ValueName = Line + 6;
+            PWSTR Separator = wcschr(ValueName, L' ');
+            if(!Separator)
+            {
+                return FALSE;
+            }
+            *Separator = L'\0';
+            ULONG Value = wcstoul(Separator + 1, &Next, 16);
+            if(!Next || *Next != L' ' || !Next[1])
+            {
+                return FALSE;
+            }
+            MemoryFlagStore::WriteImageValue(Next + 1, ValueName, Value);
+        }
+        else if(!wcsncmp(Line, L"delete ", 7))
+        {
+            /* delete <ValueName> <ImageName> */
+            PWSTR ValueName = Line + 7;
+            PWSTR Separator = wcschr(ValueName, L' ');
+            if(!Separator || !Separator[1])
+            {
+                return FALSE;
+            }
+            *Separator = L'\0';
+            MemoryFlagStore::DeleteImageValue(Separator + 1, ValueName);
+        }
+        else if(!wcsncmp(Line, L"string ", 7))
+        {
+            /* string <ValueName> <ImageName>\t<Value>, without ImageName for the IFEO key */
+            PWSTR ValueName = Line + 7;
+            PWSTR Separator = wcschr(ValueName, L' ');
+            PWSTR Tab = Separator ? wcschr(Separator + 1, L'\t') : NULL;
+            if(!Tab)
+            {
+                return FALSE;
+            }
+            *Separator = *Tab = L'\0';
+            MemoryFlagStore::WriteImageString(Separator + 1, ValueName, Tab + 1);
+        }
+        else
+        {
+            return FALSE;
+        }
+        ++*Records;
+    }
+    return TRUE;
+}
+
+BOOL FileFlagStore::Compact()
+{
+    std::wstring TempName = m_FileName + L".tmp";
+    FILE* File = _wfopen(TempName.c_str(), L"w");
+    if(!File)
+    {
+        return FALSE;
+    }
+    fwprintf(File, JOURNAL_GENERATION L"%u\n", m_Generation + 1);
+    fwprintf(File, L"registry %08x\n", m_GlobalFlags);
+    fwprintf(File, L"kernel %08x\n", m_KernelFlags);
+    for(ImageMap::const_iterator Image = m_Images.begin(); Image != m_Images.end(); ++Image)
+    {
+        for(ValueMap::const_iterator Entry = Image->second.begin(); Entry != Image->second.end(); ++Entry)
+        {
+            fwprintf(File, L"image %ls %08x %ls\n", Entry->first.c_str(), Entry->second, Image->first.c_str());
+        }
+    }
+    for(StringMap::const_iterator Entry = m_Strings.begin(); Entry != m_Strings.end(); ++Entry)
+    {
+        size_t Separator = Entry->first.find(L'\\');
+        fwprintf(File, L"string %ls %ls\t%ls\n", Entry->first.c_str() + Separator + 1,
+                 Entry->first.substr(0, Separator).c_str(), Entry->second.c_str());
+    }
+    BOOL Success = !ferror(File);
+    Success = !fclose(File) && Success;
+
+    /* Our own handle would keep the journal from being replaced, Sync opens it again. */
+    fclose(m_File);
+    m_File = NULL;
+#ifdef _WIN32
+    Success = Success && MoveFileExW(TempName.c_str(), m_FileName.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    Success = Success && !_wrename(TempName.c_str(), m_FileName.c_str());
+#endif
+    if(!Success)
+    {
+        _wremove(TempName.c_str());
+    }
+    return Success;
+}
+
+/* Every write catches up with the journal first, so a compaction by another process does not lose it. */
+BOOL FileFlagStore::WriteGlobalFlags( _In_ ULONG Flag )
+{
+    if(!Lock())
+    {
+        return FALSE;
+    }
+    BOOL Success = fwprintf(m_File, L"registry %08x\n", Flag) >= 0 && !fflush(m_File) &&
+                   MemoryFlagStore::WriteGlobalFlags(Flag);
+    Unlock();
+    return Success;
+}
+
+/*
+ * Load has to read a record back as it was written: on one line, and with the
+ * value name ending at the first space. Value is NULL for an image record.
+ */
+static BOOL IsJournalRecord( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_opt_z_ PCWSTR Value )
+{
+    return ValueName[0] && !wcspbrk(ValueName, L" \t\r\n") &&
+           !wcspbrk(ImageName, L"\t\r\n") && (!Value || !wcspbrk(Value, L"\r\n"));
+}
+
+BOOL FileFlagStore::WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    if(!ImageName || !ImageName[0] || !IsJournalRecord(ImageName, ValueName, NULL) || !Lock())
+    {
+        return FALSE;
+    }
+    BOOL Success = fwprintf(m_File, L"image %ls %08x %ls\n", ValueName, Value, ImageName) >= 0 && !fflush(m_File) &&
+                   MemoryFlagStore::WriteImageValue(ImageName, ValueName, Value);
+    Unlock();
+    return Success;
+}
+
+BOOL FileFlagStore::DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName )
+{
+    if(!ImageName || !ImageName[0] || !IsJournalRecord(ImageName, ValueName, NULL) || !Lock())
+    {
+        return FALSE;
+    }
+    BOOL Success = fwprintf(m_File, L"delete %ls %ls\n", ValueName, ImageName) >= 0 && !fflush(m_File) &&
+                   MemoryFlagStore::DeleteImageValue(ImageName, ValueName);
+    Unlock();
+    return Success;
+}
+
+BOOL FileFlagStore::WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value )
+{
+    if(!ImageName || !IsJournalRecord(ImageName, ValueName, Value) || !Lock())
+    {
+        return FALSE;
+    }
+    BOOL Success = fwprintf(m_File, L"string %ls %ls\t%ls\n", ValueName, ImageName, Value) >= 0 && !fflush(m_File) &&
+                   MemoryFlagStore::WriteImageString(ImageName, ValueName, Value);
+    Unlock();
+    return Success;
+}
+
+BOOL FileFlagStore::WriteKernelFlags( _In_ ULONG Flag )
+{
+    if(!Lock())
+    {
+        return FALSE;
+    }
+    BOOL Success = fwprintf(m_File, L"kernel %08x\n", Flag) >= 0 && !fflush(m_File) &&
+                   MemoryFlagStore::WriteKernelFlags(Flag);
+    Unlock();
+    return Success;
+}
+
+BOOL FileFlagStore::GetChangeStamp( _Out_ ULONG* Stamp )
+{
+    BOOL Changed = FALSE;
+#ifdef _WIN32
+    if(m_Notify == INVALID_HANDLE_VALUE)
+    {
+        *Stamp = 0;
+        return FALSE;
+    }
+    if(WaitForSingleObject(m_Notify, 0) == WAIT_OBJECT_0)
+    {
+        FindNextChangeNotification(m_Notify);
+        Changed = TRUE;
+    }
+#else
+    char Events[4096];
+    if(m_Notify < 0)
+    {
+        *Stamp = 0;
+        return FALSE;
+    }
+    while(read(m_Notify, Events, sizeof(Events)) > 0)
+    {
+        Changed = TRUE;
+    }
+#endif
+    /* Lock replays what was appended since the last time. */
+    if(Changed && Lock())
+    {
+        Unlock();
+    }
+    return MemoryFlagStore::GetChangeStamp(Stamp);
+}
+
+
+CachedFlagStore::CachedFlagStore( _In_ FlagStore* Inner )
+    : m_Inner(Inner)
+    , m_HaveStamp(FALSE)
+    , m_Stamp(0)
+    , m_Hits(0)
+    , m_Misses(0)
+{
+}
+
+std::wstring CachedFlagStore::Key( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName )
+{
+    return NormalizeName(ImageName) + L'\\' + NormalizeName(ValueName);
+}
+
+/* Drops the cached values when the inner store changed, FALSE when it cannot tell. */
+BOOL CachedFlagStore::IsCurrent()
+{
+    ULONG Stamp;
+    if(!m_Inner->GetChangeStamp(&Stamp))
+    {
+        m_Values.clear();
+        m_HaveStamp = FALSE;
+        return FALSE;
+    }
+    if(!m_HaveStamp || Stamp != m_Stamp)
+    {
+        m_Values.clear();
+        m_HaveStamp = TRUE;
+        m_Stamp = Stamp;
+    }
+    return TRUE;
+}
+
+void CachedFlagStore::Invalidate()
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    m_Values.clear();
+    m_HaveStamp = FALSE;
+}
+
+void CachedFlagStore::GetCounters( _Out_ ULONG* Hits, _Out_ ULONG* Misses )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    *Hits = m_Hits;
+    *Misses = m_Misses;
+}
+
+BOOL CachedFlagStore::ReadGlobalFlags( _Out_ ULONG* Flag )
+{
+    return m_Inner->ReadGlobalFlags(Flag);
+}
+
+BOOL CachedFlagStore::WriteGlobalFlags( _In_ ULONG Flag )
+{
+    return m_Inner->WriteGlobalFlags(Flag);
+}
+
+BOOL CachedFlagStore::ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    if(!IsCurrent())
+    {
+        ++m_Misses;
+        return m_Inner->ReadImageValue(ImageName, ValueName, Value);
+    }
+    std::wstring Name = Key(ImageName, ValueName);
+    ValueMap::const_iterator Entry = m_Values.find(Name);
+    if(Entry != m_Values.end())
+    {
+        ++m_Hits;
+        *Value = Entry->second;
+        return TRUE;
+    }
+    ++m_Misses;
+    if(!m_Inner->ReadImageValue(ImageName, ValueName, Value))
+    {
+        return FALSE;
+    }
+    m_Values[Name] = *Value;
+    return TRUE;
+}
+
+BOOL CachedFlagStore::WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    /* Not cached: a change by someone else could be noticed before this write. */
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    m_Values.erase(Key(ImageName, ValueName));
+    return m_Inner->WriteImageValue(ImageName, ValueName, Value);
+}
+
+BOOL CachedFlagStore::DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    m_Values.erase(Key(ImageName, ValueName));
+    return m_Inner->DeleteImageValue(ImageName, ValueName);
+}
+
+BOOL CachedFlagStore::EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context )
+{
+    return m_Inner->EnumImageValues(ValueName, Callback, Context);
+}
+
+BOOL CachedFlagStore::HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists )
+{
+    return m_Inner->HasImage(ImageName, Exists);
+}
+
+BOOL CachedFlagStore::ReadImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ std::wstring* Value )
+{
+    return m_Inner->ReadImageString(ImageName, ValueName, Value);
+}
+
+BOOL CachedFlagStore::WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value )
+{
+    return m_Inner->WriteImageString(ImageName, ValueName, Value);
+}
+
+BOOL CachedFlagStore::HasImageStrings()
+{
+    return m_Inner->HasImageStrings();
+}
+
+BOOL CachedFlagStore::ReadKernelFlags( _Out_ ULONG* Flag )
+{
+    return m_Inner->ReadKernelFlags(Flag);
+}
+
+BOOL CachedFlagStore::WriteKernelFlags( _In_ ULONG Flag )
+{
+    return m_Inner->WriteKernelFlags(Flag);
+}
+
+BOOL CachedFlagStore::Flush()
+{
+    return m_Inner->Flush();
+}
+
+BOOL CachedFlagStore::CompareExchange( _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _In_opt_z_ PCWSTR ValueName,
+                                       _In_ ULONG Expected, _In_ ULONG Value, _Out_ ULONG* Current )
+{
+    if(Dest & DEST_IMAGE)
+    {
+        std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+        m_Values.erase(Key(ImageName, ValueName));
+        return m_Inner->CompareExchange(Dest, ImageName, ValueName, Expected, Value, Current);
+    }
+    return m_Inner->CompareExchange(Dest, ImageName, ValueName, Expected, Value, Current);
+}
+
+BOOL CachedFlagStore::GetChangeStamp( _Out_ ULONG* Stamp )
+{
+    return m_Inner->GetChangeStamp(Stamp);
+}
+
+BOOL CachedFlagStore::Lock()
+{
+    return m_Inner->Lock();
+}
+
+void CachedFlagStore::Unlock()
+{
+    m_Inner->Unlock();
+}
+
+
+FlagStore* GetFlagStore()
+{
+    if(!g_FlagStore)
+    {
+#ifdef _WIN32
+        g_FlagStore = GetRegistryFlagStore();
+#else
+        static MemoryFlagStore DefaultStore;
+        g_FlagStore = &DefaultStore;
+#endif
+    }
+    return g_FlagStore;
+}
+
+void SetFlagStore( _In_opt_ FlagStore* Store )
+{
+    g_FlagStore = Store;
+}
+
+
+void MaskFlags( DWORD ActiveDest, DWORD ActiveFlags, PDWORD ApplyFlags, PDWORD IgnoredFlags)
+{
+    DWORD Mask = 0;
+    if(ActiveDest & DEST_IMAGE)
+        Mask = g_ValidImageFlags;
+    else if(ActiveDest & DEST_KERNEL)
+        Mask = g_ValidKernelFlags;
+    else
+        Mask = g_ValidRegistryFlags;
+
+    *ApplyFlags = ActiveFlags & Mask;
+    *IgnoredFlags = ActiveFlags & ~Mask;
+}
+
+DWORD ParseFlagTarget( _In_z_ PCWSTR Target )
+{
+    if(!_wcsicmp(Target, L"registry"))
+        return DEST_REGISTRY;
+    else if(!_wcsicmp(Target, L"kernel"))
+        return DEST_KERNEL;
+    return DEST_IMAGE;
+}
+
+BOOL ReadFlags( _In_ FlagStore* Store, _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _Out_ ULONG* Flags )
+{
+    if(Dest & DEST_IMAGE)
+    {
+        if(!ImageName || !ImageName[0])
+        {
+            *Flags = 0;
+            return TRUE;
+        }
+        return Store->ReadImageValue(ImageName, GLOBALFLAG_VALUENAME, Flags);
+    }
+    else if(Dest & DEST_KERNEL)
+        return Store->ReadKernelFlags(Flags);
+    return Store->ReadGlobalFlags(Flags);
+}
+
+/*
+ * Only the bits valid for Dest are compared: bits the destination does not
+ * accept (like the pool tagging bit the kernel reports) never cause a write.
+ * A missing image key reads as 0, so an edit resulting in 0 does not create one.
+ *
+ * The write is a compare-and-swap against the value the edit was computed
+ * from. When another writer got in between, the edit is applied again to
+ * the value it left behind.
+ */
+BOOL UpdateFlags( _In_ FlagStore* Store, _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _In_ const FlagEdit* Edit, _Out_ FlagUpdate* Update )
+{
+    Update->OldFlags = Update->NewFlags = Update->IgnoredFlags = 0;
+    Update->Written = FALSE;
+    Update->Retries = 0;
+    if((Dest & DEST_IMAGE) && (!ImageName || !ImageName[0]))
+    {
+        return FALSE;
+    }
+    if(!ReadFlags(Store, Dest, ImageName, &Update->OldFlags))
+    {
+        return FALSE;
+    }
+    for(;;)
+    {
+        DWORD NewFlags = 0, IgnoredFlags = 0, OldFlags = 0, Unused;
+        MaskFlags(Dest, ApplyFlagEdit(Edit, Update->OldFlags), &NewFlags, &IgnoredFlags);
+        MaskFlags(Dest, Update->OldFlags, &OldFlags, &Unused);
+        Update->NewFlags = NewFlags;
+        Update->IgnoredFlags = IgnoredFlags;
+        if(NewFlags == OldFlags)
+        {
+            return TRUE;
+        }
+
+        /* USTEnabled only lists the images, the loader reads the flag. It changes under the same lock, so concurrent edits keep each other's entries. */
+        BOOL UstChanged = (Dest & DEST_IMAGE) && ((OldFlags ^ NewFlags) & FLG_USER_STACK_TRACE_DB);
+        ULONG Current;
+        if(!Store->Lock())
+        {
+            return FALSE;
+        }
+        if(!Store->CompareExchange(Dest, ImageName, GLOBALFLAG_VALUENAME, Update->OldFlags, NewFlags, &Current))
+        {
+            Store->Unlock();
+            return FALSE;
+        }
+        if(Current == Update->OldFlags && UstChanged && !SetUstEnabled(Store, ImageName, !!(NewFlags & FLG_USER_STACK_TRACE_DB)))
+        {
+            /* Nothing else got in while the lock is held, so this puts the flag back as it was. */
+            Store->CompareExchange(Dest, ImageName, GLOBALFLAG_VALUENAME, NewFlags, Update->OldFlags, &Current);
+            Store->Unlock();
+            return FALSE;
+        }
+        Store->Unlock();
+        if(Current == Update->OldFlags)
+        {
+            Update->Written = TRUE;
+            if((Dest & DEST_IMAGE) && Store->GetImageIndex())
+            {
+                Store->GetImageIndex()->Add(ImageName);
+            }
+            return TRUE;
+        }
+        if(++Update->Retries > UPDATE_MAX_RETRIES)
+        {
+            return FALSE;
+        }
+        Update->OldFlags = Current;
+    }
+}
+
+
+BOOL ReadGlobalFlagsFromRegistry( _Out_ ULONG* Flag )
+{
+    return GetFlagStore()->ReadGlobalFlags(Flag);
+}
+
+BOOL WriteGlobalFlagsToRegistry( _In_ ULONG Flag )
+{
+    return GetFlagStore()->WriteGlobalFlags(Flag);
+}
+
+BOOL ReadImageGlobalFlagsFromRegistry( _In_z_ PCWSTR ImageName, _Out_ ULONG* Flag )
+{
+    if(!ImageName || !ImageName[0])
+    {
+        *Flag = 0;
+        return TRUE;
+    }
+    return GetFlagStore()->ReadImageValue(ImageName, GLOBALFLAG_VALUENAME, Flag);
+}
+
+BOOL WriteImageGlobalFlagsToRegistry( _In_z_ PCWSTR ImageName, _In_ ULONG Flag )
+{
+    return GetFlagStore()->WriteImageValue(ImageName, GLOBALFLAG_VALUENAME, Flag);
+}
+
+BOOL EnumImageGlobalFlagsFromRegistry( _In_ ImageValueCallback Callback, _In_opt_ PVOID Context )
+{
+    return GetFlagStore()->EnumImageValues(GLOBALFLAG_VALUENAME, Callback, Context);
+}
+
+BOOL ReadGlobalFlagsFromKernel( _Out_ ULONG* Flag )
+{
+    return GetFlagStore()->ReadKernelFlags(Flag);
+}
+
+BOOL WriteGlobalFlagsToKernel( _In_ ULONG Flag )
+{
+    return GetFlagStore()->WriteKernelFlags(Flag);
+}
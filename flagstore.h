@@ -0,0 +1,302 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "gflags.h"
+#include <map>
+#include <mutex>
+#include <string>
+
+#define GLOBALFLAG_VALUENAME        L"GlobalFlag"
+/* Other DWORD values of an image key, see the notes at the end of gflags.h. */
+#define USELARGEPAGES_VALUENAME     L"UseLargePages"
+
+class ImageNameIndex;
+
+/*
+ * Backend for all flag reads and writes.
+ * The Read / Write functions from gflags.h forward to the active store, so the
+ * parsing and apply logic can run against the real registry / kernel, or
+ * against one of the stand-ins below.
+ *
+ * Image values follow the registry semantics: names are case insensitive,
+ * and a missing image key or value reads as 0.
+ */
+struct GFLAGS_API FlagStore
+{
+    FlagStore() : m_ImageIndex(NULL) {;}
+    virtual ~FlagStore() {;}
+
+    virtual BOOL ReadGlobalFlags( _Out_ ULONG* Flag ) = 0;
+    virtual BOOL WriteGlobalFlags( _In_ ULONG Flag ) = 0;
+
+    virtual BOOL ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value ) = 0;
+    virtual BOOL WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value ) = 0;
+
+    /*
+     * Removes a value of an image key, a value that is not there is not an error.
+     * Stores that cannot remove values set it to 0 instead, when it is not 0 yet.
+     */
+    virtual BOOL DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName );
+
+    /*
+     * Reports every image that has ValueName set, in a single pass over the images.
+     * Without ValueName every image key is reported, with a Value of 0.
+     */
+    virtual BOOL EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context ) = 0;
+
+    /* *Exists tells whether ImageName has a key, with or without values. The default enumerates the images. */
+    virtual BOOL HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists );
+
+    /*
+     * REG_SZ values of an image key, such as PageHeapTargetDlls. A missing value
+     * reads as an empty string. An empty ImageName names the Image File Execution
+     * Options key itself, which holds USTEnabled. Stores without string values
+     * fail both.
+     */
+    virtual BOOL ReadImageString( _In_z_ PCWSTR /* ImageName */, _In_z_ PCWSTR /* ValueName */, _Out_ std::wstring* Value ) { Value->clear(); return FALSE; }
+    virtual BOOL WriteImageString( _In_z_ PCWSTR /* ImageName */, _In_z_ PCWSTR /* ValueName */, _In_z_ PCWSTR /* Value */ ) { return FALSE; }
+    virtual BOOL HasImageStrings() { return FALSE; }
+
+    virtual BOOL ReadKernelFlags( _Out_ ULONG* Flag ) = 0;
+    virtual BOOL WriteKernelFlags( _In_ ULONG Flag ) = 0;
+
+    /* Makes buffered writes durable, for stores that buffer them. */
+    virtual BOOL Flush() { return TRUE; }
+
+    /*
+     * Compare-and-swap of one value: Value is only written when the stored value
+     * still equals Expected. *Current receives the value found, so the swap took
+     * place when it equals Expected. ValueName is only used for DEST_IMAGE.
+     * The default implementation re-reads and writes while holding the store lock.
+     */
+    virtual BOOL CompareExchange( _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _In_opt_z_ PCWSTR ValueName,
+                                  _In_ ULONG Expected, _In_ ULONG Value, _Out_ ULONG* Current );
+
+    /*
+     * *Stamp changes whenever the image values may have changed, also by other
+     * processes. Checking it does not read the stored data, changes are picked
+     * up from change notifications. FALSE when the store cannot tell.
+     */
+    virtual BOOL GetChangeStamp( _Out_ ULONG* Stamp ) { *Stamp = 0; return FALSE; }
+
+    /* UpdateFlags adds the images it writes flags for to Index, so completions include new names. NULL for none. */
+    void SetImageIndex( _In_opt_ ImageNameIndex* Index ) { m_ImageIndex = Index; }
+    ImageNameIndex* GetImageIndex() const { return m_ImageIndex; }
+
+    /*
+     * Keeps other writers of the same backing data out, the default is no locking.
+     * Calls nest, so a read-modify-write of several values can hold the lock
+     * around CompareExchange.
+     */
+    virtual BOOL Lock() { return TRUE; }
+    virtual void Unlock() {;}
+
+private:
+    ImageNameIndex* m_ImageIndex;
+};
+
+/* Keeps everything in process memory, nothing is persisted. Safe to use from multiple threads. */
+class GFLAGS_API MemoryFlagStore : public FlagStore
+{
+public:
+    MemoryFlagStore();
+
+    virtual BOOL ReadGlobalFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteGlobalFlags( _In_ ULONG Flag );
+
+    virtual BOOL ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value );
+    virtual BOOL WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value );
+    virtual BOOL DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName );
+    virtual BOOL EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context );
+    virtual BOOL HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists );
+    virtual BOOL ReadImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ std::wstring* Value );
+    virtual BOOL WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value );
+
+    virtual BOOL HasImageStrings() { return TRUE; }
+
+    virtual BOOL ReadKernelFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteKernelFlags( _In_ ULONG Flag );
+
+    virtual BOOL GetChangeStamp( _Out_ ULONG* Stamp );
+
+    virtual BOOL Lock();
+    virtual void Unlock();
+
+protected:
+    typedef std::map<std::wstring, ULONG> ValueMap;
+    typedef std::map<std::wstring, ValueMap> ImageMap;
+    typedef std::map<std::wstring, std::wstring> StringMap;    /* keyed by '<image>\\<value>', both normalized */
+
+    std::recursive_mutex m_Lock;
+    ULONG m_GlobalFlags;
+    ULONG m_KernelFlags;
+    ImageMap m_Images;
+    StringMap m_Strings;
+    ULONG m_Version;
+};
+
+/*
+ * Memory store backed by an append-only journal file.
+ * Every write appends one line, the last record for a given target wins when
+ * the file is loaded again. Writes that contain line breaks are refused. The
+ * journal is compacted on Open when it mostly consists of overwritten records.
+ *
+ * Several processes can share one journal: <File>.lock is locked around
+ * every write and compare-and-swap, which first catch up with the records
+ * others appended.
+ * A compacted journal starts with a new generation line, telling the other
+ * processes to reload it from the start.
+ */
+class GFLAGS_API FileFlagStore : public MemoryFlagStore
+{
+public:
+    FileFlagStore();
+    ~FileFlagStore();
+
+    BOOL Open( _In_z_ PCWSTR FileName );
+    void Close();
+
+    virtual BOOL WriteGlobalFlags( _In_ ULONG Flag );
+    virtual BOOL WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value );
+    virtual BOOL DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName );
+    virtual BOOL WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value );
+    virtual BOOL WriteKernelFlags( _In_ ULONG Flag );
+
+    /* Catches up with the records other processes appended, when the journal directory changed. */
+    virtual BOOL GetChangeStamp( _Out_ ULONG* Stamp );
+
+    virtual BOOL Lock();
+    virtual void Unlock();
+
+private:
+    BOOL Load( _In_ FILE* File, _Out_ size_t* Records );
+    BOOL Sync();
+    BOOL Compact();
+
+    std::wstring m_FileName;
+    FILE* m_File;
+    FILE* m_LockFile;
+    long m_Offset;
+    ULONG m_Generation;
+    size_t m_Records;
+    ULONG m_LockDepth;
+#ifdef _WIN32
+    HANDLE m_Notify;
+#else
+    int m_Notify;
+#endif
+};
+
+/*
+ * Read-through cache of the image values of another store, so looking up the
+ * same image again does not touch the registry or the journal. Everything is
+ * dropped when the inner store reports a change (GetChangeStamp). Stores that
+ * cannot report changes are not cached. Writes go through to the inner store.
+ */
+class GFLAGS_API CachedFlagStore : public FlagStore
+{
+public:
+    CachedFlagStore( _In_ FlagStore* Inner );
+
+    virtual BOOL ReadGlobalFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteGlobalFlags( _In_ ULONG Flag );
+
+    virtual BOOL ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value );
+    virtual BOOL WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value );
+    virtual BOOL DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName );
+    virtual BOOL EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context );
+    virtual BOOL HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists );
+    virtual BOOL ReadImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ std::wstring* Value );
+    virtual BOOL WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value );
+    virtual BOOL HasImageStrings();
+
+    virtual BOOL ReadKernelFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteKernelFlags( _In_ ULONG Flag );
+
+    virtual BOOL Flush();
+    virtual BOOL CompareExchange( _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _In_opt_z_ PCWSTR ValueName,
+                                  _In_ ULONG Expected, _In_ ULONG Value, _Out_ ULONG* Current );
+    virtual BOOL GetChangeStamp( _Out_ ULONG* Stamp );
+
+    virtual BOOL Lock();
+    virtual void Unlock();
+
+    void Invalidate();
+    void GetCounters( _Out_ ULONG* Hits, _Out_ ULONG* Misses );
+
+private:
+    typedef std::map<std::wstring, ULONG> ValueMap;
+
+    BOOL IsCurrent();
+    static std::wstring Key( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName );
+
+    FlagStore* m_Inner;
+    std::recursive_mutex m_Lock;
+    BOOL m_HaveStamp;
+    ULONG m_Stamp;
+    ValueMap m_Values;
+    ULONG m_Hits;
+    ULONG m_Misses;
+};
+
+GFLAGS_API std::wstring NormalizeName( _In_z_ PCWSTR Name );
+
+/*
+ * The process-wide store used by the Read / Write functions from gflags.h and
+ * the dialog. Library users can pass their own store to the functions below
+ * instead, so several stores can be used side by side from different threads.
+ */
+GFLAGS_API FlagStore* GetFlagStore();
+GFLAGS_API void SetFlagStore( _In_opt_ FlagStore* Store );
+
+#ifdef _WIN32
+GFLAGS_API FlagStore* GetRegistryFlagStore();
+#endif
+
+struct FlagUpdate
+{
+    ULONG OldFlags;
+    ULONG NewFlags;
+    ULONG IgnoredFlags;
+    BOOL Written;
+    ULONG Retries;
+};
+
+/* DEST_REGISTRY for 'registry', DEST_KERNEL for 'kernel', otherwise Target is an image name. */
+GFLAGS_API DWORD ParseFlagTarget( _In_z_ PCWSTR Target );
+
+/* Reads the GlobalFlag value of Dest from Store, ImageName is only used for DEST_IMAGE. */
+GFLAGS_API BOOL ReadFlags( _In_ FlagStore* Store, _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _Out_ ULONG* Flags );
+
+/*
+ * Applies Edit to the current flags of Dest, writing only when that changes the stored value.
+ * The read-modify-write is atomic against other gflags instances using the same store.
+ * FALSE, with the flags left as they were, when the USTEnabled list that follows
+ * ust could not be updated.
+ */
+GFLAGS_API BOOL UpdateFlags( _In_ FlagStore* Store, _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _In_ const FlagEdit* Edit, _Out_ FlagUpdate* Update );
@@ -0,0 +1,208 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "gflags.h"
+#include "pageheap.h"
+
+// Table from https://msdn.microsoft.com/en-us/library/windows/hardware/ff549596(v=vs.85).aspx
+// Everything derived from it (valid masks, abbreviation hash) is computed by the compiler.
+// The cost classes are rough; hpa is rated as full page heap for everything, see PageHeapCost.
+
+static constexpr FlagInfo g_FlagTable[] =
+{
+    {FLG_STOP_ON_EXCEPTION, L"soe", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Stop on exception", COST_NONE, COST_NONE},
+    {FLG_SHOW_LDR_SNAPS, L"sls", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Show loader snaps", COST_LOW, COST_NONE},
+    {FLG_DEBUG_INITIAL_COMMAND, L"dic", (DEST_REGISTRY), L"Debug initial command", COST_NONE, COST_NONE},
+    {FLG_STOP_ON_HUNG_GUI, L"shg", (DEST_KERNEL), L"Stop on hung GUI", COST_NONE, COST_NONE},
+    {FLG_HEAP_ENABLE_TAIL_CHECK, L"htc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap tail checking", COST_LOW, COST_LOW},
+    {FLG_HEAP_ENABLE_FREE_CHECK, L"hfc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap free checking", COST_LOW, COST_NONE},
+    {FLG_HEAP_VALIDATE_PARAMETERS, L"hpc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap parameter checking", COST_LOW, COST_NONE},
+    {FLG_HEAP_VALIDATE_ALL, L"hvc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap validation on call", COST_EXTREME, COST_NONE},
+    {FLG_APPLICATION_VERIFIER, L"vrf", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable application verifier", COST_MEDIUM, COST_LOW},
+    // FLG_MONITOR_SILENT_PROCESS_EXIT
+    {FLG_POOL_ENABLE_TAGGING, L"ptg", (DEST_REGISTRY), L"Enable pool tagging", COST_LOW, COST_LOW},
+    {FLG_HEAP_ENABLE_TAGGING, L"htg", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap tagging", COST_LOW, COST_LOW},
+    {FLG_USER_STACK_TRACE_DB, L"ust", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Create user mode stack trace database", COST_MEDIUM, COST_MEDIUM},
+    {FLG_KERNEL_STACK_TRACE_DB, L"kst", (DEST_REGISTRY), L"Create kernel mode stack trace database", COST_MEDIUM, COST_MEDIUM},
+    {FLG_MAINTAIN_OBJECT_TYPELIST, L"otl", (DEST_REGISTRY), L"Maintain a list of objects for each type", COST_LOW, COST_LOW},
+    {FLG_HEAP_ENABLE_TAG_BY_DLL, L"htd", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap tagging by DLL", COST_LOW, COST_LOW},
+    {FLG_DISABLE_STACK_EXTENSION, L"dse", (DEST_IMAGE), L"Disable stack extension", COST_NONE, COST_NONE},
+
+    {FLG_ENABLE_CSRDEBUG, L"d32", (DEST_REGISTRY), L"Enable debugging of Win32 subsystem", COST_NONE, COST_NONE},
+    {FLG_ENABLE_KDEBUG_SYMBOL_LOAD, L"ksl", (DEST_REGISTRY | DEST_KERNEL), L"Enable loading of kernel debugger symbols", COST_NONE, COST_NONE},
+    {FLG_DISABLE_PAGE_KERNEL_STACKS, L"dps", (DEST_REGISTRY), L"Disable paging of kernel stacks", COST_NONE, COST_LOW},
+    {FLG_ENABLE_SYSTEM_CRIT_BREAKS, L"scb", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable system critical breaks", COST_NONE, COST_NONE},
+    {FLG_HEAP_DISABLE_COALESCING, L"dhc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Disable heap coalesce on free", COST_NONE, COST_MEDIUM},
+    {FLG_ENABLE_CLOSE_EXCEPTIONS, L"ece", (DEST_REGISTRY | DEST_KERNEL), L"Enable close exception", COST_NONE, COST_NONE},
+    {FLG_ENABLE_EXCEPTION_LOGGING, L"eel", (DEST_REGISTRY | DEST_KERNEL), L"Enable exception logging", COST_LOW, COST_NONE},
+    {FLG_ENABLE_HANDLE_TYPE_TAGGING, L"eot", (DEST_REGISTRY | DEST_KERNEL), L"Enable object handle type tagging", COST_LOW, COST_NONE},
+    {FLG_HEAP_PAGE_ALLOCS, L"hpa", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable page heap", COST_HIGH, COST_EXTREME},
+    {FLG_DEBUG_INITIAL_COMMAND_EX, L"dwl", (DEST_REGISTRY), L"Debug WinLogon", COST_NONE, COST_NONE},
+    {FLG_DISABLE_DBGPRINT, L"ddp", (DEST_REGISTRY | DEST_KERNEL), L"Buffer DbgPrint Output", COST_NONE, COST_NONE},
+    {FLG_CRITSEC_EVENT_CREATION, L"cse", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Early critical section event creation", COST_NONE, COST_LOW},
+    {FLG_STOP_ON_UNHANDLED_EXCEPTION, L"sue", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Stop on unhandled user-mode exception", COST_NONE, COST_NONE},
+    {FLG_ENABLE_HANDLE_EXCEPTIONS, L"bhd", (DEST_REGISTRY | DEST_KERNEL), L"Enable bad handles detection", COST_LOW, COST_NONE},
+    {FLG_DISABLE_PROTDLLS, L"dpd", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Disable protected DLL verification", COST_NONE, COST_NONE},
+};
+
+//{FLG_MONITOR_SILENT_PROCESS_EXIT, NULL, (DEST_REGISTRY), L"Enable silent process exit monitoring"},
+//{0, NULL, (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Object Reference Tracing},
+//{0, L"spp", (DEST_REGISTRY | DEST_KERNEL), Special Pool"},    // kernel only in vista
+
+
+
+#define FLAG_COUNT          (sizeof(g_FlagTable) / sizeof(g_FlagTable[0]))
+
+// Open addressing is not needed, the seed is picked so that no two abbreviations share a slot.
+#define FLAG_HASH_SLOTS     128
+#define FLAG_HASH_EMPTY     0xff
+#define FLAG_HASH_MAX_SEED  0x10000
+
+static_assert(FLAG_COUNT < FLAG_HASH_EMPTY, "flag index does not fit in a hash slot");
+
+struct FlagHashTable
+{
+    ULONG Seed;
+    BYTE Slots[FLAG_HASH_SLOTS];
+};
+
+/* FNV-1a over the abbreviation, folding ASCII letters to lower case. */
+static constexpr ULONG AbbrHash( _In_z_ const wchar_t* Abbr, _In_ ULONG Seed )
+{
+    ULONG Hash = 2166136261u ^ Seed;
+    for(; *Abbr; ++Abbr)
+    {
+        wchar_t Chr = *Abbr;
+        Hash = (Hash ^ (ULONG)((Chr >= L'A' && Chr <= L'Z') ? Chr + (L'a' - L'A') : Chr)) * 16777619u;
+    }
+    return Hash;
+}
+
+static constexpr FlagHashTable BuildFlagHash()
+{
+    FlagHashTable Table = {};
+    for(ULONG Seed = 1; Seed < FLAG_HASH_MAX_SEED; ++Seed)
+    {
+        bool Collision = false;
+        for(size_t n = 0; n < FLAG_HASH_SLOTS; ++n)
+        {
+            Table.Slots[n] = FLAG_HASH_EMPTY;
+        }
+        for(size_t n = 0; n < FLAG_COUNT && !Collision; ++n)
+        {
+            if(!g_FlagTable[n].szAbbr)
+            {
+                continue;
+            }
+            size_t Slot = AbbrHash(g_FlagTable[n].szAbbr, Seed) % FLAG_HASH_SLOTS;
+            Collision = Table.Slots[Slot] != FLAG_HASH_EMPTY;
+            Table.Slots[Slot] = (BYTE)n;
+        }
+        if(!Collision)
+        {
+            Table.Seed = Seed;
+            return Table;
+        }
+    }
+    return Table;
+}
+
+static constexpr DWORD ValidFlagsFor( _In_ WORD Dest )
+{
+    DWORD Mask = 0;
+    for(size_t n = 0; n < FLAG_COUNT; ++n)
+    {
+        Mask |= (g_FlagTable[n].wDest & Dest) ? g_FlagTable[n].dwFlag : 0;
+    }
+    return Mask;
+}
+
+static constexpr FlagHashTable g_FlagHash = BuildFlagHash();
+static_assert(g_FlagHash.Seed != 0, "no perfect hash seed found for the flag abbreviations, increase FLAG_HASH_SLOTS");
+
+const FlagInfo* const g_Flags = g_FlagTable;
+const size_t g_FlagCount = FLAG_COUNT;
+
+const DWORD g_ValidRegistryFlags = ValidFlagsFor(DEST_REGISTRY);
+const DWORD g_ValidKernelFlags = ValidFlagsFor(DEST_KERNEL);
+const DWORD g_ValidImageFlags = ValidFlagsFor(DEST_IMAGE);
+
+
+// Percent of the run time or memory without the flag, per cost class.
+static constexpr ULONG g_CostPercent[] = { 100, 110, 150, 300, 1000 };
+static_assert(sizeof(g_CostPercent) / sizeof(g_CostPercent[0]) == COST_EXTREME + 1, "a cost class has no percentage");
+
+#define COST_PERCENT_MAX    1000000
+
+#define PAGE_HEAP_LIMITS    (PAGE_HEAP_USE_SIZE_RANGE | PAGE_HEAP_USE_DLL_RANGE | PAGE_HEAP_USE_RANDOM_DECISION | PAGE_HEAP_USE_DLL_NAMES)
+
+// Light page heap only adds fill patterns and checks around the normal heap, and limited
+// full page heap gives only some allocations a page of their own.
+static void PageHeapCost( _In_ ULONG PageHeapFlags, _Inout_ BYTE* CpuCost, _Inout_ BYTE* MemoryCost )
+{
+    if(!(PageHeapFlags & PAGE_HEAP_ENABLE_PAGE_HEAP))
+    {
+        *CpuCost = COST_LOW;
+        *MemoryCost = COST_LOW;
+    }
+    else if(PageHeapFlags & PAGE_HEAP_LIMITS)
+    {
+        *CpuCost = COST_MEDIUM;
+        *MemoryCost = COST_MEDIUM;
+    }
+}
+
+void EstimateFlagCost( _In_ ULONG Flags, _In_ ULONG PageHeapFlags, _Out_ FlagCost* Cost )
+{
+    ULONGLONG Cpu = 100, Memory = 100;
+    for(size_t n = 0; n < FLAG_COUNT; ++n)
+    {
+        if(Flags & g_FlagTable[n].dwFlag)
+        {
+            BYTE CpuCost = g_FlagTable[n].bCpuCost, MemoryCost = g_FlagTable[n].bMemoryCost;
+            if(g_FlagTable[n].dwFlag == FLG_HEAP_PAGE_ALLOCS)
+            {
+                PageHeapCost(PageHeapFlags, &CpuCost, &MemoryCost);
+            }
+            Cpu = Cpu * g_CostPercent[CpuCost] / 100;
+            Memory = Memory * g_CostPercent[MemoryCost] / 100;
+            Cpu = Cpu > COST_PERCENT_MAX ? COST_PERCENT_MAX : Cpu;
+            Memory = Memory > COST_PERCENT_MAX ? COST_PERCENT_MAX : Memory;
+        }
+    }
+    Cost->CpuPercent = (ULONG)Cpu;
+    Cost->MemoryPercent = (ULONG)Memory;
+}
+
+const FlagInfo* FindFlag( _In_z_ PCWSTR Abbr )
+{
+    BYTE Index = g_FlagHash.Slots[AbbrHash(Abbr, g_FlagHash.Seed) % FLAG_HASH_SLOTS];
+    if(Index == FLAG_HASH_EMPTY || _wcsicmp(Abbr, g_FlagTable[Index].szAbbr))
+    {
+        return NULL;
+    }
+    return &g_FlagTable[Index];
+}
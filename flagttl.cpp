@@ -0,0 +1,233 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "flagttl.h"
+#include <time.h>
+
+
+ULONG GetTtlTime()
+{
+    return (ULONG)time(NULL);
+}
+
+BOOL ParseDuration( _In_z_ PCWSTR Text, _Out_ ULONG* Seconds )
+{
+    ULONGLONG Total = 0;
+    *Seconds = 0;
+    if(!*Text)
+    {
+        return FALSE;
+    }
+    while(*Text)
+    {
+        if(!iswdigit(*Text))
+        {
+            return FALSE;
+        }
+        ULONGLONG Count = 0;
+        while(iswdigit(*Text) && Count <= TTL_MAX_SECONDS)
+        {
+            Count = Count * 10 + (*Text++ - L'0');
+        }
+        switch(towlower(*Text++))
+        {
+        case L's': break;
+        case L'm': Count *= 60; break;
+        case L'h': Count *= 3600; break;
+        case L'd': Count *= 24 * 3600; break;
+        default: return FALSE;
+        }
+        Total += Count;
+        if(Total > TTL_MAX_SECONDS)
+        {
+            return FALSE;
+        }
+    }
+    *Seconds = (ULONG)Total;
+    return Total != 0;
+}
+
+static BOOL ReadRevert( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _Out_ PendingRevert* Revert )
+{
+    Revert->ImageName = ImageName;
+    Revert->Time = Revert->Flags = Revert->Mask = 0;
+    if(!Store->ReadImageValue(ImageName, TTL_TIME_VALUENAME, &Revert->Time))
+    {
+        return FALSE;
+    }
+    if(!Revert->Time)
+    {
+        return TRUE;
+    }
+    return Store->ReadImageValue(ImageName, TTL_FLAGS_VALUENAME, &Revert->Flags) &&
+           Store->ReadImageValue(ImageName, TTL_MASK_VALUENAME, &Revert->Mask);
+}
+
+/*
+ * Time goes last, an entry is only pending once its flags and mask are complete.
+ * A cleared entry is removed, time first, so the image key is left as it was.
+ */
+static BOOL WriteRevert( _In_ FlagStore* Store, _In_ const PendingRevert* Revert )
+{
+    PCWSTR ImageName = Revert->ImageName.c_str();
+    if(!Revert->Time)
+    {
+        return Store->DeleteImageValue(ImageName, TTL_TIME_VALUENAME) &&
+               Store->DeleteImageValue(ImageName, TTL_FLAGS_VALUENAME) &&
+               Store->DeleteImageValue(ImageName, TTL_MASK_VALUENAME);
+    }
+    return Store->WriteImageValue(ImageName, TTL_FLAGS_VALUENAME, Revert->Flags & Revert->Mask) &&
+           Store->WriteImageValue(ImageName, TTL_MASK_VALUENAME, Revert->Mask) &&
+           Store->WriteImageValue(ImageName, TTL_TIME_VALUENAME, Revert->Time);
+}
+
+/* Adds the bits in Changed, as they were in OldFlags, to the bits Revert already restores. */
+static void AddToRevert( _Inout_ PendingRevert* Revert, _In_ ULONG OldFlags, _In_ ULONG Changed )
+{
+    Changed &= ~Revert->Mask;
+    Revert->Flags = (Revert->Flags & Revert->Mask) | (OldFlags & Changed);
+    Revert->Mask |= Changed;
+}
+
+BOOL UpdateFlagsWithTtl( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ const FlagEdit* Edit, _In_ ULONG Seconds,
+                         _Out_ FlagUpdate* Update, _Out_ ULONG* RevertTime )
+{
+    PendingRevert Before, Revert;
+    ULONG Current;
+    DWORD Touched, Ignored;
+    Update->OldFlags = Update->NewFlags = Update->IgnoredFlags = 0;
+    Update->Written = FALSE;
+    Update->Retries = 0;
+    *RevertTime = 0;
+    if(!ImageName || !ImageName[0] || !ReadRevert(Store, ImageName, &Before) || !ReadFlags(Store, DEST_IMAGE, ImageName, &Current))
+    {
+        return FALSE;
+    }
+
+    /* Every bit the edit can change, as it is now. */
+    MaskFlags(DEST_IMAGE, ~Edit->And | Edit->Or | Edit->Xor, &Touched, &Ignored);
+    Revert = Before;
+    AddToRevert(&Revert, Current, Touched);
+    Revert.Time = GetTtlTime() + Seconds;
+    if(Revert.Mask && !WriteRevert(Store, &Revert))
+    {
+        return FALSE;
+    }
+    PendingRevert Recorded = Revert;
+    Recorded.Time = Revert.Mask ? Revert.Time : Before.Time;
+
+    /* Narrow it down to the bits that really changed, from the value the update started from. */
+    BOOL Success = UpdateFlags(Store, DEST_IMAGE, ImageName, Edit, Update);
+    Revert.Flags = Before.Flags;
+    Revert.Mask = Before.Mask;
+    if(Success && Update->Written)
+    {
+        AddToRevert(&Revert, Update->OldFlags, Update->OldFlags ^ Update->NewFlags);
+    }
+    if(!Revert.Mask)
+    {
+        Revert.Time = 0;
+    }
+    else if(!Success)
+    {
+        Revert.Time = Before.Time;
+    }
+    BOOL Unchanged = Revert.Time == Recorded.Time && (!Revert.Time ||
+                     (Revert.Mask == Recorded.Mask && (Revert.Flags & Revert.Mask) == (Recorded.Flags & Recorded.Mask)));
+    if(!Unchanged && !WriteRevert(Store, &Revert))
+    {
+        return FALSE;
+    }
+    *RevertTime = Revert.Time;
+    return Success;
+}
+
+static BOOL CollectRevert( _In_z_ PCWSTR ImageName, _In_ ULONG Value, _In_opt_ PVOID Context )
+{
+    if(Value)
+    {
+        ((std::vector<std::wstring>*)Context)->push_back(ImageName);
+    }
+    return TRUE;
+}
+
+BOOL ListPendingReverts( _In_ FlagStore* Store, _Out_ std::vector<PendingRevert>* Reverts )
+{
+    std::vector<std::wstring> Images;
+    Reverts->clear();
+    if(!Store->EnumImageValues(TTL_TIME_VALUENAME, CollectRevert, &Images))
+    {
+        return FALSE;
+    }
+    for(size_t n = 0; n < Images.size(); ++n)
+    {
+        PendingRevert Revert;
+        if(!ReadRevert(Store, Images[n].c_str(), &Revert))
+        {
+            return FALSE;
+        }
+        if(Revert.Time)
+        {
+            Reverts->push_back(Revert);
+        }
+    }
+    return TRUE;
+}
+
+BOOL RevertExpiredFlags( _In_ FlagStore* Store, _In_ ULONG Now, _Out_ ULONG* Reverted )
+{
+    std::vector<PendingRevert> Reverts;
+    *Reverted = 0;
+    if(!ListPendingReverts(Store, &Reverts))
+    {
+        return FALSE;
+    }
+    BOOL Success = TRUE;
+    for(size_t n = 0; n < Reverts.size(); ++n)
+    {
+        PendingRevert& Revert = Reverts[n];
+        if(Revert.Time > Now)
+        {
+            continue;
+        }
+        /* The flags go first: when clearing the entry fails, the revert is repeated, which changes nothing. */
+        FlagEdit Edit = { ~Revert.Mask, Revert.Flags & Revert.Mask, 0 };
+        FlagUpdate Update;
+        Revert.Time = 0;
+        if(!UpdateFlags(Store, DEST_IMAGE, Revert.ImageName.c_str(), &Edit, &Update) || !WriteRevert(Store, &Revert))
+        {
+            Success = FALSE;
+            continue;
+        }
+        ++*Reverted;
+    }
+    if(*Reverted && !Store->Flush())
+    {
+        *Reverted = 0;
+        return FALSE;
+    }
+    return Success;
+}
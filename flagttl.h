@@ -0,0 +1,75 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "flagstore.h"
+#include <string>
+#include <vector>
+
+/*
+ * Image flags that revert on their own, for the expensive ones (hpa, ust, hvc)
+ * that are only meant for an investigation.
+ *
+ * The pending revert is kept next to the GlobalFlag value of the image, in the
+ * same store, so it is found by every gflags that opens that store: the -serve
+ * daemon while it is idle, 'gflags -revert-expired' from a scheduled task, and
+ * the gflags commands that write to a live store. The revert only restores the bits
+ * the timed change touched, later changes to other bits are kept.
+ */
+
+#define TTL_TIME_VALUENAME          L"GlobalFlagRevertTime"     /* seconds since 1970, missing or 0 when nothing is pending */
+#define TTL_FLAGS_VALUENAME         L"GlobalFlagRevertFlags"    /* the bits of TTL_MASK_VALUENAME before the change */
+#define TTL_MASK_VALUENAME          L"GlobalFlagRevertMask"
+#define TTL_MAX_SECONDS             (366 * 24 * 3600)
+
+struct PendingRevert
+{
+    std::wstring ImageName;
+    ULONG Time;
+    ULONG Flags;
+    ULONG Mask;
+};
+
+GFLAGS_API ULONG GetTtlTime();
+
+/* '90s', '30m', '2h', '1d' or combinations like '1h30m'. */
+GFLAGS_API BOOL ParseDuration( _In_z_ PCWSTR Text, _Out_ ULONG* Seconds );
+
+/*
+ * UpdateFlags for an image that records how to undo the change, Seconds from now.
+ * The pending revert is written before the flags, so a failed or interrupted
+ * update never leaves a change behind that would not be reverted. A new change
+ * to an image that is already pending keeps the values from before the first
+ * change, and moves the revert to the new time.
+ */
+GFLAGS_API BOOL UpdateFlagsWithTtl( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ const FlagEdit* Edit, _In_ ULONG Seconds,
+                                    _Out_ FlagUpdate* Update, _Out_ ULONG* RevertTime );
+
+GFLAGS_API BOOL ListPendingReverts( _In_ FlagStore* Store, _Out_ std::vector<PendingRevert>* Reverts );
+
+/* Reverts every image whose time has come and flushes the store. FALSE when one of them failed. */
+GFLAGS_API BOOL RevertExpiredFlags( _In_ FlagStore* Store, _In_ ULONG Now, _Out_ ULONG* Reverted );
@@ -25,12 +25,27 @@
 #include <Windows.h>
 #include <Strsafe.h>
 #include <assert.h>
+#include <vector>
 #include "gflags.h"
+#include "flagstore.h"
+#include "callstats.h"
 
 #define GLOBALFLAG_REGKEY           L"SYSTEM\\CurrentControlSet\\Control\\Session Manager"
-#define GLOBALFLAG_VALUENAME        L"GlobalFlag"
 
-#define IMAGE_FILE_OPTIONS          L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Image File Execution Options\\%s"
+#define IMAGE_FILE_OPTIONS_KEY      L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Image File Execution Options"
+
+// Longest key name the registry allows, plus the terminator.
+#define MAX_KEY_NAME                256
+
+// Longest string image option that is read, such as PageHeapTargetDlls.
+#define MAX_STRING_VALUE            1024
+
+// Serializes compare-and-swap between all gflags instances on the machine.
+#define FLAGSTORE_MUTEX             L"Global\\gflags-FlagStore"
+
+#define CACHED_SESSION_MANAGER      0
+#define CACHED_IMAGE_OPTIONS        1
+#define CACHED_KEY_COUNT            2
 
 // reactos/include/ndk/extypes.h
 #define SystemFlagsInformation          9
@@ -43,55 +58,6 @@ typedef struct _SYSTEM_FLAGS_INFORMATION
 } SYSTEM_FLAGS_INFORMATION, *PSYSTEM_FLAGS_INFORMATION;
 
 
-// Table from https://msdn.microsoft.com/en-us/library/windows/hardware/ff549596(v=vs.85).aspx
-
-const FlagInfo g_Flags[] =
-{
-    {FLG_STOP_ON_EXCEPTION, L"soe", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Stop on exception"},
-    {FLG_SHOW_LDR_SNAPS, L"sls", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Show loader snaps"},
-    {FLG_DEBUG_INITIAL_COMMAND, L"dic", (DEST_REGISTRY), L"Debug initial command"},
-    {FLG_STOP_ON_HUNG_GUI, L"shg", (DEST_KERNEL), L"Stop on hung GUI"},
-    {FLG_HEAP_ENABLE_TAIL_CHECK, L"htc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap tail checking"},
-    {FLG_HEAP_ENABLE_FREE_CHECK, L"hfc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap free checking"},
-    {FLG_HEAP_VALIDATE_PARAMETERS, L"hpc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap parameter checking"},
-    {FLG_HEAP_VALIDATE_ALL, L"hvc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap validation on call"},
-    {FLG_APPLICATION_VERIFIER, L"vrf", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable application verifier"},
-    // FLG_MONITOR_SILENT_PROCESS_EXIT
-    {FLG_POOL_ENABLE_TAGGING, L"ptg", (DEST_REGISTRY), L"Enable pool tagging"},
-    {FLG_HEAP_ENABLE_TAGGING, L"htg", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap tagging"},
-    {FLG_USER_STACK_TRACE_DB, L"ust", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Create user mode stack trace database"},
-    {FLG_KERNEL_STACK_TRACE_DB, L"kst", (DEST_REGISTRY), L"Create kernel mode stack trace database"},
-    {FLG_MAINTAIN_OBJECT_TYPELIST, L"otl", (DEST_REGISTRY), L"Maintain a list of objects for each type"},
-    {FLG_HEAP_ENABLE_TAG_BY_DLL, L"htd", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable heap tagging by DLL"},
-    {FLG_DISABLE_STACK_EXTENSION, L"dse", (DEST_IMAGE), L"Disable stack extension"},
-
-    {FLG_ENABLE_CSRDEBUG, L"d32", (DEST_REGISTRY), L"Enable debugging of Win32 subsystem"},
-    {FLG_ENABLE_KDEBUG_SYMBOL_LOAD, L"ksl", (DEST_REGISTRY | DEST_KERNEL), L"Enable loading of kernel debugger symbols"},
-    {FLG_DISABLE_PAGE_KERNEL_STACKS, L"dps", (DEST_REGISTRY), L"Disable paging of kernel stacks"},
-    {FLG_ENABLE_SYSTEM_CRIT_BREAKS, L"scb", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable system critical breaks"},
-    {FLG_HEAP_DISABLE_COALESCING, L"dhc", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Disable heap coalesce on free"},
-    {FLG_ENABLE_CLOSE_EXCEPTIONS, L"ece", (DEST_REGISTRY | DEST_KERNEL), L"Enable close exception"},
-    {FLG_ENABLE_EXCEPTION_LOGGING, L"eel", (DEST_REGISTRY | DEST_KERNEL), L"Enable exception logging"},
-    {FLG_ENABLE_HANDLE_TYPE_TAGGING, L"eot", (DEST_REGISTRY | DEST_KERNEL), L"Enable object handle type tagging"},
-    {FLG_HEAP_PAGE_ALLOCS, L"hpa", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Enable page heap"},
-    {FLG_DEBUG_INITIAL_COMMAND_EX, L"dwl", (DEST_REGISTRY), L"Debug WinLogon"},
-    {FLG_DISABLE_DBGPRINT, L"ddp", (DEST_REGISTRY | DEST_KERNEL), L"Buffer DbgPrint Output"},
-    {FLG_CRITSEC_EVENT_CREATION, L"cse", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Early critical section event creation"},
-    {FLG_STOP_ON_UNHANDLED_EXCEPTION, L"sue", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Stop on unhandled user-mode exception"},
-    {FLG_ENABLE_HANDLE_EXCEPTIONS, L"bhd", (DEST_REGISTRY | DEST_KERNEL), L"Enable bad handles detection"},
-    {FLG_DISABLE_PROTDLLS, L"dpd", (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Disable protected DLL verification"},
-};
-
-//{FLG_MONITOR_SILENT_PROCESS_EXIT, NULL, (DEST_REGISTRY), L"Enable silent process exit monitoring"},
-//{0, NULL, (DEST_REGISTRY | DEST_KERNEL | DEST_IMAGE), L"Object Reference Tracing},
-//{0, L"spp", (DEST_REGISTRY | DEST_KERNEL), Special Pool"},    // kernel only in vista
-
-
-size_t g_FlagCount = sizeof(g_Flags) / sizeof(g_Flags[0]);
-
-DWORD g_ValidRegistryFlags = 0;
-DWORD g_ValidKernelFlags = 0;
-DWORD g_ValidImageFlags = 0;
 DWORD g_PoolTaggingEnabled = 0;
 
 typedef NTSTATUS (NTAPI* tNtQuerySystemInformation)(ULONG SystemInformationClass, PVOID SystemInformation, ULONG InformationLength, PULONG ResultLength);
@@ -124,6 +90,51 @@ struct AutoCloseReg : AutoClose<HKEY, LONG (WINAPI*)(HKEY), RegCloseKey>
     AutoCloseReg( HKEY value ) : AutoClose( value ) {;}
 };
 
+/* The registry and ntdll calls, timed for -stats. */
+static LONG TimedRegOpenKeyExW( HKEY hKey, LPCWSTR lpSubKey, DWORD ulOptions, REGSAM samDesired, PHKEY phkResult )
+{
+    CallTimer Timer(CALLSTAT_REG_OPEN_KEY);
+    return RegOpenKeyExW( hKey, lpSubKey, ulOptions, samDesired, phkResult );
+}
+
+static LONG TimedRegCreateKeyExW( HKEY hKey, LPCWSTR lpSubKey, DWORD Reserved, LPWSTR lpClass, DWORD dwOptions, REGSAM samDesired,
+                                  LPSECURITY_ATTRIBUTES lpSecurityAttributes, PHKEY phkResult, LPDWORD lpdwDisposition )
+{
+    CallTimer Timer(CALLSTAT_REG_CREATE_KEY);
+    return RegCreateKeyExW( hKey, lpSubKey, Reserved, lpClass, dwOptions, samDesired, lpSecurityAttributes, phkResult, lpdwDisposition );
+}
+
+static LONG TimedRegQueryValueExW( HKEY hKey, LPCWSTR lpValueName, LPDWORD lpReserved, LPDWORD lpType, LPBYTE lpData, LPDWORD lpcbData )
+{
+    CallTimer Timer(CALLSTAT_REG_QUERY_VALUE);
+    return RegQueryValueExW( hKey, lpValueName, lpReserved, lpType, lpData, lpcbData );
+}
+
+static LONG TimedRegSetValueExW( HKEY hKey, LPCWSTR lpValueName, DWORD Reserved, DWORD dwType, const BYTE* lpData, DWORD cbData )
+{
+    CallTimer Timer(CALLSTAT_REG_SET_VALUE);
+    return RegSetValueExW( hKey, lpValueName, Reserved, dwType, lpData, cbData );
+}
+
+static LONG TimedRegEnumKeyExW( HKEY hKey, DWORD dwIndex, LPWSTR lpName, LPDWORD lpcchName, LPDWORD lpReserved,
+                                LPWSTR lpClass, LPDWORD lpcchClass, PFILETIME lpftLastWriteTime )
+{
+    CallTimer Timer(CALLSTAT_REG_ENUM_KEY);
+    return RegEnumKeyExW( hKey, dwIndex, lpName, lpcchName, lpReserved, lpClass, lpcchClass, lpftLastWriteTime );
+}
+
+static NTSTATUS TimedNtQuerySystemInformation( ULONG SystemInformationClass, PVOID SystemInformation, ULONG InformationLength, PULONG ResultLength )
+{
+    CallTimer Timer(CALLSTAT_NT_QUERY_SYSTEM_INFO);
+    return g_NtQuerySystemInformation( SystemInformationClass, SystemInformation, InformationLength, ResultLength );
+}
+
+static NTSTATUS TimedNtSetSystemInformation( ULONG SystemInformationClass, PVOID SystemInformation, ULONG SystemInformationLength )
+{
+    CallTimer Timer(CALLSTAT_NT_SET_SYSTEM_INFO);
+    return g_NtSetSystemInformation( SystemInformationClass, SystemInformation, SystemInformationLength );
+}
+
 BOOL InitFunctionPointers()
 {
     if(!g_NtQuerySystemInformation || !g_NtSetSystemInformation || !g_RtlGetVersion)
@@ -136,18 +147,10 @@ BOOL InitFunctionPointers()
     return g_NtQuerySystemInformation && g_NtSetSystemInformation;
 }
 
+/* The masks of valid flags are computed at compile time (flagtable.cpp), only the OS dependent bits are left. */
 void UpdateValidFlags()
 {
-    g_ValidRegistryFlags = 0;
-    g_ValidKernelFlags = 0;
-    g_ValidImageFlags = 0;
-    for( size_t n = 0; n < g_FlagCount; ++n )
-    {
-        g_ValidRegistryFlags |= (g_Flags[n].wDest & DEST_REGISTRY) ? g_Flags[n].dwFlag : 0;
-        g_ValidKernelFlags |= (g_Flags[n].wDest & DEST_KERNEL) ? g_Flags[n].dwFlag : 0;
-        g_ValidImageFlags |= (g_Flags[n].wDest & DEST_IMAGE) ? g_Flags[n].dwFlag : 0;
-    }
-
+    CallTimer Timer(CALLSTAT_UPDATE_VALID_FLAGS);
     if(!InitFunctionPointers())
     {
         return;
@@ -160,11 +163,25 @@ void UpdateValidFlags()
     }
 }
 
+void GetOsVersion( _Out_ ULONG* Major, _Out_ ULONG* Minor, _Out_ ULONG* Build )
+{
+    OSVERSIONINFOW osv = {sizeof(osv), NULL};
+    InitFunctionPointers();
+    if(g_RtlGetVersion)
+    {
+        g_RtlGetVersion(&osv);
+    }
+    *Major = osv.dwMajorVersion;
+    *Minor = osv.dwMinorVersion;
+    *Build = osv.dwBuildNumber;
+}
+
 BOOL EnableDebug()
 {
     static BOOL debugEnabled = FALSE;
     if( !debugEnabled )
     {
+        CallTimer Timer(CALLSTAT_ENABLE_DEBUG);
         HANDLE hToken;
         if( OpenProcessToken( GetCurrentProcess(), TOKEN_QUERY | TOKEN_ADJUST_PRIVILEGES, &hToken ) )
         {
@@ -182,14 +199,177 @@ BOOL EnableDebug()
 }
 
 
-BOOL ReadGlobalFlagsFromRegistry( _Out_ DWORD* Flag )
+/* The real thing: HKLM for the registry / image flags, NtSetSystemInformation for the kernel. */
+class RegistryFlagStore : public FlagStore
+{
+public:
+    RegistryFlagStore();
+    ~RegistryFlagStore();
+
+    virtual BOOL ReadGlobalFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteGlobalFlags( _In_ ULONG Flag );
+
+    virtual BOOL ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value );
+    virtual BOOL WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value );
+    virtual BOOL DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName );
+    virtual BOOL EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context );
+    virtual BOOL HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists );
+
+    virtual BOOL ReadImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ std::wstring* Value );
+    virtual BOOL WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value );
+    virtual BOOL HasImageStrings() { return TRUE; }
+
+    virtual BOOL ReadKernelFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteKernelFlags( _In_ ULONG Flag );
+
+    virtual BOOL GetChangeStamp( _Out_ ULONG* Stamp );
+
+    virtual BOOL Lock();
+    virtual void Unlock();
+
+private:
+    LONG GetKey( _In_ int Which, _In_ BOOL Write, _Out_ HKEY* Key );
+    BOOL WatchImageOptions();
+
+    HANDLE m_Mutex;
+
+    /* Signaled by RegNotifyChangeKeyValue when anything below the IFEO key changes. */
+    HANDLE m_Changed;
+    ULONG m_ChangeStamp;
+
+    /* Opened on first use and kept, so a series of changes does not reopen them. */
+    HKEY m_Keys[CACHED_KEY_COUNT][2];
+};
+
+static PCWSTR g_CachedKeyNames[CACHED_KEY_COUNT] = { GLOBALFLAG_REGKEY, IMAGE_FILE_OPTIONS_KEY };
+
+FlagStore* GetRegistryFlagStore()
+{
+    static RegistryFlagStore Store;
+    return &Store;
+}
+
+RegistryFlagStore::RegistryFlagStore()
+    : m_Mutex(NULL)
+    , m_Changed(NULL)
+    , m_ChangeStamp(0)
+{
+    ZeroMemory(m_Keys, sizeof(m_Keys));
+}
+
+RegistryFlagStore::~RegistryFlagStore()
+{
+    for(int n = 0; n < CACHED_KEY_COUNT; ++n)
+    {
+        for(int w = 0; w < 2; ++w)
+        {
+            if(m_Keys[n][w])
+            {
+                RegCloseKey(m_Keys[n][w]);
+            }
+        }
+    }
+    if(m_Mutex)
+    {
+        CloseHandle(m_Mutex);
+    }
+    if(m_Changed)
+    {
+        CloseHandle(m_Changed);
+    }
+}
+
+/*
+ * Registry transactions (KTM) would not help here: transacted reads take no
+ * lock, so two jobs can still read the same value and overwrite each other.
+ * A machine wide mutex around the re-read and write does close that window.
+ */
+BOOL RegistryFlagStore::Lock()
+{
+    if(!m_Mutex)
+    {
+        m_Mutex = CreateMutexW(NULL, FALSE, FLAGSTORE_MUTEX);
+        if(!m_Mutex)
+        {
+            return FALSE;
+        }
+    }
+    DWORD Wait = WaitForSingleObject(m_Mutex, INFINITE);
+    return Wait == WAIT_OBJECT_0 || Wait == WAIT_ABANDONED;
+}
+
+void RegistryFlagStore::Unlock()
+{
+    ReleaseMutex(m_Mutex);
+}
+
+BOOL RegistryFlagStore::WatchImageOptions()
 {
     HKEY hKey;
-    if(EnableDebug() && ERROR_SUCCESS == RegOpenKeyExW( HKEY_LOCAL_MACHINE, GLOBALFLAG_REGKEY, 0, KEY_READ, &hKey ) )
+    if( ERROR_SUCCESS != GetKey( CACHED_IMAGE_OPTIONS, FALSE, &hKey ) )
+    {
+        return FALSE;
+    }
+    return ERROR_SUCCESS == RegNotifyChangeKeyValue( hKey, TRUE, REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET, m_Changed, TRUE );
+}
+
+/*
+ * The notification is re-armed each time it fired. It is tied to the thread
+ * that armed it, when that thread exits the event fires once more.
+ */
+BOOL RegistryFlagStore::GetChangeStamp( _Out_ ULONG* Stamp )
+{
+    *Stamp = m_ChangeStamp;
+    if(!m_Changed)
+    {
+        m_Changed = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if(!m_Changed || !WatchImageOptions())
+        {
+            return FALSE;
+        }
+    }
+    if(WaitForSingleObject(m_Changed, 0) == WAIT_OBJECT_0)
+    {
+        ResetEvent(m_Changed);
+        *Stamp = ++m_ChangeStamp;
+        if(!WatchImageOptions())
+        {
+            CloseHandle(m_Changed);
+            m_Changed = NULL;
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+LONG RegistryFlagStore::GetKey( _In_ int Which, _In_ BOOL Write, _Out_ HKEY* Key )
+{
+    *Key = NULL;
+    if(!EnableDebug())
+    {
+        return ERROR_ACCESS_DENIED;
+    }
+    if(!m_Keys[Which][Write])
+    {
+        LONG lRet = TimedRegOpenKeyExW( HKEY_LOCAL_MACHINE, g_CachedKeyNames[Which], 0, Write ? KEY_WRITE : KEY_READ, &m_Keys[Which][Write] );
+        if( ERROR_SUCCESS != lRet )
+        {
+            m_Keys[Which][Write] = NULL;
+            return lRet;
+        }
+    }
+    *Key = m_Keys[Which][Write];
+    return ERROR_SUCCESS;
+}
+
+BOOL RegistryFlagStore::ReadGlobalFlags( _Out_ ULONG* Flag )
+{
+    CallTimer Timer(CALLSTAT_READ_GLOBAL_FLAGS);
+    HKEY hKey;
+    if( ERROR_SUCCESS == GetKey( CACHED_SESSION_MANAGER, FALSE, &hKey ) )
     {
-        AutoCloseReg raii(hKey);
         DWORD Type = 0, cbData = sizeof(*Flag);
-        if( ERROR_SUCCESS == RegQueryValueExW( hKey, GLOBALFLAG_VALUENAME, NULL, &Type, (LPBYTE)Flag, &cbData ) && Type == REG_DWORD )
+        if( ERROR_SUCCESS == TimedRegQueryValueExW( hKey, GLOBALFLAG_VALUENAME, NULL, &Type, (LPBYTE)Flag, &cbData ) && Type == REG_DWORD )
         {
             return TRUE;
         }
@@ -197,13 +377,13 @@ BOOL ReadGlobalFlagsFromRegistry( _Out_ DWORD* Flag )
     return FALSE;
 }
 
-BOOL WriteGlobalFlagsToRegistry( _In_ DWORD Flag )
+BOOL RegistryFlagStore::WriteGlobalFlags( _In_ ULONG Flag )
 {
+    CallTimer Timer(CALLSTAT_WRITE_GLOBAL_FLAGS);
     HKEY hKey;
-    if(EnableDebug() && ERROR_SUCCESS == RegOpenKeyExW( HKEY_LOCAL_MACHINE, GLOBALFLAG_REGKEY, 0, KEY_WRITE, &hKey ) )
+    if( ERROR_SUCCESS == GetKey( CACHED_SESSION_MANAGER, TRUE, &hKey ) )
     {
-        AutoCloseReg raii(hKey);
-        if( ERROR_SUCCESS == RegSetValueExW( hKey, GLOBALFLAG_VALUENAME, NULL, REG_DWORD, (LPBYTE)&Flag, sizeof(Flag) ) )
+        if( ERROR_SUCCESS == TimedRegSetValueExW( hKey, GLOBALFLAG_VALUENAME, NULL, REG_DWORD, (LPBYTE)&Flag, sizeof(Flag) ) )
         {
             return TRUE;
         }
@@ -211,48 +391,44 @@ BOOL WriteGlobalFlagsToRegistry( _In_ DWORD Flag )
     return FALSE;
 }
 
-BOOL ReadImageGlobalFlagsFromRegistry( _In_z_ PCWSTR ImageName, _Out_ ULONG* Flag )
+BOOL RegistryFlagStore::ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value )
 {
-    HKEY hKey;
-    WCHAR FullKey[260];
-    if(!ImageName || !ImageName[0])
+    CallTimer Timer(CALLSTAT_READ_IMAGE_VALUE);
+    HKEY hParent, hKey;
+    LONG lRet = GetKey( CACHED_IMAGE_OPTIONS, FALSE, &hParent );
+    if( ERROR_SUCCESS == lRet )
     {
-        *Flag = 0;
-        return TRUE;
+        lRet = TimedRegOpenKeyExW( hParent, ImageName, 0, KEY_QUERY_VALUE, &hKey );
     }
-    StringCchPrintfW(FullKey, 260, IMAGE_FILE_OPTIONS, ImageName);
-    if(EnableDebug())
+    if( ERROR_SUCCESS == lRet )
     {
-        LONG lRet = RegOpenKeyExW( HKEY_LOCAL_MACHINE, FullKey, 0, KEY_READ, &hKey );
-        if( ERROR_SUCCESS == lRet )
-        {
-            AutoCloseReg raii(hKey);
-            DWORD Type = 0, cbData = sizeof(*Flag);
-            if( ERROR_SUCCESS == RegQueryValueExW( hKey, GLOBALFLAG_VALUENAME, NULL, &Type, (LPBYTE)Flag, &cbData ) && Type == REG_DWORD )
-            {
-                return TRUE;
-            }
-        }
-        else if(ERROR_FILE_NOT_FOUND == lRet)
+        AutoCloseReg raii(hKey);
+        DWORD Type = 0, cbData = sizeof(*Value);
+        lRet = TimedRegQueryValueExW( hKey, ValueName, NULL, &Type, (LPBYTE)Value, &cbData );
+        if( ERROR_SUCCESS == lRet && Type == REG_DWORD )
         {
-            *Flag = 0;
             return TRUE;
         }
     }
+    if(ERROR_FILE_NOT_FOUND == lRet)
+    {
+        *Value = 0;
+        return TRUE;
+    }
     return FALSE;
 }
 
-BOOL WriteImageGlobalFlagsToRegistry( _In_z_ PCWSTR ImageName,_In_ ULONG Flag )
+BOOL RegistryFlagStore::WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
 {
-    HKEY hKey;
-    WCHAR FullKey[260];
-    StringCchPrintfW(FullKey, 260, IMAGE_FILE_OPTIONS, ImageName);
+    CallTimer Timer(CALLSTAT_WRITE_IMAGE_VALUE);
+    HKEY hParent, hKey;
     DWORD dwDisposition = 0;
-    if(EnableDebug() && ERROR_SUCCESS == RegCreateKeyExW( HKEY_LOCAL_MACHINE, FullKey, 0, 0, 0, KEY_WRITE, NULL, &hKey, &dwDisposition ))
+    if( ERROR_SUCCESS == GetKey( CACHED_IMAGE_OPTIONS, TRUE, &hParent ) &&
+        ERROR_SUCCESS == TimedRegCreateKeyExW( hParent, ImageName, 0, 0, 0, KEY_SET_VALUE, NULL, &hKey, &dwDisposition ))
     {
         AutoCloseReg raii(hKey);
         //dwDisposition == REG_CREATED_NEW_KEY || REG_OPENED_EXISTING_KEY;
-        if( ERROR_SUCCESS == RegSetValueExW( hKey, GLOBALFLAG_VALUENAME, NULL, REG_DWORD, (LPBYTE)&Flag, sizeof(Flag) ) )
+        if( ERROR_SUCCESS == TimedRegSetValueExW( hKey, ValueName, NULL, REG_DWORD, (LPBYTE)&Value, sizeof(Value) ) )
         {
             return TRUE;
         }
@@ -261,8 +437,145 @@ BOOL WriteImageGlobalFlagsToRegistry( _In_z_ PCWSTR ImageName,_In_ ULONG Flag )
 
 }
 
-BOOL ReadGlobalFlagsFromKernel( _Out_ DWORD* Flag )
+BOOL RegistryFlagStore::HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists )
+{
+    HKEY hParent, hKey;
+    *Exists = FALSE;
+    LONG lRet = GetKey( CACHED_IMAGE_OPTIONS, FALSE, &hParent );
+    if( ERROR_SUCCESS == lRet )
+    {
+        lRet = TimedRegOpenKeyExW( hParent, ImageName, 0, KEY_QUERY_VALUE, &hKey );
+    }
+    if( ERROR_SUCCESS == lRet )
+    {
+        AutoCloseReg raii(hKey);
+        *Exists = TRUE;
+    }
+    return ERROR_SUCCESS == lRet || ERROR_FILE_NOT_FOUND == lRet;
+}
+
+BOOL RegistryFlagStore::DeleteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName )
+{
+    CallTimer Timer(CALLSTAT_DELETE_IMAGE_VALUE);
+    HKEY hParent, hKey;
+    LONG lRet = GetKey( CACHED_IMAGE_OPTIONS, TRUE, &hParent );
+    if( ERROR_SUCCESS == lRet )
+    {
+        lRet = TimedRegOpenKeyExW( hParent, ImageName, 0, KEY_SET_VALUE, &hKey );
+    }
+    if( ERROR_SUCCESS == lRet )
+    {
+        AutoCloseReg raii(hKey);
+        lRet = RegDeleteValueW( hKey, ValueName );
+    }
+    return ERROR_SUCCESS == lRet || ERROR_FILE_NOT_FOUND == lRet;
+}
+
+BOOL RegistryFlagStore::ReadImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ std::wstring* Value )
+{
+    CallTimer Timer(CALLSTAT_READ_IMAGE_STRING);
+    HKEY hParent, hKey;
+    Value->clear();
+    LONG lRet = GetKey( CACHED_IMAGE_OPTIONS, FALSE, &hParent );
+    if( ERROR_SUCCESS == lRet )
+    {
+        lRet = TimedRegOpenKeyExW( hParent, ImageName, 0, KEY_QUERY_VALUE, &hKey );
+    }
+    if( ERROR_SUCCESS == lRet )
+    {
+        AutoCloseReg raii(hKey);
+        std::vector<WCHAR> Buffer(MAX_STRING_VALUE);
+        DWORD Type = 0, cbData;
+        do
+        {
+            /* Lists like USTEnabled outgrow any fixed buffer, ERROR_MORE_DATA tells the size needed. */
+            cbData = (DWORD)((Buffer.size() - 1) * sizeof(WCHAR));
+            lRet = TimedRegQueryValueExW( hKey, ValueName, NULL, &Type, (LPBYTE)&Buffer[0], &cbData );
+            if( ERROR_MORE_DATA == lRet )
+            {
+                Buffer.resize(cbData / sizeof(WCHAR) + 2);
+            }
+        } while( ERROR_MORE_DATA == lRet );
+        if( ERROR_SUCCESS == lRet && (Type == REG_SZ || Type == REG_EXPAND_SZ) )
+        {
+            /* The stored string does not have to be terminated. */
+            Buffer[cbData / sizeof(WCHAR)] = L'\0';
+            *Value = &Buffer[0];
+            return TRUE;
+        }
+    }
+    return ERROR_FILE_NOT_FOUND == lRet;
+}
+
+BOOL RegistryFlagStore::WriteImageString( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_z_ PCWSTR Value )
+{
+    CallTimer Timer(CALLSTAT_WRITE_IMAGE_STRING);
+    HKEY hParent, hKey;
+    DWORD dwDisposition = 0;
+    if( ERROR_SUCCESS == GetKey( CACHED_IMAGE_OPTIONS, TRUE, &hParent ) &&
+        ERROR_SUCCESS == TimedRegCreateKeyExW( hParent, ImageName, 0, 0, 0, KEY_SET_VALUE, NULL, &hKey, &dwDisposition ))
+    {
+        AutoCloseReg raii(hKey);
+        DWORD cbData = (DWORD)((wcslen(Value) + 1) * sizeof(WCHAR));
+        return ERROR_SUCCESS == TimedRegSetValueExW( hKey, ValueName, NULL, REG_SZ, (const BYTE*)Value, cbData );
+    }
+    return FALSE;
+}
+
+BOOL RegistryFlagStore::EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context )
+{
+    CallTimer Timer(CALLSTAT_ENUM_IMAGE_VALUES);
+    HKEY hParent;
+    LONG lRet = GetKey( CACHED_IMAGE_OPTIONS, FALSE, &hParent );
+    if( ERROR_FILE_NOT_FOUND == lRet )
+    {
+        return TRUE;
+    }
+    if( ERROR_SUCCESS != lRet )
+    {
+        return FALSE;
+    }
+    for(DWORD Index = 0; ; ++Index)
+    {
+        WCHAR Name[MAX_KEY_NAME];
+        DWORD cchName = MAX_KEY_NAME;
+        lRet = TimedRegEnumKeyExW( hParent, Index, Name, &cchName, NULL, NULL, NULL, NULL );
+        if( ERROR_NO_MORE_ITEMS == lRet )
+        {
+            return TRUE;
+        }
+        if( ERROR_SUCCESS != lRet )
+        {
+            return FALSE;
+        }
+        if( !ValueName )
+        {
+            if( !Callback(Name, 0, Context) )
+            {
+                return TRUE;
+            }
+            continue;
+        }
+
+        HKEY hKey;
+        if( ERROR_SUCCESS != TimedRegOpenKeyExW( hParent, Name, 0, KEY_QUERY_VALUE, &hKey ) )
+        {
+            continue;
+        }
+        AutoCloseReg raiiKey(hKey);
+        ULONG Value = 0;
+        DWORD Type = 0, cbData = sizeof(Value);
+        if( ERROR_SUCCESS == TimedRegQueryValueExW( hKey, ValueName, NULL, &Type, (LPBYTE)&Value, &cbData ) &&
+            Type == REG_DWORD && !Callback(Name, Value, Context) )
+        {
+            return TRUE;
+        }
+    }
+}
+
+BOOL RegistryFlagStore::ReadKernelFlags( _Out_ ULONG* Flag )
 {
+    CallTimer Timer(CALLSTAT_READ_KERNEL_FLAGS);
     if(InitFunctionPointers())
     {
         ULONG Length = 0;
@@ -270,7 +583,7 @@ BOOL ReadGlobalFlagsFromKernel( _Out_ DWORD* Flag )
         sfi.Flags = 0;
         assert(sizeof(SYSTEM_FLAGS_INFORMATION) == 4);
         assert(sizeof(sfi) == 4);
-        if(SUCCEEDED(g_NtQuerySystemInformation(SystemFlagsInformation, &sfi, sizeof(sfi), &Length)) && Length == sizeof(sfi))
+        if(SUCCEEDED(TimedNtQuerySystemInformation(SystemFlagsInformation, &sfi, sizeof(sfi), &Length)) && Length == sizeof(sfi))
         {
             *Flag = sfi.Flags;
             return TRUE;
@@ -279,8 +592,9 @@ BOOL ReadGlobalFlagsFromKernel( _Out_ DWORD* Flag )
     return FALSE;
 }
 
-BOOL WriteGlobalFlagsToKernel( _In_ DWORD Flag )
+BOOL RegistryFlagStore::WriteKernelFlags( _In_ ULONG Flag )
 {
+    CallTimer Timer(CALLSTAT_WRITE_KERNEL_FLAGS);
     if(InitFunctionPointers())
     {
         SYSTEM_FLAGS_INFORMATION sfi = {0};
@@ -289,7 +603,7 @@ BOOL WriteGlobalFlagsToKernel( _In_ DWORD Flag )
         {
             sfi.Flags |= FLG_POOL_ENABLE_TAGGING;
         }
-        return SUCCEEDED(g_NtSetSystemInformation(SystemFlagsInformation, &sfi, sizeof(sfi)));
+        return SUCCEEDED(TimedNtSetSystemInformation(SystemFlagsInformation, &sfi, sizeof(sfi)));
     }
     return FALSE;
 }
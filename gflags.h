@@ -24,6 +24,8 @@
 
 #pragma once
 
+#include "platform.h"
+
 #define FLG_STOP_ON_EXCEPTION               0x1
 #define FLG_SHOW_LDR_SNAPS                  0x2
 #define FLG_DEBUG_INITIAL_COMMAND           0x4
@@ -58,12 +60,21 @@
 #define FLG_DISABLE_PROTDLLS                0x80000000
 
 
+/* How much a flag slows a process down (CPU) or makes it grow (memory). */
+#define COST_NONE           0
+#define COST_LOW            1       /* about a tenth */
+#define COST_MEDIUM         2       /* about half again */
+#define COST_HIGH           3       /* a few times */
+#define COST_EXTREME        4       /* an order of magnitude */
+
 struct FlagInfo
 {
     DWORD dwFlag;
     const wchar_t* szAbbr;
     WORD wDest;
     const wchar_t* szDesc;
+    BYTE bCpuCost;
+    BYTE bMemoryCost;
 };
 
 #define DEST_REGISTRY       1
@@ -71,29 +82,83 @@ struct FlagInfo
 #define DEST_IMAGE          4
 
 
-extern const FlagInfo g_Flags[];
-extern size_t g_FlagCount;
+extern GFLAGS_API const FlagInfo* const g_Flags;
+extern GFLAGS_API const size_t g_FlagCount;
 
-extern DWORD g_ValidRegistryFlags;
-extern DWORD g_ValidKernelFlags;
-extern DWORD g_ValidImageFlags;
-extern DWORD g_PoolTaggingEnabled;
+extern GFLAGS_API const DWORD g_ValidRegistryFlags;
+extern GFLAGS_API const DWORD g_ValidKernelFlags;
+extern GFLAGS_API const DWORD g_ValidImageFlags;
+extern GFLAGS_API DWORD g_PoolTaggingEnabled;
 
-void UpdateValidFlags();
-BOOL EnableDebug();
+/* Case insensitive abbreviation lookup, NULL when Abbr is not a known flag. */
+GFLAGS_API const FlagInfo* FindFlag( _In_z_ PCWSTR Abbr );
 
-BOOL ReadGlobalFlagsFromRegistry( _Out_ ULONG* Flag );
-BOOL WriteGlobalFlagsToRegistry( _In_ ULONG Flag );
+/*
+ * The estimated overhead of a set of flags, in percent of the process without
+ * them, so 100 is none. The costs of the flags are multiplied, this is meant
+ * to warn about expensive combinations, not to predict a number.
+ * PageHeapFlags is the PageHeapFlags value hpa runs with: light page heap, or
+ * full page heap limited to some allocations, costs far less than full page
+ * heap for everything, which is what the value of system wide flags means.
+ */
+struct FlagCost
+{
+    ULONG CpuPercent;
+    ULONG MemoryPercent;
+};
 
-BOOL ReadImageGlobalFlagsFromRegistry( _In_z_ PCWSTR ImageName, _Out_ ULONG* Flag );
-BOOL WriteImageGlobalFlagsToRegistry( _In_z_ PCWSTR ImageName,_In_ ULONG Flag );
+GFLAGS_API void EstimateFlagCost( _In_ ULONG Flags, _In_ ULONG PageHeapFlags, _Out_ FlagCost* Cost );
 
-BOOL ReadGlobalFlagsFromKernel( _Out_ ULONG* Flag );
-BOOL WriteGlobalFlagsToKernel( _In_ ULONG Flag );
+/*
+ * A compiled flag expression such as '+hpa+htc-ust', '=(soe|sls)' or '^0x10'.
+ * Applying it is ((Flags & And) | Or) ^ Xor, so one edit can be applied to
+ * any number of values without parsing the expression again.
+ */
+struct FlagEdit
+{
+    ULONG And;
+    ULONG Or;
+    ULONG Xor;
+};
 
+GFLAGS_API void InitFlagEdit( _Out_ FlagEdit* Edit );
+GFLAGS_API BOOL CompileFlagEdit( _In_z_ PCWSTR Expression, _Inout_ FlagEdit* Edit );
+GFLAGS_API void CombineFlagEdit( _Inout_ FlagEdit* Edit, _In_ const FlagEdit* Then );
+GFLAGS_API ULONG ApplyFlagEdit( _In_ const FlagEdit* Edit, _In_ ULONG Flags );
 
+GFLAGS_API void UpdateValidFlags();
+GFLAGS_API void GetOsVersion( _Out_ ULONG* Major, _Out_ ULONG* Minor, _Out_ ULONG* Build );
+GFLAGS_API BOOL EnableDebug();
 
-void ParseCommandline(int argc, PCWSTR argv[]);
+GFLAGS_API BOOL ReadGlobalFlagsFromRegistry( _Out_ ULONG* Flag );
+GFLAGS_API BOOL WriteGlobalFlagsToRegistry( _In_ ULONG Flag );
+
+GFLAGS_API BOOL ReadImageGlobalFlagsFromRegistry( _In_z_ PCWSTR ImageName, _Out_ ULONG* Flag );
+GFLAGS_API BOOL WriteImageGlobalFlagsToRegistry( _In_z_ PCWSTR ImageName,_In_ ULONG Flag );
+
+/* Called once per image, return FALSE to stop the enumeration. */
+typedef BOOL (*ImageValueCallback)( _In_z_ PCWSTR ImageName, _In_ ULONG Value, _In_opt_ PVOID Context );
+GFLAGS_API BOOL EnumImageGlobalFlagsFromRegistry( _In_ ImageValueCallback Callback, _In_opt_ PVOID Context );
+
+GFLAGS_API BOOL ReadGlobalFlagsFromKernel( _Out_ ULONG* Flag );
+GFLAGS_API BOOL WriteGlobalFlagsToKernel( _In_ ULONG Flag );
+
+GFLAGS_API void MaskFlags( DWORD ActiveDest, DWORD ActiveFlags, PDWORD ApplyFlags, PDWORD IgnoredFlags);
+
+
+struct FlagStore;
+
+/*
+ * Runs a gflags command line in the calling process and returns its exit code,
+ * or COMMANDLINE_SHOW_UI when no command was given. A store selected with
+ * -store / -hive is returned in *OpenedStore and owned by the caller. Flags
+ * whose TTL expired are reverted first for the commands that write and for the
+ * UI, unless the store is an offline hive or Wine prefix.
+ */
+#define COMMANDLINE_SHOW_UI     (-1)
+GFLAGS_API int ParseCommandline( int argc, PCWSTR argv[], _Out_ FlagStore** OpenedStore );
+GFLAGS_API void PrintFlags(FILE* dst, ULONG Flags, DWORD Dest, ULONG PageHeapFlags);
+GFLAGS_API void PrintUsage(FILE* dst);
 int ShowDialog();
 
 
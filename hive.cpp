@@ -0,0 +1,653 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "hive.h"
+#include "hiveformat.h"
+
+#define MAX_LIST_DEPTH          2
+
+/* Compare a name stored in the hive against Str without copying it out, ignoring case. */
+int NameCompare( _In_ const BYTE* Name, _In_ size_t NameBytes, _In_ BOOL Compressed, _In_ PCWSTR Str, _In_ size_t StrLength )
+{
+    size_t Length = Compressed ? NameBytes : NameBytes / 2;
+    for(size_t n = 0; n < Length && n < StrLength; ++n)
+    {
+        WCHAR Left = towupper(NameChar(Name, Compressed, n));
+        WCHAR Right = towupper(Str[n]);
+        if(Left != Right)
+        {
+            return Left < Right ? -1 : 1;
+        }
+    }
+    return (Length == StrLength) ? 0 : (Length < StrLength) ? -1 : 1;
+}
+
+BOOL NameEquals( _In_ const BYTE* Name, _In_ size_t NameBytes, _In_ BOOL Compressed, _In_ PCWSTR Str, _In_ size_t StrLength )
+{
+    if((Compressed ? NameBytes : NameBytes / 2) != StrLength)
+    {
+        return FALSE;
+    }
+    return !NameCompare(Name, NameBytes, Compressed, Str, StrLength);
+}
+
+ULONG BaseBlockChecksum( _In_ const BYTE* Base )
+{
+    ULONG Checksum = 0;
+    for(ULONG n = 0; n < REGF_CHECKSUM_OFFSET; n += 4)
+    {
+        Checksum ^= Read32(Base + n);
+    }
+    return (Checksum == 0) ? 1 : (Checksum == 0xffffffff) ? 0xfffffffe : Checksum;
+}
+
+/* Hash used by 'lh' lists. */
+ULONG NameHash( _In_ PCWSTR Name, _In_ size_t Length )
+{
+    ULONG Hash = 0;
+    for(size_t n = 0; n < Length; ++n)
+    {
+        Hash = Hash * 37 + (ULONG)towupper(Name[n]);
+    }
+    return Hash;
+}
+
+
+RegistryHive::RegistryHive()
+    : m_Base(NULL)
+    , m_Bins(NULL)
+    , m_MappedSize(0)
+    , m_BinsSize(0)
+    , m_RootKey(HIVE_INVALID_CELL)
+    , m_Dirty(FALSE)
+    , m_LogValid(FALSE)
+    , m_LogSequence(0)
+    , m_LogEnd(0)
+{
+}
+
+BOOL RegistryHive::Open( _In_z_ PCWSTR FileName, _In_ BOOL Private )
+{
+    Close();
+    if(!m_File.Open(FileName, Private) || m_File.Size() < REGF_BASE_BLOCK_SIZE)
+    {
+        Close();
+        return FALSE;
+    }
+
+    const BYTE* Base = m_File.Data();
+    ULONG BinsSize = Read32(Base + REGF_BINS_SIZE);
+    if(Read32(Base) != REGF_SIGNATURE || Read32(Base + REGF_MAJOR_VERSION) != 1 ||
+       BaseBlockChecksum(Base) != Read32(Base + REGF_CHECKSUM_OFFSET) ||
+       (BinsSize % HIVE_PAGE_SIZE) || BinsSize > m_File.Size() - REGF_BASE_BLOCK_SIZE)
+    {
+        Close();
+        return FALSE;
+    }
+
+    m_Dirty = Read32(Base + REGF_SEQUENCE1) != Read32(Base + REGF_SEQUENCE2);
+    if(m_Dirty && !Private)
+    {
+        /* Replaying the log needs a view we can modify. */
+        return Open(FileName, TRUE);
+    }
+
+    m_FileName = FileName;
+    m_Base = m_File.PrivateData();
+    m_Bins = (BYTE*)Base + REGF_BASE_BLOCK_SIZE;
+    m_MappedSize = m_BinsSize = BinsSize;
+    if(m_Dirty)
+    {
+        /* Without a usable log the primary file is the best we have. */
+        ReplayLog();
+    }
+
+    m_RootKey = Read32(Base + REGF_ROOT_CELL);
+    if(!GetKeyNode(m_RootKey))
+    {
+        Close();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void RegistryHive::Close()
+{
+    m_File.Close();
+    m_FileName.clear();
+    m_Base = NULL;
+    m_Bins = NULL;
+    m_MappedSize = 0;
+    m_BinsSize = 0;
+    m_Extents.clear();
+    m_DirtyPages.clear();
+    m_RootKey = HIVE_INVALID_CELL;
+    m_Dirty = FALSE;
+    m_LogValid = FALSE;
+    m_LogSequence = 0;
+    m_LogEnd = 0;
+}
+
+/* Resolves a range of the hive bins, either in the mapping or in an appended extent. */
+BYTE* RegistryHive::GetBinData( _In_ ULONG Offset, _In_ ULONG Length ) const
+{
+    if(Offset >= m_BinsSize || Length > m_BinsSize - Offset)
+    {
+        return NULL;
+    }
+    if(Offset + Length <= m_MappedSize)
+    {
+        return m_Bins + Offset;
+    }
+    for(std::deque<Extent>::const_iterator it = m_Extents.begin(); it != m_Extents.end(); ++it)
+    {
+        if(Offset >= it->Offset && Offset + Length <= it->Offset + it->Data.size())
+        {
+            return (BYTE*)&it->Data[Offset - it->Offset];
+        }
+    }
+    return NULL;
+}
+
+BOOL RegistryHive::GrowBins( _In_ ULONG BinsSize )
+{
+    if(BinsSize > m_BinsSize)
+    {
+        Extent NewExtent;
+        NewExtent.Offset = m_BinsSize;
+        m_Extents.push_back(NewExtent);
+        m_Extents.back().Data.resize(BinsSize - m_BinsSize);
+        m_BinsSize = BinsSize;
+    }
+    return TRUE;
+}
+
+/* Returns the data of an allocated cell, or NULL when the offset does not point to one. */
+const BYTE* RegistryHive::GetCell( _In_ ULONG Offset, _Out_ ULONG* Size ) const
+{
+    *Size = 0;
+    const BYTE* Cell = (Offset & 7) ? NULL : GetBinData(Offset, 8);
+    if(!Cell)
+    {
+        return NULL;
+    }
+    LONG CellSize = (LONG)Read32(Cell);
+    if(CellSize > -8 || !GetBinData(Offset, (ULONG)-CellSize))
+    {
+        return NULL;
+    }
+    *Size = (ULONG)-CellSize - 4;
+    return Cell + 4;
+}
+
+const BYTE* RegistryHive::GetKeyNode( _In_ ULONG Offset ) const
+{
+    ULONG Size;
+    const BYTE* Node = GetCell(Offset, &Size);
+    if(!Node || Size < NK_NAME || Read16(Node) != CELL_NK || NK_NAME + (ULONG)Read16(Node + NK_NAME_LENGTH) > Size)
+    {
+        return NULL;
+    }
+    return Node;
+}
+
+LONG RegistryHive::FindInList( _In_ ULONG List, _In_ PCWSTR Name, _In_ size_t NameLength, _In_ ULONG Hash, _In_ int Depth, _Out_ ULONG* SubKey ) const
+{
+    ULONG Size;
+    const BYTE* Cell = GetCell(List, &Size);
+    if(!Cell || Size < 4)
+    {
+        return ERROR_BADDB;
+    }
+    WORD Signature = Read16(Cell);
+    ULONG Count = Read16(Cell + 2);
+    ULONG Stride = (Signature == CELL_LF || Signature == CELL_LH) ? 8 : 4;
+    if(4 + Count * Stride > Size)
+    {
+        return ERROR_BADDB;
+    }
+
+    for(ULONG n = 0; n < Count; ++n)
+    {
+        const BYTE* Entry = Cell + 4 + n * Stride;
+        ULONG Offset = Read32(Entry);
+        if(Signature == CELL_RI)
+        {
+            if(Depth >= MAX_LIST_DEPTH)
+            {
+                return ERROR_BADDB;
+            }
+            LONG Result = FindInList(Offset, Name, NameLength, Hash, Depth + 1, SubKey);
+            if(Result != ERROR_FILE_NOT_FOUND)
+            {
+                return Result;
+            }
+            continue;
+        }
+        if(Signature == CELL_LH && Read32(Entry + 4) != Hash)
+        {
+            continue;
+        }
+        if(Signature != CELL_LF && Signature != CELL_LH && Signature != CELL_LI)
+        {
+            return ERROR_BADDB;
+        }
+        const BYTE* Node = GetKeyNode(Offset);
+        if(!Node)
+        {
+            return ERROR_BADDB;
+        }
+        if(NameEquals(Node + NK_NAME, Read16(Node + NK_NAME_LENGTH), Read16(Node + NK_FLAGS) & KEY_COMP_NAME, Name, NameLength))
+        {
+            *SubKey = Offset;
+            return ERROR_SUCCESS;
+        }
+    }
+    return ERROR_FILE_NOT_FOUND;
+}
+
+LONG RegistryHive::FindSubKey( _In_ ULONG Key, _In_ PCWSTR Name, _In_ size_t NameLength, _Out_ ULONG* SubKey ) const
+{
+    const BYTE* Node = GetKeyNode(Key);
+    if(!Node)
+    {
+        return ERROR_BADDB;
+    }
+    if(!Read32(Node + NK_SUBKEY_COUNT))
+    {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    return FindInList(Read32(Node + NK_SUBKEY_LIST), Name, NameLength, NameHash(Name, NameLength), 0, SubKey);
+}
+
+LONG RegistryHive::OpenKey( _In_ ULONG Key, _In_z_ PCWSTR Path, _Out_ ULONG* SubKey ) const
+{
+    *SubKey = HIVE_INVALID_CELL;
+    while(*Path)
+    {
+        PCWSTR End = wcschr(Path, L'\\');
+        size_t Length = End ? (size_t)(End - Path) : wcslen(Path);
+        if(Length)
+        {
+            LONG Result = FindSubKey(Key, Path, Length, &Key);
+            if(Result != ERROR_SUCCESS)
+            {
+                return Result;
+            }
+        }
+        Path += Length + (End ? 1 : 0);
+    }
+    *SubKey = Key;
+    return ERROR_SUCCESS;
+}
+
+/* Walks a subkey list in hive order, without looking up each key by name again. */
+LONG RegistryHive::EnumList( _In_ ULONG List, _In_ int Depth, _In_ SubKeyCallback Callback, _In_opt_ PVOID Context ) const
+{
+    ULONG Size;
+    const BYTE* Cell = GetCell(List, &Size);
+    if(!Cell || Size < 4)
+    {
+        return ERROR_BADDB;
+    }
+    WORD Signature = Read16(Cell);
+    ULONG Count = Read16(Cell + 2);
+    ULONG Stride = (Signature == CELL_LF || Signature == CELL_LH) ? 8 : 4;
+    if(4 + Count * Stride > Size)
+    {
+        return ERROR_BADDB;
+    }
+
+    for(ULONG n = 0; n < Count; ++n)
+    {
+        ULONG Offset = Read32(Cell + 4 + n * Stride);
+        if(Signature == CELL_RI)
+        {
+            if(Depth >= MAX_LIST_DEPTH)
+            {
+                return ERROR_BADDB;
+            }
+            LONG Result = EnumList(Offset, Depth + 1, Callback, Context);
+            if(Result != ERROR_SUCCESS)
+            {
+                return Result;
+            }
+            continue;
+        }
+        if(Signature != CELL_LF && Signature != CELL_LH && Signature != CELL_LI)
+        {
+            return ERROR_BADDB;
+        }
+        const BYTE* Node = GetKeyNode(Offset);
+        if(!Node)
+        {
+            return ERROR_BADDB;
+        }
+
+        WCHAR Name[HIVE_MAX_KEY_NAME];
+        BOOL Compressed = Read16(Node + NK_FLAGS) & KEY_COMP_NAME;
+        size_t NameBytes = Read16(Node + NK_NAME_LENGTH);
+        size_t Length = Compressed ? NameBytes : NameBytes / 2;
+        if(Length >= HIVE_MAX_KEY_NAME)
+        {
+            return ERROR_BADDB;
+        }
+        for(size_t c = 0; c < Length; ++c)
+        {
+            Name[c] = NameChar(Node + NK_NAME, Compressed, c);
+        }
+        Name[Length] = L'\0';
+        if(!Callback(Offset, Name, Context))
+        {
+            return ERROR_NO_MORE_ITEMS;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+/* Returns ERROR_SUCCESS when all subkeys were visited, ERROR_NO_MORE_ITEMS when the callback stopped early. */
+LONG RegistryHive::EnumSubKeys( _In_ ULONG Key, _In_ SubKeyCallback Callback, _In_opt_ PVOID Context ) const
+{
+    const BYTE* Node = GetKeyNode(Key);
+    if(!Node)
+    {
+        return ERROR_BADDB;
+    }
+    if(!Read32(Node + NK_SUBKEY_COUNT))
+    {
+        return ERROR_SUCCESS;
+    }
+    return EnumList(Read32(Node + NK_SUBKEY_LIST), 0, Callback, Context);
+}
+
+LONG RegistryHive::FindValue( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* ValueOffset ) const
+{
+    *ValueOffset = HIVE_INVALID_CELL;
+    const BYTE* Node = GetKeyNode(Key);
+    if(!Node)
+    {
+        return ERROR_BADDB;
+    }
+    ULONG Count = Read32(Node + NK_VALUE_COUNT);
+    if(!Count)
+    {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    ULONG Size;
+    const BYTE* List = GetCell(Read32(Node + NK_VALUE_LIST), &Size);
+    if(!List || Count > Size / 4)
+    {
+        return ERROR_BADDB;
+    }
+
+    size_t NameLength = wcslen(ValueName);
+    for(ULONG n = 0; n < Count; ++n)
+    {
+        ULONG Offset = Read32(List + n * 4);
+        const BYTE* Value = GetCell(Offset, &Size);
+        if(!Value || Size < VK_NAME || Read16(Value) != CELL_VK || VK_NAME + (ULONG)Read16(Value + VK_NAME_LENGTH) > Size)
+        {
+            return ERROR_BADDB;
+        }
+        if(NameEquals(Value + VK_NAME, Read16(Value + VK_NAME_LENGTH), Read16(Value + VK_FLAGS) & VALUE_COMP_NAME, ValueName, NameLength))
+        {
+            *ValueOffset = Offset;
+            return ERROR_SUCCESS;
+        }
+    }
+    return ERROR_FILE_NOT_FOUND;
+}
+
+LONG RegistryHive::QueryValue( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* Type, _Out_ const BYTE** Data, _Out_ ULONG* Size ) const
+{
+    ULONG Offset, CellSize;
+    *Data = NULL;
+    *Size = 0;
+    LONG Result = FindValue(Key, ValueName, &Offset);
+    if(Result != ERROR_SUCCESS)
+    {
+        return Result;
+    }
+    const BYTE* Value = GetCell(Offset, &CellSize);
+
+    *Type = Read32(Value + VK_TYPE);
+    ULONG DataSize = Read32(Value + VK_DATA_SIZE);
+    if(DataSize & VK_DATA_INLINE)
+    {
+        DataSize &= ~VK_DATA_INLINE;
+        if(DataSize > 4)
+        {
+            return ERROR_BADDB;
+        }
+        *Data = Value + VK_DATA_OFFSET;
+        *Size = DataSize;
+        return ERROR_SUCCESS;
+    }
+
+    const BYTE* Cell = GetCell(Read32(Value + VK_DATA_OFFSET), &CellSize);
+    if(!Cell)
+    {
+        return DataSize ? ERROR_BADDB : ERROR_SUCCESS;
+    }
+    if(DataSize > CellSize)
+    {
+        /* Big data ('db') records are only used for values > 16k, not needed here. */
+        return ERROR_NOT_SUPPORTED;
+    }
+    *Data = Cell;
+    *Size = DataSize;
+    return ERROR_SUCCESS;
+}
+
+LONG RegistryHive::QueryDword( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value ) const
+{
+    ULONG Type, Size;
+    const BYTE* Data;
+    LONG Result = QueryValue(Key, ValueName, &Type, &Data, &Size);
+    if(Result == ERROR_SUCCESS)
+    {
+        if(Type != REG_DWORD || Size != sizeof(*Value))
+        {
+            return ERROR_INVALID_DATA;
+        }
+        *Value = Read32(Data);
+    }
+    return Result;
+}
+
+
+HiveFlagStore::HiveFlagStore()
+    : m_Ifeo(HIVE_INVALID_CELL)
+    , m_SessionManager(HIVE_INVALID_CELL)
+{
+}
+
+/* Accepts either a SOFTWARE or a SYSTEM hive, telling them apart by their top level keys. */
+BOOL HiveFlagStore::OpenHive( _In_z_ PCWSTR FileName, _In_ BOOL UseLog )
+{
+    RegistryHive Probe;
+    ULONG Key;
+    if(!Probe.Open(FileName))
+    {
+        return FALSE;
+    }
+    BOOL IsSystem = Probe.OpenKey(Probe.RootKey(), L"Select", &Key) == ERROR_SUCCESS;
+    Probe.Close();
+
+    if(IsSystem)
+    {
+        ULONG Current = 1;
+        WCHAR ControlSet[64];
+        if(!m_System.Open(FileName, UseLog))
+        {
+            return FALSE;
+        }
+        if(m_System.OpenKey(m_System.RootKey(), L"Select", &Key) == ERROR_SUCCESS)
+        {
+            m_System.QueryDword(Key, L"Current", &Current);
+        }
+        swprintf(ControlSet, sizeof(ControlSet) / sizeof(ControlSet[0]), L"ControlSet%03u\\" HIVE_SYSTEM_SESSION_MANAGER, Current);
+        if(m_System.OpenKey(m_System.RootKey(), ControlSet, &m_SessionManager) != ERROR_SUCCESS)
+        {
+            m_SessionManager = HIVE_INVALID_CELL;
+        }
+        return TRUE;
+    }
+
+    if(!m_Software.Open(FileName, UseLog))
+    {
+        return FALSE;
+    }
+    if(m_Software.OpenKey(m_Software.RootKey(), HIVE_SOFTWARE_IFEO, &m_Ifeo) != ERROR_SUCCESS)
+    {
+        m_Ifeo = HIVE_INVALID_CELL;
+    }
+    return TRUE;
+}
+
+BOOL HiveFlagStore::ReadGlobalFlags( _Out_ ULONG* Flag )
+{
+    return m_SessionManager != HIVE_INVALID_CELL &&
+        m_System.QueryDword(m_SessionManager, GLOBALFLAG_VALUENAME, Flag) == ERROR_SUCCESS;
+}
+
+BOOL HiveFlagStore::WriteGlobalFlags( _In_ ULONG Flag )
+{
+    return m_SessionManager != HIVE_INVALID_CELL &&
+        m_System.SetDword(m_SessionManager, GLOBALFLAG_VALUENAME, Flag) == ERROR_SUCCESS;
+}
+
+BOOL HiveFlagStore::ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value )
+{
+    ULONG Key;
+    *Value = 0;
+    if(!m_Software.IsOpen())
+    {
+        return FALSE;
+    }
+    if(m_Ifeo == HIVE_INVALID_CELL)
+    {
+        return TRUE;
+    }
+    LONG Result = m_Software.OpenKey(m_Ifeo, ImageName, &Key);
+    if(Result == ERROR_SUCCESS)
+    {
+        Result = m_Software.QueryDword(Key, ValueName, Value);
+    }
+    return Result == ERROR_SUCCESS || Result == ERROR_FILE_NOT_FOUND;
+}
+
+BOOL HiveFlagStore::HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists )
+{
+    ULONG Key;
+    *Exists = FALSE;
+    if(!m_Software.IsOpen())
+    {
+        return FALSE;
+    }
+    if(m_Ifeo == HIVE_INVALID_CELL)
+    {
+        return TRUE;
+    }
+    LONG Result = m_Software.OpenKey(m_Ifeo, ImageName, &Key);
+    *Exists = Result == ERROR_SUCCESS;
+    return Result == ERROR_SUCCESS || Result == ERROR_FILE_NOT_FOUND;
+}
+
+BOOL HiveFlagStore::WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    ULONG Key;
+    if(!m_Software.IsOpen() || !ImageName || !ImageName[0])
+    {
+        return FALSE;
+    }
+    if(m_Ifeo == HIVE_INVALID_CELL &&
+       m_Software.CreateKey(m_Software.RootKey(), HIVE_SOFTWARE_IFEO, &m_Ifeo) != ERROR_SUCCESS)
+    {
+        m_Ifeo = HIVE_INVALID_CELL;
+        return FALSE;
+    }
+    return m_Software.CreateKey(m_Ifeo, ImageName, &Key) == ERROR_SUCCESS &&
+        m_Software.SetDword(Key, ValueName, Value) == ERROR_SUCCESS;
+}
+
+struct ImageEnumContext
+{
+    const RegistryHive* Hive;
+    PCWSTR ValueName;
+    ImageValueCallback Callback;
+    PVOID Context;
+};
+
+static BOOL EnumImageKey( _In_ ULONG SubKey, _In_z_ PCWSTR Name, _In_opt_ PVOID Context )
+{
+    ImageEnumContext* Enum = (ImageEnumContext*)Context;
+    ULONG Value = 0;
+    if(Enum->ValueName && Enum->Hive->QueryDword(SubKey, Enum->ValueName, &Value) != ERROR_SUCCESS)
+    {
+        return TRUE;
+    }
+    return Enum->Callback(Name, Value, Enum->Context);
+}
+
+BOOL HiveFlagStore::EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context )
+{
+    if(!m_Software.IsOpen())
+    {
+        return FALSE;
+    }
+    if(m_Ifeo == HIVE_INVALID_CELL)
+    {
+        return TRUE;
+    }
+    ImageEnumContext Enum = { &m_Software, ValueName, Callback, Context };
+    LONG Result = m_Software.EnumSubKeys(m_Ifeo, EnumImageKey, &Enum);
+    return Result == ERROR_SUCCESS || Result == ERROR_NO_MORE_ITEMS;
+}
+
+BOOL HiveFlagStore::ReadKernelFlags( _Out_ ULONG* /* Flag */ )
+{
+    return FALSE;
+}
+
+BOOL HiveFlagStore::WriteKernelFlags( _In_ ULONG /* Flag */ )
+{
+    return FALSE;
+}
+
+BOOL HiveFlagStore::Flush()
+{
+    BOOL Success = TRUE;
+    if(m_Software.IsModified())
+    {
+        Success = m_Software.Commit() && Success;
+    }
+    if(m_System.IsModified())
+    {
+        Success = m_System.Commit() && Success;
+    }
+    return Success;
+}
@@ -0,0 +1,177 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "mapfile.h"
+#include "flagstore.h"
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Offline registry hive (regf) support, no registry APIs involved.
+ * The hive is mapped and the nk / vk / list cells are walked in place.
+ *
+ * Keys are identified by their cell offset (relative to the first hbin).
+ * Functions return registry style error codes: ERROR_FILE_NOT_FOUND when a
+ * key or value does not exist, ERROR_BADDB when the hive is inconsistent.
+ *
+ * When the primary file is marked dirty, the pages recorded in <hive>.LOG1
+ * are replayed into a private view at open time, the file is not touched.
+ */
+
+#define HIVE_INVALID_CELL               0xffffffff
+#define HIVE_PAGE_SIZE                  0x1000
+#define HIVE_MAX_KEY_NAME               256
+
+#define HIVE_SOFTWARE_IFEO              L"Microsoft\\Windows NT\\CurrentVersion\\Image File Execution Options"
+#define HIVE_SYSTEM_SESSION_MANAGER     L"Control\\Session Manager"
+
+class GFLAGS_API RegistryHive
+{
+public:
+    /* Called with the decoded name of each subkey, return FALSE to stop. */
+    typedef BOOL (*SubKeyCallback)( _In_ ULONG SubKey, _In_z_ PCWSTR Name, _In_opt_ PVOID Context );
+
+    RegistryHive();
+
+    BOOL Open( _In_z_ PCWSTR FileName, _In_ BOOL Private = FALSE );
+    void Close();
+
+    BOOL IsOpen() const { return m_RootKey != HIVE_INVALID_CELL; }
+    BOOL IsDirty() const { return m_Dirty; }
+    ULONG RootKey() const { return m_RootKey; }
+
+    LONG OpenKey( _In_ ULONG Key, _In_z_ PCWSTR Path, _Out_ ULONG* SubKey ) const;
+    LONG EnumSubKeys( _In_ ULONG Key, _In_ SubKeyCallback Callback, _In_opt_ PVOID Context ) const;
+    LONG QueryValue( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* Type, _Out_ const BYTE** Data, _Out_ ULONG* Size ) const;
+    LONG QueryDword( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value ) const;
+
+protected:
+    /* Bins appended after the end of the mapping (log replay, new cells). */
+    struct Extent
+    {
+        ULONG Offset;
+        std::vector<BYTE> Data;
+    };
+
+    BYTE* GetBinData( _In_ ULONG Offset, _In_ ULONG Length ) const;
+    const BYTE* GetCell( _In_ ULONG Offset, _Out_ ULONG* Size ) const;
+    const BYTE* GetKeyNode( _In_ ULONG Offset ) const;
+    LONG FindSubKey( _In_ ULONG Key, _In_ PCWSTR Name, _In_ size_t NameLength, _Out_ ULONG* SubKey ) const;
+    LONG FindInList( _In_ ULONG List, _In_ PCWSTR Name, _In_ size_t NameLength, _In_ ULONG Hash, _In_ int Depth, _Out_ ULONG* SubKey ) const;
+    LONG EnumList( _In_ ULONG List, _In_ int Depth, _In_ SubKeyCallback Callback, _In_opt_ PVOID Context ) const;
+    LONG FindValue( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* ValueOffset ) const;
+
+    BOOL ReplayLog();
+    BOOL GrowBins( _In_ ULONG BinsSize );
+
+    std::wstring m_FileName;
+    MappedFile m_File;
+    BYTE* m_Base;
+    BYTE* m_Bins;
+    ULONG m_MappedSize;
+    ULONG m_BinsSize;
+    std::deque<Extent> m_Extents;
+    std::set<ULONG> m_DirtyPages;
+    ULONG m_RootKey;
+    BOOL m_Dirty;
+    BOOL m_LogValid;
+    ULONG m_LogSequence;
+    ULONG m_LogEnd;
+};
+
+/*
+ * Updates a hive in place, touching only the cells that change.
+ * New cells are carved from bins appended to the end of the hive, replaced
+ * cells are marked free. Commit writes the dirty pages back to the primary
+ * file using the usual sequence number protocol, or appends them as a single
+ * HvLE entry to <hive>.LOG1 and leaves the primary marked dirty.
+ */
+class GFLAGS_API HiveWriter : public RegistryHive
+{
+public:
+    HiveWriter();
+
+    BOOL Open( _In_z_ PCWSTR FileName, _In_ BOOL UseLog );
+
+    LONG CreateKey( _In_ ULONG Key, _In_z_ PCWSTR Path, _Out_ ULONG* SubKey );
+    LONG SetDword( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _In_ ULONG Value );
+
+    BOOL IsModified() const { return m_Modified; }
+    BOOL Commit();
+
+private:
+    BYTE* GetMutableCell( _In_ ULONG Offset, _Out_ ULONG* Size );
+    void MarkDirty( _In_ ULONG Offset, _In_ ULONG Length );
+    ULONG AllocateCell( _In_ ULONG Size );
+    void FreeCell( _In_ ULONG Offset );
+    LONG CreateSubKey( _In_ ULONG Parent, _In_ PCWSTR Name, _In_ size_t NameLength, _Out_ ULONG* SubKey );
+    LONG InsertIntoList( _In_ ULONG List, _In_ ULONG SubKey, _In_ PCWSTR Name, _In_ size_t NameLength, _Out_ ULONG* NewList );
+    void TouchKey( _In_ ULONG Key );
+
+    BOOL WritePrimary();
+    BOOL WriteLog();
+    void UpdateBaseBlock( _In_ ULONG Sequence1, _In_ ULONG Sequence2 );
+
+    BOOL m_UseLog;
+    BOOL m_Modified;
+};
+
+/*
+ * Flag store on top of offline SOFTWARE and / or SYSTEM hives.
+ * Image values come from the SOFTWARE hive, the boot registry flags from the
+ * current control set of the SYSTEM hive. There is no running kernel.
+ * Writes are collected in memory and reach the files on Flush.
+ */
+class GFLAGS_API HiveFlagStore : public FlagStore
+{
+public:
+    HiveFlagStore();
+
+    BOOL OpenHive( _In_z_ PCWSTR FileName, _In_ BOOL UseLog = FALSE );
+
+    virtual BOOL ReadGlobalFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteGlobalFlags( _In_ ULONG Flag );
+
+    virtual BOOL ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value );
+    virtual BOOL WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value );
+    virtual BOOL EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context );
+    virtual BOOL HasImage( _In_z_ PCWSTR ImageName, _Out_ BOOL* Exists );
+
+    virtual BOOL ReadKernelFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteKernelFlags( _In_ ULONG Flag );
+
+    virtual BOOL Flush();
+
+private:
+    HiveWriter m_Software;
+    HiveWriter m_System;
+    ULONG m_Ifeo;
+    ULONG m_SessionManager;
+};
@@ -0,0 +1,144 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+/* On-disk layout of regf hives, shared by the hive reader and writer. */
+
+// https://github.com/msuhanov/regf/blob/master/Windows%20registry%20file%20format%20specification.md
+
+#define REGF_SIGNATURE          0x66676572      /* 'regf' */
+#define REGF_BASE_BLOCK_SIZE    0x1000
+#define REGF_SEQUENCE1          0x04
+#define REGF_SEQUENCE2          0x08
+#define REGF_TIMESTAMP          0x0c
+#define REGF_MAJOR_VERSION      0x14
+#define REGF_FILE_TYPE          0x1c
+#define REGF_ROOT_CELL          0x24
+#define REGF_BINS_SIZE          0x28
+#define REGF_FLAGS              0x90
+#define REGF_CHECKSUM_OFFSET    0x1fc
+#define REGF_LOG_HEADER_SIZE    0x200
+#define REGF_TYPE_PRIMARY       0
+#define REGF_TYPE_LOG_NEW       6
+
+#define HBIN_SIGNATURE          0x6e696268      /* 'hbin' */
+#define HBIN_HEADER_SIZE        0x20
+#define HBIN_OFFSET             0x04
+#define HBIN_SIZE               0x08
+#define HBIN_TIMESTAMP          0x14
+
+#define HVLE_SIGNATURE          0x454c7648      /* 'HvLE' */
+#define HVLE_HEADER_SIZE        0x28
+#define HVLE_SIZE               0x04
+#define HVLE_FLAGS              0x08
+#define HVLE_SEQUENCE           0x0c
+#define HVLE_BINS_SIZE          0x10
+#define HVLE_PAGE_COUNT         0x14
+#define HVLE_HASH1              0x18
+#define HVLE_HASH2              0x20
+#define HVLE_ALIGNMENT          0x200
+
+#define CELL_NK                 0x6b6e          /* 'nk' */
+#define CELL_VK                 0x6b76          /* 'vk' */
+#define CELL_SK                 0x6b73          /* 'sk' */
+#define CELL_LF                 0x666c          /* 'lf' */
+#define CELL_LH                 0x686c          /* 'lh' */
+#define CELL_LI                 0x696c          /* 'li' */
+#define CELL_RI                 0x6972          /* 'ri' */
+
+#define NK_FLAGS                0x02
+#define NK_TIMESTAMP            0x04
+#define NK_PARENT               0x10
+#define NK_SUBKEY_COUNT         0x14
+#define NK_VOLATILE_COUNT       0x18
+#define NK_SUBKEY_LIST          0x1c
+#define NK_VOLATILE_LIST        0x20
+#define NK_VALUE_COUNT          0x24
+#define NK_VALUE_LIST           0x28
+#define NK_SECURITY             0x2c
+#define NK_CLASS                0x30
+#define NK_MAX_SUBKEY_NAME      0x34
+#define NK_MAX_VALUE_NAME       0x3c
+#define NK_MAX_VALUE_DATA       0x40
+#define NK_NAME_LENGTH          0x48
+#define NK_CLASS_LENGTH         0x4a
+#define NK_NAME                 0x4c
+#define KEY_COMP_NAME           0x0020
+
+#define SK_REFERENCES           0x0c
+
+#define VK_NAME_LENGTH          0x02
+#define VK_DATA_SIZE            0x04
+#define VK_DATA_OFFSET          0x08
+#define VK_TYPE                 0x0c
+#define VK_FLAGS                0x10
+#define VK_NAME                 0x14
+#define VALUE_COMP_NAME         0x0001
+#define VK_DATA_INLINE          0x80000000
+
+
+static inline WORD Read16( _In_ const BYTE* Ptr )
+{
+    return (WORD)(Ptr[0] | (Ptr[1] << 8));
+}
+
+static inline ULONG Read32( _In_ const BYTE* Ptr )
+{
+    return (ULONG)Ptr[0] | ((ULONG)Ptr[1] << 8) | ((ULONG)Ptr[2] << 16) | ((ULONG)Ptr[3] << 24);
+}
+
+static inline ULONGLONG Read64( _In_ const BYTE* Ptr )
+{
+    return (ULONGLONG)Read32(Ptr) | ((ULONGLONG)Read32(Ptr + 4) << 32);
+}
+
+static inline void Write16( _In_ BYTE* Ptr, _In_ WORD Value )
+{
+    Ptr[0] = (BYTE)Value;
+    Ptr[1] = (BYTE)(Value >> 8);
+}
+
+static inline void Write32( _In_ BYTE* Ptr, _In_ ULONG Value )
+{
+    Write16(Ptr, (WORD)Value);
+    Write16(Ptr + 2, (WORD)(Value >> 16));
+}
+
+static inline void Write64( _In_ BYTE* Ptr, _In_ ULONGLONG Value )
+{
+    Write32(Ptr, (ULONG)Value);
+    Write32(Ptr + 4, (ULONG)(Value >> 32));
+}
+
+static inline WCHAR NameChar( _In_ const BYTE* Name, _In_ BOOL Compressed, _In_ size_t Index )
+{
+    return Compressed ? (WCHAR)Name[Index] : (WCHAR)Read16(Name + Index * 2);
+}
+
+int NameCompare( _In_ const BYTE* Name, _In_ size_t NameBytes, _In_ BOOL Compressed, _In_ PCWSTR Str, _In_ size_t StrLength );
+BOOL NameEquals( _In_ const BYTE* Name, _In_ size_t NameBytes, _In_ BOOL Compressed, _In_ PCWSTR Str, _In_ size_t StrLength );
+ULONG NameHash( _In_ PCWSTR Name, _In_ size_t Length );
+ULONG BaseBlockChecksum( _In_ const BYTE* Base );
@@ -0,0 +1,344 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "hivescan.h"
+#include "flagstore.h"
+#include "mapfile.h"
+#include "hiveformat.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+/* The .LOG1 / .LOG2 files next to a hive start with a regf base block as well, only the file type tells them apart. */
+static BOOL HasHiveSignature( _In_z_ PCWSTR FileName )
+{
+    BYTE Header[REGF_FILE_TYPE + 4] = {0};
+    FILE* File = _wfopen(FileName, L"rb");
+    if(!File)
+    {
+        return FALSE;
+    }
+    BOOL Match = fread(Header, 1, sizeof(Header), File) == sizeof(Header) && Read32(Header) == REGF_SIGNATURE &&
+                 Read32(Header + REGF_FILE_TYPE) == REGF_TYPE_PRIMARY;
+    fclose(File);
+    return Match;
+}
+
+/* An image key found in a hive, its flags are filled in by the task that covers it. */
+struct ScanImageKey
+{
+    ULONG Key;
+    std::wstring Name;
+    ULONG Flags;
+    BOOL HasFlags;
+};
+
+/* The hive is closed when the last of its Remaining tasks is done, so only the hives being read are mapped. */
+struct ScanHive
+{
+    RegistryHive Hive;
+    HiveScanResult* Result;
+    std::vector<ScanImageKey> Images;
+    std::atomic<size_t> Remaining;
+};
+
+/* Open a hive and read what it has, or read the flags of Images[First, Last) of a SOFTWARE hive. */
+struct ScanTask
+{
+    ScanHive* Hive;
+    size_t First;
+    size_t Last;
+    BOOL Open;
+};
+
+class HiveScanner
+{
+public:
+    HiveScanner( _In_ ULONG Threads )
+        : m_Threads(Threads)
+        , m_Queues(new Queue[Threads])
+        , m_Pending(0)
+        , m_Queued(0)
+    {
+    }
+
+    void Run( _Inout_ std::deque<ScanHive>* Hives )
+    {
+        /* Hives come largest first, so no thread is left with a big one at the end. */
+        for(size_t n = 0; n < Hives->size(); ++n)
+        {
+            ScanTask Task = { &(*Hives)[n], 0, 0, TRUE };
+            (*Hives)[n].Remaining = 1;
+            m_Queues[n % m_Threads].Tasks.push_back(Task);
+        }
+        m_Pending = m_Queued = Hives->size();
+
+        std::vector<std::thread> Workers;
+        for(ULONG n = 1; n < m_Threads; ++n)
+        {
+            Workers.push_back(std::thread(&HiveScanner::Worker, this, n));
+        }
+        Worker(0);
+        for(size_t n = 0; n < Workers.size(); ++n)
+        {
+            Workers[n].join();
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex Lock;
+        std::deque<ScanTask> Tasks;
+    };
+
+    /* The task is counted before it can be taken, so m_Queued is never below the number of queued tasks. */
+    void Push( _In_ ULONG Worker, _In_ const ScanTask& Task )
+    {
+        {
+            std::lock_guard<std::mutex> Guard(m_WaitLock);
+            ++m_Pending;
+            ++m_Queued;
+            std::lock_guard<std::mutex> QueueGuard(m_Queues[Worker].Lock);
+            m_Queues[Worker].Tasks.push_back(Task);
+        }
+        m_Wake.notify_one();
+    }
+
+    /* Own tasks are taken from the back, tasks of other threads from the front. */
+    BOOL Pop( _In_ ULONG Worker, _Out_ ScanTask* Task )
+    {
+        BOOL Found = FALSE;
+        for(ULONG n = 0; n < m_Threads && !Found; ++n)
+        {
+            Queue& Victim = m_Queues[(Worker + n) % m_Threads];
+            std::lock_guard<std::mutex> Guard(Victim.Lock);
+            if(!Victim.Tasks.empty())
+            {
+                *Task = n ? Victim.Tasks.front() : Victim.Tasks.back();
+                n ? Victim.Tasks.pop_front() : Victim.Tasks.pop_back();
+                Found = TRUE;
+            }
+        }
+        if(Found)
+        {
+            std::lock_guard<std::mutex> Guard(m_WaitLock);
+            --m_Queued;
+        }
+        return Found;
+    }
+
+    void Finish( _Inout_ ScanHive* Scan )
+    {
+        if(!--Scan->Remaining)
+        {
+            Scan->Hive.Close();
+        }
+        std::lock_guard<std::mutex> Guard(m_WaitLock);
+        if(!--m_Pending)
+        {
+            m_Wake.notify_all();
+        }
+    }
+
+    /* Sleeps while the queues are empty, until a running task adds work or the last one is done. */
+    void Worker( _In_ ULONG Worker )
+    {
+        ScanTask Task;
+        for(;;)
+        {
+            if(!Pop(Worker, &Task))
+            {
+                std::unique_lock<std::mutex> Lock(m_WaitLock);
+                m_Wake.wait(Lock, [this]() { return !m_Pending || m_Queued; });
+                if(!m_Pending)
+                {
+                    break;
+                }
+                continue;
+            }
+            if(Task.Open)
+            {
+                OpenHive(Worker, Task.Hive);
+            }
+            else
+            {
+                ReadImages(Task.Hive, Task.First, Task.Last);
+            }
+            Finish(Task.Hive);
+        }
+    }
+
+    static BOOL CollectImageKey( _In_ ULONG SubKey, _In_z_ PCWSTR Name, _In_opt_ PVOID Context )
+    {
+        ScanImageKey Image = { SubKey, Name, 0, FALSE };
+        ((ScanHive*)Context)->Images.push_back(Image);
+        return TRUE;
+    }
+
+    void OpenHive( _In_ ULONG Worker, _Inout_ ScanHive* Scan )
+    {
+        HiveScanResult* Result = Scan->Result;
+        RegistryHive& Hive = Scan->Hive;
+        ULONG Key;
+        if(!HasHiveSignature(Result->FileName.c_str()))
+        {
+            Result->Type = HIVE_SCAN_NOT_A_HIVE;
+            return;
+        }
+        if(!Hive.Open(Result->FileName.c_str()))
+        {
+            Result->Type = HIVE_SCAN_DAMAGED;
+            return;
+        }
+
+        if(Hive.OpenKey(Hive.RootKey(), L"Select", &Key) == ERROR_SUCCESS)
+        {
+            ULONG Current = 1;
+            WCHAR SessionManager[64];
+            Result->Type = HIVE_SCAN_SYSTEM;
+            Hive.QueryDword(Key, L"Current", &Current);
+            swprintf(SessionManager, 64, L"ControlSet%03u\\" HIVE_SYSTEM_SESSION_MANAGER, Current);
+            Result->HasGlobalFlags = Hive.OpenKey(Hive.RootKey(), SessionManager, &Key) == ERROR_SUCCESS &&
+                Hive.QueryDword(Key, GLOBALFLAG_VALUENAME, &Result->GlobalFlags) == ERROR_SUCCESS;
+            return;
+        }
+
+        Result->Type = HIVE_SCAN_SOFTWARE;
+        if(Hive.OpenKey(Hive.RootKey(), HIVE_SOFTWARE_IFEO, &Key) != ERROR_SUCCESS)
+        {
+            return;
+        }
+        LONG Status = Hive.EnumSubKeys(Key, CollectImageKey, Scan);
+        if(Status != ERROR_SUCCESS && Status != ERROR_NO_MORE_ITEMS)
+        {
+            Result->Type = HIVE_SCAN_DAMAGED;
+            return;
+        }
+
+        /* The flags of a large IFEO key are read by several tasks, other threads can take them. */
+        size_t First = std::min(Scan->Images.size(), (size_t)HIVE_SCAN_SPLIT_IMAGES);
+        Scan->Remaining += (Scan->Images.size() - First + HIVE_SCAN_SPLIT_IMAGES - 1) / HIVE_SCAN_SPLIT_IMAGES;
+        for(size_t Next = First; Next < Scan->Images.size(); Next += HIVE_SCAN_SPLIT_IMAGES)
+        {
+            ScanTask Task = { Scan, Next, std::min(Scan->Images.size(), Next + HIVE_SCAN_SPLIT_IMAGES), FALSE };
+            Push(Worker, Task);
+        }
+        ReadImages(Scan, 0, First);
+    }
+
+    static void ReadImages( _Inout_ ScanHive* Scan, _In_ size_t First, _In_ size_t Last )
+    {
+        for(size_t n = First; n < Last; ++n)
+        {
+            ScanImageKey& Image = Scan->Images[n];
+            Image.HasFlags = Scan->Hive.QueryDword(Image.Key, GLOBALFLAG_VALUENAME, &Image.Flags) == ERROR_SUCCESS;
+        }
+    }
+
+    ULONG m_Threads;
+    std::unique_ptr<Queue[]> m_Queues;
+    std::mutex m_WaitLock;
+    std::condition_variable m_Wake;
+    size_t m_Pending;               /* tasks queued or running, under m_WaitLock */
+    size_t m_Queued;
+};
+
+/* Orders file indices by descending size. */
+struct LargerFile
+{
+    const std::vector<std::pair<std::wstring, ULONGLONG> >* Files;
+
+    bool operator()( _In_ size_t Left, _In_ size_t Right ) const
+    {
+        return (*Files)[Left].second > (*Files)[Right].second;
+    }
+};
+
+static bool IsNotAHive( _In_ const HiveScanResult& Result )
+{
+    return Result.Type == HIVE_SCAN_NOT_A_HIVE;
+}
+
+BOOL ScanHives( _In_z_ PCWSTR Directory, _In_ ULONG Threads, _Out_ std::vector<HiveScanResult>* Results )
+{
+    std::vector<std::pair<std::wstring, ULONGLONG> > Files;
+    Results->clear();
+    ListFiles(Directory, &Files);
+    if(Files.empty())
+    {
+        return FALSE;
+    }
+
+    /* Results are ordered by name, tasks are queued by size. */
+    std::sort(Files.begin(), Files.end());
+    std::vector<size_t> Order(Files.size());
+    Results->resize(Files.size());
+    for(size_t n = 0; n < Files.size(); ++n)
+    {
+        (*Results)[n].FileName = Files[n].first;
+        (*Results)[n].Type = HIVE_SCAN_NOT_A_HIVE;
+        (*Results)[n].HasGlobalFlags = FALSE;
+        (*Results)[n].GlobalFlags = 0;
+        Order[n] = n;
+    }
+    LargerFile BySize = { &Files };
+    std::stable_sort(Order.begin(), Order.end(), BySize);
+
+    std::deque<ScanHive> Hives(Files.size());
+    for(size_t n = 0; n < Files.size(); ++n)
+    {
+        Hives[n].Result = &(*Results)[Order[n]];
+    }
+
+    if(!Threads)
+    {
+        Threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    HiveScanner Scanner((ULONG)std::min((size_t)Threads, Files.size()));
+    Scanner.Run(&Hives);
+
+    for(size_t n = 0; n < Hives.size(); ++n)
+    {
+        std::vector<HiveScanImage>& Images = Hives[n].Result->Images;
+        for(size_t i = 0; i < Hives[n].Images.size(); ++i)
+        {
+            if(Hives[n].Images[i].HasFlags)
+            {
+                HiveScanImage Image = { Hives[n].Images[i].Name, Hives[n].Images[i].Flags };
+                Images.push_back(Image);
+            }
+        }
+    }
+
+    Results->erase(std::remove_if(Results->begin(), Results->end(), IsNotAHive), Results->end());
+    return TRUE;
+}
@@ -0,0 +1,66 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "hive.h"
+#include <string>
+#include <vector>
+
+/*
+ * Reads the flags from every offline hive below a directory, for audits over
+ * many extracted images. The hives are processed by a pool of threads, one
+ * hive per task; the image keys of large SOFTWARE hives are split into
+ * several tasks. Each thread has its own task queue and takes work from the
+ * others when it runs out. The results do not depend on the scheduling: the
+ * hives are ordered by file name, the images in the order of the hive.
+ */
+
+#define HIVE_SCAN_SPLIT_IMAGES      1024
+
+/* HiveScanResult::Type */
+#define HIVE_SCAN_NOT_A_HIVE        0
+#define HIVE_SCAN_SOFTWARE          1
+#define HIVE_SCAN_SYSTEM            2
+#define HIVE_SCAN_DAMAGED           3
+
+struct HiveScanImage
+{
+    std::wstring Name;
+    ULONG Flags;
+};
+
+struct HiveScanResult
+{
+    std::wstring FileName;
+    DWORD Type;
+    BOOL HasGlobalFlags;            /* SYSTEM hives with a GlobalFlag value */
+    ULONG GlobalFlags;
+    std::vector<HiveScanImage> Images;  /* SOFTWARE hives, the images with a GlobalFlag value */
+};
+
+/* Threads 0 uses one thread per processor. */
+GFLAGS_API BOOL ScanHives( _In_z_ PCWSTR Directory, _In_ ULONG Threads, _Out_ std::vector<HiveScanResult>* Results );
@@ -0,0 +1,795 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "hive.h"
+#include "hiveformat.h"
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#define _fseeki64   fseeko
+#define _commit     fsync
+#define _fileno     fileno
+#endif
+
+#define MARVIN32_SEED           0x82EF4D887A4E55C5ULL
+#define HIVE_ALIGN(Size, To)    (((Size) + (To) - 1) & ~((To) - 1))
+
+
+static inline ULONG Rotl32( _In_ ULONG Value, _In_ int Shift )
+{
+    return (Value << Shift) | (Value >> (32 - Shift));
+}
+
+/* Marvin32, as used for the log entry hashes. */
+static ULONGLONG Marvin32( _In_ const BYTE* Data, _In_ size_t Length )
+{
+    ULONG Lo = (ULONG)MARVIN32_SEED, Hi = (ULONG)(MARVIN32_SEED >> 32);
+    ULONG Final = 0x80;
+    for(;; Data += 4, Length -= 4)
+    {
+        if(Length < 4)
+        {
+            for(size_t n = Length; n > 0; --n)
+            {
+                Final = (Final << 8) | Data[n - 1];
+            }
+            Lo += Final;
+        }
+        else
+        {
+            Lo += Read32(Data);
+        }
+        for(int Round = (Length < 4) ? 2 : 1; Round > 0; --Round)
+        {
+            Hi ^= Lo; Lo = Rotl32(Lo, 20);
+            Lo += Hi; Hi = Rotl32(Hi, 9);
+            Hi ^= Lo; Lo = Rotl32(Lo, 27);
+            Lo += Hi; Hi = Rotl32(Hi, 19);
+        }
+        if(Length < 4)
+        {
+            break;
+        }
+    }
+    return ((ULONGLONG)Hi << 32) | Lo;
+}
+
+static ULONGLONG FileTimeNow()
+{
+    return ((ULONGLONG)time(NULL) + 11644473600ULL) * 10000000ULL;
+}
+
+static BOOL WriteAt( _In_ FILE* File, _In_ ULONGLONG Offset, _In_ const void* Data, _In_ size_t Size )
+{
+    return !_fseeki64(File, Offset, SEEK_SET) && fwrite(Data, 1, Size, File) == Size;
+}
+
+static BOOL SyncFile( _In_ FILE* File )
+{
+    return !fflush(File) && !_commit(_fileno(File));
+}
+
+static BOOL IsCompressible( _In_ PCWSTR Name, _In_ size_t Length )
+{
+    for(size_t n = 0; n < Length; ++n)
+    {
+        if(Name[n] > 0xff)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void StoreName( _In_ BYTE* Dest, _In_ PCWSTR Name, _In_ size_t Length, _In_ BOOL Compressed )
+{
+    for(size_t n = 0; n < Length; ++n)
+    {
+        if(Compressed)
+        {
+            Dest[n] = (BYTE)Name[n];
+        }
+        else
+        {
+            Write16(Dest + n * 2, (WORD)Name[n]);
+        }
+    }
+}
+
+
+/*
+ * Applies the entries of <hive>.LOG1 that continue the primary file's last
+ * consistent state (log sequence == primary sequence 2), in order, until the
+ * first entry that is missing, out of sequence or fails its hashes.
+ */
+BOOL RegistryHive::ReplayLog()
+{
+    std::wstring LogName = m_FileName + L".LOG1";
+    FILE* File = _wfopen(LogName.c_str(), L"rb");
+    if(!File)
+    {
+        return FALSE;
+    }
+    std::vector<BYTE> Log;
+    BYTE Buffer[HIVE_PAGE_SIZE];
+    size_t Read;
+    while((Read = fread(Buffer, 1, sizeof(Buffer), File)) > 0)
+    {
+        Log.insert(Log.end(), Buffer, Buffer + Read);
+    }
+    fclose(File);
+
+    if(Log.size() < REGF_LOG_HEADER_SIZE || Read32(&Log[0]) != REGF_SIGNATURE ||
+       Read32(&Log[REGF_FILE_TYPE]) != REGF_TYPE_LOG_NEW ||
+       BaseBlockChecksum(&Log[0]) != Read32(&Log[REGF_CHECKSUM_OFFSET]) ||
+       Read32(&Log[REGF_SEQUENCE1]) != Read32(m_Base + REGF_SEQUENCE2))
+    {
+        return FALSE;
+    }
+
+    ULONG Sequence = Read32(&Log[REGF_SEQUENCE1]);
+    size_t Position = REGF_LOG_HEADER_SIZE;
+    while(Position + HVLE_HEADER_SIZE <= Log.size())
+    {
+        const BYTE* Entry = &Log[Position];
+        ULONG Size = Read32(Entry + HVLE_SIZE);
+        ULONG Count = Read32(Entry + HVLE_PAGE_COUNT);
+        if(Read32(Entry) != HVLE_SIGNATURE || Size < HVLE_HEADER_SIZE || (Size % HVLE_ALIGNMENT) ||
+           Size > Log.size() - Position || Read32(Entry + HVLE_SEQUENCE) != Sequence ||
+           Count > (Size - HVLE_HEADER_SIZE) / 8 ||
+           Marvin32(Entry, HVLE_HASH2) != Read64(Entry + HVLE_HASH2) ||
+           Marvin32(Entry + HVLE_HEADER_SIZE, Size - HVLE_HEADER_SIZE) != Read64(Entry + HVLE_HASH1))
+        {
+            break;
+        }
+
+        ULONG BinsSize = Read32(Entry + HVLE_BINS_SIZE);
+        const BYTE* Page = Entry + HVLE_HEADER_SIZE + Count * 8;
+        const BYTE* End = Entry + Size;
+        if(BinsSize % HIVE_PAGE_SIZE)
+        {
+            break;
+        }
+        GrowBins(BinsSize);
+        for(ULONG n = 0; n < Count; ++n)
+        {
+            ULONG Offset = Read32(Entry + HVLE_HEADER_SIZE + n * 8);
+            ULONG Length = Read32(Entry + HVLE_HEADER_SIZE + n * 8 + 4);
+            if((Offset % HIVE_PAGE_SIZE) || (Length % HIVE_PAGE_SIZE) || Length > (size_t)(End - Page))
+            {
+                return FALSE;
+            }
+            for(ULONG Done = 0; Done < Length; Done += HIVE_PAGE_SIZE)
+            {
+                BYTE* Dest = GetBinData(Offset + Done, HIVE_PAGE_SIZE);
+                if(!Dest)
+                {
+                    return FALSE;
+                }
+                memcpy(Dest, Page + Done, HIVE_PAGE_SIZE);
+                m_DirtyPages.insert((Offset + Done) / HIVE_PAGE_SIZE);
+            }
+            Page += Length;
+        }
+        ++Sequence;
+        Position += Size;
+    }
+
+    m_LogValid = TRUE;
+    m_LogSequence = Sequence;
+    m_LogEnd = (ULONG)Position;
+    return TRUE;
+}
+
+
+HiveWriter::HiveWriter()
+    : m_UseLog(FALSE)
+    , m_Modified(FALSE)
+{
+}
+
+BOOL HiveWriter::Open( _In_z_ PCWSTR FileName, _In_ BOOL UseLog )
+{
+    m_UseLog = UseLog;
+    m_Modified = FALSE;
+    return RegistryHive::Open(FileName, TRUE);
+}
+
+void HiveWriter::MarkDirty( _In_ ULONG Offset, _In_ ULONG Length )
+{
+    for(ULONG Page = Offset / HIVE_PAGE_SIZE; Page <= (Offset + Length - 1) / HIVE_PAGE_SIZE; ++Page)
+    {
+        m_DirtyPages.insert(Page);
+    }
+    m_Modified = TRUE;
+}
+
+BYTE* HiveWriter::GetMutableCell( _In_ ULONG Offset, _Out_ ULONG* Size )
+{
+    BYTE* Cell = (BYTE*)GetCell(Offset, Size);
+    if(Cell)
+    {
+        MarkDirty(Offset, *Size + 4);
+    }
+    return Cell;
+}
+
+/*
+ * New cells only come from bins this writer appended, so an update never
+ * has to scan (and page in) the existing hive looking for free space.
+ */
+ULONG HiveWriter::AllocateCell( _In_ ULONG Size )
+{
+    ULONG Needed = HIVE_ALIGN(Size + 4, 8);
+    for(int Attempt = 0; Attempt < 2; ++Attempt)
+    {
+        for(std::deque<Extent>::iterator it = m_Extents.begin(); it != m_Extents.end(); ++it)
+        {
+            ULONG Bin = it->Offset;
+            while(Bin < it->Offset + it->Data.size())
+            {
+                const BYTE* Header = GetBinData(Bin, HBIN_HEADER_SIZE);
+                ULONG BinSize = Header ? Read32(Header + HBIN_SIZE) : 0;
+                if(!Header || Read32(Header) != HBIN_SIGNATURE || !BinSize || !GetBinData(Bin, BinSize))
+                {
+                    break;
+                }
+                for(ULONG Cell = Bin + HBIN_HEADER_SIZE; Cell + 8 <= Bin + BinSize; )
+                {
+                    BYTE* Ptr = GetBinData(Cell, 4);
+                    LONG CellSize = (LONG)Read32(Ptr);
+                    ULONG Length = (ULONG)(CellSize < 0 ? -CellSize : CellSize);
+                    if(Length < 8 || (Length & 7) || Length > Bin + BinSize - Cell)
+                    {
+                        break;
+                    }
+                    while(CellSize > 0 && Cell + Length + 8 <= Bin + BinSize)
+                    {
+                        /* Coalesce with the free cells that follow. */
+                        LONG NextSize = (LONG)Read32(GetBinData(Cell + Length, 4));
+                        if(NextSize <= 0 || (NextSize & 7) || (ULONG)NextSize > Bin + BinSize - Cell - Length)
+                        {
+                            break;
+                        }
+                        Length += (ULONG)NextSize;
+                        Write32(Ptr, Length);
+                        MarkDirty(Cell, 4);
+                    }
+                    if(CellSize > 0 && Length >= Needed)
+                    {
+                        if(Length - Needed >= 8)
+                        {
+                            Write32(GetBinData(Cell + Needed, 4), Length - Needed);
+                            Length = Needed;
+                        }
+                        Write32(Ptr, (ULONG)-(LONG)Length);
+                        memset(Ptr + 4, 0, Length - 4);
+                        MarkDirty(Cell, Length);
+                        return Cell;
+                    }
+                    Cell += Length;
+                }
+                Bin += BinSize;
+            }
+        }
+
+        /* Nothing free, append a new bin large enough for the cell. */
+        ULONG Bin = m_BinsSize;
+        ULONG BinSize = HIVE_ALIGN(Needed + HBIN_HEADER_SIZE, HIVE_PAGE_SIZE);
+        if(!GrowBins(m_BinsSize + BinSize))
+        {
+            break;
+        }
+        BYTE* Header = GetBinData(Bin, BinSize);
+        Write32(Header, HBIN_SIGNATURE);
+        Write32(Header + HBIN_OFFSET, Bin);
+        Write32(Header + HBIN_SIZE, BinSize);
+        Write64(Header + HBIN_TIMESTAMP, FileTimeNow());
+        Write32(Header + HBIN_HEADER_SIZE, BinSize - HBIN_HEADER_SIZE);
+        MarkDirty(Bin, BinSize);
+    }
+    return HIVE_INVALID_CELL;
+}
+
+void HiveWriter::FreeCell( _In_ ULONG Offset )
+{
+    ULONG Size;
+    if(GetCell(Offset, &Size))
+    {
+        Write32(GetBinData(Offset, 4), Size + 4);
+        MarkDirty(Offset, 4);
+    }
+}
+
+void HiveWriter::TouchKey( _In_ ULONG Key )
+{
+    ULONG Size;
+    BYTE* Node = GetMutableCell(Key, &Size);
+    if(Node)
+    {
+        Write64(Node + NK_TIMESTAMP, FileTimeNow());
+    }
+}
+
+/* Inserts SubKey into a subkey list, keeping it sorted. The leaf list is rebuilt as a new cell. */
+LONG HiveWriter::InsertIntoList( _In_ ULONG List, _In_ ULONG SubKey, _In_ PCWSTR Name, _In_ size_t NameLength, _Out_ ULONG* NewList )
+{
+    ULONG Size;
+    const BYTE* Cell = GetCell(List, &Size);
+    if(!Cell || Size < 4)
+    {
+        return ERROR_BADDB;
+    }
+    WORD Signature = Read16(Cell);
+    ULONG Count = Read16(Cell + 2);
+    if(Signature == CELL_RI)
+    {
+        if(!Count || 4 + Count * 4 > Size)
+        {
+            return ERROR_BADDB;
+        }
+        /* Pick the first leaf whose last entry sorts after Name, or the last leaf. */
+        ULONG Leaf = Count - 1;
+        for(ULONG n = 0; n + 1 < Count; ++n)
+        {
+            ULONG LeafSize;
+            const BYTE* LeafCell = GetCell(Read32(Cell + 4 + n * 4), &LeafSize);
+            ULONG LeafCount = LeafCell && LeafSize >= 4 ? Read16(LeafCell + 2) : 0;
+            ULONG Stride = LeafCell && Read16(LeafCell) == CELL_LI ? 4 : 8;
+            if(!LeafCount || 4 + LeafCount * Stride > LeafSize)
+            {
+                return ERROR_BADDB;
+            }
+            const BYTE* Last = GetKeyNode(Read32(LeafCell + 4 + (LeafCount - 1) * Stride));
+            if(!Last)
+            {
+                return ERROR_BADDB;
+            }
+            if(NameCompare(Last + NK_NAME, Read16(Last + NK_NAME_LENGTH), Read16(Last + NK_FLAGS) & KEY_COMP_NAME, Name, NameLength) > 0)
+            {
+                Leaf = n;
+                break;
+            }
+        }
+        ULONG NewLeaf;
+        LONG Result = InsertIntoList(Read32(Cell + 4 + Leaf * 4), SubKey, Name, NameLength, &NewLeaf);
+        if(Result != ERROR_SUCCESS)
+        {
+            return Result;
+        }
+        BYTE* Index = GetMutableCell(List, &Size);
+        Write32(Index + 4 + Leaf * 4, NewLeaf);
+        *NewList = List;
+        return ERROR_SUCCESS;
+    }
+
+    if(Signature != CELL_LF && Signature != CELL_LH && Signature != CELL_LI)
+    {
+        return ERROR_BADDB;
+    }
+    ULONG Stride = (Signature == CELL_LI) ? 4 : 8;
+    if(4 + Count * Stride > Size || Count >= 0xffff)
+    {
+        return ERROR_BADDB;
+    }
+
+    ULONG Low = 0, High = Count;
+    while(Low < High)
+    {
+        ULONG Middle = (Low + High) / 2;
+        const BYTE* Node = GetKeyNode(Read32(Cell + 4 + Middle * Stride));
+        if(!Node)
+        {
+            return ERROR_BADDB;
+        }
+        if(NameCompare(Node + NK_NAME, Read16(Node + NK_NAME_LENGTH), Read16(Node + NK_FLAGS) & KEY_COMP_NAME, Name, NameLength) < 0)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+
+    /* Release the old list first so the new one can take its place. */
+    std::vector<BYTE> Entries(Cell + 4, Cell + 4 + Count * Stride);
+    FreeCell(List);
+    ULONG Offset = AllocateCell(4 + (Count + 1) * Stride);
+    if(Offset == HIVE_INVALID_CELL)
+    {
+        return ERROR_OUTOFMEMORY;
+    }
+    BYTE* Dest = GetMutableCell(Offset, &Size);
+    Write16(Dest, Signature);
+    Write16(Dest + 2, (WORD)(Count + 1));
+    if(Count)
+    {
+        memcpy(Dest + 4, &Entries[0], Low * Stride);
+        memcpy(Dest + 4 + (Low + 1) * Stride, &Entries[Low * Stride], (Count - Low) * Stride);
+    }
+
+    BYTE* Entry = Dest + 4 + Low * Stride;
+    Write32(Entry, SubKey);
+    if(Signature == CELL_LH)
+    {
+        Write32(Entry + 4, NameHash(Name, NameLength));
+    }
+    else if(Signature == CELL_LF)
+    {
+        for(size_t n = 0; n < 4; ++n)
+        {
+            Entry[4 + n] = n < NameLength ? (BYTE)Name[n] : 0;
+        }
+    }
+    *NewList = Offset;
+    return ERROR_SUCCESS;
+}
+
+LONG HiveWriter::CreateSubKey( _In_ ULONG Parent, _In_ PCWSTR Name, _In_ size_t NameLength, _Out_ ULONG* SubKey )
+{
+    BOOL Compressed = IsCompressible(Name, NameLength);
+    ULONG NameBytes = (ULONG)(Compressed ? NameLength : NameLength * 2);
+    const BYTE* ParentNode = GetKeyNode(Parent);
+    if(!ParentNode || NameBytes > 0xffff)
+    {
+        return ParentNode ? ERROR_INVALID_DATA : ERROR_BADDB;
+    }
+    ULONG Security = Read32(ParentNode + NK_SECURITY);
+
+    ULONG Offset = AllocateCell(NK_NAME + NameBytes);
+    if(Offset == HIVE_INVALID_CELL)
+    {
+        return ERROR_OUTOFMEMORY;
+    }
+    ULONG Size;
+    BYTE* Node = GetMutableCell(Offset, &Size);
+    Write16(Node, CELL_NK);
+    Write16(Node + NK_FLAGS, Compressed ? KEY_COMP_NAME : 0);
+    Write64(Node + NK_TIMESTAMP, FileTimeNow());
+    Write32(Node + NK_PARENT, Parent);
+    Write32(Node + NK_SUBKEY_LIST, HIVE_INVALID_CELL);
+    Write32(Node + NK_VOLATILE_LIST, HIVE_INVALID_CELL);
+    Write32(Node + NK_VALUE_LIST, HIVE_INVALID_CELL);
+    Write32(Node + NK_SECURITY, Security);
+    Write32(Node + NK_CLASS, HIVE_INVALID_CELL);
+    Write16(Node + NK_NAME_LENGTH, (WORD)NameBytes);
+    StoreName(Node + NK_NAME, Name, NameLength, Compressed);
+
+    /* The new key shares the security descriptor of its parent. */
+    BYTE* Descriptor = GetMutableCell(Security, &Size);
+    if(Descriptor && Size >= SK_REFERENCES + 4 && Read16(Descriptor) == CELL_SK)
+    {
+        Write32(Descriptor + SK_REFERENCES, Read32(Descriptor + SK_REFERENCES) + 1);
+    }
+
+    ParentNode = GetKeyNode(Parent);
+    ULONG Count = Read32(ParentNode + NK_SUBKEY_COUNT);
+    ULONG List;
+    if(!Count)
+    {
+        List = AllocateCell(4 + 8);
+        if(List == HIVE_INVALID_CELL)
+        {
+            return ERROR_OUTOFMEMORY;
+        }
+        BYTE* Leaf = GetMutableCell(List, &Size);
+        Write16(Leaf, CELL_LH);
+        Write16(Leaf + 2, 1);
+        Write32(Leaf + 4, Offset);
+        Write32(Leaf + 8, NameHash(Name, NameLength));
+    }
+    else
+    {
+        LONG Result = InsertIntoList(Read32(ParentNode + NK_SUBKEY_LIST), Offset, Name, NameLength, &List);
+        if(Result != ERROR_SUCCESS)
+        {
+            return Result;
+        }
+    }
+
+    BYTE* Update = GetMutableCell(Parent, &Size);
+    Write32(Update + NK_SUBKEY_COUNT, Count + 1);
+    Write32(Update + NK_SUBKEY_LIST, List);
+    if(Read32(Update + NK_MAX_SUBKEY_NAME) < NameLength * 2)
+    {
+        Write32(Update + NK_MAX_SUBKEY_NAME, (ULONG)NameLength * 2);
+    }
+    Write64(Update + NK_TIMESTAMP, FileTimeNow());
+    *SubKey = Offset;
+    return ERROR_SUCCESS;
+}
+
+LONG HiveWriter::CreateKey( _In_ ULONG Key, _In_z_ PCWSTR Path, _Out_ ULONG* SubKey )
+{
+    *SubKey = HIVE_INVALID_CELL;
+    while(*Path)
+    {
+        PCWSTR End = wcschr(Path, L'\\');
+        size_t Length = End ? (size_t)(End - Path) : wcslen(Path);
+        if(Length)
+        {
+            LONG Result = FindSubKey(Key, Path, Length, &Key);
+            if(Result == ERROR_FILE_NOT_FOUND)
+            {
+                Result = CreateSubKey(Key, Path, Length, &Key);
+            }
+            if(Result != ERROR_SUCCESS)
+            {
+                return Result;
+            }
+        }
+        Path += Length + (End ? 1 : 0);
+    }
+    *SubKey = Key;
+    return ERROR_SUCCESS;
+}
+
+LONG HiveWriter::SetDword( _In_ ULONG Key, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    ULONG Offset, Size;
+    LONG Result = FindValue(Key, ValueName, &Offset);
+    if(Result == ERROR_SUCCESS)
+    {
+        BYTE* Existing = GetMutableCell(Offset, &Size);
+        ULONG DataSize = Read32(Existing + VK_DATA_SIZE);
+        if(!(DataSize & VK_DATA_INLINE) && DataSize)
+        {
+            FreeCell(Read32(Existing + VK_DATA_OFFSET));
+        }
+        Write32(Existing + VK_DATA_SIZE, VK_DATA_INLINE | sizeof(Value));
+        Write32(Existing + VK_DATA_OFFSET, Value);
+        Write32(Existing + VK_TYPE, REG_DWORD);
+        TouchKey(Key);
+        return ERROR_SUCCESS;
+    }
+    if(Result != ERROR_FILE_NOT_FOUND)
+    {
+        return Result;
+    }
+
+    size_t NameLength = wcslen(ValueName);
+    BOOL Compressed = IsCompressible(ValueName, NameLength);
+    ULONG NameBytes = (ULONG)(Compressed ? NameLength : NameLength * 2);
+    if(NameBytes > 0xffff)
+    {
+        return ERROR_INVALID_DATA;
+    }
+    Offset = AllocateCell(VK_NAME + NameBytes);
+    if(Offset == HIVE_INVALID_CELL)
+    {
+        return ERROR_OUTOFMEMORY;
+    }
+    BYTE* NewValue = GetMutableCell(Offset, &Size);
+    Write16(NewValue, CELL_VK);
+    Write16(NewValue + VK_NAME_LENGTH, (WORD)NameBytes);
+    Write32(NewValue + VK_DATA_SIZE, VK_DATA_INLINE | sizeof(Value));
+    Write32(NewValue + VK_DATA_OFFSET, Value);
+    Write32(NewValue + VK_TYPE, REG_DWORD);
+    Write16(NewValue + VK_FLAGS, Compressed ? VALUE_COMP_NAME : 0);
+    StoreName(NewValue + VK_NAME, ValueName, NameLength, Compressed);
+
+    const BYTE* Node = GetKeyNode(Key);
+    ULONG Count = Read32(Node + NK_VALUE_COUNT);
+    std::vector<BYTE> Entries(Count * 4);
+    if(Count)
+    {
+        ULONG OldList = Read32(Node + NK_VALUE_LIST);
+        const BYTE* Old = GetCell(OldList, &Size);
+        if(!Old || Count > Size / 4)
+        {
+            return ERROR_BADDB;
+        }
+        memcpy(&Entries[0], Old, Count * 4);
+        FreeCell(OldList);
+    }
+    ULONG List = AllocateCell((Count + 1) * 4);
+    if(List == HIVE_INVALID_CELL)
+    {
+        return ERROR_OUTOFMEMORY;
+    }
+    BYTE* Values = GetMutableCell(List, &Size);
+    if(Count)
+    {
+        memcpy(Values, &Entries[0], Count * 4);
+    }
+    Write32(Values + Count * 4, Offset);
+
+    BYTE* Update = GetMutableCell(Key, &Size);
+    Write32(Update + NK_VALUE_COUNT, Count + 1);
+    Write32(Update + NK_VALUE_LIST, List);
+    if(Read32(Update + NK_MAX_VALUE_NAME) < NameLength * 2)
+    {
+        Write32(Update + NK_MAX_VALUE_NAME, (ULONG)NameLength * 2);
+    }
+    if(Read32(Update + NK_MAX_VALUE_DATA) < sizeof(Value))
+    {
+        Write32(Update + NK_MAX_VALUE_DATA, sizeof(Value));
+    }
+    Write64(Update + NK_TIMESTAMP, FileTimeNow());
+    return ERROR_SUCCESS;
+}
+
+void HiveWriter::UpdateBaseBlock( _In_ ULONG Sequence1, _In_ ULONG Sequence2 )
+{
+    Write32(m_Base + REGF_SEQUENCE1, Sequence1);
+    Write32(m_Base + REGF_SEQUENCE2, Sequence2);
+    Write64(m_Base + REGF_TIMESTAMP, FileTimeNow());
+    Write32(m_Base + REGF_BINS_SIZE, m_BinsSize);
+    Write32(m_Base + REGF_CHECKSUM_OFFSET, BaseBlockChecksum(m_Base));
+}
+
+/*
+ * Same order as the kernel uses: mark the primary dirty (sequence 1 bumped),
+ * write the dirty pages, then make it consistent again (sequence 2 catches up).
+ */
+BOOL HiveWriter::WritePrimary()
+{
+    FILE* File = _wfopen(m_FileName.c_str(), L"r+b");
+    if(!File)
+    {
+        return FALSE;
+    }
+    ULONG Sequence = Read32(m_Base + REGF_SEQUENCE1) + 1;
+    UpdateBaseBlock(Sequence, Read32(m_Base + REGF_SEQUENCE2));
+    BOOL Success = WriteAt(File, 0, m_Base, REGF_BASE_BLOCK_SIZE) && SyncFile(File);
+
+    for(std::set<ULONG>::const_iterator it = m_DirtyPages.begin(); Success && it != m_DirtyPages.end(); ++it)
+    {
+        ULONG Offset = *it * HIVE_PAGE_SIZE;
+        const BYTE* Page = GetBinData(Offset, HIVE_PAGE_SIZE);
+        Success = Page && WriteAt(File, REGF_BASE_BLOCK_SIZE + (ULONGLONG)Offset, Page, HIVE_PAGE_SIZE);
+    }
+    Success = Success && SyncFile(File);
+
+    if(Success)
+    {
+        UpdateBaseBlock(Sequence, Sequence);
+        Success = WriteAt(File, 0, m_Base, REGF_BASE_BLOCK_SIZE) && SyncFile(File);
+    }
+    Success = !fclose(File) && Success;
+    if(Success)
+    {
+        m_Dirty = FALSE;
+        m_LogValid = FALSE;
+    }
+    return Success;
+}
+
+/*
+ * Appends the dirty pages as one HvLE entry to <hive>.LOG1, then only bumps
+ * sequence 1 of the primary so the next load replays the log.
+ */
+BOOL HiveWriter::WriteLog()
+{
+    std::wstring LogName = m_FileName + L".LOG1";
+    ULONG Sequence2 = Read32(m_Base + REGF_SEQUENCE2);
+    if(!m_LogValid)
+    {
+        m_LogSequence = Sequence2;
+        m_LogEnd = REGF_LOG_HEADER_SIZE;
+    }
+
+    std::vector<std::pair<ULONG, ULONG> > Runs;
+    ULONG Payload = 0;
+    for(std::set<ULONG>::const_iterator it = m_DirtyPages.begin(); it != m_DirtyPages.end(); ++it)
+    {
+        ULONG Offset = *it * HIVE_PAGE_SIZE;
+        if(!Runs.empty() && Runs.back().first + Runs.back().second == Offset)
+        {
+            Runs.back().second += HIVE_PAGE_SIZE;
+        }
+        else
+        {
+            Runs.push_back(std::make_pair(Offset, (ULONG)HIVE_PAGE_SIZE));
+        }
+        Payload += HIVE_PAGE_SIZE;
+    }
+
+    ULONG Size = HIVE_ALIGN(HVLE_HEADER_SIZE + (ULONG)Runs.size() * 8 + Payload, HVLE_ALIGNMENT);
+    std::vector<BYTE> Entry(Size, 0);
+    Write32(&Entry[0], HVLE_SIGNATURE);
+    Write32(&Entry[HVLE_SIZE], Size);
+    Write32(&Entry[HVLE_FLAGS], Read32(m_Base + REGF_FLAGS));
+    Write32(&Entry[HVLE_SEQUENCE], m_LogSequence);
+    Write32(&Entry[HVLE_BINS_SIZE], m_BinsSize);
+    Write32(&Entry[HVLE_PAGE_COUNT], (ULONG)Runs.size());
+    BYTE* Page = &Entry[HVLE_HEADER_SIZE + Runs.size() * 8];
+    for(size_t n = 0; n < Runs.size(); ++n)
+    {
+        Write32(&Entry[HVLE_HEADER_SIZE + n * 8], Runs[n].first);
+        Write32(&Entry[HVLE_HEADER_SIZE + n * 8 + 4], Runs[n].second);
+        for(ULONG Done = 0; Done < Runs[n].second; Done += HIVE_PAGE_SIZE)
+        {
+            const BYTE* Source = GetBinData(Runs[n].first + Done, HIVE_PAGE_SIZE);
+            if(!Source)
+            {
+                return FALSE;
+            }
+            memcpy(Page, Source, HIVE_PAGE_SIZE);
+            Page += HIVE_PAGE_SIZE;
+        }
+    }
+    Write64(&Entry[HVLE_HASH1], Marvin32(&Entry[HVLE_HEADER_SIZE], Size - HVLE_HEADER_SIZE));
+    Write64(&Entry[HVLE_HASH2], Marvin32(&Entry[0], HVLE_HASH2));
+
+    FILE* File = _wfopen(LogName.c_str(), m_LogValid ? L"r+b" : L"w+b");
+    if(!File)
+    {
+        return FALSE;
+    }
+    BOOL Success = TRUE;
+    if(!m_LogValid)
+    {
+        BYTE Header[REGF_LOG_HEADER_SIZE];
+        memcpy(Header, m_Base, sizeof(Header));
+        Write32(Header + REGF_SEQUENCE1, Sequence2);
+        Write32(Header + REGF_SEQUENCE2, Sequence2);
+        Write32(Header + REGF_FILE_TYPE, REGF_TYPE_LOG_NEW);
+        Write32(Header + REGF_CHECKSUM_OFFSET, BaseBlockChecksum(Header));
+        Success = WriteAt(File, 0, Header, sizeof(Header));
+    }
+    Success = Success && WriteAt(File, m_LogEnd, &Entry[0], Size) && SyncFile(File);
+    Success = !fclose(File) && Success;
+    if(!Success)
+    {
+        return FALSE;
+    }
+    m_LogValid = TRUE;
+    m_LogEnd += Size;
+    ++m_LogSequence;
+
+    /* Only the base block of the primary changes: it is now behind its log. */
+    File = _wfopen(m_FileName.c_str(), L"r+b");
+    if(!File)
+    {
+        return FALSE;
+    }
+    Write32(m_Base + REGF_SEQUENCE1, m_LogSequence);
+    Write32(m_Base + REGF_CHECKSUM_OFFSET, BaseBlockChecksum(m_Base));
+    Success = WriteAt(File, 0, m_Base, REGF_BASE_BLOCK_SIZE) && SyncFile(File);
+    Success = !fclose(File) && Success;
+    m_Dirty = TRUE;
+    return Success;
+}
+
+BOOL HiveWriter::Commit()
+{
+    if(!m_Modified)
+    {
+        return TRUE;
+    }
+    if(!(m_UseLog ? WriteLog() : WritePrimary()))
+    {
+        return FALSE;
+    }
+    m_DirtyPages.clear();
+    m_Modified = FALSE;
+    return TRUE;
+}
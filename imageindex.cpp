@@ -0,0 +1,149 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "imageindex.h"
+
+
+ImageNameIndex::ImageNameIndex()
+{
+    Reset();
+}
+
+/* Only the root node is left. */
+void ImageNameIndex::Reset()
+{
+    Node Root = { L'\0', IMAGE_INDEX_NONE, IMAGE_INDEX_NONE, IMAGE_INDEX_NONE };
+    m_Nodes.assign(1, Root);
+    m_Names.clear();
+}
+
+BOOL ImageNameIndex::AddImage( _In_z_ PCWSTR ImageName, _In_ ULONG /* Value */, _In_opt_ PVOID Context )
+{
+    ImageNameIndex* Index = (ImageNameIndex*)Context;
+    ULONG Node = Index->Find(ImageName, TRUE);
+    if(Index->m_Nodes[Node].Name == IMAGE_INDEX_NONE)
+    {
+        Index->m_Nodes[Node].Name = (ULONG)Index->m_Names.size();
+        Index->m_Names.push_back(ImageName);
+    }
+    return TRUE;
+}
+
+BOOL ImageNameIndex::Build( _In_ FlagStore* Store )
+{
+    std::lock_guard<std::mutex> Guard(m_Lock);
+    Reset();
+    return Store->EnumImageValues(NULL, AddImage, this);
+}
+
+void ImageNameIndex::Add( _In_z_ PCWSTR ImageName )
+{
+    if(!ImageName[0])
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> Guard(m_Lock);
+    AddImage(ImageName, 0, this);
+}
+
+BOOL ImageNameIndex::Contains( _In_z_ PCWSTR ImageName )
+{
+    std::lock_guard<std::mutex> Guard(m_Lock);
+    ULONG Node = Find(ImageName, FALSE);
+    return Node != IMAGE_INDEX_NONE && m_Nodes[Node].Name != IMAGE_INDEX_NONE;
+}
+
+size_t ImageNameIndex::Count()
+{
+    std::lock_guard<std::mutex> Guard(m_Lock);
+    return m_Names.size();
+}
+
+/* Walks (or extends) the trie along the lowercase Key, keeping the siblings sorted. */
+ULONG ImageNameIndex::Find( _In_z_ PCWSTR Key, _In_ BOOL Create )
+{
+    ULONG Current = 0;
+    for(; *Key; ++Key)
+    {
+        WCHAR Char = towlower(*Key);
+        ULONG Previous = IMAGE_INDEX_NONE;
+        ULONG Child = m_Nodes[Current].FirstChild;
+        while(Child != IMAGE_INDEX_NONE && m_Nodes[Child].Char < Char)
+        {
+            Previous = Child;
+            Child = m_Nodes[Child].NextSibling;
+        }
+        if(Child == IMAGE_INDEX_NONE || m_Nodes[Child].Char != Char)
+        {
+            if(!Create)
+            {
+                return IMAGE_INDEX_NONE;
+            }
+            Node New = { Char, IMAGE_INDEX_NONE, Child, IMAGE_INDEX_NONE };
+            Child = (ULONG)m_Nodes.size();
+            m_Nodes.push_back(New);
+            if(Previous == IMAGE_INDEX_NONE)
+                m_Nodes[Current].FirstChild = Child;
+            else
+                m_Nodes[Previous].NextSibling = Child;
+        }
+        Current = Child;
+    }
+    return Current;
+}
+
+void ImageNameIndex::Complete( _In_z_ PCWSTR Prefix, _In_ size_t MaxResults, _Inout_ std::vector<std::wstring>* Results )
+{
+    std::lock_guard<std::mutex> Guard(m_Lock);
+    ULONG Start = Find(Prefix, FALSE);
+    if(Start == IMAGE_INDEX_NONE)
+    {
+        return;
+    }
+
+    /* Depth first, a node's own name sorts before the names below it. */
+    std::vector<ULONG> Stack(1, Start);
+    size_t Found = 0;
+    while(!Stack.empty() && Found < MaxResults)
+    {
+        ULONG Current = Stack.back();
+        Stack.pop_back();
+        const Node& Entry = m_Nodes[Current];
+        if(Entry.Name != IMAGE_INDEX_NONE)
+        {
+            Results->push_back(m_Names[Entry.Name]);
+            ++Found;
+        }
+        if(Current != Start && Entry.NextSibling != IMAGE_INDEX_NONE)
+        {
+            Stack.push_back(Entry.NextSibling);
+        }
+        if(Entry.FirstChild != IMAGE_INDEX_NONE)
+        {
+            Stack.push_back(Entry.FirstChild);
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "flagstore.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define IMAGE_INDEX_NONE        0xffffffff
+
+/*
+ * Case insensitive prefix trie over the image names of a store, for completing
+ * image names. It is built once, names written later are added with Add.
+ *
+ * Nodes hold one character, with their children kept as a sorted sibling
+ * list, so a completion walks the prefix and then lists names alphabetically.
+ * All functions can be called from any thread.
+ */
+class GFLAGS_API ImageNameIndex
+{
+public:
+    ImageNameIndex();
+
+    /* Replaces the contents with every image known to Store. */
+    BOOL Build( _In_ FlagStore* Store );
+    void Add( _In_z_ PCWSTR ImageName );
+    BOOL Contains( _In_z_ PCWSTR ImageName );
+    size_t Count();
+
+    /* Appends up to MaxResults names starting with Prefix, in alphabetical order. */
+    void Complete( _In_z_ PCWSTR Prefix, _In_ size_t MaxResults, _Inout_ std::vector<std::wstring>* Results );
+
+private:
+    struct Node
+    {
+        WCHAR Char;
+        ULONG FirstChild;
+        ULONG NextSibling;
+        ULONG Name;         /* index in m_Names, IMAGE_INDEX_NONE when no name ends here */
+    };
+
+    static BOOL AddImage( _In_z_ PCWSTR ImageName, _In_ ULONG Value, _In_opt_ PVOID Context );
+    ULONG Find( _In_z_ PCWSTR Key, _In_ BOOL Create );
+    void Reset();
+
+    std::mutex m_Lock;
+    std::vector<Node> m_Nodes;
+    std::vector<std::wstring> m_Names;
+};
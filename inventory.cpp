@@ -0,0 +1,499 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "inventory.h"
+#include "mapfile.h"
+#include "gflags.h"
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+/*
+ * The x86 popcnt instruction is not in the baseline instruction set, so the
+ * compiler only emits it in CountBitsPopcnt, which is used after CPUID says
+ * it is there. Elsewhere __builtin_popcountll is whatever the target has.
+ */
+static ULONGLONG CountBitsPortable( _In_ const ULONGLONG* Words, _In_ size_t Count )
+{
+    ULONGLONG Total = 0;
+    for(size_t n = 0; n < Count; ++n)
+    {
+#if defined(_MSC_VER)
+        ULONGLONG Value = Words[n] - ((Words[n] >> 1) & 0x5555555555555555ULL);
+        Value = (Value & 0x3333333333333333ULL) + ((Value >> 2) & 0x3333333333333333ULL);
+        Value = (Value + (Value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        Total += (Value * 0x0101010101010101ULL) >> 56;
+#else
+        Total += (ULONGLONG)__builtin_popcountll(Words[n]);
+#endif
+    }
+    return Total;
+}
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define INVENTORY_POPCNT_DISPATCH
+static ULONGLONG CountBitsPopcnt( _In_ const ULONGLONG* Words, _In_ size_t Count )
+{
+    ULONGLONG Total = 0;
+    for(size_t n = 0; n < Count; ++n)
+    {
+#if defined(_M_X64)
+        Total += __popcnt64(Words[n]);
+#else
+        Total += __popcnt((ULONG)Words[n]) + __popcnt((ULONG)(Words[n] >> 32));
+#endif
+    }
+    return Total;
+}
+
+static BOOL HasPopcnt()
+{
+    int Info[4];
+    __cpuid(Info, 1);
+    return (Info[2] >> 23) & 1;
+}
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INVENTORY_POPCNT_DISPATCH
+__attribute__((target("popcnt")))
+static ULONGLONG CountBitsPopcnt( _In_ const ULONGLONG* Words, _In_ size_t Count )
+{
+    ULONGLONG Total = 0;
+    for(size_t n = 0; n < Count; ++n)
+    {
+        Total += (ULONGLONG)__builtin_popcountll(Words[n]);
+    }
+    return Total;
+}
+
+static BOOL HasPopcnt()
+{
+    return __builtin_cpu_supports("popcnt");
+}
+#endif
+
+static ULONGLONG CountBits( _In_ const ULONGLONG* Words, _In_ size_t Count )
+{
+#ifdef INVENTORY_POPCNT_DISPATCH
+    static const BOOL Popcnt = HasPopcnt();
+    if(Popcnt)
+    {
+        return CountBitsPopcnt(Words, Count);
+    }
+#endif
+    return CountBitsPortable(Words, Count);
+}
+
+/* Index of the lowest bit set, Value must not be 0. */
+static inline ULONG LowestBit( _In_ ULONGLONG Value )
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long Index;
+    _BitScanForward64(&Index, Value);
+    return Index;
+#elif defined(_MSC_VER)
+    unsigned long Index;
+    if(_BitScanForward(&Index, (ULONG)Value))
+    {
+        return Index;
+    }
+    _BitScanForward(&Index, (ULONG)(Value >> 32));
+    return Index + 32;
+#else
+    return (ULONG)__builtin_ctzll(Value);
+#endif
+}
+
+
+FlagInventory::FlagInventory()
+{
+}
+
+ULONG FlagInventory::Intern( _In_z_ PCWSTR Name, _Inout_ std::unordered_map<std::wstring, ULONG>* Index, _Inout_ std::vector<std::wstring>* Names )
+{
+    std::pair<std::unordered_map<std::wstring, ULONG>::iterator, bool> Entry = Index->insert(std::make_pair(std::wstring(Name), (ULONG)Names->size()));
+    if(Entry.second)
+    {
+        Names->push_back(Name);
+    }
+    return Entry.first->second;
+}
+
+void FlagInventory::Add( _In_z_ PCWSTR Host, _In_z_ PCWSTR Target, _In_ ULONG Flags )
+{
+    size_t Record = m_Flags.size();
+    size_t ChunkIndex = Record / INVENTORY_CHUNK_RECORDS;
+    WORD Offset = (WORD)(Record % INVENTORY_CHUNK_RECORDS);
+    m_HostIds.push_back(Intern(Host, &m_HostIndex, &m_Hosts));
+    m_TargetIds.push_back(Intern(Target, &m_TargetIndex, &m_Targets));
+    m_Flags.push_back(Flags);
+
+    for(ULONG Remaining = Flags; Remaining; Remaining &= Remaining - 1)
+    {
+        std::vector<Chunk>& Bitmap = m_Bitmaps[LowestBit(Remaining)];
+        if(Bitmap.size() <= ChunkIndex)
+        {
+            Bitmap.resize(ChunkIndex + 1);
+        }
+        Chunk& Bits = Bitmap[ChunkIndex];
+        if(!Bits.Bits.empty())
+        {
+            Bits.Bits[Offset / 64] |= 1ULL << (Offset % 64);
+            continue;
+        }
+        Bits.Array.push_back(Offset);
+        if(Bits.Array.size() > INVENTORY_ARRAY_MAX)
+        {
+            /* Past this point the array takes more space than the bitmap. */
+            Bits.Bits.assign(INVENTORY_CHUNK_WORDS, 0);
+            for(size_t n = 0; n < Bits.Array.size(); ++n)
+            {
+                Bits.Bits[Bits.Array[n] / 64] |= 1ULL << (Bits.Array[n] % 64);
+            }
+            std::vector<WORD>().swap(Bits.Array);
+        }
+    }
+}
+
+BOOL FlagInventory::AddSnapshot( _In_z_ PCWSTR Host, _Inout_ SnapshotReader* Snapshot )
+{
+    const SnapshotHeader& Header = Snapshot->Header();
+    std::wstring Name;
+    ULONG Flags;
+    if(Header.Contents & SNAPSHOT_HAS_REGISTRY)
+    {
+        Add(Host, L"registry", Header.GlobalFlags);
+    }
+    if(Header.Contents & SNAPSHOT_HAS_KERNEL)
+    {
+        Add(Host, L"kernel", Header.KernelFlags);
+    }
+    while(Snapshot->Next(&Name, &Flags))
+    {
+        Add(Host, Name.c_str(), Flags);
+    }
+    return Snapshot->IsComplete();
+}
+
+BOOL FlagInventory::AddSnapshots( _In_z_ PCWSTR Directory, _Out_ ULONG* Hosts )
+{
+    std::vector<std::pair<std::wstring, ULONGLONG> > Files;
+    BOOL Success = TRUE;
+    *Hosts = 0;
+    ListFiles(Directory, &Files);
+    std::sort(Files.begin(), Files.end());
+    for(size_t n = 0; n < Files.size(); ++n)
+    {
+        SnapshotReader Snapshot;
+        const std::wstring& FileName = Files[n].first;
+        if(!Snapshot.Open(FileName.c_str()))
+        {
+            continue;
+        }
+        size_t Start = FileName.find_last_of(L"\\/");
+        Start = Start == std::wstring::npos ? 0 : Start + 1;
+        size_t End = FileName.rfind(L'.');
+        End = End == std::wstring::npos || End < Start ? FileName.size() : End;
+        Success = AddSnapshot(FileName.substr(Start, End - Start).c_str(), &Snapshot) && Success;
+        ++*Hosts;
+    }
+    return Success;
+}
+
+BOOL FlagInventory::ParseUnary( _Inout_ PCWSTR* Pos, _Inout_ std::vector<Node>* Nodes, _Out_ size_t* Root ) const
+{
+    while(iswspace(**Pos))
+    {
+        ++*Pos;
+    }
+    if(**Pos == L'!')
+    {
+        ++*Pos;
+        Node Not = { NodeNot, 0, 0, 0 };
+        if(!ParseUnary(Pos, Nodes, &Not.Left))
+        {
+            return FALSE;
+        }
+        *Root = Nodes->size();
+        Nodes->push_back(Not);
+        return Nodes->size() <= INVENTORY_EXPRESSION_MAX;
+    }
+    if(**Pos == L'(')
+    {
+        ++*Pos;
+        if(!ParseOr(Pos, Nodes, Root))
+        {
+            return FALSE;
+        }
+        while(iswspace(**Pos))
+        {
+            ++*Pos;
+        }
+        return *(*Pos)++ == L')';
+    }
+
+    WCHAR Token[32];
+    size_t Length = 0;
+    while(iswalnum((*Pos)[Length]) && Length < 31)
+    {
+        Token[Length] = (*Pos)[Length];
+        ++Length;
+    }
+    Token[Length] = L'\0';
+    *Pos += Length;
+
+    ULONG Mask = 0;
+    const FlagInfo* Flag = Length ? FindFlag(Token) : NULL;
+    if(Flag)
+    {
+        Mask = Flag->dwFlag;
+    }
+    else if(Length > 2 && Token[0] == L'0' && towlower(Token[1]) == L'x')
+    {
+        PWSTR End = NULL;
+        Mask = wcstoul(Token + 2, &End, 16);
+        Mask = *End ? 0 : Mask;
+    }
+    if(!Mask)
+    {
+        return FALSE;
+    }
+
+    /* A mask with several bits needs all of them. */
+    for(ULONG Remaining = Mask; Remaining; Remaining &= Remaining - 1)
+    {
+        Node Bit = { NodeBit, LowestBit(Remaining), 0, 0 };
+        Nodes->push_back(Bit);
+        if(Remaining != Mask)
+        {
+            Node And = { NodeAnd, 0, *Root, Nodes->size() - 1 };
+            Nodes->push_back(And);
+        }
+        *Root = Nodes->size() - 1;
+    }
+    return Nodes->size() <= INVENTORY_EXPRESSION_MAX;
+}
+
+BOOL FlagInventory::ParseAnd( _Inout_ PCWSTR* Pos, _Inout_ std::vector<Node>* Nodes, _Out_ size_t* Root ) const
+{
+    if(!ParseUnary(Pos, Nodes, Root))
+    {
+        return FALSE;
+    }
+    for(;;)
+    {
+        while(iswspace(**Pos))
+        {
+            ++*Pos;
+        }
+        if(**Pos != L'&')
+        {
+            return TRUE;
+        }
+        ++*Pos;
+        Node And = { NodeAnd, 0, *Root, 0 };
+        if(!ParseUnary(Pos, Nodes, &And.Right))
+        {
+            return FALSE;
+        }
+        *Root = Nodes->size();
+        Nodes->push_back(And);
+    }
+}
+
+BOOL FlagInventory::ParseOr( _Inout_ PCWSTR* Pos, _Inout_ std::vector<Node>* Nodes, _Out_ size_t* Root ) const
+{
+    if(!ParseAnd(Pos, Nodes, Root))
+    {
+        return FALSE;
+    }
+    for(;;)
+    {
+        while(iswspace(**Pos))
+        {
+            ++*Pos;
+        }
+        if(**Pos != L'|')
+        {
+            return TRUE;
+        }
+        ++*Pos;
+        Node Or = { NodeOr, 0, *Root, 0 };
+        if(!ParseAnd(Pos, Nodes, &Or.Right))
+        {
+            return FALSE;
+        }
+        *Root = Nodes->size();
+        Nodes->push_back(Or);
+    }
+}
+
+/*
+ * Evaluates a node over the first Words words of one chunk into Result, using
+ * the space after Scratch for the operands. FALSE when Result is all zero.
+ * The loops work on whole words and have no dependencies between iterations,
+ * so the compiler can vectorize them.
+ */
+BOOL FlagInventory::Evaluate( _In_ const std::vector<Node>& Nodes, _In_ size_t Root, _In_ size_t ChunkIndex, _In_ size_t Words,
+                              _Out_ ULONGLONG* Result, _Inout_ ULONGLONG* Scratch ) const
+{
+    const Node& Current = Nodes[Root];
+    switch(Current.Type)
+    {
+    case NodeBit:
+    {
+        const std::vector<Chunk>& Bitmap = m_Bitmaps[Current.Bit];
+        const Chunk* Bits = ChunkIndex < Bitmap.size() ? &Bitmap[ChunkIndex] : NULL;
+        if(Bits && !Bits->Bits.empty())
+        {
+            memcpy(Result, Bits->Bits.data(), Words * sizeof(ULONGLONG));
+            return TRUE;
+        }
+        memset(Result, 0, Words * sizeof(ULONGLONG));
+        if(!Bits || Bits->Array.empty())
+        {
+            return FALSE;
+        }
+        for(size_t n = 0; n < Bits->Array.size(); ++n)
+        {
+            Result[Bits->Array[n] / 64] |= 1ULL << (Bits->Array[n] % 64);
+        }
+        return TRUE;
+    }
+    case NodeNot:
+    {
+        Evaluate(Nodes, Current.Left, ChunkIndex, Words, Result, Scratch);
+        for(size_t n = 0; n < Words; ++n)
+        {
+            Result[n] = ~Result[n];
+        }
+        /* Records past the end of the inventory never match. */
+        size_t Used = (m_Flags.size() - ChunkIndex * INVENTORY_CHUNK_RECORDS) % 64;
+        if(Used && Words * 64 > m_Flags.size() - ChunkIndex * INVENTORY_CHUNK_RECORDS)
+        {
+            Result[Words - 1] &= (1ULL << Used) - 1;
+        }
+        return TRUE;
+    }
+    case NodeAnd:
+    {
+        if(!Evaluate(Nodes, Current.Left, ChunkIndex, Words, Result, Scratch))
+        {
+            return FALSE;
+        }
+        const Node& Right = Nodes[Current.Right];
+        if(Right.Type == NodeNot)
+        {
+            /* a & !b without inverting b first. */
+            Evaluate(Nodes, Right.Left, ChunkIndex, Words, Scratch, Scratch + Words);
+            for(size_t n = 0; n < Words; ++n)
+            {
+                Result[n] &= ~Scratch[n];
+            }
+            return TRUE;
+        }
+        if(!Evaluate(Nodes, Current.Right, ChunkIndex, Words, Scratch, Scratch + Words))
+        {
+            memset(Result, 0, Words * sizeof(ULONGLONG));
+            return FALSE;
+        }
+        for(size_t n = 0; n < Words; ++n)
+        {
+            Result[n] &= Scratch[n];
+        }
+        return TRUE;
+    }
+    case NodeOr:
+    default:
+    {
+        BOOL Any = Evaluate(Nodes, Current.Left, ChunkIndex, Words, Result, Scratch);
+        if(!Evaluate(Nodes, Current.Right, ChunkIndex, Words, Scratch, Scratch + Words))
+        {
+            return Any;
+        }
+        for(size_t n = 0; n < Words; ++n)
+        {
+            Result[n] |= Scratch[n];
+        }
+        return TRUE;
+    }
+    }
+}
+
+BOOL FlagInventory::Query( _In_z_ PCWSTR Expression, _In_opt_ InventoryMatchCallback Callback, _In_opt_ PVOID Context, _Out_ ULONGLONG* Matches ) const
+{
+    std::vector<Node> Nodes;
+    size_t Root = 0;
+    PCWSTR Pos = Expression;
+    *Matches = 0;
+    if(!ParseOr(&Pos, &Nodes, &Root))
+    {
+        return FALSE;
+    }
+    while(iswspace(*Pos))
+    {
+        ++Pos;
+    }
+    if(*Pos)
+    {
+        return FALSE;
+    }
+
+    /* One buffer for the result and one per level of the expression. */
+    std::vector<ULONGLONG> Buffers((Nodes.size() + 1) * INVENTORY_CHUNK_WORDS);
+    ULONGLONG* Result = Buffers.data();
+    size_t Chunks = (m_Flags.size() + INVENTORY_CHUNK_RECORDS - 1) / INVENTORY_CHUNK_RECORDS;
+    for(size_t ChunkIndex = 0; ChunkIndex < Chunks; ++ChunkIndex)
+    {
+        size_t Records = std::min(m_Flags.size() - ChunkIndex * INVENTORY_CHUNK_RECORDS, (size_t)INVENTORY_CHUNK_RECORDS);
+        size_t Words = (Records + 63) / 64;
+        if(!Evaluate(Nodes, Root, ChunkIndex, Words, Result, Result + INVENTORY_CHUNK_WORDS))
+        {
+            continue;
+        }
+        ULONGLONG Count = CountBits(Result, Words);
+        *Matches += Count;
+        if(!Callback || !Count)
+        {
+            continue;
+        }
+        for(size_t n = 0; Callback && n < Words; ++n)
+        {
+            for(ULONGLONG Word = Result[n]; Word; Word &= Word - 1)
+            {
+                size_t Record = ChunkIndex * INVENTORY_CHUNK_RECORDS + n * 64 + LowestBit(Word);
+                if(!Callback(m_Hosts[m_HostIds[Record]].c_str(), m_Targets[m_TargetIds[Record]].c_str(), m_Flags[Record], Context))
+                {
+                    Callback = NULL;
+                    break;
+                }
+            }
+        }
+    }
+    return TRUE;
+}
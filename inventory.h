@@ -0,0 +1,105 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "snapshot.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Flags of many hosts, one record per host and target (an image name, or
+ * 'registry' / 'kernel'), for questions like 'which images have hpa but not
+ * ust'. Besides the records, there is one bitmap per flag bit over the record
+ * numbers. The bitmaps are split in chunks of INVENTORY_CHUNK_RECORDS records;
+ * a chunk is stored as a sorted array of record offsets while few records
+ * have the bit, and as a plain bitmap once that is smaller.
+ *
+ * Queries combine the bitmaps a chunk at a time, 64 bits per operation, and
+ * count the matches with popcount.
+ */
+
+#define INVENTORY_CHUNK_RECORDS     65536
+#define INVENTORY_CHUNK_WORDS       (INVENTORY_CHUNK_RECORDS / 64)
+#define INVENTORY_ARRAY_MAX         (INVENTORY_CHUNK_RECORDS / 16)
+#define INVENTORY_EXPRESSION_MAX    64
+
+/* Called for each matching record, return FALSE to stop. */
+typedef BOOL (*InventoryMatchCallback)( _In_z_ PCWSTR Host, _In_z_ PCWSTR Target, _In_ ULONG Flags, _In_opt_ PVOID Context );
+
+class GFLAGS_API FlagInventory
+{
+public:
+    FlagInventory();
+
+    void Add( _In_z_ PCWSTR Host, _In_z_ PCWSTR Target, _In_ ULONG Flags );
+    BOOL AddSnapshot( _In_z_ PCWSTR Host, _Inout_ SnapshotReader* Snapshot );
+
+    /* Adds every snapshot below Directory, named after the file without its extension. */
+    BOOL AddSnapshots( _In_z_ PCWSTR Directory, _Out_ ULONG* Hosts );
+
+    size_t Count() const { return m_Flags.size(); }
+
+    /*
+     * Expression combines flag abbreviations or hex masks with '&', '|', '!'
+     * and parentheses, 'hpa & !ust' for example. A mask matches records that
+     * have all of its bits. FALSE when the expression is not valid.
+     */
+    BOOL Query( _In_z_ PCWSTR Expression, _In_opt_ InventoryMatchCallback Callback, _In_opt_ PVOID Context, _Out_ ULONGLONG* Matches ) const;
+
+private:
+    struct Chunk
+    {
+        std::vector<WORD> Array;
+        std::vector<ULONGLONG> Bits;    /* used instead of Array once it is not empty */
+    };
+
+    enum NodeType { NodeBit, NodeNot, NodeAnd, NodeOr };
+
+    struct Node
+    {
+        NodeType Type;
+        ULONG Bit;
+        size_t Left;
+        size_t Right;
+    };
+
+    ULONG Intern( _In_z_ PCWSTR Name, _Inout_ std::unordered_map<std::wstring, ULONG>* Index, _Inout_ std::vector<std::wstring>* Names );
+    BOOL ParseOr( _Inout_ PCWSTR* Pos, _Inout_ std::vector<Node>* Nodes, _Out_ size_t* Root ) const;
+    BOOL ParseAnd( _Inout_ PCWSTR* Pos, _Inout_ std::vector<Node>* Nodes, _Out_ size_t* Root ) const;
+    BOOL ParseUnary( _Inout_ PCWSTR* Pos, _Inout_ std::vector<Node>* Nodes, _Out_ size_t* Root ) const;
+    BOOL Evaluate( _In_ const std::vector<Node>& Nodes, _In_ size_t Root, _In_ size_t ChunkIndex, _In_ size_t Words, _Out_ ULONGLONG* Result, _Inout_ ULONGLONG* Scratch ) const;
+
+    std::vector<std::wstring> m_Hosts;
+    std::vector<std::wstring> m_Targets;
+    std::unordered_map<std::wstring, ULONG> m_HostIndex;
+    std::unordered_map<std::wstring, ULONG> m_TargetIndex;
+    std::vector<ULONG> m_HostIds;
+    std::vector<ULONG> m_TargetIds;
+    std::vector<ULONG> m_Flags;
+    std::vector<Chunk> m_Bitmaps[32];
+};
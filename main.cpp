@@ -22,17 +22,85 @@
  * SOFTWARE.
  */
 
-#include <Windows.h>
+#include "platform.h"
 #include "gflags.h"
+#include "flagstore.h"
+#include "flagttl.h"
+#ifndef _WIN32
+#include <locale.h>
+#include <string>
+#include <vector>
+#endif
 
 
+#ifdef _WIN32
+
 int wmain(int argc, const wchar_t *argv[])
 {
+    FlagStore* Store = NULL;
     UpdateValidFlags();
     if( argc > 1 )
     {
-        ParseCommandline( argc, argv );
+        int Result = ParseCommandline( argc, argv, &Store );
+        if( Result != COMMANDLINE_SHOW_UI )
+        {
+            delete Store;
+            return Result;
+        }
+    }
+    else
+    {
+        /* ParseCommandline does this for the store it selected. */
+        ULONG Reverted;
+        RevertExpiredFlags( GetFlagStore(), GetTtlTime(), &Reverted );
     }
     FreeConsole();
-    return ShowDialog();
+    if( Store )
+    {
+        SetFlagStore( Store );
+    }
+    int Result = ShowDialog();
+    SetFlagStore( NULL );
+    delete Store;
+    return Result;
 }
+
+#else
+
+/* The dialog is Win32 only, elsewhere gflags is just the command line. */
+int main(int argc, char *argv[])
+{
+    std::vector<std::wstring> Args(argc);
+    std::vector<PCWSTR> WideArgs(argc);
+    FlagStore* Store = NULL;
+    setlocale( LC_ALL, "" );
+    for( int n = 0; n < argc; ++n )
+    {
+        size_t Length = mbstowcs( NULL, argv[n], 0 );
+        if( Length == (size_t)-1 )
+        {
+            fwprintf( stderr, L"gflags: Argument %d is not valid in the current locale\r\n", n );
+            return 1;
+        }
+        std::vector<WCHAR> Buffer( Length + 1 );
+        mbstowcs( &Buffer[0], argv[n], Length + 1 );
+        Args[n] = &Buffer[0];
+        WideArgs[n] = Args[n].c_str();
+    }
+    UpdateValidFlags();
+    if( argc < 2 )
+    {
+        PrintUsage( stderr );
+        return 1;
+    }
+    int Result = ParseCommandline( argc, &WideArgs[0], &Store );
+    delete Store;
+    if( Result == COMMANDLINE_SHOW_UI )
+    {
+        fwprintf( stderr, L"gflags: The dialog is only available on Windows\r\n" );
+        return 1;
+    }
+    return Result;
+}
+
+#endif
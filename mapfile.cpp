@@ -0,0 +1,347 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "mapfile.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+MappedFile::MappedFile()
+#ifdef _WIN32
+    : m_File(INVALID_HANDLE_VALUE)
+    , m_Mapping(NULL)
+#else
+    : m_File(-1)
+#endif
+    , m_Data(NULL)
+    , m_Size(0)
+    , m_Private(FALSE)
+    , m_Window(NULL)
+    , m_WindowLength(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+BOOL MappedFile::Open( _In_z_ PCWSTR FileName, _In_ BOOL Private )
+{
+    Close();
+    m_File = CreateFileW(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(m_File == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    LARGE_INTEGER FileSize;
+    if(!GetFileSizeEx(m_File, &FileSize) || (ULONGLONG)FileSize.QuadPart > (SIZE_T)-1)
+    {
+        Close();
+        return FALSE;
+    }
+    m_Size = (size_t)FileSize.QuadPart;
+    if(!m_Size)
+    {
+        return TRUE;
+    }
+    m_Mapping = CreateFileMappingW(m_File, NULL, Private ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if(m_Mapping)
+    {
+        m_Data = (BYTE*)MapViewOfFile(m_Mapping, Private ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    }
+    if(!m_Data)
+    {
+        Close();
+        return FALSE;
+    }
+    m_Private = Private;
+    return TRUE;
+}
+
+BOOL MappedFile::OpenWindowed( _In_z_ PCWSTR FileName )
+{
+    Close();
+    m_File = CreateFileW(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(m_File == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    LARGE_INTEGER FileSize;
+    if(!GetFileSizeEx(m_File, &FileSize) || (ULONGLONG)FileSize.QuadPart > (SIZE_T)-1)
+    {
+        Close();
+        return FALSE;
+    }
+    m_Size = (size_t)FileSize.QuadPart;
+    if(m_Size)
+    {
+        m_Mapping = CreateFileMappingW(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(!m_Mapping)
+        {
+            Close();
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+const BYTE* MappedFile::MapWindow( _In_ size_t Offset, _In_ size_t Length, _Out_ size_t* Available )
+{
+    SYSTEM_INFO Info;
+    GetSystemInfo(&Info);
+    UnmapWindow();
+    *Available = 0;
+    if(!m_Mapping || Offset >= m_Size)
+    {
+        return NULL;
+    }
+    /* Views start at a multiple of the allocation granularity. */
+    size_t Base = Offset - Offset % Info.dwAllocationGranularity;
+    size_t End = Length < m_Size - Offset ? Offset + Length : m_Size;
+    m_Window = (BYTE*)MapViewOfFile(m_Mapping, FILE_MAP_READ, (DWORD)((ULONGLONG)Base >> 32), (DWORD)Base, End - Base);
+    if(!m_Window)
+    {
+        return NULL;
+    }
+    m_WindowLength = End - Base;
+    *Available = End - Offset;
+    return m_Window + (Offset - Base);
+}
+
+void MappedFile::UnmapWindow()
+{
+    if(m_Window)
+    {
+        UnmapViewOfFile(m_Window);
+    }
+    m_Window = NULL;
+    m_WindowLength = 0;
+}
+
+void MappedFile::Close()
+{
+    UnmapWindow();
+    if(m_Data)
+    {
+        UnmapViewOfFile(m_Data);
+    }
+    if(m_Mapping)
+    {
+        CloseHandle(m_Mapping);
+    }
+    if(m_File != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_File);
+    }
+    m_File = INVALID_HANDLE_VALUE;
+    m_Mapping = NULL;
+    m_Data = NULL;
+    m_Size = 0;
+    m_Private = FALSE;
+}
+
+#else
+
+BOOL MappedFile::Open( _In_z_ PCWSTR FileName, _In_ BOOL Private )
+{
+    char NarrowName[1024];
+    Close();
+    if(wcstombs(NarrowName, FileName, sizeof(NarrowName)) == (size_t)-1)
+    {
+        return FALSE;
+    }
+    m_File = open(NarrowName, O_RDONLY);
+    if(m_File < 0)
+    {
+        return FALSE;
+    }
+    struct stat st;
+    if(fstat(m_File, &st))
+    {
+        Close();
+        return FALSE;
+    }
+    m_Size = (size_t)st.st_size;
+    if(!m_Size)
+    {
+        return TRUE;
+    }
+    void* Data = Private ? mmap(NULL, m_Size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_File, 0)
+                         : mmap(NULL, m_Size, PROT_READ, MAP_SHARED, m_File, 0);
+    if(Data == MAP_FAILED)
+    {
+        Close();
+        return FALSE;
+    }
+    m_Data = (BYTE*)Data;
+    m_Private = Private;
+    return TRUE;
+}
+
+BOOL MappedFile::OpenWindowed( _In_z_ PCWSTR FileName )
+{
+    char NarrowName[1024];
+    Close();
+    if(wcstombs(NarrowName, FileName, sizeof(NarrowName)) == (size_t)-1)
+    {
+        return FALSE;
+    }
+    m_File = open(NarrowName, O_RDONLY);
+    if(m_File < 0)
+    {
+        return FALSE;
+    }
+    struct stat st;
+    if(fstat(m_File, &st))
+    {
+        Close();
+        return FALSE;
+    }
+    m_Size = (size_t)st.st_size;
+    return TRUE;
+}
+
+const BYTE* MappedFile::MapWindow( _In_ size_t Offset, _In_ size_t Length, _Out_ size_t* Available )
+{
+    UnmapWindow();
+    *Available = 0;
+    if(m_File < 0 || Offset >= m_Size)
+    {
+        return NULL;
+    }
+    /* Mappings start at a page boundary. */
+    size_t PageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t Base = Offset - Offset % PageSize;
+    size_t End = Length < m_Size - Offset ? Offset + Length : m_Size;
+    void* Window = mmap(NULL, End - Base, PROT_READ, MAP_SHARED, m_File, (off_t)Base);
+    if(Window == MAP_FAILED)
+    {
+        return NULL;
+    }
+    madvise(Window, End - Base, MADV_SEQUENTIAL);
+    m_Window = (BYTE*)Window;
+    m_WindowLength = End - Base;
+    *Available = End - Offset;
+    return m_Window + (Offset - Base);
+}
+
+void MappedFile::UnmapWindow()
+{
+    if(m_Window)
+    {
+        munmap(m_Window, m_WindowLength);
+    }
+    m_Window = NULL;
+    m_WindowLength = 0;
+}
+
+void MappedFile::Close()
+{
+    UnmapWindow();
+    if(m_Data)
+    {
+        munmap(m_Data, m_Size);
+    }
+    if(m_File >= 0)
+    {
+        close(m_File);
+    }
+    m_File = -1;
+    m_Data = NULL;
+    m_Size = 0;
+    m_Private = FALSE;
+}
+
+#endif
+
+
+void ListFiles( _In_z_ PCWSTR Directory, _Inout_ std::vector<std::pair<std::wstring, ULONGLONG> >* Files )
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAW Data;
+    HANDLE Find = FindFirstFileW((std::wstring(Directory) + L"\\*").c_str(), &Data);
+    if(Find == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    do
+    {
+        std::wstring Path = std::wstring(Directory) + L"\\" + Data.cFileName;
+        if(Data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if(wcscmp(Data.cFileName, L".") && wcscmp(Data.cFileName, L".."))
+            {
+                ListFiles(Path.c_str(), Files);
+            }
+        }
+        else
+        {
+            Files->push_back(std::make_pair(Path, ((ULONGLONG)Data.nFileSizeHigh << 32) | Data.nFileSizeLow));
+        }
+    } while(FindNextFileW(Find, &Data));
+    FindClose(Find);
+#else
+    char NarrowDirectory[1024];
+    if(wcstombs(NarrowDirectory, Directory, sizeof(NarrowDirectory)) == (size_t)-1)
+    {
+        return;
+    }
+    DIR* Dir = opendir(NarrowDirectory);
+    if(!Dir)
+    {
+        return;
+    }
+    while(struct dirent* Entry = readdir(Dir))
+    {
+        std::string Path = std::string(NarrowDirectory) + "/" + Entry->d_name;
+        WCHAR WidePath[1024];
+        struct stat st;
+        if(!strcmp(Entry->d_name, ".") || !strcmp(Entry->d_name, "..") || stat(Path.c_str(), &st) ||
+           mbstowcs(WidePath, Path.c_str(), 1024) == (size_t)-1)
+        {
+            continue;
+        }
+        if(S_ISDIR(st.st_mode))
+        {
+            ListFiles(WidePath, Files);
+        }
+        else if(S_ISREG(st.st_mode))
+        {
+            Files->push_back(std::make_pair(std::wstring(WidePath), (ULONGLONG)st.st_size));
+        }
+    }
+    closedir(Dir);
+#endif
+}
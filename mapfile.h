@@ -0,0 +1,80 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include <string>
+#include <vector>
+
+/*
+ * View of a whole file, mapped into memory.
+ * A private view can be modified, changes stay in process memory and never
+ * reach the file.
+ *
+ * Files opened with OpenWindowed are not mapped as a whole, MapWindow maps
+ * one part of them at a time, for files too large to keep in memory.
+ */
+class GFLAGS_API MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    BOOL Open( _In_z_ PCWSTR FileName, _In_ BOOL Private = FALSE );
+    BOOL OpenWindowed( _In_z_ PCWSTR FileName );
+    void Close();
+
+    /*
+     * Replaces the current window with the read only data at Offset, at most Length bytes.
+     * *Available receives the number of bytes mapped from Offset, 0 past the end of the file.
+     */
+    const BYTE* MapWindow( _In_ size_t Offset, _In_ size_t Length, _Out_ size_t* Available );
+
+    const BYTE* Data() const { return m_Data; }
+    BYTE* PrivateData() const { return m_Private ? m_Data : NULL; }
+    size_t Size() const { return m_Size; }
+
+private:
+    MappedFile( const MappedFile& );
+    MappedFile& operator=( const MappedFile& );
+
+#ifdef _WIN32
+    HANDLE m_File;
+    HANDLE m_Mapping;
+#else
+    int m_File;
+#endif
+    void UnmapWindow();
+
+    BYTE* m_Data;
+    size_t m_Size;
+    BOOL m_Private;
+    BYTE* m_Window;
+    size_t m_WindowLength;
+};
+
+/* Adds the regular files below Directory, with their sizes, to *Files. */
+GFLAGS_API void ListFiles( _In_z_ PCWSTR Directory, _Inout_ std::vector<std::pair<std::wstring, ULONGLONG> >* Files );
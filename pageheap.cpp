@@ -0,0 +1,139 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "pageheap.h"
+
+#define PAGE_HEAP_MANAGED_FLAGS     (PAGE_HEAP_ENABLE_PAGE_HEAP | PAGE_HEAP_USE_SIZE_RANGE | PAGE_HEAP_USE_RANDOM_DECISION | PAGE_HEAP_USE_DLL_NAMES)
+
+
+void InitPageHeapConfig( _Out_ PageHeapConfig* Config )
+{
+    Config->Mode = PAGEHEAP_OFF;
+    Config->SizeStart = Config->SizeEnd = 0;
+    Config->RandomPercent = 0;
+    Config->TargetDlls.clear();
+    Config->Flags = 0;
+}
+
+BOOL ReadPageHeapConfig( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _Out_ PageHeapConfig* Config )
+{
+    ULONG GlobalFlag;
+    InitPageHeapConfig(Config);
+    if(!ReadFlags(Store, DEST_IMAGE, ImageName, &GlobalFlag) ||
+       !Store->ReadImageValue(ImageName, PAGEHEAP_FLAGS_VALUENAME, &Config->Flags))
+    {
+        return FALSE;
+    }
+    if(GlobalFlag & FLG_HEAP_PAGE_ALLOCS)
+    {
+        Config->Mode = (Config->Flags & PAGE_HEAP_ENABLE_PAGE_HEAP) ? PAGEHEAP_FULL : PAGEHEAP_LIGHT;
+    }
+    if((Config->Flags & PAGE_HEAP_USE_SIZE_RANGE) &&
+       (!Store->ReadImageValue(ImageName, PAGEHEAP_SIZE_START_VALUENAME, &Config->SizeStart) ||
+        !Store->ReadImageValue(ImageName, PAGEHEAP_SIZE_END_VALUENAME, &Config->SizeEnd)))
+    {
+        return FALSE;
+    }
+    if((Config->Flags & PAGE_HEAP_USE_RANDOM_DECISION) && !Store->ReadImageValue(ImageName, PAGEHEAP_RANDOM_VALUENAME, &Config->RandomPercent))
+    {
+        return FALSE;
+    }
+    if(Config->Flags & PAGE_HEAP_USE_DLL_NAMES)
+    {
+        Store->ReadImageString(ImageName, PAGEHEAP_DLLS_VALUENAME, &Config->TargetDlls);
+    }
+    return TRUE;
+}
+
+/* Writes Value unless the store already holds it, a missing value counts as 0. */
+static BOOL UpdateImageValue( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    ULONG Current;
+    if(!Store->ReadImageValue(ImageName, ValueName, &Current))
+    {
+        return FALSE;
+    }
+    return Current == Value || Store->WriteImageValue(ImageName, ValueName, Value);
+}
+
+static BOOL UpdateImageString( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ const std::wstring& Value )
+{
+    std::wstring Current;
+    if(!Store->ReadImageString(ImageName, ValueName, &Current))
+    {
+        /* Nothing to clear in a store without string values. */
+        return Value.empty();
+    }
+    return Current == Value || Store->WriteImageString(ImageName, ValueName, Value.c_str());
+}
+
+static BOOL WriteLimits( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ const PageHeapConfig* Config, _In_ ULONG Flags )
+{
+    return UpdateImageValue(Store, ImageName, PAGEHEAP_SIZE_START_VALUENAME, Config->SizeStart) &&
+           UpdateImageValue(Store, ImageName, PAGEHEAP_SIZE_END_VALUENAME, Config->SizeEnd) &&
+           UpdateImageValue(Store, ImageName, PAGEHEAP_RANDOM_VALUENAME, Config->RandomPercent) &&
+           UpdateImageString(Store, ImageName, PAGEHEAP_DLLS_VALUENAME, Config->TargetDlls) &&
+           UpdateImageValue(Store, ImageName, PAGEHEAP_FLAGS_VALUENAME, Flags);
+}
+
+BOOL WritePageHeapConfig( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ const PageHeapConfig* Config )
+{
+    BOOL Limited = Config->SizeEnd || Config->RandomPercent || !Config->TargetDlls.empty();
+    if((Limited && Config->Mode != PAGEHEAP_FULL) || ((Config->SizeStart || Config->SizeEnd) && Config->SizeStart >= Config->SizeEnd) ||
+       Config->RandomPercent > 100)
+    {
+        return FALSE;
+    }
+
+    FlagEdit Edit;
+    FlagUpdate Update;
+    InitFlagEdit(&Edit);
+    if(Config->Mode == PAGEHEAP_OFF)
+    {
+        PageHeapConfig Off;
+        InitPageHeapConfig(&Off);
+        Edit.And = ~(ULONG)FLG_HEAP_PAGE_ALLOCS;
+        return UpdateFlags(Store, DEST_IMAGE, ImageName, &Edit, &Update) && WriteLimits(Store, ImageName, &Off, 0);
+    }
+
+    Edit.Or = FLG_HEAP_PAGE_ALLOCS;
+    return WriteLimits(Store, ImageName, Config, GetPageHeapFlags(Config)) && UpdateFlags(Store, DEST_IMAGE, ImageName, &Edit, &Update);
+}
+
+ULONG GetPageHeapFlags( _In_ const PageHeapConfig* Config )
+{
+    if(Config->Mode == PAGEHEAP_OFF)
+    {
+        return 0;
+    }
+    /* Stack traces are on by default, like a new page heap from the other tools. */
+    ULONG Flags = Config->Flags ? (Config->Flags & ~PAGE_HEAP_MANAGED_FLAGS) : PAGE_HEAP_COLLECT_STACK_TRACES;
+    Flags |= Config->Mode == PAGEHEAP_FULL ? PAGE_HEAP_ENABLE_PAGE_HEAP : 0;
+    Flags |= Config->SizeEnd ? PAGE_HEAP_USE_SIZE_RANGE : 0;
+    Flags |= Config->RandomPercent ? PAGE_HEAP_USE_RANDOM_DECISION : 0;
+    Flags |= Config->TargetDlls.empty() ? 0 : PAGE_HEAP_USE_DLL_NAMES;
+    return Flags;
+}
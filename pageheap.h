@@ -0,0 +1,86 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "flagstore.h"
+#include <string>
+
+/*
+ * Page heap settings of an image, next to its GlobalFlag value. hpa alone puts
+ * every allocation of the process in full page heap. The PageHeapFlags value
+ * picks light page heap instead, or limits full page heap to the allocations
+ * from some DLLs, of some sizes, or to a random share of them; the rest then
+ * gets light page heap.
+ */
+
+#define PAGEHEAP_FLAGS_VALUENAME        L"PageHeapFlags"
+#define PAGEHEAP_SIZE_START_VALUENAME   L"PageHeapSizeRangeStart"
+#define PAGEHEAP_SIZE_END_VALUENAME     L"PageHeapSizeRangeEnd"
+#define PAGEHEAP_RANDOM_VALUENAME       L"PageHeapRandomProbability"
+#define PAGEHEAP_DLLS_VALUENAME         L"PageHeapTargetDlls"
+
+/* PageHeapFlags, as read by the heap manager */
+#define PAGE_HEAP_ENABLE_PAGE_HEAP          0x0001      /* full page heap, light page heap without it */
+#define PAGE_HEAP_COLLECT_STACK_TRACES      0x0002
+#define PAGE_HEAP_USE_SIZE_RANGE            0x0008
+#define PAGE_HEAP_USE_DLL_RANGE             0x0010
+#define PAGE_HEAP_USE_RANDOM_DECISION       0x0020
+#define PAGE_HEAP_USE_DLL_NAMES             0x0100
+
+/* PageHeapConfig::Mode */
+#define PAGEHEAP_OFF                0
+#define PAGEHEAP_LIGHT              1
+#define PAGEHEAP_FULL               2
+
+struct PageHeapConfig
+{
+    DWORD Mode;
+    /* The limits of full page heap, each one is used when set. */
+    ULONG SizeStart;            /* bytes, with SizeEnd */
+    ULONG SizeEnd;
+    ULONG RandomPercent;
+    std::wstring TargetDlls;    /* separated by spaces */
+    /* PageHeapFlags as stored, bits that are not listed above are kept. */
+    ULONG Flags;
+};
+
+GFLAGS_API void InitPageHeapConfig( _Out_ PageHeapConfig* Config );
+
+/* Stores without string values read no TargetDlls. */
+GFLAGS_API BOOL ReadPageHeapConfig( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _Out_ PageHeapConfig* Config );
+
+/*
+ * Writes the values that differ from what is stored and sets or clears hpa.
+ * The limits are written before hpa is set, so a process that starts in
+ * between never runs with full page heap for everything. FALSE when the
+ * limits are not valid: they need PAGEHEAP_FULL, a SizeStart below SizeEnd
+ * and a RandomPercent up to 100.
+ */
+GFLAGS_API BOOL WritePageHeapConfig( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ const PageHeapConfig* Config );
+
+/* The PageHeapFlags value WritePageHeapConfig stores for Config. */
+GFLAGS_API ULONG GetPageHeapFlags( _In_ const PageHeapConfig* Config );
@@ -0,0 +1,65 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include "platform.h"
+#include "gflags.h"
+
+/*
+ * Stand-ins for the Win32 parts of gflags.cpp, so the stores, the console and
+ * the server build on other platforms. There is no registry or running system
+ * to change there: GetFlagStore falls back to a MemoryFlagStore.
+ */
+
+#ifndef _WIN32
+
+#include <sys/utsname.h>
+
+DWORD g_PoolTaggingEnabled = 0;
+
+void UpdateValidFlags()
+{
+}
+
+/* The kernel release, such as 6.8.12 from '6.8.12-generic'. Snapshots record it like a Windows build. */
+void GetOsVersion( _Out_ ULONG* Major, _Out_ ULONG* Minor, _Out_ ULONG* Build )
+{
+    struct utsname Name;
+    unsigned int Version[3] = { 0, 0, 0 };
+    if(!uname(&Name))
+    {
+        sscanf(Name.release, "%u.%u.%u", &Version[0], &Version[1], &Version[2]);
+    }
+    *Major = Version[0];
+    *Minor = Version[1];
+    *Build = Version[2];
+}
+
+BOOL EnableDebug()
+{
+    return FALSE;
+}
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+/*
+ * Minimal portability layer.
+ * On Windows this is just <Windows.h>; elsewhere it provides the handful of
+ * Win32 types and helpers the store / parsing code needs, so those parts can
+ * be built and exercised on non-Windows build agents.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#ifdef _WIN32
+
+#include <Windows.h>
+
+#else
+
+#include <stdint.h>
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef uint64_t ULONGLONG;
+typedef wchar_t WCHAR;
+typedef WCHAR* PWSTR;
+typedef const WCHAR* PCWSTR;
+typedef DWORD* PDWORD;
+typedef ULONG* PULONG;
+typedef void* PVOID;
+typedef BYTE* LPBYTE;
+
+#define TRUE    1
+#define FALSE   0
+
+#define _In_
+#define _In_z_
+#define _In_opt_
+#define _In_opt_z_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+
+#define ERROR_SUCCESS           0L
+#define ERROR_FILE_NOT_FOUND    2L
+#define ERROR_ACCESS_DENIED     5L
+#define ERROR_INVALID_DATA      13L
+#define ERROR_OUTOFMEMORY       14L
+#define ERROR_NOT_SUPPORTED     50L
+#define ERROR_MORE_DATA         234L
+#define ERROR_NO_MORE_ITEMS     259L
+#define ERROR_BADDB             1009L
+
+#define REG_NONE                0
+#define REG_SZ                  1
+#define REG_EXPAND_SZ           2
+#define REG_BINARY              3
+#define REG_DWORD               4
+#define REG_LINK                6
+#define REG_MULTI_SZ            7
+
+#define _wcsicmp    wcscasecmp
+#define _wcsnicmp   wcsncasecmp
+
+#define wcstok_s    wcstok
+
+static inline int localtime_s(struct tm* Result, const time_t* Time)
+{
+    return localtime_r(Time, Result) ? 0 : -1;
+}
+
+static inline FILE* _wfopen(const wchar_t* Path, const wchar_t* Mode)
+{
+    char NarrowPath[1024], NarrowMode[16];
+    if(wcstombs(NarrowPath, Path, sizeof(NarrowPath)) == (size_t)-1 ||
+       wcstombs(NarrowMode, Mode, sizeof(NarrowMode)) == (size_t)-1)
+    {
+        return NULL;
+    }
+    return fopen(NarrowPath, NarrowMode);
+}
+
+static inline int _wrename(const wchar_t* OldPath, const wchar_t* NewPath)
+{
+    char NarrowOld[1024], NarrowNew[1024];
+    if(wcstombs(NarrowOld, OldPath, sizeof(NarrowOld)) == (size_t)-1 ||
+       wcstombs(NarrowNew, NewPath, sizeof(NarrowNew)) == (size_t)-1)
+    {
+        return -1;
+    }
+    return rename(NarrowOld, NarrowNew);
+}
+
+static inline int _wremove(const wchar_t* Path)
+{
+    char NarrowPath[1024];
+    if(wcstombs(NarrowPath, Path, sizeof(NarrowPath)) == (size_t)-1)
+    {
+        return -1;
+    }
+    return remove(NarrowPath);
+}
+
+#endif
+
+/*
+ * gflagscore can be linked statically or as a shared library.
+ * GFLAGS_SHARED is set for users of the shared library, GFLAGS_BUILD while building it.
+ */
+#if defined(GFLAGS_SHARED) && defined(_WIN32)
+#  ifdef GFLAGS_BUILD
+#    define GFLAGS_API  __declspec(dllexport)
+#  else
+#    define GFLAGS_API  __declspec(dllimport)
+#  endif
+#elif defined(GFLAGS_SHARED)
+#  define GFLAGS_API    __attribute__((visibility("default")))
+#else
+#  define GFLAGS_API
+#endif
@@ -0,0 +1,358 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "regfile.h"
+#include "mapfile.h"
+#include <string>
+#include <vector>
+
+#define REG_HEADER          L"Windows Registry Editor Version 5.00"
+#define REG_BOM             0xfeff
+#define REG_WINDOW_SIZE     (4 * 1024 * 1024)
+#define REG_LINE_MAX        1024
+#define REG_IMPORT_BATCH    1024
+#define REG_OUTPUT_BUFFER   (64 * 1024)
+
+
+/* Writes Text as UTF-16LE. */
+static BOOL WriteText( _In_ FILE* File, _In_z_ PCWSTR Text )
+{
+#ifdef _WIN32
+    size_t Length = wcslen(Text);
+    return fwrite(Text, sizeof(WCHAR), Length, File) == Length;
+#else
+    for(; *Text; ++Text)
+    {
+        ULONG Char = (ULONG)*Text;
+        if(Char > 0xffff)
+        {
+            ULONG High = 0xd800 | ((Char - 0x10000) >> 10);
+            putc(High & 0xff, File);
+            putc(High >> 8, File);
+            Char = 0xdc00 | (Char & 0x3ff);
+        }
+        putc(Char & 0xff, File);
+        putc(Char >> 8, File);
+    }
+    return !ferror(File);
+#endif
+}
+
+struct ExportContext
+{
+    FILE* File;
+    BOOL Success;
+};
+
+static BOOL ExportImage( _In_z_ PCWSTR ImageName, _In_ ULONG Value, _In_opt_ PVOID Context )
+{
+    ExportContext* Export = (ExportContext*)Context;
+    WCHAR Record[REG_LINE_MAX];
+    swprintf(Record, REG_LINE_MAX, L"[" REG_IMAGE_OPTIONS_KEY L"\\%ls]\r\n\"" GLOBALFLAG_VALUENAME L"\"=dword:%08x\r\n\r\n", ImageName, Value);
+    Export->Success = WriteText(Export->File, Record);
+    return Export->Success;
+}
+
+BOOL ExportRegFile( _In_ FlagStore* Store, _In_z_ PCWSTR FileName )
+{
+    FILE* File = _wfopen(FileName, L"wb");
+    if(!File)
+    {
+        return FALSE;
+    }
+    setvbuf(File, NULL, _IOFBF, REG_OUTPUT_BUFFER);
+
+    WCHAR Record[REG_LINE_MAX];
+    WCHAR Bom[] = { REG_BOM, L'\0' };
+    ULONG Flags;
+    BOOL Success = WriteText(File, Bom) && WriteText(File, REG_HEADER L"\r\n\r\n");
+    if(Success && Store->ReadGlobalFlags(&Flags))
+    {
+        swprintf(Record, REG_LINE_MAX, L"[" REG_SESSION_MANAGER_KEY L"]\r\n\"" GLOBALFLAG_VALUENAME L"\"=dword:%08x\r\n\r\n", Flags);
+        Success = WriteText(File, Record);
+    }
+    if(Success && Store->ReadKernelFlags(&Flags))
+    {
+        swprintf(Record, REG_LINE_MAX, REG_KERNEL_COMMENT L"\"" GLOBALFLAG_VALUENAME L"\"=dword:%08x\r\n\r\n", Flags);
+        Success = WriteText(File, Record);
+    }
+    if(Success)
+    {
+        ExportContext Export = { File, TRUE };
+        Success = Store->EnumImageValues(GLOBALFLAG_VALUENAME, ExportImage, &Export) && Export.Success;
+    }
+    Success = !fclose(File) && Success;
+    return Success;
+}
+
+
+/* Splits a UTF-16LE file into logical lines, with a mapped window moving through the file. */
+class RegFileReader
+{
+public:
+    RegFileReader()
+        : m_Window(NULL)
+        , m_WindowStart(0)
+        , m_WindowLength(0)
+        , m_Offset(0)
+        , m_Line(0)
+    {
+    }
+
+    BOOL Open( _In_z_ PCWSTR FileName )
+    {
+        WCHAR Char;
+        return m_File.OpenWindowed(FileName) && Next(&Char) && Char == REG_BOM;
+    }
+
+    ULONG LineNumber() const { return m_Line; }
+
+    /*
+     * The next line without its line break, values continued with a trailing
+     * backslash are joined. Only the first REG_LINE_MAX characters are kept,
+     * which is plenty for the lines that are parsed.
+     */
+    BOOL ReadLine( _Out_ std::wstring* Line )
+    {
+        WCHAR Char, Last = L'\0';
+        BOOL Any = FALSE;
+        Line->clear();
+        while(Next(&Char))
+        {
+            Any = TRUE;
+            if(Char == L'\r')
+            {
+                continue;
+            }
+            if(Char == L'\n')
+            {
+                ++m_Line;
+                if(Last == L'\\' && (*Line)[0] != L'[')
+                {
+                    Last = L'\0';
+                    continue;
+                }
+                return TRUE;
+            }
+            if(Line->size() < REG_LINE_MAX)
+            {
+                Line->push_back(Char);
+            }
+            Last = Char;
+        }
+        if(Any)
+        {
+            ++m_Line;
+        }
+        return Any;
+    }
+
+private:
+    BOOL Next( _Out_ WCHAR* Char )
+    {
+        if(m_Offset + 2 > m_WindowStart + m_WindowLength)
+        {
+            m_Window = m_File.MapWindow(m_Offset, REG_WINDOW_SIZE, &m_WindowLength);
+            m_WindowStart = m_Offset;
+            if(m_WindowLength < 2)
+            {
+                return FALSE;
+            }
+        }
+        const BYTE* Data = m_Window + (m_Offset - m_WindowStart);
+        m_Offset += 2;
+        *Char = (WCHAR)(Data[0] | (Data[1] << 8));
+        return TRUE;
+    }
+
+    MappedFile m_File;
+    const BYTE* m_Window;
+    size_t m_WindowStart;
+    size_t m_WindowLength;
+    size_t m_Offset;
+    ULONG m_Line;
+};
+
+/* Destination of a key, *ImageName receives the image for DEST_IMAGE. 0 for all other keys. */
+static DWORD KeyTarget( _In_z_ PCWSTR Key, _Out_ std::wstring* ImageName )
+{
+    const size_t ImageOptionsLength = wcslen(REG_IMAGE_OPTIONS_KEY);
+    if(!_wcsicmp(Key, REG_SESSION_MANAGER_KEY))
+    {
+        return DEST_REGISTRY;
+    }
+    if(!_wcsnicmp(Key, REG_IMAGE_OPTIONS_KEY, ImageOptionsLength) && Key[ImageOptionsLength] == L'\\' &&
+       Key[ImageOptionsLength + 1] && !wcschr(Key + ImageOptionsLength + 1, L'\\'))
+    {
+        *ImageName = Key + ImageOptionsLength + 1;
+        return DEST_IMAGE;
+    }
+    return 0;
+}
+
+/*
+ * '"GlobalFlag"=dword:<hex>', or the '"GlobalFlag"="0x<hex>"' string form
+ * that is also found in the wild. FALSE for other values, and for deletions.
+ */
+static BOOL ParseGlobalFlag( _In_z_ PCWSTR Line, _Out_ ULONG* Value )
+{
+    const size_t NameLength = wcslen(GLOBALFLAG_VALUENAME);
+    if(Line[0] != L'"' || _wcsnicmp(Line + 1, GLOBALFLAG_VALUENAME, NameLength) || Line[NameLength + 1] != L'"')
+    {
+        return FALSE;
+    }
+    PCWSTR Data = Line + NameLength + 2;
+    while(iswspace(*Data))
+    {
+        ++Data;
+    }
+    if(*Data++ != L'=')
+    {
+        return FALSE;
+    }
+    while(iswspace(*Data))
+    {
+        ++Data;
+    }
+    if(!_wcsnicmp(Data, L"dword:", 6))
+    {
+        Data += 6;
+    }
+    else if(*Data == L'"')
+    {
+        ++Data;
+    }
+    else
+    {
+        return FALSE;
+    }
+    PWSTR End = NULL;
+    *Value = wcstoul(Data, &End, 16);
+    return End != Data;
+}
+
+struct RegImportEntry
+{
+    DWORD Dest;
+    std::wstring ImageName;
+    ULONG Value;
+    ULONG Line;
+};
+
+static void ApplyImportBatch( _In_ FlagStore* Store, _Inout_ std::vector<RegImportEntry>* Batch, _Inout_ RegImportResult* Result )
+{
+    ULONG Applied = 0;
+    for(size_t n = 0; n < Batch->size(); ++n)
+    {
+        const RegImportEntry& Entry = (*Batch)[n];
+        FlagEdit Edit = { 0, Entry.Value, 0 };
+        FlagUpdate Update;
+        if(UpdateFlags(Store, Entry.Dest, Entry.ImageName.c_str(), &Edit, &Update))
+        {
+            ++Applied;
+            Result->Unchanged += Update.Written ? 0 : 1;
+            Result->IgnoredFlags |= Update.IgnoredFlags;
+        }
+        else
+        {
+            ++Result->Failed;
+            Result->FailedLine = Result->FailedLine ? Result->FailedLine : Entry.Line;
+        }
+    }
+    /* Values that did not make it to disk are not applied. */
+    if(Store->Flush())
+    {
+        Result->Applied += Applied;
+    }
+    else if(Applied)
+    {
+        Result->Failed += Applied;
+        Result->FailedLine = Result->FailedLine ? Result->FailedLine : (*Batch)[0].Line;
+    }
+    Batch->clear();
+}
+
+BOOL ImportRegFile( _In_ FlagStore* Store, _In_z_ PCWSTR FileName, _Out_ RegImportResult* Result )
+{
+    memset(Result, 0, sizeof(*Result));
+    RegFileReader Reader;
+    std::wstring Line, ImageName;
+    if(!Reader.Open(FileName) || !Reader.ReadLine(&Line) || Line != REG_HEADER)
+    {
+        Result->FailedLine = Reader.LineNumber() ? Reader.LineNumber() : 1;
+        return FALSE;
+    }
+
+    std::vector<RegImportEntry> Batch;
+    DWORD Dest = 0;
+    while(Reader.ReadLine(&Line))
+    {
+        PCWSTR Text = Line.c_str();
+        while(iswspace(*Text))
+        {
+            ++Text;
+        }
+        DWORD ValueDest = Dest;
+        if(Text[0] == L'[')
+        {
+            /* [-Key] deletes a key, those are not imported. */
+            size_t Start = Text - Line.c_str() + 1, End = Line.rfind(L']');
+            Dest = 0;
+            if(Text[1] != L'-' && End != std::wstring::npos)
+            {
+                Line.erase(End);
+                Dest = KeyTarget(Line.c_str() + Start, &ImageName);
+            }
+            continue;
+        }
+        else if(!_wcsnicmp(Text, REG_KERNEL_COMMENT, wcslen(REG_KERNEL_COMMENT)))
+        {
+            Text += wcslen(REG_KERNEL_COMMENT);
+            ValueDest = DEST_KERNEL;
+        }
+        else if(Text[0] == L';' || !Dest)
+        {
+            continue;
+        }
+
+        RegImportEntry Entry;
+        if(!ParseGlobalFlag(Text, &Entry.Value))
+        {
+            continue;
+        }
+        Entry.Dest = ValueDest;
+        Entry.ImageName = ValueDest == DEST_IMAGE ? ImageName : L"";
+        Entry.Line = Reader.LineNumber();
+        Batch.push_back(Entry);
+        ++Result->Values;
+        if(Batch.size() >= REG_IMPORT_BATCH)
+        {
+            ApplyImportBatch(Store, &Batch, Result);
+        }
+    }
+    ApplyImportBatch(Store, &Batch, Result);
+    return !Result->Failed;
+}
@@ -0,0 +1,56 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "flagstore.h"
+
+/*
+ * .reg files (REGEDIT5, UTF-16) with the GlobalFlag values of the system and
+ * of every image. Both directions stream: an export never collects the images
+ * first, an import only maps a small window of the file at a time and applies
+ * the values in batches.
+ *
+ * The flags of the running system have no registry location, they are kept in
+ * a ';gflags kernel' comment line, which regedit ignores.
+ */
+
+#define REG_SESSION_MANAGER_KEY     L"HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Control\\Session Manager"
+#define REG_IMAGE_OPTIONS_KEY       L"HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Image File Execution Options"
+#define REG_KERNEL_COMMENT          L";gflags kernel "
+
+struct RegImportResult
+{
+    ULONG Values;           /* GlobalFlag values found in the file */
+    ULONG Applied;
+    ULONG Unchanged;        /* applied, but the store already held the value */
+    ULONG Failed;
+    DWORD IgnoredFlags;     /* flags not valid for their destination */
+    ULONG FailedLine;       /* first line that could not be applied or parsed, 0 when none */
+};
+
+GFLAGS_API BOOL ExportRegFile( _In_ FlagStore* Store, _In_z_ PCWSTR FileName );
+GFLAGS_API BOOL ImportRegFile( _In_ FlagStore* Store, _In_z_ PCWSTR FileName, _Out_ RegImportResult* Result );
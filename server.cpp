@@ -0,0 +1,672 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "server.h"
+#include "flagttl.h"
+#include "callstats.h"
+#include <chrono>
+
+#ifdef _WIN32
+#define INVALID_SERVER_HANDLE   INVALID_HANDLE_VALUE
+#else
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define INVALID_SERVER_HANDLE   (-1)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL            0
+#endif
+#endif
+
+#define SERVER_READ_CHUNK       512
+#define CLIENT_CONNECT_WAIT_MS  1000
+
+
+/* The protocol is UTF-8 on the wire. */
+static std::wstring Widen( _In_ const std::string& Text )
+{
+#ifdef _WIN32
+    int Length = MultiByteToWideChar(CP_UTF8, 0, Text.c_str(), (int)Text.size(), NULL, 0);
+    std::wstring Result(Length, L'\0');
+    if(Length)
+    {
+        MultiByteToWideChar(CP_UTF8, 0, Text.c_str(), (int)Text.size(), &Result[0], Length);
+    }
+    return Result;
+#else
+    size_t Length = mbstowcs(NULL, Text.c_str(), 0);
+    if(Length == (size_t)-1)
+    {
+        return std::wstring(Text.begin(), Text.end());
+    }
+    std::wstring Result(Length, L'\0');
+    mbstowcs(&Result[0], Text.c_str(), Length);
+    return Result;
+#endif
+}
+
+static std::string Narrow( _In_ const std::wstring& Text )
+{
+#ifdef _WIN32
+    int Length = WideCharToMultiByte(CP_UTF8, 0, Text.c_str(), (int)Text.size(), NULL, 0, NULL, NULL);
+    std::string Result(Length, '\0');
+    if(Length)
+    {
+        WideCharToMultiByte(CP_UTF8, 0, Text.c_str(), (int)Text.size(), &Result[0], Length, NULL, NULL);
+    }
+    return Result;
+#else
+    size_t Length = wcstombs(NULL, Text.c_str(), 0);
+    if(Length == (size_t)-1)
+    {
+        return std::string(Text.begin(), Text.end());
+    }
+    std::string Result(Length, '\0');
+    wcstombs(&Result[0], Text.c_str(), Length + 1);
+    return Result;
+#endif
+}
+
+/* Returns the number of bytes read, 0 when the other side is gone. */
+static int ReadConnection( _In_ ServerHandle Connection, _Out_ char* Buffer, _In_ int Size )
+{
+#ifdef _WIN32
+    DWORD Read = 0;
+    return ReadFile(Connection, Buffer, Size, &Read, NULL) ? (int)Read : 0;
+#else
+    ssize_t Read;
+    do
+    {
+        Read = recv(Connection, Buffer, Size, 0);
+    } while(Read < 0 && errno == EINTR);
+    return Read > 0 ? (int)Read : 0;
+#endif
+}
+
+static BOOL WriteConnection( _In_ ServerHandle Connection, _In_ const std::string& Data )
+{
+    size_t Offset = 0;
+    while(Offset < Data.size())
+    {
+#ifdef _WIN32
+        DWORD Written = 0;
+        if(!WriteFile(Connection, Data.c_str() + Offset, (DWORD)(Data.size() - Offset), &Written, NULL))
+        {
+            return FALSE;
+        }
+#else
+        ssize_t Written = send(Connection, Data.c_str() + Offset, Data.size() - Offset, MSG_NOSIGNAL);
+        if(Written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return FALSE;
+        }
+#endif
+        Offset += Written;
+    }
+    return TRUE;
+}
+
+static void CloseConnection( _In_ ServerHandle Connection )
+{
+#ifdef _WIN32
+    CloseHandle(Connection);
+#else
+    close(Connection);
+#endif
+}
+
+/* Reads up to the next newline, Buffer keeps what was read beyond it. */
+static BOOL ReadLine( _In_ ServerHandle Connection, _Inout_ std::string* Buffer, _Out_ std::string* Line )
+{
+    size_t End;
+    while((End = Buffer->find('\n')) == std::string::npos)
+    {
+        char Chunk[SERVER_READ_CHUNK];
+        if(Buffer->size() > SERVER_LINE_MAX)
+        {
+            return FALSE;
+        }
+        int Read = ReadConnection(Connection, Chunk, sizeof(Chunk));
+        if(!Read)
+        {
+            return FALSE;
+        }
+        Buffer->append(Chunk, Read);
+    }
+    Line->assign(*Buffer, 0, End);
+    Buffer->erase(0, End + 1);
+    return TRUE;
+}
+
+/* Splits off the next word of Text, returns NULL when there is none. */
+static PWSTR NextWord( _Inout_ PWSTR* Text )
+{
+    PWSTR Word = *Text;
+    while(iswspace(*Word))
+    {
+        ++Word;
+    }
+    if(!*Word)
+    {
+        return NULL;
+    }
+    PWSTR End = Word;
+    while(*End && !iswspace(*End))
+    {
+        ++End;
+    }
+    if(*End)
+    {
+        *End++ = L'\0';
+    }
+    *Text = End;
+    return Word;
+}
+
+
+FlagServer::FlagServer( _In_ FlagStore* Store, _In_ ULONG BatchWindowMs )
+    : m_Store(Store)
+    , m_BatchWindowMs(BatchWindowMs)
+    , m_Stopping(FALSE)
+    , m_Changes(0)
+    , m_Writes(0)
+    , m_Listen(INVALID_SERVER_HANDLE)
+{
+    m_Batch = std::thread(&FlagServer::BatchThread, this);
+}
+
+FlagServer::~FlagServer()
+{
+    Stop();
+}
+
+BOOL FlagServer::IsStopping()
+{
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    return m_Stopping;
+}
+
+void FlagServer::GetCounters( _Out_ ULONG* Changes, _Out_ ULONG* Writes )
+{
+    std::lock_guard<std::mutex> Lock(m_Lock);
+    *Changes = m_Changes;
+    *Writes = m_Writes;
+}
+
+void FlagServer::HandleRequest( _In_z_ PCWSTR Request, _Out_ std::wstring* Response )
+{
+    WCHAR Line[SERVER_LINE_MAX];
+    WCHAR Buffer[64];
+    wcsncpy(Line, Request, SERVER_LINE_MAX - 1);
+    Line[SERVER_LINE_MAX - 1] = L'\0';
+
+    PWSTR Rest = Line;
+    PWSTR Command = NextWord(&Rest);
+    if(Command && !_wcsicmp(Command, L"stats"))
+    {
+        *Response = L"ok " + FormatCallStatsJson();
+        return;
+    }
+    PWSTR Target = Command ? NextWord(&Rest) : NULL;
+    if(!Target)
+    {
+        *Response = L"error expected '<get|set> <Target> [<Flags>]'";
+        return;
+    }
+    DWORD Dest = ParseFlagTarget(Target);
+
+    if(!_wcsicmp(Command, L"get"))
+    {
+        ULONG Flags = 0;
+        BOOL Success;
+        {
+            std::lock_guard<std::mutex> Lock(m_StoreLock);
+            Success = ReadFlags(m_Store, Dest, Target, &Flags);
+        }
+        if(!Success)
+        {
+            *Response = L"error could not read the flags";
+            return;
+        }
+        swprintf(Buffer, 64, L"ok %08x", Flags);
+        *Response = Buffer;
+    }
+    else if(!_wcsicmp(Command, L"set"))
+    {
+        FlagEdit Edit;
+        ULONG OldFlags, NewFlags;
+        InitFlagEdit(&Edit);
+        if(!CompileFlagEdit(Rest, &Edit))
+        {
+            *Response = L"error invalid flags";
+            return;
+        }
+        if(!Change(Dest, Target, &Edit, &OldFlags, &NewFlags))
+        {
+            *Response = L"error could not write the flags";
+            return;
+        }
+        swprintf(Buffer, 64, L"ok %08x %08x", OldFlags, NewFlags);
+        *Response = Buffer;
+    }
+    else
+    {
+        *Response = L"error unknown request";
+    }
+}
+
+/* Queues the change with the others for the same target and waits for the batch to be written. */
+BOOL FlagServer::Change( _In_ DWORD Dest, _In_z_ PCWSTR Target, _In_ const FlagEdit* Edit, _Out_ ULONG* OldFlags, _Out_ ULONG* NewFlags )
+{
+    std::wstring Key = Dest == DEST_IMAGE ? L"i:" + NormalizeName(Target) : Dest == DEST_KERNEL ? L"k" : L"r";
+    Waiter Self;
+    Self.Edit = *Edit;
+    Self.Done = Self.Success = FALSE;
+    Self.OldFlags = Self.NewFlags = 0;
+
+    std::unique_lock<std::mutex> Lock(m_Lock);
+    if(m_Stopping)
+    {
+        return FALSE;
+    }
+    PendingMap::iterator It = m_Pending.find(Key);
+    if(It == m_Pending.end())
+    {
+        Pending New;
+        New.Dest = Dest;
+        New.ImageName = Dest == DEST_IMAGE ? Target : L"";
+        InitFlagEdit(&New.Edit);
+        It = m_Pending.insert(PendingMap::value_type(Key, New)).first;
+    }
+    CombineFlagEdit(&It->second.Edit, Edit);
+    It->second.Waiters.push_back(&Self);
+    ++m_Changes;
+    m_Wake.notify_one();
+
+    while(!Self.Done)
+    {
+        m_Done.wait(Lock);
+    }
+    *OldFlags = Self.OldFlags;
+    *NewFlags = Self.NewFlags;
+    return Self.Success;
+}
+
+/*
+ * One compare-and-swap per target, with all changes of the batch combined.
+ * The waiters are answered in the order they arrived, each with the flags
+ * before and after its own change.
+ */
+ULONG FlagServer::ApplyBatch( _Inout_ PendingMap* Batch )
+{
+    std::lock_guard<std::mutex> Lock(m_StoreLock);
+    ULONG Writes = 0;
+    for(PendingMap::iterator It = Batch->begin(); It != Batch->end(); ++It)
+    {
+        Pending& Target = It->second;
+        FlagUpdate Update;
+        BOOL Success = UpdateFlags(m_Store, Target.Dest, Target.ImageName.c_str(), &Target.Edit, &Update);
+        Writes += (Success && Update.Written) ? 1 : 0;
+
+        ULONG Flags = Update.OldFlags;
+        for(size_t n = 0; n < Target.Waiters.size(); ++n)
+        {
+            Waiter* Current = Target.Waiters[n];
+            DWORD Apply, Ignored;
+            MaskFlags(Target.Dest, ApplyFlagEdit(&Current->Edit, Flags), &Apply, &Ignored);
+            Current->Success = Success;
+            Current->OldFlags = Flags;
+            Current->NewFlags = Flags = Apply;
+        }
+    }
+    if(Writes && !m_Store->Flush())
+    {
+        for(PendingMap::iterator It = Batch->begin(); It != Batch->end(); ++It)
+        {
+            for(size_t n = 0; n < It->second.Waiters.size(); ++n)
+            {
+                It->second.Waiters[n]->Success = FALSE;
+            }
+        }
+    }
+    return Writes;
+}
+
+void FlagServer::RevertExpired()
+{
+    std::lock_guard<std::mutex> Lock(m_StoreLock);
+    ULONG Reverted;
+    RevertExpiredFlags(m_Store, GetTtlTime(), &Reverted);
+}
+
+void FlagServer::BatchThread()
+{
+    std::unique_lock<std::mutex> Lock(m_Lock);
+    for(;;)
+    {
+        while(m_Pending.empty() && !m_Stopping)
+        {
+            if(m_Wake.wait_for(Lock, std::chrono::milliseconds(SERVER_REVERT_INTERVAL_MS)) == std::cv_status::timeout)
+            {
+                Lock.unlock();
+                RevertExpired();
+                Lock.lock();
+            }
+        }
+        if(m_Pending.empty())
+        {
+            break;
+        }
+        /* Give the other clients one batch window to add their changes, unless shutting down. */
+        m_Wake.wait_for(Lock, std::chrono::milliseconds(m_BatchWindowMs), [this]() { return m_Stopping != FALSE; });
+
+        PendingMap Batch;
+        Batch.swap(m_Pending);
+        Lock.unlock();
+        ULONG Writes = ApplyBatch(&Batch);
+        Lock.lock();
+
+        m_Writes += Writes;
+        for(PendingMap::iterator It = Batch.begin(); It != Batch.end(); ++It)
+        {
+            for(size_t n = 0; n < It->second.Waiters.size(); ++n)
+            {
+                It->second.Waiters[n]->Done = TRUE;
+            }
+        }
+        m_Done.notify_all();
+    }
+}
+
+void FlagServer::ClientThread( _Inout_ Client* Self )
+{
+    std::string Buffer, Line;
+    std::wstring Response;
+    while(ReadLine(Self->Connection, &Buffer, &Line))
+    {
+        HandleRequest(Widen(Line).c_str(), &Response);
+        if(!WriteConnection(Self->Connection, Narrow(Response) + "\n"))
+        {
+            break;
+        }
+    }
+    std::lock_guard<std::mutex> Lock(m_ClientLock);
+    Self->Finished = TRUE;
+}
+
+void FlagServer::AddClient( _In_ ServerHandle Connection )
+{
+    ReapClients(FALSE);
+    std::lock_guard<std::mutex> Lock(m_ClientLock);
+    if(IsStopping())
+    {
+        CloseConnection(Connection);
+        return;
+    }
+    Client* New = new Client();
+    New->Connection = Connection;
+    New->Finished = FALSE;
+    m_Clients.push_back(New);
+    New->Thread = std::thread(&FlagServer::ClientThread, this, New);
+}
+
+/* Cleans up the clients that disconnected, or disconnects and cleans up all of them. */
+void FlagServer::ReapClients( _In_ BOOL All )
+{
+    std::vector<Client*> Reap;
+    {
+        std::lock_guard<std::mutex> Lock(m_ClientLock);
+        for(size_t n = 0; n < m_Clients.size(); )
+        {
+            if(All || m_Clients[n]->Finished)
+            {
+                Reap.push_back(m_Clients[n]);
+                m_Clients.erase(m_Clients.begin() + n);
+            }
+            else
+            {
+                ++n;
+            }
+        }
+    }
+    for(size_t n = 0; n < Reap.size(); ++n)
+    {
+        Client* Current = Reap[n];
+#ifdef _WIN32
+        /* The client thread can be blocked in ReadFile, or about to enter it. */
+        while(WaitForSingleObject(Current->Thread.native_handle(), 10) == WAIT_TIMEOUT)
+        {
+            CancelSynchronousIo(Current->Thread.native_handle());
+        }
+#else
+        shutdown(Current->Connection, SHUT_RDWR);
+#endif
+        Current->Thread.join();
+        CloseConnection(Current->Connection);
+        delete Current;
+    }
+}
+
+BOOL FlagServer::Serve( _In_z_ PCWSTR Endpoint )
+{
+#ifdef _WIN32
+    {
+        std::lock_guard<std::mutex> Lock(m_ClientLock);
+        m_Endpoint = Endpoint;
+    }
+    for(;;)
+    {
+        HANDLE Pipe = CreateNamedPipeW(Endpoint, PIPE_ACCESS_DUPLEX,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES, SERVER_LINE_MAX, SERVER_LINE_MAX, 0, NULL);
+        if(Pipe == INVALID_HANDLE_VALUE)
+        {
+            return IsStopping();
+        }
+        {
+            /* Either Stop sees the pipe and connects to it, or it is seen stopping here. */
+            std::lock_guard<std::mutex> Lock(m_ClientLock);
+            if(IsStopping())
+            {
+                CloseHandle(Pipe);
+                return TRUE;
+            }
+            m_Listen = Pipe;
+        }
+        BOOL Connected = ConnectNamedPipe(Pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+        {
+            std::lock_guard<std::mutex> Lock(m_ClientLock);
+            m_Listen = INVALID_SERVER_HANDLE;
+        }
+        if(IsStopping())
+        {
+            CloseHandle(Pipe);
+            return TRUE;
+        }
+        if(Connected)
+        {
+            AddClient(Pipe);
+        }
+        else
+        {
+            CloseHandle(Pipe);
+        }
+    }
+#else
+    std::string Path = Narrow(Endpoint);
+    sockaddr_un Address;
+    memset(&Address, 0, sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    if(Path.empty() || Path.size() >= sizeof(Address.sun_path))
+    {
+        return FALSE;
+    }
+    memcpy(Address.sun_path, Path.c_str(), Path.size());
+
+    int Listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(Listen < 0)
+    {
+        return FALSE;
+    }
+    unlink(Path.c_str());
+    if(bind(Listen, (sockaddr*)&Address, sizeof(Address)) || listen(Listen, SOMAXCONN))
+    {
+        close(Listen);
+        return FALSE;
+    }
+    {
+        std::lock_guard<std::mutex> Lock(m_ClientLock);
+        m_Listen = Listen;
+    }
+    while(!IsStopping())
+    {
+        int Connection = accept(Listen, NULL, NULL);
+        if(Connection < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        AddClient(Connection);
+    }
+    {
+        std::lock_guard<std::mutex> Lock(m_ClientLock);
+        m_Listen = INVALID_SERVER_HANDLE;
+    }
+    close(Listen);
+    unlink(Path.c_str());
+    return IsStopping();
+#endif
+}
+
+/* Stops accepting clients, disconnects the connected ones and writes the changes still queued. */
+void FlagServer::Stop()
+{
+    {
+        std::lock_guard<std::mutex> Lock(m_Lock);
+        m_Stopping = TRUE;
+        m_Wake.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> Lock(m_ClientLock);
+        if(m_Listen != INVALID_SERVER_HANDLE)
+        {
+#ifdef _WIN32
+            /* Connect once, so ConnectNamedPipe returns and sees that the server stops. */
+            HANDLE Wake = CreateFileW(m_Endpoint.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+            if(Wake != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(Wake);
+            }
+#else
+            shutdown(m_Listen, SHUT_RDWR);
+#endif
+        }
+    }
+    ReapClients(TRUE);
+    if(m_Batch.joinable())
+    {
+        m_Batch.join();
+    }
+}
+
+
+FlagClient::FlagClient()
+    : m_Connection(INVALID_SERVER_HANDLE)
+{
+}
+
+FlagClient::~FlagClient()
+{
+    Close();
+}
+
+BOOL FlagClient::Connect( _In_z_ PCWSTR Endpoint )
+{
+    Close();
+#ifdef _WIN32
+    for(;;)
+    {
+        m_Connection = CreateFileW(Endpoint, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if(m_Connection != INVALID_HANDLE_VALUE)
+        {
+            return TRUE;
+        }
+        /* All pipe instances are in use until the server creates the next one. */
+        if(GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(Endpoint, CLIENT_CONNECT_WAIT_MS))
+        {
+            return FALSE;
+        }
+    }
+#else
+    std::string Path = Narrow(Endpoint);
+    sockaddr_un Address;
+    memset(&Address, 0, sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    if(Path.empty() || Path.size() >= sizeof(Address.sun_path))
+    {
+        return FALSE;
+    }
+    memcpy(Address.sun_path, Path.c_str(), Path.size());
+    m_Connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(m_Connection < 0)
+    {
+        return FALSE;
+    }
+    if(connect(m_Connection, (sockaddr*)&Address, sizeof(Address)))
+    {
+        Close();
+        return FALSE;
+    }
+    return TRUE;
+#endif
+}
+
+void FlagClient::Close()
+{
+    if(m_Connection != INVALID_SERVER_HANDLE)
+    {
+        CloseConnection(m_Connection);
+        m_Connection = INVALID_SERVER_HANDLE;
+    }
+    m_Buffer.clear();
+}
+
+BOOL FlagClient::Request( _In_z_ PCWSTR Request, _Out_ std::wstring* Response )
+{
+    std::string Line;
+    if(m_Connection == INVALID_SERVER_HANDLE ||
+       !WriteConnection(m_Connection, Narrow(Request) + "\n") ||
+       !ReadLine(m_Connection, &m_Buffer, &Line))
+    {
+        return FALSE;
+    }
+    *Response = Widen(Line);
+    return TRUE;
+}
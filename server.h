@@ -0,0 +1,157 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "gflags.h"
+#include "flagstore.h"
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * 'gflags -serve' keeps one store (with its key handles and privileges) open
+ * and answers requests from local clients, one request line per response line:
+ *
+ *   get <Target>                   ok <Flags>
+ *   set <Target> <Expression>      ok <OldFlags> <NewFlags>
+ *   stats                          ok <JSON>, the call latencies of callstats.h
+ *
+ * Targets are 'registry', 'kernel' or an image name, like in batch files, flags
+ * are hexadecimal. A request that fails is answered with 'error <Reason>'.
+ *
+ * Changes are collected for one batch window: all changes to the same target
+ * are combined into a single edit, which costs one write. Each client is only
+ * answered once its change is written, with the flags before and after its
+ * own change.
+ *
+ * While idle, the server reverts the timed image flags that expired (flagttl.h).
+ */
+
+#ifdef _WIN32
+#define SERVER_DEFAULT_ENDPOINT     L"\\\\.\\pipe\\gflags"
+typedef HANDLE ServerHandle;
+#else
+#define SERVER_DEFAULT_ENDPOINT     L"/tmp/gflags.sock"
+typedef int ServerHandle;
+#endif
+
+#define SERVER_BATCH_WINDOW_MS      10
+#define SERVER_LINE_MAX             1024
+#define SERVER_REVERT_INTERVAL_MS   (60 * 1000)
+
+class GFLAGS_API FlagServer
+{
+public:
+    FlagServer( _In_ FlagStore* Store, _In_ ULONG BatchWindowMs );
+    ~FlagServer();
+
+    /* Answers one request line, blocks until a change is written. Can be called from any thread. */
+    void HandleRequest( _In_z_ PCWSTR Request, _Out_ std::wstring* Response );
+
+    /* Accepts clients on Endpoint until Stop is called. */
+    BOOL Serve( _In_z_ PCWSTR Endpoint );
+    void Stop();
+
+    /* Number of changes requested, and the number of writes they took. */
+    void GetCounters( _Out_ ULONG* Changes, _Out_ ULONG* Writes );
+
+private:
+    struct Waiter
+    {
+        FlagEdit Edit;
+        BOOL Done;
+        BOOL Success;
+        ULONG OldFlags;
+        ULONG NewFlags;
+    };
+
+    struct Pending
+    {
+        DWORD Dest;
+        std::wstring ImageName;
+        FlagEdit Edit;
+        std::vector<Waiter*> Waiters;
+    };
+    typedef std::map<std::wstring, Pending> PendingMap;
+
+    struct Client
+    {
+        ServerHandle Connection;
+        std::thread Thread;
+        BOOL Finished;
+    };
+
+    BOOL IsStopping();
+    BOOL Change( _In_ DWORD Dest, _In_z_ PCWSTR Target, _In_ const FlagEdit* Edit, _Out_ ULONG* OldFlags, _Out_ ULONG* NewFlags );
+    ULONG ApplyBatch( _Inout_ PendingMap* Batch );
+    void RevertExpired();
+    void BatchThread();
+    void AddClient( _In_ ServerHandle Connection );
+    void ReapClients( _In_ BOOL All );
+    void ClientThread( _Inout_ Client* Self );
+
+    FlagStore* m_Store;
+    ULONG m_BatchWindowMs;
+
+    std::mutex m_Lock;
+    std::condition_variable m_Wake;
+    std::condition_variable m_Done;
+    PendingMap m_Pending;
+    BOOL m_Stopping;
+    ULONG m_Changes;
+    ULONG m_Writes;
+    std::thread m_Batch;
+
+    /* Serializes reads with the batch writes, the stores are not all thread safe. */
+    std::mutex m_StoreLock;
+
+    std::mutex m_ClientLock;
+    std::vector<Client*> m_Clients;
+    ServerHandle m_Listen;
+    std::wstring m_Endpoint;
+};
+
+/* Connection to a FlagServer, for clients in other processes. */
+class GFLAGS_API FlagClient
+{
+public:
+    FlagClient();
+    ~FlagClient();
+
+    BOOL Connect( _In_z_ PCWSTR Endpoint );
+    void Close();
+
+    /* Sends one request line and waits for the response line. */
+    BOOL Request( _In_z_ PCWSTR Request, _Out_ std::wstring* Response );
+
+private:
+    ServerHandle m_Connection;
+    std::string m_Buffer;
+};
@@ -0,0 +1,188 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "platform.h"
+#include "gflags.h"
+#include "flagstore.h"
+#include "server.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*
+ * Behavior of FlagServer over a MemoryFlagStore: the answers to get and set,
+ * the error answers, and that the changes to one target within a batch window
+ * take a single write. The last part goes through FlagClient and the endpoint.
+ */
+
+#define TEST_BATCH_WINDOW_MS    300
+
+static int g_Failures = 0;
+
+#define CHECK(Condition)    Check(!!(Condition), #Condition, __LINE__)
+
+static void Check( _In_ BOOL Passed, _In_z_ const char* Condition, _In_ int Line )
+{
+    if(!Passed)
+    {
+        fprintf(stderr, "servertest.cpp(%d): failed: %s\n", Line, Condition);
+        ++g_Failures;
+    }
+}
+
+/* Reads of 'locked.exe' fail, like an image key without read access. */
+class LockedImageStore : public MemoryFlagStore
+{
+public:
+    virtual BOOL ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value )
+    {
+        *Value = 0;
+        return NormalizeName(ImageName) != L"locked.exe" && MemoryFlagStore::ReadImageValue(ImageName, ValueName, Value);
+    }
+};
+
+static std::wstring Handle( _In_ FlagServer* Server, _In_z_ PCWSTR Request )
+{
+    std::wstring Response;
+    Server->HandleRequest(Request, &Response);
+    return Response;
+}
+
+static BOOL IsError( _In_ const std::wstring& Response )
+{
+    return !Response.compare(0, 6, L"error ");
+}
+
+static void TestRequests()
+{
+    LockedImageStore Store;
+    ULONG Flags = 0, Changes = 0, Writes = 0;
+    Store.WriteImageValue(L"a.exe", GLOBALFLAG_VALUENAME, FLG_HEAP_ENABLE_TAIL_CHECK);
+    FlagServer Server(&Store, 0);
+
+    CHECK(Handle(&Server, L"get a.exe") == L"ok 00000010");
+    CHECK(Handle(&Server, L"get registry") == L"ok 00000000");
+    CHECK(Handle(&Server, L"set a.exe +hpa") == L"ok 00000010 02000010");
+    CHECK(Store.ReadImageValue(L"a.exe", GLOBALFLAG_VALUENAME, &Flags) && Flags == 0x02000010);
+    CHECK(Handle(&Server, L"set A.EXE -htc") == L"ok 02000010 02000000");
+    CHECK(Handle(&Server, L"get a.exe") == L"ok 02000000");
+
+    CHECK(IsError(Handle(&Server, L"")));
+    CHECK(IsError(Handle(&Server, L"get")));
+    CHECK(IsError(Handle(&Server, L"remove a.exe")));
+    CHECK(IsError(Handle(&Server, L"get locked.exe")));
+    CHECK(IsError(Handle(&Server, L"set locked.exe +hpa")));
+    CHECK(IsError(Handle(&Server, L"set a.exe +nosuchflag")));
+    CHECK(IsError(Handle(&Server, L"set a.exe hpa htc")));
+    CHECK(Store.ReadImageValue(L"a.exe", GLOBALFLAG_VALUENAME, &Flags) && Flags == 0x02000000);
+
+    /* The failed set on locked.exe was requested, but not written. */
+    Server.GetCounters(&Changes, &Writes);
+    CHECK(Changes == 3 && Writes == 2);
+}
+
+static void TestCoalescing()
+{
+    static const PCWSTR Requests[] = { L"set b.exe +htc", L"set b.exe +hfc", L"set B.EXE +hpc", L"set b.exe +hvc" };
+    const size_t Count = sizeof(Requests) / sizeof(Requests[0]);
+    MemoryFlagStore Store;
+    FlagServer Server(&Store, TEST_BATCH_WINDOW_MS);
+    std::vector<std::wstring> Responses(Count);
+    std::vector<std::thread> Clients;
+    for(size_t n = 0; n < Count; ++n)
+    {
+        Clients.push_back(std::thread([&, n]() { Server.HandleRequest(Requests[n], &Responses[n]); }));
+    }
+    for(size_t n = 0; n < Count; ++n)
+    {
+        Clients[n].join();
+    }
+
+    ULONG Flags = 0, Changes = 0, Writes = 0, Seen = 0;
+    Server.GetCounters(&Changes, &Writes);
+    CHECK(Changes == Count);
+    CHECK(Writes == 1);
+    CHECK(Store.ReadImageValue(L"b.exe", GLOBALFLAG_VALUENAME, &Flags) && Flags == 0xf0);
+    /* Each client sees its own bit added, on top of the clients answered before it. */
+    for(size_t n = 0; n < Count; ++n)
+    {
+        ULONG Old = 0, New = 0;
+        CHECK(swscanf(Responses[n].c_str(), L"ok %x %x", &Old, &New) == 2);
+        CHECK((Old | (0x10u << n)) == New && !(Old & (0x10u << n)));
+        Seen |= New;
+    }
+    CHECK(Seen == 0xf0);
+}
+
+static void TestClient()
+{
+    WCHAR Endpoint[64];
+#ifdef _WIN32
+    swprintf(Endpoint, 64, L"\\\\.\\pipe\\gflags-servertest-%u", (ULONG)GetCurrentProcessId());
+#else
+    swprintf(Endpoint, 64, L"/tmp/gflags-servertest-%u.sock", (ULONG)getpid());
+#endif
+    MemoryFlagStore Store;
+    FlagServer Server(&Store, SERVER_BATCH_WINDOW_MS);
+    std::thread Serving([&]() { Server.Serve(Endpoint); });
+
+    /* Serve may not be listening yet. */
+    FlagClient Client;
+    BOOL Connected = FALSE;
+    for(int Attempt = 0; Attempt < 200 && !(Connected = Client.Connect(Endpoint)); ++Attempt)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(Connected);
+    std::wstring Response;
+    CHECK(Client.Request(L"set c.exe +ust", &Response) && Response == L"ok 00000000 00001000");
+    CHECK(Client.Request(L"get c.exe", &Response) && Response == L"ok 00001000");
+    CHECK(Client.Request(L"set c.exe +bogus", &Response) && IsError(Response));
+    CHECK(Client.Request(L"get kernel", &Response) && Response == L"ok 00000000");
+    Client.Close();
+
+    Server.Stop();
+    Serving.join();
+    ULONG Flags = 0;
+    CHECK(Store.ReadImageValue(L"c.exe", GLOBALFLAG_VALUENAME, &Flags) && Flags == FLG_USER_STACK_TRACE_DB);
+}
+
+int main()
+{
+    UpdateValidFlags();
+    TestRequests();
+    TestCoalescing();
+    TestClient();
+    if(g_Failures)
+    {
+        fprintf(stderr, "servertest: %d checks failed\n", g_Failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "snapshot.h"
+#include "gflags.h"
+#include <time.h>
+#include <algorithm>
+
+#define SNAPSHOT_OUTPUT_BUFFER      (64 * 1024)
+#define SNAPSHOT_SHARED_MAX         0xffff
+
+struct SnapshotImage
+{
+    std::wstring Key;
+    std::wstring Name;
+    ULONG Flags;
+};
+
+static bool SnapshotImageLess( _In_ const SnapshotImage& Left, _In_ const SnapshotImage& Right )
+{
+    return Left.Key < Right.Key;
+}
+
+static BOOL CollectImage( _In_z_ PCWSTR ImageName, _In_ ULONG Value, _In_opt_ PVOID Context )
+{
+    std::vector<SnapshotImage>* Images = (std::vector<SnapshotImage>*)Context;
+    SnapshotImage Image = { NormalizeName(ImageName), ImageName, Value };
+    Images->push_back(Image);
+    return TRUE;
+}
+
+/* Same order as the sorted keys: case insensitive, character by character. */
+static int CompareImageNames( _In_ const std::wstring& Left, _In_ const std::wstring& Right )
+{
+    size_t Length = std::min(Left.size(), Right.size());
+    for(size_t n = 0; n < Length; ++n)
+    {
+        WCHAR L = towlower(Left[n]), R = towlower(Right[n]);
+        if(L != R)
+        {
+            return L < R ? -1 : 1;
+        }
+    }
+    return Left.size() == Right.size() ? 0 : (Left.size() < Right.size() ? -1 : 1);
+}
+
+static void ToUtf16( _In_ const std::wstring& Name, _Out_ std::vector<WORD>* Units )
+{
+    Units->clear();
+    for(size_t n = 0; n < Name.size(); ++n)
+    {
+        ULONG Char = (ULONG)Name[n];
+        if(Char > 0xffff)
+        {
+            Units->push_back((WORD)(0xd800 | ((Char - 0x10000) >> 10)));
+            Char = 0xdc00 | (Char & 0x3ff);
+        }
+        Units->push_back((WORD)Char);
+    }
+}
+
+static void FromUtf16( _In_ const std::vector<WORD>& Units, _Out_ std::wstring* Name )
+{
+    Name->clear();
+    for(size_t n = 0; n < Units.size(); ++n)
+    {
+        ULONG Char = Units[n];
+        if(sizeof(WCHAR) > 2 && Char >= 0xd800 && Char < 0xdc00 && n + 1 < Units.size() &&
+           Units[n + 1] >= 0xdc00 && Units[n + 1] < 0xe000)
+        {
+            Char = 0x10000 + ((Char & 0x3ff) << 10) + (Units[++n] & 0x3ff);
+        }
+        Name->push_back((WCHAR)Char);
+    }
+}
+
+BOOL WriteSnapshot( _In_ FlagStore* Store, _In_z_ PCWSTR FileName, _Out_ ULONG* Images )
+{
+    SnapshotHeader Header;
+    std::vector<SnapshotImage> Entries;
+    *Images = 0;
+    memset(&Header, 0, sizeof(Header));
+    Header.Magic = SNAPSHOT_MAGIC;
+    Header.Version = SNAPSHOT_VERSION;
+    GetOsVersion(&Header.OsMajor, &Header.OsMinor, &Header.OsBuild);
+    Header.ValidRegistryFlags = g_ValidRegistryFlags;
+    Header.ValidKernelFlags = g_ValidKernelFlags;
+    Header.ValidImageFlags = g_ValidImageFlags;
+    Header.Time = (ULONGLONG)time(NULL);
+    Header.Contents |= Store->ReadGlobalFlags(&Header.GlobalFlags) ? SNAPSHOT_HAS_REGISTRY : 0;
+    Header.Contents |= Store->ReadKernelFlags(&Header.KernelFlags) ? SNAPSHOT_HAS_KERNEL : 0;
+    if(!Store->EnumImageValues(GLOBALFLAG_VALUENAME, CollectImage, &Entries))
+    {
+        return FALSE;
+    }
+    std::sort(Entries.begin(), Entries.end(), SnapshotImageLess);
+
+    /* Front coded names: only the part that differs from the previous name is stored. */
+    std::vector<ULONG> Flags;
+    std::vector<WORD> Table, Previous, Units;
+    Flags.reserve(Entries.size());
+    for(size_t n = 0; n < Entries.size(); ++n)
+    {
+        if(n && Entries[n].Key == Entries[n - 1].Key)
+        {
+            continue;
+        }
+        ToUtf16(Entries[n].Name, &Units);
+        size_t Shared = 0;
+        while(Shared < Units.size() && Shared < Previous.size() && Shared < SNAPSHOT_SHARED_MAX && Units[Shared] == Previous[Shared])
+        {
+            ++Shared;
+        }
+        if(Units.size() - Shared > 0xffff)
+        {
+            return FALSE;
+        }
+        Table.push_back((WORD)Shared);
+        Table.push_back((WORD)(Units.size() - Shared));
+        Table.insert(Table.end(), Units.begin() + Shared, Units.end());
+        Flags.push_back(Entries[n].Flags);
+        Previous.swap(Units);
+    }
+    Header.ImageCount = (DWORD)Flags.size();
+    Header.NameTableSize = (DWORD)(Table.size() * sizeof(WORD));
+
+    FILE* File = _wfopen(FileName, L"wb");
+    if(!File)
+    {
+        return FALSE;
+    }
+    setvbuf(File, NULL, _IOFBF, SNAPSHOT_OUTPUT_BUFFER);
+    fwrite(&Header, sizeof(Header), 1, File);
+    fwrite(Flags.data(), sizeof(ULONG), Flags.size(), File);
+    fwrite(Table.data(), sizeof(WORD), Table.size(), File);
+    BOOL Success = !ferror(File);
+    Success = !fclose(File) && Success;
+    *Images = Header.ImageCount;
+    return Success;
+}
+
+
+SnapshotReader::SnapshotReader()
+    : m_Flags(NULL)
+    , m_Names(NULL)
+    , m_NamesEnd(NULL)
+    , m_Index(0)
+{
+    memset(&m_Header, 0, sizeof(m_Header));
+}
+
+BOOL SnapshotReader::Open( _In_z_ PCWSTR FileName )
+{
+    if(!m_File.Open(FileName) || m_File.Size() < sizeof(m_Header))
+    {
+        return FALSE;
+    }
+    memcpy(&m_Header, m_File.Data(), sizeof(m_Header));
+    if(m_Header.Magic != SNAPSHOT_MAGIC || m_Header.Version != SNAPSHOT_VERSION ||
+       m_File.Size() != sizeof(m_Header) + (ULONGLONG)m_Header.ImageCount * sizeof(ULONG) + m_Header.NameTableSize)
+    {
+        return FALSE;
+    }
+    m_Flags = m_File.Data() + sizeof(m_Header);
+    m_Names = m_Flags + (size_t)m_Header.ImageCount * sizeof(ULONG);
+    m_NamesEnd = m_Names + m_Header.NameTableSize;
+    m_Index = 0;
+    m_Name.clear();
+    return TRUE;
+}
+
+BOOL SnapshotReader::Next( _Out_ std::wstring* Name, _Out_ ULONG* Flags )
+{
+    WORD Shared, Length;
+    if(m_Index >= m_Header.ImageCount || m_NamesEnd - m_Names < 2 * (ptrdiff_t)sizeof(WORD))
+    {
+        return FALSE;
+    }
+    memcpy(&Shared, m_Names, sizeof(WORD));
+    memcpy(&Length, m_Names + sizeof(WORD), sizeof(WORD));
+    if(Shared > m_Name.size() || (size_t)(m_NamesEnd - m_Names) < (2 + (size_t)Length) * sizeof(WORD))
+    {
+        return FALSE;
+    }
+    m_Names += 2 * sizeof(WORD);
+    m_Name.resize(Shared + Length);
+    memcpy(m_Name.data() + Shared, m_Names, Length * sizeof(WORD));
+    m_Names += Length * sizeof(WORD);
+    memcpy(Flags, m_Flags + (size_t)m_Index * sizeof(ULONG), sizeof(ULONG));
+    ++m_Index;
+    FromUtf16(m_Name, Name);
+    return TRUE;
+}
+
+
+static BOOL DiffValue( _In_ DWORD Dest, _In_ DWORD Contents, _In_ const SnapshotHeader& Old, _In_ const SnapshotHeader& New,
+                       _In_ ULONG OldFlags, _In_ ULONG NewFlags, _In_ SnapshotDiffCallback Callback, _In_opt_ PVOID Context )
+{
+    BOOL InOld = (Old.Contents & Contents) != 0, InNew = (New.Contents & Contents) != 0;
+    OldFlags = InOld ? OldFlags : 0;
+    NewFlags = InNew ? NewFlags : 0;
+    if(InOld == InNew && OldFlags == NewFlags)
+    {
+        return TRUE;
+    }
+    DWORD Change = InOld == InNew ? SNAPSHOT_CHANGED : (InNew ? SNAPSHOT_ADDED : SNAPSHOT_REMOVED);
+    return Callback(Dest, NULL, Change, OldFlags, NewFlags, Context);
+}
+
+/* A merge join over the two sorted name tables, each snapshot is read once. */
+BOOL DiffSnapshots( _Inout_ SnapshotReader* Old, _Inout_ SnapshotReader* New, _In_ SnapshotDiffCallback Callback, _In_opt_ PVOID Context )
+{
+    const SnapshotHeader& OldHeader = Old->Header();
+    const SnapshotHeader& NewHeader = New->Header();
+    if(!DiffValue(DEST_REGISTRY, SNAPSHOT_HAS_REGISTRY, OldHeader, NewHeader, OldHeader.GlobalFlags, NewHeader.GlobalFlags, Callback, Context) ||
+       !DiffValue(DEST_KERNEL, SNAPSHOT_HAS_KERNEL, OldHeader, NewHeader, OldHeader.KernelFlags, NewHeader.KernelFlags, Callback, Context))
+    {
+        return TRUE;
+    }
+
+    std::wstring OldName, NewName;
+    ULONG OldFlags = 0, NewFlags = 0;
+    BOOL HaveOld = Old->Next(&OldName, &OldFlags);
+    BOOL HaveNew = New->Next(&NewName, &NewFlags);
+    while(HaveOld || HaveNew)
+    {
+        int Order = !HaveOld ? 1 : (!HaveNew ? -1 : CompareImageNames(OldName, NewName));
+        BOOL Continue = TRUE;
+        if(Order < 0)
+        {
+            Continue = Callback(DEST_IMAGE, OldName.c_str(), SNAPSHOT_REMOVED, OldFlags, 0, Context);
+            HaveOld = Old->Next(&OldName, &OldFlags);
+        }
+        else if(Order > 0)
+        {
+            Continue = Callback(DEST_IMAGE, NewName.c_str(), SNAPSHOT_ADDED, 0, NewFlags, Context);
+            HaveNew = New->Next(&NewName, &NewFlags);
+        }
+        else
+        {
+            if(OldFlags != NewFlags)
+            {
+                Continue = Callback(DEST_IMAGE, NewName.c_str(), SNAPSHOT_CHANGED, OldFlags, NewFlags, Context);
+            }
+            HaveOld = Old->Next(&OldName, &OldFlags);
+            HaveNew = New->Next(&NewName, &NewFlags);
+        }
+        if(!Continue)
+        {
+            return TRUE;
+        }
+    }
+    return Old->IsComplete() && New->IsComplete();
+}
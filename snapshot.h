@@ -0,0 +1,112 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "flagstore.h"
+#include "mapfile.h"
+#include <string>
+#include <vector>
+
+/*
+ * Binary snapshot of all flags of a store, to detect configuration drift.
+ *
+ *   SnapshotHeader
+ *   ULONG Flags[ImageCount]     GlobalFlag of each image, in name order
+ *   name table                  ImageCount entries of WORD Shared, WORD Length,
+ *                               WCHAR Suffix[Length] (UTF-16): the name is the
+ *                               first Shared characters of the previous name
+ *                               followed by Suffix.
+ *
+ * Images are sorted by their case insensitive name, so two snapshots are
+ * compared with a single merge pass over both.
+ */
+
+#define SNAPSHOT_MAGIC              0x53534647      /* 'GFSS' */
+#define SNAPSHOT_VERSION            1
+
+/* SnapshotHeader::Contents */
+#define SNAPSHOT_HAS_REGISTRY       0x1
+#define SNAPSHOT_HAS_KERNEL         0x2
+
+struct SnapshotHeader
+{
+    DWORD Magic;
+    DWORD Version;
+    DWORD OsMajor;
+    DWORD OsMinor;
+    DWORD OsBuild;
+    DWORD ValidRegistryFlags;
+    DWORD ValidKernelFlags;
+    DWORD ValidImageFlags;
+    DWORD Contents;
+    DWORD GlobalFlags;
+    DWORD KernelFlags;
+    DWORD ImageCount;
+    DWORD NameTableSize;        /* bytes */
+    DWORD Reserved;
+    ULONGLONG Time;             /* seconds since 1970 */
+};
+
+/* Reads the images of a snapshot one by one, in name order. */
+class GFLAGS_API SnapshotReader
+{
+public:
+    SnapshotReader();
+
+    BOOL Open( _In_z_ PCWSTR FileName );
+    const SnapshotHeader& Header() const { return m_Header; }
+
+    /* FALSE after the last image, or when the name table is damaged. */
+    BOOL Next( _Out_ std::wstring* Name, _Out_ ULONG* Flags );
+    /* TRUE once every image was read. */
+    BOOL IsComplete() const { return m_Index == m_Header.ImageCount; }
+
+private:
+    MappedFile m_File;
+    SnapshotHeader m_Header;
+    const BYTE* m_Flags;
+    const BYTE* m_Names;
+    const BYTE* m_NamesEnd;
+    ULONG m_Index;
+    std::vector<WORD> m_Name;
+};
+
+/* SnapshotDiffCallback Change */
+#define SNAPSHOT_CHANGED            0
+#define SNAPSHOT_ADDED              1
+#define SNAPSHOT_REMOVED            2
+
+/*
+ * Called for each target that differs, ImageName is NULL for DEST_REGISTRY and DEST_KERNEL.
+ * Flags that were missing read as 0. Return FALSE to stop.
+ */
+typedef BOOL (*SnapshotDiffCallback)( _In_ DWORD Dest, _In_opt_z_ PCWSTR ImageName, _In_ DWORD Change,
+                                      _In_ ULONG OldFlags, _In_ ULONG NewFlags, _In_opt_ PVOID Context );
+
+/* *Images receives the number of images written. */
+GFLAGS_API BOOL WriteSnapshot( _In_ FlagStore* Store, _In_z_ PCWSTR FileName, _Out_ ULONG* Images );
+GFLAGS_API BOOL DiffSnapshots( _Inout_ SnapshotReader* Old, _Inout_ SnapshotReader* New, _In_ SnapshotDiffCallback Callback, _In_opt_ PVOID Context );
@@ -0,0 +1,126 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include "platform.h"
+#include "tracedb.h"
+
+/* USTEnabled is a value of the Image File Execution Options key, not of an image. */
+#define IMAGE_FILE_OPTIONS_ROOT     L""
+
+
+BOOL ReadUstEnabled( _In_ FlagStore* Store, _Out_ std::vector<std::wstring>* ImageNames )
+{
+    std::wstring List;
+    ImageNames->clear();
+    if(!Store->ReadImageString(IMAGE_FILE_OPTIONS_ROOT, USTENABLED_VALUENAME, &List))
+    {
+        return FALSE;
+    }
+    size_t Start = 0;
+    while(Start < List.size())
+    {
+        size_t End = List.find_first_of(L"; ", Start);
+        if(End == std::wstring::npos)
+        {
+            End = List.size();
+        }
+        if(End > Start)
+        {
+            ImageNames->push_back(List.substr(Start, End - Start));
+        }
+        Start = End + 1;
+    }
+    return TRUE;
+}
+
+BOOL SetUstEnabled( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ BOOL Enabled )
+{
+    std::wstring List;
+    if(!ImageName[0])
+    {
+        return FALSE;
+    }
+    if(!Store->HasImageStrings())
+    {
+        return TRUE;
+    }
+    if(!Store->ReadImageString(IMAGE_FILE_OPTIONS_ROOT, USTENABLED_VALUENAME, &List))
+    {
+        return FALSE;
+    }
+    size_t Length = wcslen(ImageName), Start = 0;
+    BOOL Listed = FALSE, Changed = FALSE;
+    while(Start < List.size())
+    {
+        size_t End = List.find_first_of(L"; ", Start);
+        if(End == std::wstring::npos)
+        {
+            End = List.size();
+        }
+        if(End - Start != Length || _wcsnicmp(List.c_str() + Start, ImageName, Length))
+        {
+            Start = End + 1;
+            continue;
+        }
+        Listed = TRUE;
+        if(Enabled)
+        {
+            break;
+        }
+        /* Take the separator after the name along, or the one before it for the last name. */
+        if(End < List.size())
+        {
+            ++End;
+        }
+        else if(Start > 0)
+        {
+            --Start;
+        }
+        List.erase(Start, End - Start);
+        Changed = TRUE;
+    }
+    if(Enabled && !Listed)
+    {
+        List += List.empty() ? L"" : L";";
+        List += ImageName;
+        Changed = TRUE;
+    }
+    return !Changed || Store->WriteImageString(IMAGE_FILE_OPTIONS_ROOT, USTENABLED_VALUENAME, List.c_str());
+}
+
+ULONG SuggestTraceDatabaseSize( _In_ ULONG AllocationsPerSecond, _In_ ULONG RetentionSeconds )
+{
+    const ULONGLONG Megabyte = 1024 * 1024;
+    ULONGLONG Records = (ULONGLONG)AllocationsPerSecond * RetentionSeconds;
+    if(Records > TRACEDB_MAX_MB * Megabyte / TRACEDB_ENTRY_BYTES)
+    {
+        return TRACEDB_MAX_MB;
+    }
+    ULONGLONG Bytes = Records * TRACEDB_ENTRY_BYTES;
+    Bytes += Bytes / 4;
+    ULONGLONG Size = (Bytes + Megabyte - 1) / Megabyte;
+    return Size > TRACEDB_MAX_MB ? TRACEDB_MAX_MB : (ULONG)Size;
+}
@@ -0,0 +1,70 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#pragma once
+
+#include "platform.h"
+#include "flagstore.h"
+#include <string>
+#include <vector>
+
+/*
+ * The user mode stack trace database that ust creates in a process. Its size
+ * is an image option next to GlobalFlag; without it the process gets the
+ * default database, which fills up on allocation heavy services and then
+ * records no more traces. The images with ust are also listed in the
+ * USTEnabled value of the Image File Execution Options key itself, UpdateFlags
+ * keeps that list in step with the flag.
+ */
+
+#define TRACEDB_SIZE_VALUENAME      L"StackTraceDatabaseSizeInMb"
+#define USTENABLED_VALUENAME        L"USTEnabled"       /* image names separated by ; */
+#define TRACEDB_MAX_MB              1024
+
+/*
+ * Estimated bytes per recorded allocation: an x64 RTL_STACK_TRACE_ENTRY with
+ * 16 frames and its hash chain slot.
+ */
+#define TRACEDB_ENTRY_BYTES         152
+
+/* FALSE for stores without string values, SetUstEnabled then leaves the list alone. */
+GFLAGS_API BOOL ReadUstEnabled( _In_ FlagStore* Store, _Out_ std::vector<std::wstring>* ImageNames );
+
+/*
+ * Adds or removes ImageName in place, the rest of the list is kept as it is
+ * and only written when this changes it. TRUE without a write for stores
+ * without string values. Callers that also change the flag hold Store->Lock().
+ */
+GFLAGS_API BOOL SetUstEnabled( _In_ FlagStore* Store, _In_z_ PCWSTR ImageName, _In_ BOOL Enabled );
+
+/*
+ * A StackTraceDatabaseSizeInMb for a process that makes AllocationsPerSecond
+ * allocations and keeps them for RetentionSeconds, when every one of them has
+ * a different stack. Repeated stacks share an entry, so real processes need
+ * less. A quarter is added for the hash table, the result is capped at
+ * TRACEDB_MAX_MB and is 0 only for 0 allocations.
+ */
+GFLAGS_API ULONG SuggestTraceDatabaseSize( _In_ ULONG AllocationsPerSecond, _In_ ULONG RetentionSeconds );
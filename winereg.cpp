@@ -0,0 +1,694 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "platform.h"
+#include "winereg.h"
+#include <time.h>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define WINE_REGISTRY_HEADER        "WINE REGISTRY Version 2"
+#define WINE_CONTROL_SET            L"System\\ControlSet"
+#define WINE_NO_SECTION             ((size_t)-1)
+#define WINE_TICKS_PER_SECOND       10000000ULL
+#define WINE_EPOCH_DIFFERENCE       11644473600ULL
+
+static const char g_WineEscapes[33] = ".......abtnvfr.............e....";
+
+
+static BOOL GetFileStamp( _In_z_ PCWSTR FileName, _Out_ ULONGLONG* WriteTime, _Out_ ULONGLONG* Size )
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA Data;
+    if(!GetFileAttributesExW(FileName, GetFileExInfoStandard, &Data))
+    {
+        return FALSE;
+    }
+    *WriteTime = ((ULONGLONG)Data.ftLastWriteTime.dwHighDateTime << 32) | Data.ftLastWriteTime.dwLowDateTime;
+    *Size = ((ULONGLONG)Data.nFileSizeHigh << 32) | Data.nFileSizeLow;
+#else
+    char NarrowName[1024];
+    struct stat st;
+    if(wcstombs(NarrowName, FileName, sizeof(NarrowName)) == (size_t)-1 || stat(NarrowName, &st))
+    {
+        return FALSE;
+    }
+    *WriteTime = (ULONGLONG)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    *Size = (ULONGLONG)st.st_size;
+#endif
+    return TRUE;
+}
+
+static int HexDigit( _In_ char Char )
+{
+    if(Char >= '0' && Char <= '9') return Char - '0';
+    if(Char >= 'a' && Char <= 'f') return Char - 'a' + 10;
+    if(Char >= 'A' && Char <= 'F') return Char - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Decodes a string as wineserver writes them, up to the unescaped Delimiter.
+ * Returns the position of the delimiter, or NULL when the line ends first.
+ */
+static const char* ParseWineString( _In_ const char* Pos, _In_ const char* End, _In_ char Delimiter, _Out_ std::wstring* Result )
+{
+    Result->clear();
+    for(; Pos < End && *Pos != '\n'; ++Pos)
+    {
+        if(*Pos == Delimiter)
+        {
+            return Pos;
+        }
+        if(*Pos != '\\' || Pos + 1 >= End)
+        {
+            Result->push_back((WCHAR)(BYTE)*Pos);
+            continue;
+        }
+        const char* Escape = (const char*)memchr(g_WineEscapes, *++Pos, 32);
+        if(Escape && *Escape != '.')
+        {
+            Result->push_back((WCHAR)(Escape - g_WineEscapes));
+        }
+        else if(*Pos == 'x')
+        {
+            WCHAR Char = 0;
+            for(int n = 0; n < 4 && Pos + 1 < End && HexDigit(Pos[1]) >= 0; ++n)
+            {
+                Char = (WCHAR)(Char * 16 + HexDigit(*++Pos));
+            }
+            Result->push_back(Char);
+        }
+        else if(*Pos >= '0' && *Pos <= '7')
+        {
+            WCHAR Char = (WCHAR)(*Pos - '0');
+            for(int n = 1; n < 3 && Pos + 1 < End && Pos[1] >= '0' && Pos[1] <= '7'; ++n)
+            {
+                Char = (WCHAR)(Char * 8 + *++Pos - '0');
+            }
+            Result->push_back(Char);
+        }
+        else
+        {
+            Result->push_back((WCHAR)(BYTE)*Pos);
+        }
+    }
+    return NULL;
+}
+
+/* The reverse of ParseWineString, escapes everything outside printable ASCII and the Delimiters. */
+static void AppendWineString( _Inout_ std::string* Out, _In_z_ PCWSTR Str, _In_z_ const char* Delimiters )
+{
+    char Escaped[16];
+    for(; *Str; ++Str)
+    {
+        ULONG Char = (ULONG)*Str;
+        if(Char > 127)
+        {
+            snprintf(Escaped, sizeof(Escaped), iswxdigit(Str[1]) ? "\\x%04x" : "\\x%x", Char);
+            Out->append(Escaped);
+        }
+        else if(Char < 32)
+        {
+            if(g_WineEscapes[Char] != '.')
+            {
+                snprintf(Escaped, sizeof(Escaped), "\\%c", g_WineEscapes[Char]);
+            }
+            else
+            {
+                snprintf(Escaped, sizeof(Escaped), "\\%03o", Char);
+            }
+            Out->append(Escaped);
+        }
+        else
+        {
+            if(Char == '\\' || strchr(Delimiters, (char)Char))
+            {
+                Out->push_back('\\');
+            }
+            Out->push_back((char)Char);
+        }
+    }
+}
+
+/* '"Name"=<data>' lines, *Data receives the position after the '='. */
+static BOOL ParseValueLine( _In_ const char* Line, _In_ const char* End, _Out_ std::wstring* Name, _Out_ const char** Data )
+{
+    if(Line >= End || *Line != '"')
+    {
+        return FALSE;
+    }
+    const char* Pos = ParseWineString(Line + 1, End, '"', Name);
+    if(!Pos || Pos + 1 >= End || Pos[1] != '=')
+    {
+        return FALSE;
+    }
+    *Data = Pos + 2;
+    return TRUE;
+}
+
+static const char* LineEnd( _In_ const char* Pos, _In_ const char* End )
+{
+    const char* NewLine = (const char*)memchr(Pos, '\n', End - Pos);
+    return NewLine ? NewLine + 1 : End;
+}
+
+static std::string FormatDwordValue( _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    char Data[32];
+    std::string Line = "\"";
+    AppendWineString(&Line, ValueName, "\"");
+    snprintf(Data, sizeof(Data), "\"=dword:%08x\n", Value);
+    return Line + Data;
+}
+
+
+WineFlagStore::WineFlagStore()
+    : m_WriteTime(0)
+    , m_FileSize(0)
+{
+    m_SessionManager.Start = WINE_NO_SECTION;
+}
+
+BOOL WineFlagStore::Open( _In_z_ PCWSTR Prefix )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    std::wstring Path(Prefix);
+    size_t NameLength = wcslen(WINE_SYSTEM_REG);
+    if(Path.size() > NameLength && !_wcsicmp(Path.c_str() + Path.size() - NameLength, WINE_SYSTEM_REG) &&
+       (Path[Path.size() - NameLength - 1] == L'/' || Path[Path.size() - NameLength - 1] == L'\\'))
+    {
+        m_FileName = Path;
+        m_Directory = Path.substr(0, Path.size() - NameLength - 1);
+    }
+    else
+    {
+        m_Directory = Path;
+        m_FileName = Path + L"/" WINE_SYSTEM_REG;
+    }
+    m_Pending.clear();
+    return Load();
+}
+
+BOOL WineFlagStore::Load()
+{
+    std::map<ULONG, Section> ControlSets;
+    Section Select, Ignored;
+    Section* Current = &Ignored;
+    std::wstring Name;
+    const size_t IfeoLength = wcslen(WINE_SOFTWARE_IFEO);
+    const size_t ControlSetLength = wcslen(WINE_CONTROL_SET);
+
+    m_File.Close();
+    m_Images.clear();
+    m_SessionManager.Start = WINE_NO_SECTION;
+    Select.Start = WINE_NO_SECTION;
+    if(!GetFileStamp(m_FileName.c_str(), &m_WriteTime, &m_FileSize) || !m_File.Open(m_FileName.c_str()))
+    {
+        return FALSE;
+    }
+
+    const char* Data = (const char*)m_File.Data();
+    const char* End = Data + m_File.Size();
+    if(m_File.Size() < sizeof(WINE_REGISTRY_HEADER) - 1 || memcmp(Data, WINE_REGISTRY_HEADER, sizeof(WINE_REGISTRY_HEADER) - 1))
+    {
+        m_File.Close();
+        return FALSE;
+    }
+
+    /* Only the '[' lines are decoded here, values are parsed when they are queried. */
+    for(const char* Line = Data; Line < End; Line = LineEnd(Line, End))
+    {
+        if(*Line != '[')
+        {
+            continue;
+        }
+        Current->End = Line - Data;
+        Current = &Ignored;
+        if(!ParseWineString(Line + 1, End, ']', &Name))
+        {
+            continue;
+        }
+
+        Section Key;
+        Key.Start = Line - Data;
+        Key.Body = LineEnd(Line, End) - Data;
+        if(Name.size() > IfeoLength + 1 && !_wcsnicmp(Name.c_str(), WINE_SOFTWARE_IFEO, IfeoLength) &&
+           Name[IfeoLength] == L'\\' && !wcschr(Name.c_str() + IfeoLength + 1, L'\\'))
+        {
+            Key.Name = Name.substr(IfeoLength + 1);
+            Current = &(m_Images[NormalizeName(Key.Name.c_str())] = Key);
+        }
+        else if(!_wcsicmp(Name.c_str(), WINE_SYSTEM_SELECT))
+        {
+            Key.Name = Name;
+            Current = &(Select = Key);
+        }
+        else if(!_wcsnicmp(Name.c_str(), WINE_CONTROL_SET, ControlSetLength))
+        {
+            PWSTR Rest = NULL;
+            ULONG Set = wcstoul(Name.c_str() + ControlSetLength, &Rest, 10);
+            if(Rest != Name.c_str() + ControlSetLength && !_wcsicmp(Rest, L"\\" HIVE_SYSTEM_SESSION_MANAGER))
+            {
+                Key.Name = Name;
+                Current = &(ControlSets[Set] = Key);
+            }
+        }
+    }
+    Current->End = End - Data;
+
+    ULONG Set = 1;
+    if(Select.Start != WINE_NO_SECTION)
+    {
+        FindValue(Select, L"Current", &Set);
+    }
+    std::map<ULONG, Section>::const_iterator SessionManager = ControlSets.find(Set);
+    if(SessionManager != ControlSets.end())
+    {
+        m_SessionManager = SessionManager->second;
+    }
+    else
+    {
+        WCHAR SessionManagerName[64];
+        swprintf(SessionManagerName, 64, WINE_CONTROL_SET L"%03u\\" HIVE_SYSTEM_SESSION_MANAGER, Set);
+        m_SessionManager.Name = SessionManagerName;
+    }
+    return TRUE;
+}
+
+/* Picks up changes made by others, by wineserver saving the registry or another gflags. */
+BOOL WineFlagStore::Refresh()
+{
+    ULONGLONG WriteTime, Size;
+    if(m_File.Data() && GetFileStamp(m_FileName.c_str(), &WriteTime, &Size) && WriteTime == m_WriteTime && Size == m_FileSize)
+    {
+        return TRUE;
+    }
+    return Load();
+}
+
+/* ERROR_SUCCESS, ERROR_FILE_NOT_FOUND, or ERROR_INVALID_DATA when the value is not a dword. */
+LONG WineFlagStore::FindValue( _In_ const Section& Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value ) const
+{
+    const char* Data = (const char*)m_File.Data();
+    const char* End = Data + Key.End;
+    std::wstring Name;
+    const char* ValueData;
+    *Value = 0;
+    for(const char* Line = Data + Key.Body; Line < End; Line = LineEnd(Line, End))
+    {
+        if(!ParseValueLine(Line, End, &Name, &ValueData) || _wcsicmp(Name.c_str(), ValueName))
+        {
+            continue;
+        }
+        char* Stop = NULL;
+        if(End - ValueData < 6 || memcmp(ValueData, "dword:", 6))
+        {
+            return ERROR_INVALID_DATA;
+        }
+        *Value = strtoul(ValueData + 6, &Stop, 16);
+        return Stop != ValueData + 6 ? ERROR_SUCCESS : ERROR_INVALID_DATA;
+    }
+    return ERROR_FILE_NOT_FOUND;
+}
+
+const WineFlagStore::PendingValue* WineFlagStore::FindPending( _In_opt_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName ) const
+{
+    if(m_Pending.empty())
+    {
+        return NULL;
+    }
+    PendingMap::const_iterator Pending = m_Pending.find((ImageName ? NormalizeName(ImageName) : L"") + L'\\' + NormalizeName(ValueName));
+    return Pending != m_Pending.end() ? &Pending->second : NULL;
+}
+
+BOOL WineFlagStore::ReadGlobalFlags( _Out_ ULONG* Flag )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    const PendingValue* Pending = FindPending(NULL, GLOBALFLAG_VALUENAME);
+    if(Pending)
+    {
+        *Flag = Pending->Value;
+        return TRUE;
+    }
+    if(!Refresh())
+    {
+        return FALSE;
+    }
+    LONG Result = ERROR_FILE_NOT_FOUND;
+    *Flag = 0;
+    if(m_SessionManager.Start != WINE_NO_SECTION)
+    {
+        Result = FindValue(m_SessionManager, GLOBALFLAG_VALUENAME, Flag);
+    }
+    return Result == ERROR_SUCCESS || Result == ERROR_FILE_NOT_FOUND;
+}
+
+BOOL WineFlagStore::WriteGlobalFlags( _In_ ULONG Flag )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    PendingValue Pending = { L"", GLOBALFLAG_VALUENAME, Flag };
+    m_Pending[L"\\" + NormalizeName(GLOBALFLAG_VALUENAME)] = Pending;
+    return TRUE;
+}
+
+BOOL WineFlagStore::ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    const PendingValue* Pending = FindPending(ImageName, ValueName);
+    *Value = 0;
+    if(Pending)
+    {
+        *Value = Pending->Value;
+        return TRUE;
+    }
+    if(!Refresh())
+    {
+        return FALSE;
+    }
+    SectionMap::const_iterator Image = m_Images.find(NormalizeName(ImageName));
+    if(Image == m_Images.end())
+    {
+        return TRUE;
+    }
+    LONG Result = FindValue(Image->second, ValueName, Value);
+    return Result == ERROR_SUCCESS || Result == ERROR_FILE_NOT_FOUND;
+}
+
+BOOL WineFlagStore::WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    if(!ImageName || !ImageName[0] || wcschr(ImageName, L'\\'))
+    {
+        return FALSE;
+    }
+    PendingValue Pending = { ImageName, ValueName, Value };
+    m_Pending[NormalizeName(ImageName) + L'\\' + NormalizeName(ValueName)] = Pending;
+    return TRUE;
+}
+
+BOOL WineFlagStore::EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context )
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    if(!Refresh())
+    {
+        return FALSE;
+    }
+    for(SectionMap::const_iterator Image = m_Images.begin(); Image != m_Images.end(); ++Image)
+    {
+        ULONG Value = 0;
+        if(ValueName)
+        {
+            const PendingValue* Pending = FindPending(Image->first.c_str(), ValueName);
+            if(Pending)
+            {
+                Value = Pending->Value;
+            }
+            else if(FindValue(Image->second, ValueName, &Value) != ERROR_SUCCESS)
+            {
+                continue;
+            }
+        }
+        if(!Callback(Image->second.Name.c_str(), Value, Context))
+        {
+            return TRUE;
+        }
+    }
+
+    /* Images that only exist in the pending writes so far. */
+    std::set<std::wstring> Reported;
+    for(PendingMap::const_iterator Pending = m_Pending.begin(); Pending != m_Pending.end(); ++Pending)
+    {
+        const PendingValue& Entry = Pending->second;
+        std::wstring Image = NormalizeName(Entry.Image.c_str());
+        if(Entry.Image.empty() || m_Images.count(Image) || (ValueName && _wcsicmp(Entry.ValueName.c_str(), ValueName)) ||
+           !Reported.insert(Image).second)
+        {
+            continue;
+        }
+        if(!Callback(Entry.Image.c_str(), ValueName ? Entry.Value : 0, Context))
+        {
+            break;
+        }
+    }
+    return TRUE;
+}
+
+BOOL WineFlagStore::ReadKernelFlags( _Out_ ULONG* /* Flag */ )
+{
+    return FALSE;
+}
+
+BOOL WineFlagStore::WriteKernelFlags( _In_ ULONG /* Flag */ )
+{
+    return FALSE;
+}
+
+BOOL WineFlagStore::Lock()
+{
+    m_Lock.lock();
+    return TRUE;
+}
+
+void WineFlagStore::Unlock()
+{
+    m_Lock.unlock();
+}
+
+/*
+ * Copies the mapped file to File. Sections with pending values are rewritten:
+ * existing value lines are replaced, missing values are added after the last
+ * value of the section. Keys that do not exist yet are appended at the end,
+ * wineserver does not depend on the order of the keys.
+ */
+BOOL WineFlagStore::WriteFile( _In_ FILE* File ) const
+{
+    typedef std::map<size_t, std::vector<const PendingValue*> > EditMap;
+    EditMap Edits;
+    std::map<std::wstring, std::vector<const PendingValue*> > NewKeys;
+    for(PendingMap::const_iterator Pending = m_Pending.begin(); Pending != m_Pending.end(); ++Pending)
+    {
+        const PendingValue& Entry = Pending->second;
+        const Section* Key = &m_SessionManager;
+        std::wstring KeyName = m_SessionManager.Name;
+        if(!Entry.Image.empty())
+        {
+            SectionMap::const_iterator Image = m_Images.find(NormalizeName(Entry.Image.c_str()));
+            Key = Image != m_Images.end() ? &Image->second : NULL;
+            KeyName = WINE_SOFTWARE_IFEO L"\\" + Entry.Image;
+        }
+        if(Key && Key->Start != WINE_NO_SECTION)
+        {
+            Edits[Key->Start].push_back(&Entry);
+        }
+        else
+        {
+            NewKeys[KeyName].push_back(&Entry);
+        }
+    }
+
+    const char* Data = (const char*)m_File.Data();
+    const char* End = Data + m_File.Size();
+    const char* Pos = Data;
+    std::wstring Name;
+    for(EditMap::const_iterator Edit = Edits.begin(); Edit != Edits.end(); ++Edit)
+    {
+        const Section* Key = &m_SessionManager;
+        if(!Edit->second[0]->Image.empty())
+        {
+            Key = &m_Images.find(NormalizeName(Edit->second[0]->Image.c_str()))->second;
+        }
+        const char* SectionEnd = Data + Key->End;
+        const char* InsertAt = Data + Key->Body;
+        for(const char* Line = InsertAt; Line < SectionEnd; Line = LineEnd(Line, SectionEnd))
+        {
+            if(*Line != '\n' && *Line != '\r')
+            {
+                InsertAt = LineEnd(Line, SectionEnd);
+            }
+        }
+
+        std::vector<BOOL> Written(Edit->second.size(), FALSE);
+        fwrite(Pos, 1, Key->Body - (Pos - Data), File);
+        for(const char* Line = Data + Key->Body; Line < InsertAt; )
+        {
+            const char* Next = LineEnd(Line, SectionEnd);
+            const char* ValueData;
+            size_t Match = Edit->second.size();
+            if(ParseValueLine(Line, Next, &Name, &ValueData))
+            {
+                for(Match = 0; Match < Edit->second.size() && _wcsicmp(Name.c_str(), Edit->second[Match]->ValueName.c_str()); ++Match)
+                    ;
+            }
+            if(Match < Edit->second.size())
+            {
+                std::string Value = FormatDwordValue(Edit->second[Match]->ValueName.c_str(), Edit->second[Match]->Value);
+                fwrite(Value.data(), 1, Value.size(), File);
+                Written[Match] = TRUE;
+            }
+            else
+            {
+                fwrite(Line, 1, Next - Line, File);
+            }
+            Line = Next;
+        }
+        if(InsertAt > Data && InsertAt[-1] != '\n')
+        {
+            fputc('\n', File);
+        }
+        for(size_t n = 0; n < Edit->second.size(); ++n)
+        {
+            if(!Written[n])
+            {
+                std::string Value = FormatDwordValue(Edit->second[n]->ValueName.c_str(), Edit->second[n]->Value);
+                fwrite(Value.data(), 1, Value.size(), File);
+            }
+        }
+        Pos = InsertAt;
+    }
+    fwrite(Pos, 1, End - Pos, File);
+    if(End > Data && End[-1] != '\n')
+    {
+        fputc('\n', File);
+    }
+
+    time_t Now = time(NULL);
+    ULONGLONG FileTime = ((ULONGLONG)Now + WINE_EPOCH_DIFFERENCE) * WINE_TICKS_PER_SECOND;
+    for(std::map<std::wstring, std::vector<const PendingValue*> >::const_iterator Key = NewKeys.begin(); Key != NewKeys.end(); ++Key)
+    {
+        char Times[64];
+        std::string Header = "\n[";
+        AppendWineString(&Header, Key->first.c_str(), "[]");
+        snprintf(Times, sizeof(Times), "] %llu\n#time=%llx\n", (unsigned long long)Now, (unsigned long long)FileTime);
+        Header += Times;
+        for(size_t n = 0; n < Key->second.size(); ++n)
+        {
+            Header += FormatDwordValue(Key->second[n]->ValueName.c_str(), Key->second[n]->Value);
+        }
+        fwrite(Header.data(), 1, Header.size(), File);
+    }
+    return !ferror(File);
+}
+
+#ifndef _WIN32
+/*
+ * Takes the lock a wineserver holds while it runs for the prefix. wineserver
+ * creates it in /tmp/.wine-<uid>/server-<dev>-<inode of the prefix>/lock and
+ * retries when it finds it taken at startup, so none can start and load the
+ * registry while the file is replaced. -1 when a wineserver is running.
+ */
+static int LockWineServer( _In_z_ PCWSTR Directory )
+{
+    char NarrowDirectory[1024], LockPath[128];
+    struct stat st;
+    if(wcstombs(NarrowDirectory, Directory, sizeof(NarrowDirectory)) == (size_t)-1 || stat(NarrowDirectory, &st))
+    {
+        return -1;
+    }
+    snprintf(LockPath, sizeof(LockPath), "/tmp/.wine-%u", (unsigned)getuid());
+    mkdir(LockPath, 0700);
+    size_t Length = strlen(LockPath);
+    snprintf(LockPath + Length, sizeof(LockPath) - Length, "/server-%llx-%llx", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+    mkdir(LockPath, 0700);
+    strncat(LockPath, "/lock", sizeof(LockPath) - strlen(LockPath) - 1);
+
+    int Lock = open(LockPath, O_CREAT | O_RDWR, 0600);
+    if(Lock < 0)
+    {
+        return -1;
+    }
+    struct flock Range;
+    memset(&Range, 0, sizeof(Range));
+    Range.l_type = F_WRLCK;
+    Range.l_whence = SEEK_SET;
+    if(fcntl(Lock, F_SETLK, &Range))
+    {
+        close(Lock);
+        return -1;
+    }
+    return Lock;
+}
+#endif
+
+BOOL WineFlagStore::Flush()
+{
+    std::lock_guard<std::recursive_mutex> Guard(m_Lock);
+    if(m_Pending.empty())
+    {
+        return TRUE;
+    }
+#ifndef _WIN32
+    int ServerLock = LockWineServer(m_Directory.c_str());
+    if(ServerLock < 0)
+    {
+        return FALSE;
+    }
+#endif
+
+    std::wstring TempName = m_FileName + L".tmp";
+    FILE* File = NULL;
+    BOOL Success = Refresh() && (File = _wfopen(TempName.c_str(), L"wb")) != NULL;
+    if(File)
+    {
+        Success = WriteFile(File);
+        Success = !fclose(File) && Success;
+    }
+
+    /* The mapping would keep the file from being replaced on Windows. */
+    m_File.Close();
+#ifdef _WIN32
+    Success = Success && MoveFileExW(TempName.c_str(), m_FileName.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    char NarrowName[1024], NarrowTemp[1024];
+    struct stat st;
+    if(Success && wcstombs(NarrowName, m_FileName.c_str(), sizeof(NarrowName)) != (size_t)-1 &&
+       wcstombs(NarrowTemp, TempName.c_str(), sizeof(NarrowTemp)) != (size_t)-1 && !stat(NarrowName, &st))
+    {
+        chmod(NarrowTemp, st.st_mode & 07777);
+    }
+    Success = Success && !_wrename(TempName.c_str(), m_FileName.c_str());
+#endif
+    if(Success)
+    {
+        m_Pending.clear();
+    }
+    else if(File)
+    {
+        _wremove(TempName.c_str());
+    }
+    Success = Load() && Success;
+#ifndef _WIN32
+    close(ServerLock);
+#endif
+    return Success;
+}
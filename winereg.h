@@ -0,0 +1,115 @@
+/*
+ * Global flags editor
+ *
+ * Copyright (c) 2015 Mark Jansen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "platform.h"
+#include "mapfile.h"
+#include "flagstore.h"
+#include "hive.h"
+#include <map>
+#include <mutex>
+#include <string>
+
+/*
+ * Flag store on top of the text registry of a Wine prefix (system.reg).
+ *
+ * Opening the file builds an index of the image keys and of the session
+ * manager key: the byte range of each section in the mapped file. Queries
+ * only parse the lines of the section they need, the index is rebuilt when
+ * the file changed on disk.
+ *
+ * Writes are collected in memory and reach the file on Flush, which copies
+ * the file, rewriting only the sections that change and appending new image
+ * keys, and then replaces the original. A running wineserver keeps its own
+ * copy of the registry and would overwrite the file when it saves, so Flush
+ * holds the lock of the wineserver of the prefix while it writes, and fails
+ * when a wineserver holds it. There is no running kernel.
+ */
+
+#define WINE_SYSTEM_REG             L"system.reg"
+#define WINE_SOFTWARE_IFEO          L"Software\\" HIVE_SOFTWARE_IFEO
+#define WINE_SYSTEM_SELECT          L"System\\Select"
+
+class GFLAGS_API WineFlagStore : public FlagStore
+{
+public:
+    WineFlagStore();
+
+    /* Prefix is the prefix directory, or the system.reg file itself. */
+    BOOL Open( _In_z_ PCWSTR Prefix );
+
+    virtual BOOL ReadGlobalFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteGlobalFlags( _In_ ULONG Flag );
+
+    virtual BOOL ReadImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value );
+    virtual BOOL WriteImageValue( _In_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName, _In_ ULONG Value );
+    virtual BOOL EnumImageValues( _In_opt_z_ PCWSTR ValueName, _In_ ImageValueCallback Callback, _In_opt_ PVOID Context );
+
+    virtual BOOL ReadKernelFlags( _Out_ ULONG* Flag );
+    virtual BOOL WriteKernelFlags( _In_ ULONG Flag );
+
+    virtual BOOL Flush();
+
+    virtual BOOL Lock();
+    virtual void Unlock();
+
+private:
+    /* Byte range of one key in the mapped file, from its '[' line up to the next key. */
+    struct Section
+    {
+        std::wstring Name;
+        size_t Start;
+        size_t Body;
+        size_t End;
+    };
+
+    /* A written value that has not reached the file yet, Image is empty for the session manager. */
+    struct PendingValue
+    {
+        std::wstring Image;
+        std::wstring ValueName;
+        ULONG Value;
+    };
+
+    typedef std::map<std::wstring, Section> SectionMap;
+    typedef std::map<std::wstring, PendingValue> PendingMap;
+
+    BOOL Refresh();
+    BOOL Load();
+    LONG FindValue( _In_ const Section& Key, _In_z_ PCWSTR ValueName, _Out_ ULONG* Value ) const;
+    const PendingValue* FindPending( _In_opt_z_ PCWSTR ImageName, _In_z_ PCWSTR ValueName ) const;
+    BOOL WriteFile( _In_ FILE* File ) const;
+
+    std::recursive_mutex m_Lock;
+    std::wstring m_Directory;
+    std::wstring m_FileName;
+    MappedFile m_File;
+    ULONGLONG m_WriteTime;
+    ULONGLONG m_FileSize;
+    SectionMap m_Images;
+    Section m_SessionManager;
+    PendingMap m_Pending;
+};